@@ -0,0 +1,86 @@
+#ifndef COMPLETION_QUEUE_H
+#define COMPLETION_QUEUE_H
+/*
+子线程到主线程（reactor）的完成队列。
+
+子线程处理完请求后不再直接修改epoll注册、关闭连接，而是把完成事件压入队列，
+由主线程统一批量执行所有的socket关闭和epoll_ctl操作，连接状态和用户计数只有主线程一个写者。
+
+队列是无锁的多生产者单消费者链表栈，节点内嵌在http_conn中，不需要分配内存。
+只有队列从空变为非空的那一次push才写eventfd，多个子线程同时完成时只唤醒主线程一次。
+*/
+#include <atomic>
+#include <exception>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+// 完成事件，内嵌在每个连接中（一个连接同一时刻最多只有一个未处理的完成事件）
+struct completion{
+    completion * next;
+    int fd;     // 连接的socket，主线程用它找到users[fd]
+    int type;   // 完成事件的类型
+};
+
+class completion_queue{
+public:
+    /*
+        完成事件类型
+        COMP_WRITE  :   子线程发送时socket写缓冲满，由主线程继续发送（必要时注册EPOLLOUT）
+        COMP_CLOSE  :   请求处理出错或者不保持连接，由主线程关闭连接
+        COMP_PROXY  :   反向代理的请求报文已经准备好，由主线程连接上游并转发响应
+        COMP_WS     :   WebSocket握手完成，由主线程订阅频道并接手之后的读写
+    */
+    enum TYPE { COMP_WRITE = 0, COMP_CLOSE, COMP_PROXY, COMP_WS };
+
+    completion_queue():m_head(NULL){
+        m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(m_eventfd < 0){
+            throw std::exception();
+        }
+    }
+    ~completion_queue(){
+        close(m_eventfd);
+    }
+
+    // 主线程把eventfd注册到epoll上
+    int fd() const { return m_eventfd; }
+
+    // 子线程压入一个完成事件，push之后子线程不能再访问该连接
+    void push(completion * c){
+        completion * old = m_head.load(std::memory_order_relaxed);
+        do{
+            c->next = old;
+        }while(!m_head.compare_exchange_weak(old, c, std::memory_order_release, std::memory_order_relaxed));
+        if(old == NULL){
+            // 队列原来是空的，唤醒主线程（合并唤醒）
+            uint64_t one = 1;
+            ssize_t ret = write(m_eventfd, &one, sizeof(one));
+            (void)ret;
+        }
+    }
+
+    // 主线程取出所有完成事件，按完成的先后顺序返回链表
+    completion * pop_all(){
+        uint64_t cnt;
+        ssize_t ret = read(m_eventfd, &cnt, sizeof(cnt)); // 先清空计数，之后push的事件会再次唤醒
+        (void)ret;
+        completion * list = m_head.exchange(NULL, std::memory_order_acquire);
+        // 栈是后进先出的，反转成先进先出
+        completion * fifo = NULL;
+        while(list){
+            completion * next = list->next;
+            list->next = fifo;
+            fifo = list;
+            list = next;
+        }
+        return fifo;
+    }
+
+private:
+    std::atomic<completion *> m_head;
+    int m_eventfd;
+};
+
+#endif
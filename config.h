@@ -0,0 +1,44 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// 服务器的运行参数，main中解析命令行后填充，其他模块只读
+
+#include <stddef.h>
+
+struct server_config{
+    const char * doc_root;      // 网站根目录
+    bool inline_dispatch;       // 命中内存缓存的请求是否直接在主线程处理（不经过线程池）
+    size_t cache_capacity;      // 内存文件缓存的总大小（字节）
+    size_t cache_max_file;      // 能放入内存缓存的单个文件的最大大小（字节）
+    int cache_revalidate;       // 缓存项多少秒之后需要重新stat校验
+    int max_conns;              // 最大连接数，0表示不超过MAX_FD
+    const char * cache_control; // 文件响应的Cache-Control头部，空表示不发送
+    size_t gzip_capacity;       // 动态压缩缓存的总大小（字节）
+    size_t gzip_max_file;       // 超过这个大小的文件不做动态压缩
+    const char * upload_dir;    // POST/PUT /upload/文件名 保存的目录，空表示不接受上传
+    long long max_body;         // 请求体的最大大小（字节）
+    bool autoindex;             // 请求目录时生成目录列表（分块编码流式发送）
+    double rate_limit;          // 每个IP每秒的请求数，0表示不限制
+    double rate_burst;          // 每个IP允许的突发请求数
+    double bandwidth;           // 每个IP的发送带宽（字节/秒），0表示不限制
+    int workers;                // 多进程模式的worker进程数，0表示单进程
+    size_t shm_cache_size;      // 跨进程共享的文件内容缓存的大小（字节），0表示不使用
+    const char * upgrade_path;  // 热升级的控制socket路径，空表示不支持热升级
+    const char * bundle_path;   // 预先打包的静态文件，空表示只从网站根目录读取
+    int listen_backlog;         // 监听socket的全连接队列长度
+    int defer_accept;           // TCP_DEFER_ACCEPT的秒数，0表示不使用
+    int fastopen;               // TCP_FASTOPEN的队列长度，0表示不使用
+    bool nodelay;               // 客户端连接关闭Nagle
+    bool cork;                  // 还有内容马上要发送时用MSG_MORE提示内核合并分段
+    size_t zerocopy_min;        // 不小于这个大小的内存中响应体用MSG_ZEROCOPY发送（字节），0表示不使用
+    int tls_port;               // HTTPS监听端口，0表示不监听
+    const char * tls_cert;      // PEM格式的证书链
+    const char * tls_key;       // PEM格式的私钥
+    bool ktls;                  // 握手之后尝试把记录层交给内核（kTLS）
+    int h2_streams;             // 每个HTTP/2连接同时处理的流数，0表示不支持HTTP/2（h2c）
+    const char * ws_prefix;     // WebSocket的路径前缀，之后的部分是频道名，空表示不接受WebSocket
+};
+
+extern server_config g_config;
+
+#endif
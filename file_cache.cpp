@@ -0,0 +1,191 @@
+#include "file_cache.h"
+#include "server_stats.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+file_cache::file_cache(size_t capacity, size_t max_file, int revalidate)
+    : m_capacity(capacity), m_max_file(max_file), m_revalidate(revalidate), m_bytes(0)
+{
+}
+
+// 查找未过期的缓存项
+file_entry_ptr file_cache::lookup(const char *path)
+{
+    file_entry_ptr entry;
+    time_t now = time(NULL);
+    m_lock.lock();
+    auto it = m_index.find(path);
+    if (it != m_index.end() && now - (*it->second)->checked < m_revalidate)
+    {
+        // 移到LRU链表头部
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        entry = *it->second;
+    }
+    m_lock.unlock();
+    if (entry)
+    {
+        g_stats.cache_hits++;
+    }
+    return entry;
+}
+
+// 文件没有变化：inode、大小和修改时间都相同
+static bool same_version(const struct stat &a, const struct stat &b)
+{
+    return a.st_ino == b.st_ino && a.st_size == b.st_size && a.st_mtime == b.st_mtime;
+}
+
+// 用stat的结果校验缓存项，文件没有变化时只刷新校验时间，否则重新读入
+file_entry_ptr file_cache::load(const char *path, const struct stat &st)
+{
+    if ((size_t)st.st_size > m_max_file || (size_t)st.st_size > m_capacity)
+    {
+        return file_entry_ptr();
+    }
+    m_lock.lock();
+    auto it = m_index.find(path);
+    if (it != m_index.end())
+    {
+        file_entry_ptr entry = *it->second;
+        if (same_version(entry->st, st))
+        {
+            entry->checked = time(NULL);
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            m_lock.unlock();
+            g_stats.cache_hits++;
+            return entry;
+        }
+        erase(it); // 文件已经变化
+    }
+    auto fit = m_flights.find(path);
+    if (fit != m_flights.end())
+    {
+        // 其他线程正在读这个文件，等待它读完后共享结果
+        std::shared_ptr<flight> f = fit->second;
+        while (!f->done)
+        {
+            f->done_cond.wait(m_lock.get());
+        }
+        m_lock.unlock();
+        g_stats.cache_coalesced++;
+        if (f->result && same_version(f->result->st, st))
+        {
+            return f->result;
+        }
+        return file_entry_ptr(); // 读取失败或者期间文件又变化了，调用者自己映射文件
+    }
+    std::shared_ptr<flight> f(new flight);
+    m_flights[path] = f;
+    m_lock.unlock();
+    g_stats.cache_misses++;
+
+    // 读文件不持有锁
+    file_entry_ptr entry = read_file(path, st);
+
+    m_lock.lock();
+    if (entry)
+    {
+        insert(entry);
+    }
+    f->result = entry;
+    f->done = true;
+    m_flights.erase(path);
+    f->done_cond.broadcast(m_lock.get());
+    m_lock.unlock();
+    return entry;
+}
+
+file_entry_ptr file_cache::read_file(const char *path, const struct stat &st)
+{
+    if (g_shm_cache)
+    {
+        // 其他进程已经读入了这个版本就直接使用，否则读进共享内存，之后其他进程可以使用
+        const char *data;
+        size_t size;
+        int slot = g_shm_cache->get(path, st, data, size);
+        if (slot < 0)
+        {
+            slot = g_shm_cache->put(path, st, data, size);
+        }
+        if (slot >= 0)
+        {
+            file_entry_ptr entry(new file_entry);
+            entry->path = path;
+            entry->st = st;
+            entry->size = size;
+            entry->data = (char *)data;
+            entry->shm_slot = slot;
+            entry->checked = time(NULL);
+            return entry;
+        }
+        // 共享缓存中没有可用的槽，读进自己的内存
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return file_entry_ptr();
+    }
+    file_entry_ptr entry(new file_entry);
+    entry->path = path;
+    entry->st = st;
+    entry->size = st.st_size;
+    entry->data = new char[entry->size + 1];
+    size_t got = 0;
+    while (got < entry->size)
+    {
+        ssize_t n = read(fd, entry->data + got, entry->size - got);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+    if (got != entry->size)
+    {
+        return file_entry_ptr(); // 读的过程中文件被截断了
+    }
+    entry->checked = time(NULL);
+    return entry;
+}
+
+std::vector<std::string> file_cache::hot_paths(size_t n)
+{
+    std::vector<std::string> paths;
+    m_lock.lock();
+    for (auto it = m_lru.begin(); it != m_lru.end() && paths.size() < n; ++it)
+    {
+        paths.push_back((*it)->path);
+    }
+    m_lock.unlock();
+    return paths;
+}
+
+// 插入缓存项，超过容量时从LRU尾部淘汰
+void file_cache::insert(const file_entry_ptr &entry)
+{
+    auto it = m_index.find(entry->path);
+    if (it != m_index.end())
+    {
+        erase(it); // 其他线程同时读入了同一个文件
+    }
+    while (m_bytes + entry->size > m_capacity && !m_lru.empty())
+    {
+        erase(m_index.find(m_lru.back()->path));
+    }
+    m_lru.push_front(entry);
+    m_index[entry->path] = m_lru.begin();
+    m_bytes += entry->size;
+}
+
+void file_cache::erase(std::unordered_map<std::string, lru_list::iterator>::iterator it)
+{
+    m_bytes -= (*it->second)->size;
+    m_lru.erase(it->second);
+    m_index.erase(it);
+}
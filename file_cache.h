@@ -0,0 +1,82 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+/*
+小静态文件的内存缓存。
+
+文件内容读入内存后按路径缓存，LRU淘汰，总大小有上限。
+缓存项通过shared_ptr共享，连接发送期间持有引用，淘汰不会释放正在发送的内容。
+lookup不做任何系统调用，缓存项超过校验间隔后返回未命中，由调用者stat后调用load重新校验。
+同一个文件同时有多个未命中时只有第一个线程读文件（single-flight），其余的等它读完后共享同一个缓存项，
+冷启动时一批请求同一个文件不会各自读一遍、各自分配一份内存。
+配置了跨进程的共享缓存（shm_cache.h）时，读文件先查共享缓存，缓存项直接指向共享内存中的内容。
+*/
+#include <string>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <time.h>
+#include <sys/stat.h>
+#include "locker.h"
+#include "shm_cache.h"
+
+// 一个缓存的文件
+struct file_entry{
+    std::string path;
+    char * data;            // 文件内容
+    size_t size;
+    struct stat st;         // 读入时的文件状态
+    time_t checked;         // 上次校验（stat）的时间
+    int shm_slot;           // 内容在共享缓存中时是槽号，data指向共享内存；-1表示data是自己分配的
+
+    file_entry():data(NULL), size(0), checked(0), shm_slot(-1){}
+    ~file_entry(){
+        if(shm_slot >= 0){
+            g_shm_cache->release(shm_slot);
+        }else{
+            delete [] data;
+        }
+    }
+};
+
+typedef std::shared_ptr<file_entry> file_entry_ptr;
+
+class file_cache{
+public:
+    file_cache(size_t capacity, size_t max_file, int revalidate);
+
+    // 查找未过期的缓存项，不做系统调用，主线程可以直接调用
+    file_entry_ptr lookup(const char * path);
+    // 用stat得到的状态校验缓存项，没有或者已经变化时重新读入文件；文件太大返回空
+    // 其他线程正在读入同一个文件时等待它的结果
+    file_entry_ptr load(const char * path, const struct stat & st);
+    // 最近使用的最多n个文件的路径，热升级时交给新进程预热
+    std::vector<std::string> hot_paths(size_t n);
+
+private:
+    // 正在读入的文件，等待者持有shared_ptr，读入的线程从m_flights中删除后仍然有效
+    struct flight{
+        cond done_cond;
+        bool done;
+        file_entry_ptr result; // 读取失败时为空
+
+        flight():done(false){}
+    };
+    typedef std::list<file_entry_ptr> lru_list;
+    static file_entry_ptr read_file(const char * path, const struct stat & st);
+    void insert(const file_entry_ptr & entry); // 调用者持有锁
+    void erase(std::unordered_map<std::string, lru_list::iterator>::iterator it);
+
+private:
+    size_t m_capacity;
+    size_t m_max_file;
+    int m_revalidate;
+    size_t m_bytes;     // 当前缓存的总字节数
+
+    lru_list m_lru;     // 最近使用的在前面
+    std::unordered_map<std::string, lru_list::iterator> m_index;
+    std::unordered_map<std::string, std::shared_ptr<flight> > m_flights; // 正在读入的文件
+    locker m_lock;
+};
+
+#endif
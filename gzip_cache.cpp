@@ -0,0 +1,199 @@
+#include "gzip_cache.h"
+#include "server_stats.h"
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <exception>
+
+gzip_cache::gzip_cache(size_t capacity, size_t max_file)
+    : m_capacity(capacity), m_max_file(max_file), m_bytes(0), m_stop(false)
+{
+    // 一个后台压缩线程，请求线程从不等待它
+    if (pthread_create(&m_thread, NULL, worker, this) != 0)
+    {
+        throw std::exception();
+    }
+    if (pthread_detach(m_thread) != 0)
+    {
+        throw std::exception();
+    }
+}
+
+gzip_cache::~gzip_cache()
+{
+    m_stop = true;
+}
+
+// 文件标识：设备号、inode、大小、修改时间，文件变化后自然找不到旧的压缩版本
+std::string gzip_cache::key(const struct stat &st)
+{
+    char buf[96];
+    snprintf(buf, sizeof(buf), "%lx:%lx:%llx:%llx.%lx", (unsigned long)st.st_dev, (unsigned long)st.st_ino,
+             (unsigned long long)st.st_size, (unsigned long long)st.st_mtim.tv_sec, (unsigned long)st.st_mtim.tv_nsec);
+    return buf;
+}
+
+file_entry_ptr gzip_cache::lookup(const struct stat &st)
+{
+    file_entry_ptr entry;
+    std::string k = key(st);
+    m_lock.lock();
+    auto it = m_index.find(k);
+    if (it != m_index.end())
+    {
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        entry = *it->second;
+    }
+    m_lock.unlock();
+    return entry;
+}
+
+void gzip_cache::submit(const char *path, const struct stat &st)
+{
+    if ((size_t)st.st_size > m_max_file)
+    {
+        return;
+    }
+    std::string k = key(st);
+    m_lock.lock();
+    bool queued = m_index.count(k) || !m_pending.insert(k).second;
+    m_lock.unlock();
+    if (queued)
+    {
+        return;
+    }
+    job j;
+    j.path = path;
+    j.st = st;
+    m_job_lock.lock();
+    m_jobs.push_back(j);
+    m_job_lock.unlock();
+    m_job_stat.post();
+}
+
+void *gzip_cache::worker(void *arg)
+{
+    gzip_cache *cache = (gzip_cache *)arg;
+    cache->run();
+    return cache;
+}
+
+void gzip_cache::run()
+{
+    while (!m_stop)
+    {
+        m_job_stat.wait();
+        m_job_lock.lock();
+        if (m_jobs.empty())
+        {
+            m_job_lock.unlock();
+            continue;
+        }
+        job j = m_jobs.front();
+        m_jobs.pop_front();
+        m_job_lock.unlock();
+
+        file_entry_ptr entry = compress(j);
+        std::string k = key(j.st);
+        m_lock.lock();
+        m_pending.erase(k);
+        if (entry)
+        {
+            insert(k, entry);
+        }
+        m_lock.unlock();
+    }
+}
+
+// 读入文件并压缩成gzip格式，文件在此期间变化时放弃
+file_entry_ptr gzip_cache::compress(const job &j)
+{
+    int fd = open(j.path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return file_entry_ptr();
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_ino != j.st.st_ino || st.st_size != j.st.st_size || st.st_mtime != j.st.st_mtime)
+    {
+        close(fd);
+        return file_entry_ptr();
+    }
+    size_t size = st.st_size;
+    char *src = new char[size + 1];
+    size_t got = 0;
+    while (got < size)
+    {
+        ssize_t n = read(fd, src + got, size - got);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+    if (got != size)
+    {
+        delete[] src;
+        return file_entry_ptr();
+    }
+
+    file_entry_ptr entry(new file_entry);
+    entry->path = key(j.st);
+    entry->st = j.st;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // windowBits 15+16 输出gzip格式
+    if (deflateInit2(&zs, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+    {
+        size_t bound = deflateBound(&zs, size);
+        char *dst = new char[bound];
+        zs.next_in = (Bytef *)src;
+        zs.avail_in = size;
+        zs.next_out = (Bytef *)dst;
+        zs.avail_out = bound;
+        if (deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < size)
+        {
+            entry->data = dst;
+            entry->size = zs.total_out;
+            entry->st.st_size = zs.total_out; // 缓存项描述的是压缩后的内容
+            g_stats.gzip_compressed++;
+        }
+        else
+        {
+            delete[] dst; // 压缩后没有变小，留下空的标记
+        }
+        deflateEnd(&zs);
+    }
+    delete[] src;
+    return entry;
+}
+
+// 插入压缩版本，超过容量时从LRU尾部淘汰，调用者持有锁
+void gzip_cache::insert(const std::string &k, const file_entry_ptr &entry)
+{
+    auto it = m_index.find(k);
+    if (it != m_index.end())
+    {
+        m_bytes -= (*it->second)->size;
+        m_lru.erase(it->second);
+        m_index.erase(it);
+    }
+    while (m_bytes + entry->size > m_capacity && !m_lru.empty())
+    {
+        file_entry_ptr victim = m_lru.back();
+        m_bytes -= victim->size;
+        m_index.erase(victim->path);
+        m_lru.pop_back();
+    }
+    m_lru.push_front(entry);
+    m_index[k] = m_lru.begin();
+    m_bytes += entry->size;
+}
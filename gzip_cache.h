@@ -0,0 +1,61 @@
+#ifndef GZIP_CACHE_H
+#define GZIP_CACHE_H
+/*
+动态压缩版本的缓存。
+
+可压缩类型的文件在没有预压缩的.gz文件时，由后台线程用zlib压缩，结果按文件标识
+（设备号、inode、大小、修改时间）缓存，LRU淘汰，总大小有上限。
+请求线程只查缓存和提交任务，从不等待压缩：缓存没有时先发送未压缩的内容。
+压缩后没有变小的文件也会缓存一个空的标记，之后不再尝试压缩。
+*/
+#include <string>
+#include <list>
+#include <set>
+#include <unordered_map>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "locker.h"
+#include "file_cache.h"
+
+class gzip_cache{
+public:
+    gzip_cache(size_t capacity, size_t max_file);
+    ~gzip_cache();
+
+    // 查找文件的压缩版本，不做系统调用；返回的缓存项data为NULL表示压缩不划算
+    file_entry_ptr lookup(const struct stat & st);
+    // 提交后台压缩任务，同一个文件正在压缩时忽略，不阻塞
+    void submit(const char * path, const struct stat & st);
+
+private:
+    struct job{
+        std::string path;
+        struct stat st;
+    };
+    typedef std::list<file_entry_ptr> lru_list;
+
+    static std::string key(const struct stat & st);
+    static void * worker(void * arg);
+    void run();
+    file_entry_ptr compress(const job & j); // 读文件并gzip压缩
+    void insert(const std::string & k, const file_entry_ptr & entry);
+
+private:
+    size_t m_capacity;
+    size_t m_max_file;  // 超过这个大小的文件不做动态压缩
+    size_t m_bytes;
+
+    lru_list m_lru;
+    std::unordered_map<std::string, lru_list::iterator> m_index; // 键是文件标识，缓存项的path保存同样的键
+    std::set<std::string> m_pending; // 已经提交还没有压缩完的文件
+    locker m_lock;
+
+    // 压缩任务队列，和线程池一样用互斥锁+信号量
+    std::list<job> m_jobs;
+    locker m_job_lock;
+    sem m_job_stat;
+    pthread_t m_thread;
+    bool m_stop;
+};
+
+#endif
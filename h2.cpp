@@ -0,0 +1,1211 @@
+#include "h2.h"
+#include "http_conn.h"
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+// http_conn.cpp中HTTP/1.1的响应也用的
+extern void http_date(time_t t, char *buf, size_t len);
+extern const off_t MIN_GZIP_SIZE;
+extern const char *error_400_form;
+extern const char *error_403_form;
+extern const char *error_404_form;
+extern const char *error_405_form;
+extern const char *error_500_form;
+
+// 帧类型、标志、错误码和设置项（RFC 7540 第6、7节）
+enum { FRAME_DATA = 0, FRAME_HEADERS, FRAME_PRIORITY, FRAME_RST_STREAM, FRAME_SETTINGS, FRAME_PUSH_PROMISE,
+    FRAME_PING, FRAME_GOAWAY, FRAME_WINDOW_UPDATE, FRAME_CONTINUATION };
+enum { FLAG_END_STREAM = 0x1, FLAG_ACK = 0x1, FLAG_END_HEADERS = 0x4, FLAG_PADDED = 0x8, FLAG_PRIORITY = 0x20 };
+enum { ERR_NO_ERROR = 0x0, ERR_PROTOCOL = 0x1, ERR_INTERNAL = 0x2, ERR_FLOW_CONTROL = 0x3, ERR_FRAME_SIZE = 0x6,
+    ERR_REFUSED_STREAM = 0x7, ERR_COMPRESSION = 0x9, ERR_ENHANCE_YOUR_CALM = 0xb, ERR_HTTP_1_1_REQUIRED = 0xd };
+enum { SETTINGS_HEADER_TABLE_SIZE = 0x1, SETTINGS_ENABLE_PUSH = 0x2, SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4, SETTINGS_MAX_FRAME_SIZE = 0x5, SETTINGS_MAX_HEADER_LIST_SIZE = 0x6 };
+
+static const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const char switching_101_response[] =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Connection: Upgrade\r\n"
+    "Upgrade: h2c\r\n"
+    "\r\n";
+static const char too_many_429_form[] = "Too many requests, try again later.\n";
+
+static uint32_t get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void put_frame_header(uint8_t *h, size_t len, uint8_t type, uint8_t flags, uint32_t id)
+{
+    h[0] = len >> 16;
+    h[1] = len >> 8;
+    h[2] = len;
+    h[3] = type;
+    h[4] = flags;
+    put32(h + 5, id);
+}
+
+// HTTP2-Settings是SETTINGS帧的内容，base64url编码，可以没有填充
+static long base64url_decode(const char *s, uint8_t *out, size_t cap)
+{
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (; *s && *s != '='; s++)
+    {
+        int v;
+        char c = *s;
+        if (c >= 'A' && c <= 'Z')
+            v = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            v = c - '0' + 52;
+        else if (c == '-' || c == '+')
+            v = 62;
+        else if (c == '_' || c == '/')
+            v = 63;
+        else
+            return -1;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            if (n >= cap)
+            {
+                return -1;
+            }
+            out[n++] = (uint8_t)(acc >> bits);
+        }
+    }
+    return (long)n;
+}
+
+static int parse_method(const str_view &m)
+{
+    static const struct
+    {
+        const char *name;
+        int method;
+    } methods[] = {
+        {"GET", http_conn::GET},   {"HEAD", http_conn::HEAD},     {"POST", http_conn::POST},
+        {"PUT", http_conn::PUT},   {"DELETE", http_conn::DELETE}, {"OPTIONS", http_conn::OPTIONS},
+    };
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
+    {
+        if (m.equals(methods[i].name))
+        {
+            return methods[i].method;
+        }
+    }
+    return -1;
+}
+
+h2_session::h2_session(const sockaddr_in &addr, int max_streams)
+    : m_address(addr), m_max_streams(max_streams), m_open(0), m_rr(0), m_last_stream(0), m_preface_left(PREFACE_LEN),
+      m_goaway_sent(false), m_goaway_recv(false), m_closing(false), m_conn_window(DEFAULT_WINDOW),
+      m_initial_window(DEFAULT_WINDOW), m_max_frame(MAX_FRAME), m_block_head(0), m_plain_len(0), m_in_len(0),
+      m_block_len(0), m_block_stream(0), m_block_end_stream(false), m_out_len(0), m_batch_out(0), m_iov_count(0),
+      m_iov_idx(0)
+{
+    m_streams = new stream[max_streams];
+    for (int i = 0; i < max_streams; i++)
+    {
+        stream &s = m_streams[i];
+        s.id = 0;
+        s.data = NULL;
+        s.left = 0;
+        s.mapped = NULL;
+        s.mapped_len = 0;
+        s.owned = NULL;
+    }
+    g_stats.h2_connections++;
+}
+
+h2_session::~h2_session()
+{
+    for (int i = 0; i < m_max_streams; i++)
+    {
+        if (m_streams[i].id)
+        {
+            drop(m_streams[i]);
+        }
+    }
+    delete[] m_streams;
+}
+
+// 服务器的连接序言：SETTINGS帧，只声明和默认值不同的设置
+void h2_session::server_preface()
+{
+    uint8_t p[12];
+    p[0] = 0;
+    p[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(p + 2, m_max_streams);
+    p[6] = 0;
+    p[7] = SETTINGS_MAX_HEADER_LIST_SIZE;
+    put32(p + 8, MAX_HEADER_BLOCK);
+    frame(FRAME_SETTINGS, 0, 0, p, sizeof(p));
+}
+
+void h2_session::start(const char *data, size_t len)
+{
+    server_preface();
+    memcpy(m_in, data, len);
+    m_in_len = len;
+}
+
+bool h2_session::upgrade(const char *settings, const h2_request &req, const char *rest, size_t len)
+{
+    append(switching_101_response, sizeof(switching_101_response) - 1);
+    server_preface();
+    // 101就是对这些设置的确认，不需要SETTINGS ACK
+    uint8_t payload[256];
+    long n = base64url_decode(settings, payload, sizeof(payload));
+    if (n < 0 || !apply_settings(payload, n))
+    {
+        return false;
+    }
+    g_stats.h2_upgrades++;
+    memcpy(m_in, rest, len);
+    m_in_len = len;
+    // 升级的请求是流1，对方已经发送完
+    m_last_stream = 1;
+    stream *s = open(1);
+    s->remote_closed = true;
+    respond(*s, req);
+    return true;
+}
+
+int h2_session::run(int fd)
+{
+    while (true)
+    {
+        if (http_conn::m_draining.load(std::memory_order_relaxed) && !m_goaway_sent)
+        {
+            // 进程正在排空：对方不要再打开新的流，已经打开的处理完后关闭连接
+            uint8_t p[8];
+            put32(p, m_last_stream);
+            put32(p + 4, ERR_NO_ERROR);
+            frame(FRAME_GOAWAY, 0, 0, p, sizeof(p));
+            m_goaway_sent = true;
+        }
+        int ret = flush(fd);
+        if (ret != H2_IDLE)
+        {
+            return ret;
+        }
+        if (!parse())
+        {
+            continue; // GOAWAY发送出去后关闭
+        }
+        if (m_out_len > 0 || sendable())
+        {
+            continue;
+        }
+        // 所有完整的帧都处理了，剩下的不到一帧，缓冲区一定还有空间
+        ssize_t n = recv(fd, m_in + m_in_len, IN_BUFFER_SIZE - m_in_len, 0);
+        if (n > 0)
+        {
+            m_in_len += n;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return H2_IDLE;
+        }
+        return H2_CLOSE;
+    }
+}
+
+int h2_session::flush(int fd)
+{
+    while (true)
+    {
+        if (m_iov_idx == m_iov_count)
+        {
+            finish_batch();
+            fill();
+            if (m_iov_count == 0)
+            {
+                break;
+            }
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = m_iov + m_iov_idx;
+        msg.msg_iovlen = m_iov_count - m_iov_idx;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            return errno == EAGAIN ? H2_BLOCKED : H2_CLOSE;
+        }
+        while (n > 0)
+        {
+            struct iovec &v = m_iov[m_iov_idx];
+            if ((size_t)n >= v.iov_len)
+            {
+                n -= v.iov_len;
+                m_iov_idx++;
+            }
+            else
+            {
+                v.iov_base = (char *)v.iov_base + n;
+                v.iov_len -= n;
+                n = 0;
+            }
+        }
+    }
+    if (m_closing || (m_open.load() == 0 && (m_goaway_sent || m_goaway_recv)))
+    {
+        return H2_CLOSE;
+    }
+    return H2_IDLE;
+}
+
+bool h2_session::pending() const
+{
+    if (m_closing)
+    {
+        return false;
+    }
+    if (http_conn::m_draining.load(std::memory_order_relaxed) && !m_goaway_sent)
+    {
+        return true;
+    }
+    if (m_in_len < FRAME_HEADER)
+    {
+        return m_preface_left > 0 && m_in_len > 0;
+    }
+    size_t len = ((size_t)(uint8_t)m_in[0] << 16) | ((size_t)(uint8_t)m_in[1] << 8) | (uint8_t)m_in[2];
+    return m_preface_left > 0 || m_in_len >= FRAME_HEADER + len;
+}
+
+void h2_session::close(int fd)
+{
+    if (m_goaway_sent || m_iov_idx != m_iov_count)
+    {
+        return; // 发送到一半的帧后面不能插入
+    }
+    m_goaway_sent = true;
+    uint8_t buf[FRAME_HEADER + 8];
+    put_frame_header(buf, 8, FRAME_GOAWAY, 0, 0);
+    put32(buf + FRAME_HEADER, m_last_stream);
+    put32(buf + FRAME_HEADER + 4, ERR_NO_ERROR);
+    send(fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// 处理输入缓冲区中完整的帧；输出缓冲区快满时先停下，发送之后再继续
+bool h2_session::parse()
+{
+    size_t pos = 0;
+    bool ok = true;
+    if (m_preface_left > 0)
+    {
+        size_t n = m_in_len < m_preface_left ? m_in_len : m_preface_left;
+        if (memcmp(m_in, PREFACE + PREFACE_LEN - m_preface_left, n) != 0)
+        {
+            m_closing = true; // 不是HTTP/2的客户端，直接关闭
+            return false;
+        }
+        m_preface_left -= n;
+        pos = n;
+    }
+    while (ok && !m_closing && m_in_len - pos >= FRAME_HEADER && m_out_len + OUT_RESERVE <= OUT_BUFFER_SIZE)
+    {
+        const uint8_t *h = (const uint8_t *)m_in + pos;
+        size_t len = ((size_t)h[0] << 16) | ((size_t)h[1] << 8) | h[2];
+        if (len > MAX_FRAME)
+        {
+            ok = connection_error(ERR_FRAME_SIZE);
+            break;
+        }
+        if (m_in_len - pos < FRAME_HEADER + len)
+        {
+            break;
+        }
+        ok = on_frame(h[3], h[4], get32(h + 5) & MAX_WINDOW, h + FRAME_HEADER, len);
+        pos += FRAME_HEADER + len;
+    }
+    memmove(m_in, m_in + pos, m_in_len - pos);
+    m_in_len -= pos;
+    return ok;
+}
+
+bool h2_session::on_frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, size_t len)
+{
+    if (m_block_stream && (type != FRAME_CONTINUATION || id != m_block_stream))
+    {
+        return connection_error(ERR_PROTOCOL); // 头部块的中间不能插入其他帧
+    }
+    switch (type)
+    {
+    case FRAME_DATA:
+    {
+        if (id == 0 || id > m_last_stream)
+        {
+            return connection_error(ERR_PROTOCOL);
+        }
+        // 不接收请求体：收到多少就把窗口还给对方多少，内容丢弃
+        stream *s = find(id);
+        if (len > 0)
+        {
+            window_update(0, len);
+            if (s && !s->remote_closed && !(flags & FLAG_END_STREAM))
+            {
+                window_update(id, len);
+            }
+        }
+        if (s && (flags & FLAG_END_STREAM))
+        {
+            s->remote_closed = true;
+        }
+        return true;
+    }
+    case FRAME_HEADERS:
+        return on_headers(flags, id, p, len);
+    case FRAME_CONTINUATION:
+        if (!m_block_stream)
+        {
+            return connection_error(ERR_PROTOCOL);
+        }
+        if (m_block_len + len > MAX_HEADER_BLOCK)
+        {
+            return connection_error(ERR_ENHANCE_YOUR_CALM);
+        }
+        memcpy(m_block + m_block_len, p, len);
+        m_block_len += len;
+        return (flags & FLAG_END_HEADERS) ? end_headers() : true;
+    case FRAME_PRIORITY:
+        return true; // 不按优先级调度，所有流轮流发送
+    case FRAME_RST_STREAM:
+    {
+        if (id == 0 || id > m_last_stream)
+        {
+            return connection_error(ERR_PROTOCOL);
+        }
+        if (len != 4)
+        {
+            return connection_error(ERR_FRAME_SIZE);
+        }
+        stream *s = find(id);
+        if (s)
+        {
+            s->reset = true; // 已经在发送的批中的帧发送完后释放
+            g_stats.h2_resets++;
+        }
+        return true;
+    }
+    case FRAME_SETTINGS:
+        if (id != 0)
+        {
+            return connection_error(ERR_PROTOCOL);
+        }
+        if (flags & FLAG_ACK)
+        {
+            return len == 0 || connection_error(ERR_FRAME_SIZE);
+        }
+        if (!apply_settings(p, len))
+        {
+            return false;
+        }
+        frame(FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        return true;
+    case FRAME_PING:
+        if (id != 0)
+        {
+            return connection_error(ERR_PROTOCOL);
+        }
+        if (len != 8)
+        {
+            return connection_error(ERR_FRAME_SIZE);
+        }
+        if (!(flags & FLAG_ACK))
+        {
+            frame(FRAME_PING, FLAG_ACK, 0, p, len);
+        }
+        return true;
+    case FRAME_GOAWAY:
+        if (id != 0)
+        {
+            return connection_error(ERR_PROTOCOL);
+        }
+        m_goaway_recv = true; // 对方不会再打开新的流，已经打开的处理完后关闭
+        return true;
+    case FRAME_WINDOW_UPDATE:
+    {
+        if (len != 4)
+        {
+            return connection_error(ERR_FRAME_SIZE);
+        }
+        uint32_t increment = get32(p) & MAX_WINDOW;
+        if (id == 0)
+        {
+            if (increment == 0)
+            {
+                return connection_error(ERR_PROTOCOL);
+            }
+            if (m_conn_window + increment > MAX_WINDOW)
+            {
+                return connection_error(ERR_FLOW_CONTROL);
+            }
+            m_conn_window += increment;
+            return true;
+        }
+        if (id > m_last_stream)
+        {
+            return connection_error(ERR_PROTOCOL);
+        }
+        stream *s = find(id);
+        if (!s || s->reset)
+        {
+            return true; // 已经结束的流
+        }
+        if (increment == 0 || s->window + increment > MAX_WINDOW)
+        {
+            rst_stream(id, increment == 0 ? ERR_PROTOCOL : ERR_FLOW_CONTROL);
+            s->reset = true;
+            return true;
+        }
+        s->window += increment;
+        return true;
+    }
+    case FRAME_PUSH_PROMISE:
+        return connection_error(ERR_PROTOCOL); // 客户端不能推送
+    default:
+        return true; // 不认识的帧类型忽略
+    }
+}
+
+bool h2_session::on_headers(uint8_t flags, uint32_t id, const uint8_t *p, size_t len)
+{
+    if (id == 0 || !(id & 1))
+    {
+        return connection_error(ERR_PROTOCOL); // 客户端打开的流是奇数
+    }
+    size_t pad = 0;
+    if (flags & FLAG_PADDED)
+    {
+        if (len < 1)
+        {
+            return connection_error(ERR_PROTOCOL);
+        }
+        pad = p[0];
+        p++;
+        len--;
+    }
+    if (flags & FLAG_PRIORITY)
+    {
+        if (len < 5)
+        {
+            return connection_error(ERR_PROTOCOL);
+        }
+        p += 5;
+        len -= 5;
+    }
+    if (pad > len)
+    {
+        return connection_error(ERR_PROTOCOL);
+    }
+    len -= pad;
+    memcpy(m_block, p, len); // HEADERS帧不超过MAX_FRAME，和头部块一样大
+    m_block_len = len;
+    m_block_stream = id;
+    m_block_end_stream = flags & FLAG_END_STREAM;
+    return (flags & FLAG_END_HEADERS) ? end_headers() : true;
+}
+
+bool h2_session::end_headers()
+{
+    uint32_t id = m_block_stream;
+    m_block_stream = 0;
+    // 所有的头部块都要解码，动态表才能和对方保持一致
+    int count = m_decoder.decode(m_block, m_block_len, m_fields, MAX_FIELDS, m_fields_buf, sizeof(m_fields_buf));
+    if (count < 0)
+    {
+        return connection_error(ERR_COMPRESSION);
+    }
+    if (id <= m_last_stream)
+    {
+        // 已经打开的流上的第二个头部块是请求体之后的尾部字段，不使用
+        stream *s = find(id);
+        if (s && m_block_end_stream)
+        {
+            s->remote_closed = true;
+        }
+        return true;
+    }
+    m_last_stream = id;
+    if (m_goaway_sent)
+    {
+        return true; // GOAWAY之后打开的流不处理，对方会重试
+    }
+    stream *s = open(id);
+    if (!s)
+    {
+        g_stats.h2_refused++;
+        rst_stream(id, ERR_REFUSED_STREAM);
+        return true;
+    }
+    s->remote_closed = m_block_end_stream;
+
+    h2_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = -1;
+    req.has_body = !m_block_end_stream;
+    header_view headers[http_conn::MAX_HEADERS];
+    int header_count = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const hpack_field &f = m_fields[i];
+        switch (f.token)
+        {
+        case HPACK_METHOD:
+            req.method = parse_method(f.value);
+            break;
+        case HPACK_PATH:
+            req.path = f.value.data;
+            break;
+        case HPACK_ACCEPT_ENCODING:
+            req.accept_gzip = http_conn::accepts_gzip(f.value.data);
+            break;
+        case HPACK_IF_NONE_MATCH:
+            req.if_none_match = f.value.data;
+            break;
+        case HPACK_IF_MODIFIED_SINCE:
+            req.if_modified_since = f.value.data;
+            break;
+        }
+        if (f.name.data[0] != ':' && header_count < http_conn::MAX_HEADERS)
+        {
+            headers[header_count].name = f.name;
+            headers[header_count].value = f.value;
+            header_count++;
+        }
+    }
+    req.headers = headers;
+    req.header_count = header_count;
+    if (!req.path || req.path[0] == '\0')
+    {
+        rst_stream(id, ERR_PROTOCOL); // 缺少:path的请求不完整
+        s->reset = true;
+        return true;
+    }
+    respond(*s, req);
+    return true;
+}
+
+bool h2_session::apply_settings(const uint8_t *p, size_t len)
+{
+    if (len % 6 != 0)
+    {
+        return connection_error(ERR_FRAME_SIZE);
+    }
+    for (size_t i = 0; i < len; i += 6)
+    {
+        uint16_t key = (p[i] << 8) | p[i + 1];
+        uint32_t value = get32(p + i + 2);
+        switch (key)
+        {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            m_encoder.set_max_size(value);
+            break;
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1)
+            {
+                return connection_error(ERR_PROTOCOL);
+            }
+            break; // 服务器不推送
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > MAX_WINDOW)
+            {
+                return connection_error(ERR_FLOW_CONTROL);
+            }
+            // 已经打开的流按差值调整，窗口可能变成负数
+            for (int k = 0; k < m_max_streams; k++)
+            {
+                if (m_streams[k].id)
+                {
+                    m_streams[k].window += (int64_t)value - m_initial_window;
+                }
+            }
+            m_initial_window = value;
+            break;
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < MAX_FRAME || value > 0xffffff)
+            {
+                return connection_error(ERR_PROTOCOL);
+            }
+            m_max_frame = value;
+            break;
+        default:
+            break; // MAX_CONCURRENT_STREAMS只限制推送，MAX_HEADER_LIST_SIZE对我们的响应没有影响
+        }
+    }
+    return true;
+}
+
+h2_session::stream *h2_session::find(uint32_t id)
+{
+    for (int i = 0; i < m_max_streams; i++)
+    {
+        if (m_streams[i].id == id)
+        {
+            return m_streams + i;
+        }
+    }
+    return NULL;
+}
+
+h2_session::stream *h2_session::open(uint32_t id)
+{
+    stream *s = find(0);
+    if (!s)
+    {
+        return NULL;
+    }
+    s->id = id;
+    s->window = m_initial_window;
+    s->remote_closed = false;
+    s->done = false;
+    s->reset = false;
+    s->data = NULL;
+    s->left = 0;
+    m_open++;
+    g_stats.h2_streams++;
+    return s;
+}
+
+// 流结束：对方还在发送请求体时告诉它不用再发了
+void h2_session::release(stream &s)
+{
+    if (!s.remote_closed && !s.reset)
+    {
+        rst_stream(s.id, ERR_NO_ERROR);
+    }
+    drop(s);
+}
+
+void h2_session::drop(stream &s)
+{
+    s.entry.reset();
+    if (s.mapped)
+    {
+        munmap(s.mapped, s.mapped_len);
+        s.mapped = NULL;
+    }
+    delete[] s.owned;
+    s.owned = NULL;
+    s.id = 0;
+    s.data = NULL;
+    s.left = 0;
+    m_open--;
+}
+
+void h2_session::respond(stream &s, const h2_request &req)
+{
+    bool head = req.method == http_conn::HEAD;
+    if (g_limiter && g_limiter->limits_requests() &&
+        !g_limiter->allow_request(m_address.sin_addr.s_addr, timer_queue::now_us()))
+    {
+        g_stats.rate_limited++;
+        respond_simple(s, 429, MIME_TYPES[MIME_HTML].type, too_many_429_form, sizeof(too_many_429_form) - 1, head);
+        return;
+    }
+    if (req.method < 0)
+    {
+        respond_simple(s, 405, MIME_TYPES[MIME_HTML].type, error_405_form, strlen(error_405_form), false);
+        return;
+    }
+    if (req.method == http_conn::OPTIONS)
+    {
+        begin_headers();
+        add_status(200);
+        const char *allow = http_conn::allowed_methods();
+        add_field(HPACK_NAME_ALLOW, allow, strlen(allow), true);
+        add_field(HPACK_NAME_CONTENT_LENGTH, "0", 1, false);
+        end_headers(s, true);
+        return;
+    }
+    size_t path_len = strcspn(req.path, "?");
+    // 动态接口优先于静态文件，处理函数拿不到请求体，带请求体的请求不查路由表
+    router *routes = http_conn::m_router;
+    route_match match;
+    const router::route *r = NULL;
+    if (!req.has_body && routes && routes->size() > 0)
+    {
+        r = routes->lookup(req.path, path_len, match);
+    }
+    if (r)
+    {
+        if (!(r->methods & (1u << req.method)))
+        {
+            respond_simple(s, 405, MIME_TYPES[MIME_HTML].type, error_405_form, strlen(error_405_form), head);
+            return;
+        }
+        route_request rr;
+        rr.method = req.method;
+        rr.path.data = req.path;
+        rr.path.len = path_len;
+        rr.query.data = req.path + path_len + (req.path[path_len] == '?' ? 1 : 0);
+        rr.query.len = strlen(rr.query.data);
+        rr.headers = req.headers;
+        rr.header_count = req.header_count;
+        rr.match = &match;
+        s.owned = new char[http_conn::STREAM_BUFFER_SIZE];
+        route_response resp(s.owned, http_conn::STREAM_BUFFER_SIZE);
+        if (!r->handler(rr, resp, r->arg) || resp.overflow())
+        {
+            respond_simple(s, 500, MIME_TYPES[MIME_HTML].type, error_500_form, strlen(error_500_form), head);
+            return;
+        }
+        begin_headers();
+        add_status(resp.status);
+        add_field(HPACK_NAME_CONTENT_TYPE, resp.content_type, strlen(resp.content_type), true);
+        add_field(HPACK_NAME_CACHE_CONTROL, "no-store", strlen("no-store"), true); // 动态内容
+        char digits[24];
+        int n = snprintf(digits, sizeof(digits), "%zu", resp.size());
+        add_field(HPACK_NAME_CONTENT_LENGTH, digits, n, false);
+        s.data = resp.data();
+        s.left = head ? 0 : resp.size();
+        end_headers(s, s.left == 0);
+        return;
+    }
+    bool proxied = http_conn::m_upstreams && http_conn::m_upstreams->match(req.path);
+    bool upload = (req.method == http_conn::POST || req.method == http_conn::PUT) && g_config.upload_dir;
+    if (proxied || upload)
+    {
+        // 转发和上传的请求体在HTTP/1.1的连接上流式处理，客户端收到后用HTTP/1.1重试
+        g_stats.h2_resets++;
+        rst_stream(s.id, ERR_HTTP_1_1_REQUIRED);
+        s.reset = true;
+        return;
+    }
+    if (req.method != http_conn::GET && req.method != http_conn::HEAD)
+    {
+        respond_simple(s, 405, MIME_TYPES[MIME_HTML].type, error_405_form, strlen(error_405_form), head);
+        return;
+    }
+    respond_file(s, req);
+}
+
+// 和HTTP/1.1的do_request相同的顺序：打包文件 -> 内存缓存 -> stat -> 选择编码 -> 304 -> 读入缓存或者mmap
+void h2_session::respond_file(stream &s, const h2_request &req)
+{
+    bool head = req.method == http_conn::HEAD;
+    size_t path_len = strcspn(req.path, "?");
+    static_bundle *bundle = http_conn::m_bundle;
+    const bundle_entry *e = bundle ? bundle->find(req.path, path_len) : NULL;
+    if (e)
+    {
+        // 打包时拼好的校验头部："ETag: ...\r\n[Content-Encoding: gzip\r\n]Last-Modified: ...\r\n"
+        g_stats.bundle_hits++;
+        bool gz = req.accept_gzip && e->gz_size > 0;
+        size_t len;
+        const char *h = bundle->headers(*e, gz, len);
+        const char *etag = h + strlen("ETag: ");
+        size_t etag_len = gz ? e->gz_etag_len : e->etag_len;
+        char tag[64];
+        if (etag_len >= sizeof(tag))
+        {
+            etag_len = sizeof(tag) - 1;
+        }
+        memcpy(tag, etag, etag_len);
+        tag[etag_len] = '\0';
+        const char *date = strstr(h, "Last-Modified: ") + strlen("Last-Modified: ");
+        size_t date_len = strcspn(date, "\r");
+        bool fresh = http_conn::still_valid(req.if_none_match, req.if_modified_since, tag, e->mtime);
+        size_t size = gz ? e->gz_size : e->size;
+        respond_validated(e->mime, fresh, gz, tag, etag_len, date, date_len, size);
+        if (!fresh && !head)
+        {
+            s.data = bundle->data(*e, gz);
+            s.left = size;
+        }
+        end_headers(s, s.left == 0);
+        return;
+    }
+
+    if (http_conn::escapes_root(req.path, path_len))
+    {
+        respond_simple(s, 403, MIME_TYPES[MIME_HTML].type, error_403_form, strlen(error_403_form), head);
+        return;
+    }
+    char real[http_conn::FILENAME_LEN];
+    size_t root_len = strlen(g_config.doc_root);
+    if (root_len + path_len >= sizeof(real))
+    {
+        respond_simple(s, 404, MIME_TYPES[MIME_HTML].type, error_404_form, strlen(error_404_form), head);
+        return;
+    }
+    memcpy(real, g_config.doc_root, root_len);
+    memcpy(real + root_len, req.path, path_len);
+    real[root_len + path_len] = '\0';
+    int mime = mime_lookup(real);
+    file_entry_ptr entry = http_conn::m_file_cache->lookup(real);
+    struct stat st;
+    if (entry)
+    {
+        st = entry->st;
+    }
+    else if (stat(real, &st) < 0)
+    {
+        respond_simple(s, 404, MIME_TYPES[MIME_HTML].type, error_404_form, strlen(error_404_form), head);
+        return;
+    }
+    else if (!(st.st_mode & S_IROTH))
+    {
+        respond_simple(s, 403, MIME_TYPES[MIME_HTML].type, error_403_form, strlen(error_403_form), head);
+        return;
+    }
+    else if (S_ISDIR(st.st_mode))
+    {
+        if (g_config.autoindex)
+        {
+            // 目录列表是边生成边发送的分块响应，用HTTP/1.1
+            g_stats.h2_resets++;
+            rst_stream(s.id, ERR_HTTP_1_1_REQUIRED);
+            s.reset = true;
+            return;
+        }
+        respond_simple(s, 400, MIME_TYPES[MIME_HTML].type, error_400_form, strlen(error_400_form), head);
+        return;
+    }
+
+    // 和select_encoding一样：后台压缩好的版本 -> 缓存中的.gz -> 磁盘上的.gz -> 提交后台压缩
+    bool gz = false;
+    if (req.accept_gzip && MIME_TYPES[mime].compressible && st.st_size >= MIN_GZIP_SIZE)
+    {
+        file_entry_ptr z = http_conn::m_gzip_cache->lookup(st);
+        char gz_path[http_conn::FILENAME_LEN + 3];
+        snprintf(gz_path, sizeof(gz_path), "%s.gz", real);
+        file_entry_ptr sibling = z ? file_entry_ptr() : http_conn::m_file_cache->lookup(gz_path);
+        struct stat gz_stat;
+        if (z)
+        {
+            if (z->data)
+            {
+                entry = z;
+                gz = true;
+            }
+        }
+        else if (sibling)
+        {
+            entry = sibling;
+            gz = true;
+        }
+        else if (stat(gz_path, &gz_stat) == 0 && S_ISREG(gz_stat.st_mode) && (gz_stat.st_mode & S_IROTH) &&
+                 gz_stat.st_mtime >= st.st_mtime && strlen(gz_path) < sizeof(real))
+        {
+            strcpy(real, gz_path);
+            st = gz_stat;
+            entry.reset();
+            gz = true;
+        }
+        else if (!head)
+        {
+            http_conn::m_gzip_cache->submit(real, st);
+        }
+        if (entry)
+        {
+            st = entry->st;
+        }
+    }
+
+    char tag[64];
+    http_conn::format_etag(st, gz, tag, sizeof(tag));
+    char date[64];
+    http_date(st.st_mtime, date, sizeof(date));
+    bool fresh = http_conn::still_valid(req.if_none_match, req.if_modified_since, tag, st.st_mtime);
+    if (!fresh && !head && st.st_size > 0)
+    {
+        if (!entry)
+        {
+            entry = http_conn::m_file_cache->load(real, st); // 小文件读入缓存，之后的请求不用stat
+        }
+        if (entry)
+        {
+            s.data = entry->data;
+        }
+        else
+        {
+            int fd = ::open(real, O_RDONLY);
+            void *addr = fd < 0 ? MAP_FAILED : mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+            if (addr == MAP_FAILED)
+            {
+                respond_simple(s, 500, MIME_TYPES[MIME_HTML].type, error_500_form, strlen(error_500_form), false);
+                return;
+            }
+            s.mapped = (char *)addr;
+            s.mapped_len = st.st_size;
+            s.data = s.mapped;
+        }
+        s.left = st.st_size;
+        s.entry = entry;
+    }
+    respond_validated(mime, fresh, gz, tag, strlen(tag), date, strlen(date), st.st_size);
+    end_headers(s, s.left == 0);
+}
+
+// 文件响应的头部（不结束头部块）：200或者304、类型、Vary、校验头部、长度
+void h2_session::respond_validated(int mime, bool fresh, bool gz, const char *etag, size_t etag_len, const char *date,
+                                   size_t date_len, long long size)
+{
+    g_stats.file_responses++;
+    begin_headers();
+    if (fresh)
+    {
+        g_stats.not_modified++;
+        add_status(304);
+    }
+    else
+    {
+        if (gz)
+        {
+            g_stats.gzip_responses++;
+        }
+        add_status(200);
+        const char *type = MIME_TYPES[mime].type;
+        add_field(HPACK_NAME_CONTENT_TYPE, type, strlen(type), true);
+    }
+    if (MIME_TYPES[mime].compressible)
+    {
+        add_field(HPACK_NAME_VARY, "Accept-Encoding", strlen("Accept-Encoding"), true);
+    }
+    add_field(HPACK_NAME_ETAG, etag, etag_len, false);
+    if (gz)
+    {
+        add_field(HPACK_NAME_CONTENT_ENCODING, "gzip", strlen("gzip"), true);
+    }
+    if (g_config.cache_control && g_config.cache_control[0])
+    {
+        add_field(HPACK_NAME_CACHE_CONTROL, g_config.cache_control, strlen(g_config.cache_control), true);
+    }
+    add_field(HPACK_NAME_LAST_MODIFIED, date, date_len, false);
+    if (!fresh)
+    {
+        char digits[24];
+        int n = snprintf(digits, sizeof(digits), "%lld", size);
+        add_field(HPACK_NAME_CONTENT_LENGTH, digits, n, false);
+    }
+}
+
+// 错误页面和429：内容是静态字符串
+void h2_session::respond_simple(stream &s, int status, const char *type, const char *body, size_t len, bool head)
+{
+    begin_headers();
+    add_status(status);
+    add_field(HPACK_NAME_CONTENT_TYPE, type, strlen(type), true);
+    if (status == 429)
+    {
+        add_field(HPACK_NAME_RETRY_AFTER, "1", 1, false);
+    }
+    char digits[24];
+    int n = snprintf(digits, sizeof(digits), "%zu", len);
+    add_field(HPACK_NAME_CONTENT_LENGTH, digits, n, false);
+    s.data = body;
+    s.left = head ? 0 : len;
+    end_headers(s, s.left == 0);
+}
+
+// HEADERS帧直接在输出缓冲区中编码，帧头在头部块长度确定后填写
+void h2_session::begin_headers()
+{
+    m_block_head = m_out_len;
+    size_t cap = OUT_BUFFER_SIZE - m_out_len - FRAME_HEADER;
+    m_encoder.begin(m_out + m_out_len + FRAME_HEADER, cap < m_max_frame ? cap : m_max_frame);
+    m_plain_len = 0;
+}
+
+void h2_session::add_status(int status)
+{
+    m_encoder.status(status);
+    m_plain_len += strlen("HTTP/1.1 200 OK\r\n");
+}
+
+void h2_session::add_field(int name, const char *value, size_t len, bool indexed)
+{
+    m_encoder.field(name, value, len, indexed);
+    m_plain_len += strlen(hpack_static_name(name)) + strlen(": ") + len + strlen("\r\n");
+}
+
+void h2_session::end_headers(stream &s, bool end_stream)
+{
+    size_t len = m_encoder.finish();
+    if (len == 0)
+    {
+        // 头部超过了一帧（-C的值太长），放弃这个流；编码器已经撤销了这个块对动态表的修改，连接上之后的块不受影响
+        rst_stream(s.id, ERR_INTERNAL);
+        s.reset = true;
+        return;
+    }
+    put_frame_header(m_out + m_block_head, len, FRAME_HEADERS, FLAG_END_HEADERS | (end_stream ? FLAG_END_STREAM : 0),
+                     s.id);
+    m_out_len += FRAME_HEADER + len;
+    if (end_stream)
+    {
+        s.done = true;
+    }
+    g_stats.h2_header_bytes += len;
+    g_stats.h2_header_plain += m_plain_len + strlen("\r\n");
+}
+
+bool h2_session::append(const void *data, size_t len)
+{
+    if (m_out_len + len > OUT_BUFFER_SIZE)
+    {
+        m_closing = true; // 不会发生：处理每一帧之前都留了OUT_RESERVE
+        return false;
+    }
+    memcpy(m_out + m_out_len, data, len);
+    m_out_len += len;
+    return true;
+}
+
+void h2_session::frame(uint8_t type, uint8_t flags, uint32_t id, const void *payload, size_t len)
+{
+    uint8_t h[FRAME_HEADER];
+    put_frame_header(h, len, type, flags, id);
+    if (append(h, sizeof(h)) && len > 0)
+    {
+        append(payload, len);
+    }
+}
+
+void h2_session::rst_stream(uint32_t id, uint32_t code)
+{
+    uint8_t p[4];
+    put32(p, code);
+    frame(FRAME_RST_STREAM, 0, id, p, sizeof(p));
+}
+
+void h2_session::window_update(uint32_t id, uint32_t increment)
+{
+    uint8_t p[4];
+    put32(p, increment);
+    frame(FRAME_WINDOW_UPDATE, 0, id, p, sizeof(p));
+}
+
+bool h2_session::connection_error(uint32_t code)
+{
+    if (!m_goaway_sent)
+    {
+        uint8_t p[8];
+        put32(p, m_last_stream);
+        put32(p + 4, code);
+        frame(FRAME_GOAWAY, 0, 0, p, sizeof(p));
+        m_goaway_sent = true;
+    }
+    m_closing = true;
+    return false;
+}
+
+bool h2_session::sendable() const
+{
+    if (m_conn_window <= 0)
+    {
+        return false;
+    }
+    for (int i = 0; i < m_max_streams; i++)
+    {
+        const stream &s = m_streams[i];
+        if (s.id && !s.reset && s.left > 0 && s.window > 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 下一批：输出缓冲区中的全部内容，加上按流轮流的DATA帧，直到批满或者窗口用完
+void h2_session::fill()
+{
+    m_iov_count = 0;
+    m_iov_idx = 0;
+    m_batch_out = m_out_len;
+    if (m_out_len > 0)
+    {
+        m_iov[0].iov_base = m_out;
+        m_iov[0].iov_len = m_out_len;
+        m_iov_count = 1;
+    }
+    int frames = 0;
+    size_t bytes = 0;
+    bool progress = true;
+    while (progress && frames < MAX_BATCH_FRAMES && bytes < MAX_BATCH_BYTES && m_conn_window > 0)
+    {
+        progress = false;
+        for (int k = 0; k < m_max_streams && frames < MAX_BATCH_FRAMES && m_conn_window > 0; k++)
+        {
+            stream &s = m_streams[(m_rr + k) % m_max_streams];
+            if (!s.id || s.reset || s.left == 0 || s.window <= 0)
+            {
+                continue;
+            }
+            size_t n = s.left;
+            if (n > m_max_frame)
+                n = m_max_frame;
+            if (n > (size_t)s.window)
+                n = s.window;
+            if (n > (size_t)m_conn_window)
+                n = m_conn_window;
+            bool last = (n == s.left);
+            uint8_t *h = m_heads[frames++];
+            put_frame_header(h, n, FRAME_DATA, last ? FLAG_END_STREAM : 0, s.id);
+            m_iov[m_iov_count].iov_base = h;
+            m_iov[m_iov_count].iov_len = FRAME_HEADER;
+            m_iov[m_iov_count + 1].iov_base = (void *)s.data;
+            m_iov[m_iov_count + 1].iov_len = n;
+            m_iov_count += 2;
+            s.data += n;
+            s.left -= n;
+            s.window -= n;
+            m_conn_window -= n;
+            if (last)
+            {
+                s.done = true;
+            }
+            bytes += FRAME_HEADER + n;
+            progress = true;
+        }
+        m_rr = (m_rr + 1) % m_max_streams;
+    }
+}
+
+void h2_session::finish_batch()
+{
+    if (m_batch_out > 0)
+    {
+        memmove(m_out, m_out + m_batch_out, m_out_len - m_batch_out);
+        m_out_len -= m_batch_out;
+        m_batch_out = 0;
+    }
+    m_iov_count = 0;
+    m_iov_idx = 0;
+    // 批中引用的内容都发送出去了，结束的流可以释放缓存项和映射
+    for (int i = 0; i < m_max_streams; i++)
+    {
+        stream &s = m_streams[i];
+        if (s.id && (s.done || s.reset))
+        {
+            release(s);
+        }
+    }
+}
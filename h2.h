@@ -0,0 +1,169 @@
+#ifndef H2_H
+#define H2_H
+/*
+明文的HTTP/2（h2c，RFC 7540）：一个连接上同时处理多个请求（流），头部用HPACK压缩。
+
+浏览器对HTTP/1.1的服务器开六个以上的并行连接，每个都占一个fd和一个http_conn；HTTP/2只需要一个连接。
+两种开始方式：
+  1. 先验知识：连接的第一个请求行是连接序言"PRI * HTTP/2.0"（curl --http2-prior-knowledge、h2load、反向代理）
+  2. Upgrade: h2c：HTTP/1.1的请求带Upgrade: h2c和HTTP2-Settings，回复101后这个请求的响应作为流1发送
+HTTPS连接上的Upgrade不处理（h2c只用于明文），HTTPS的HTTP/2需要ALPN，目前不支持。
+
+和HTTP/1.1的连接一样由持有者线程处理：可读时交给线程池，子线程读帧、处理请求、发送；
+socket写缓冲满时交给主线程，等EPOLLOUT后由主线程继续发送（只发送，不读socket）。
+  - 输出：控制帧和响应的HEADERS帧写进输出缓冲区；DATA帧只有9字节的帧头在缓冲区，内容直接指向
+    内存缓存项、打包文件或者mmap的文件，一批帧（输出缓冲区 + 多个流的DATA帧）用一次sendmsg发送。
+    一批没有发送完之前只在输出缓冲区后面追加，已经在批中的内容地址不变
+  - 调度：多个流轮流发送，每次一帧，帧的大小不超过对方的SETTINGS_MAX_FRAME_SIZE、流的窗口和连接的窗口；
+    窗口用完的流等对方的WINDOW_UPDATE
+  - 每个流的请求在子线程中直接处理：路由表、打包文件、内存缓存、stat + 读入缓存或者mmap，和HTTP/1.1共用这些模块；
+    响应的校验值（ETag、304）和gzip的选择和HTTP/1.1一致
+  - 请求体只用于判断：需要请求体的上传（POST/PUT）和反向代理、目录列表用RST_STREAM(HTTP_1_1_REQUIRED)拒绝，
+    客户端会改用HTTP/1.1重试；Range请求返回完整内容（RFC 7233允许忽略Range）
+  - 请求速率的限制对每个新流检查，超过时这个流返回429；-W的发送带宽限制不作用于HTTP/2连接
+*/
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "hpack.h"
+#include "file_cache.h"
+#include "static_bundle.h"
+
+// 服务器处理一个请求用到的字段，字符串以\0结尾
+struct h2_request{
+    int method;                     // http_conn::METHOD，不支持的方法为-1
+    const char * path;              // :path，没有时为NULL
+    bool accept_gzip;
+    bool has_body;                  // 请求头部之后还有DATA帧（没有END_STREAM）
+    const char * if_none_match;     // 没有时为NULL
+    const char * if_modified_since;
+    const header_view * headers;    // 普通头部（不含伪头部），交给路由处理函数
+    int header_count;
+};
+
+class h2_session{
+public:
+    // run/flush的结果
+    enum RESULT { H2_IDLE = 0, H2_BLOCKED, H2_CLOSE };
+    static const int DEFAULT_MAX_STREAMS = 100;     // SETTINGS_MAX_CONCURRENT_STREAMS
+    static const size_t PREFACE_LEN = 24;           // "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+    // max_streams：同时处理的流数，超过时新流被拒绝（REFUSED_STREAM）
+    h2_session(const sockaddr_in & addr, int max_streams);
+    ~h2_session();
+
+    // 先验知识：data是读缓冲区中已经收到的数据，从连接序言开始
+    void start(const char * data, size_t len);
+    // Upgrade: h2c：settings是HTTP2-Settings的值，请求作为流1处理（对方已经发送完），rest是请求之后已经读到的数据
+    bool upgrade(const char * settings, const h2_request & req, const char * rest, size_t len);
+    // 持有者线程：读帧、处理请求、发送，直到socket没有数据可读并且发送完（H2_IDLE）或者写缓冲满（H2_BLOCKED）
+    int run(int fd);
+    // 主线程等到EPOLLOUT后继续发送，不读socket
+    int flush(int fd);
+    // 发送完之后还有已经读到、没有处理的帧（处理时输出缓冲区满了），需要交给子线程
+    bool pending() const;
+    // 还有没有结束的流：排空时不当作空闲连接关闭
+    bool busy() const { return m_open.load(std::memory_order_relaxed) > 0; }
+    // 连接关闭之前：还没有发送过GOAWAY时尽力发送（不等待）
+    void close(int fd);
+
+private:
+    static const size_t FRAME_HEADER = 9;
+    static const size_t MAX_FRAME = 16384;          // 我们接受的帧的大小（SETTINGS_MAX_FRAME_SIZE的默认值）
+    static const size_t IN_BUFFER_SIZE = 32768;     // 至少放得下一个最大的帧
+    static const size_t OUT_BUFFER_SIZE = 65536;    // 控制帧和HEADERS帧
+    static const size_t OUT_RESERVE = 4096;         // 输出缓冲区剩余空间不够时暂停处理帧，先发送
+    static const size_t MAX_HEADER_BLOCK = 16384;   // 一个请求的头部块（HEADERS + CONTINUATION），也是SETTINGS_MAX_HEADER_LIST_SIZE
+    static const size_t FIELD_BUFFER_SIZE = 32768;  // 解码出的头部字符串
+    static const int MAX_FIELDS = 64;
+    static const int MAX_BATCH_FRAMES = 32;         // 一次sendmsg中的DATA帧数
+    static const size_t MAX_BATCH_BYTES = 256 * 1024;
+    static const int32_t DEFAULT_WINDOW = 65535;
+    static const uint32_t MAX_WINDOW = 0x7fffffff;
+
+    struct stream{
+        uint32_t id;                // 0表示空闲的槽
+        int64_t window;             // 对方给这个流的发送窗口，SETTINGS_INITIAL_WINDOW_SIZE变小时可能为负
+        bool remote_closed;         // 对方的请求已经发送完（END_STREAM）
+        bool done;                  // 响应的最后一帧已经放进输出
+        bool reset;                 // 对方RST_STREAM，不再发送
+        const char * data;          // 还没有发送的响应体
+        size_t left;
+        file_entry_ptr entry;       // 响应体在内存缓存中时持有缓存项
+        char * mapped;              // mmap的大文件
+        size_t mapped_len;
+        char * owned;               // 路由处理函数生成的内容
+    };
+
+    bool parse();                                   // 处理已经读到的完整的帧，连接错误时返回false（GOAWAY已经放进输出）
+    bool on_frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t * p, size_t len);
+    bool on_headers(uint8_t flags, uint32_t id, const uint8_t * p, size_t len);
+    bool end_headers();                             // 头部块完整了：解码，新的流处理请求
+    bool apply_settings(const uint8_t * p, size_t len);
+    stream * find(uint32_t id);
+    stream * open(uint32_t id);
+    void release(stream & s);                       // 流结束，对方没有发送完时RST_STREAM(NO_ERROR)
+    void drop(stream & s);                          // 释放流持有的内容，槽变成空闲
+    void server_preface();
+    void respond(stream & s, const h2_request & req);
+    void respond_file(stream & s, const h2_request & req);
+    void respond_validated(int mime, bool fresh, bool gz, const char * etag, size_t etag_len,
+                           const char * date, size_t date_len, long long size);
+    void respond_simple(stream & s, int status, const char * type, const char * body, size_t len, bool head);
+    void begin_headers();
+    void add_status(int status);
+    void add_field(int name, const char * value, size_t len, bool indexed);
+    void end_headers(stream & s, bool end_stream);
+
+    bool append(const void * data, size_t len);     // 追加到输出缓冲区，放不下时返回false
+    void frame(uint8_t type, uint8_t flags, uint32_t id, const void * payload, size_t len);
+    void rst_stream(uint32_t id, uint32_t code);
+    void window_update(uint32_t id, uint32_t increment);
+    bool connection_error(uint32_t code);           // 发送GOAWAY，之后关闭连接，返回false
+    bool sendable() const;                          // 有流的响应体可以发送（窗口没有用完）
+    void fill();                                    // 组装下一批
+    void finish_batch();                            // 一批发送完：释放结束的流，输出缓冲区中没有发送的部分移到开头
+
+    sockaddr_in m_address;
+    int m_max_streams;
+    stream * m_streams;
+    std::atomic<int> m_open;        // 占用的槽数
+    int m_rr;                       // 轮流发送的起点
+    uint32_t m_last_stream;         // 对方打开过的最大的流
+    size_t m_preface_left;          // 还没有收到的连接序言字节数
+    bool m_goaway_sent;
+    bool m_goaway_recv;
+    bool m_closing;                 // 连接错误，发送完GOAWAY后关闭
+
+    // 对方的设置和连接级的窗口
+    int64_t m_conn_window;
+    int64_t m_initial_window;
+    size_t m_max_frame;
+
+    hpack_decoder m_decoder;
+    hpack_encoder m_encoder;
+    size_t m_block_head;            // 正在写的HEADERS帧在输出缓冲区中的位置
+    size_t m_plain_len;             // 同样的响应头部用HTTP/1.1的文本表示的长度（统计）
+
+    char m_in[IN_BUFFER_SIZE];
+    size_t m_in_len;
+    uint8_t m_block[MAX_HEADER_BLOCK]; // 正在接收的头部块
+    size_t m_block_len;
+    uint32_t m_block_stream;        // 等待CONTINUATION的流，0表示没有
+    bool m_block_end_stream;
+    char m_fields_buf[FIELD_BUFFER_SIZE];
+    hpack_field m_fields[MAX_FIELDS];
+
+    uint8_t m_out[OUT_BUFFER_SIZE];
+    size_t m_out_len;
+    size_t m_batch_out;             // 正在发送的批包含输出缓冲区的前这么多字节
+    struct iovec m_iov[1 + 2 * MAX_BATCH_FRAMES];
+    int m_iov_count;
+    int m_iov_idx;
+    uint8_t m_heads[MAX_BATCH_FRAMES][FRAME_HEADER]; // 这一批DATA帧的帧头
+};
+
+#endif
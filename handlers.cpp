@@ -0,0 +1,211 @@
+#include "handlers.h"
+#include "server_stats.h"
+#include "config.h"
+#include <arpa/inet.h>
+
+static bool status_all(const route_request & /*req*/, route_response &resp, void * /*arg*/)
+{
+    resp.append("{");
+    for (int i = 0; i < stat_counter_count; i++)
+    {
+        resp.appendf("%s\"%s\":%lu", i ? "," : "", stat_counters[i].name, (g_stats.*stat_counters[i].field).load());
+    }
+    return resp.append("}\n");
+}
+
+static bool status_one(const route_request &req, route_response &resp, void * /*arg*/)
+{
+    str_view name = req.param("name");
+    for (int i = 0; i < stat_counter_count; i++)
+    {
+        if (name.equals(stat_counters[i].name))
+        {
+            return resp.appendf("{\"%s\":%lu}\n", stat_counters[i].name, (g_stats.*stat_counters[i].field).load());
+        }
+    }
+    resp.status = 404;
+    return resp.append("{\"error\":\"no such counter\"}\n");
+}
+
+// 字符串值中的"和\需要转义
+static void append_json_string(route_response &resp, const char *s)
+{
+    resp.append("\"");
+    if (s)
+    {
+        for (; *s; s++)
+        {
+            if (*s == '"' || *s == '\\')
+            {
+                resp.append("\\", 1);
+            }
+            resp.append(s, 1);
+        }
+    }
+    resp.append("\"");
+}
+
+static bool config_all(const route_request & /*req*/, route_response &resp, void * /*arg*/)
+{
+    resp.append("{\"doc_root\":");
+    append_json_string(resp, g_config.doc_root);
+    resp.appendf(",\"inline_dispatch\":%s,\"cache_capacity\":%zu,\"cache_max_file\":%zu,\"cache_revalidate\":%d,"
+                 "\"max_conns\":%d,\"cache_control\":",
+                 g_config.inline_dispatch ? "true" : "false", g_config.cache_capacity, g_config.cache_max_file,
+                 g_config.cache_revalidate, g_config.max_conns);
+    append_json_string(resp, g_config.cache_control);
+    resp.appendf(",\"gzip_capacity\":%zu,\"gzip_max_file\":%zu,\"upload_dir\":", g_config.gzip_capacity,
+                 g_config.gzip_max_file);
+    if (g_config.upload_dir)
+    {
+        append_json_string(resp, g_config.upload_dir);
+    }
+    else
+    {
+        resp.append("null");
+    }
+    resp.appendf(",\"max_body\":%lld,\"autoindex\":%s,\"rate_limit\":%g,\"rate_burst\":%g,\"bandwidth\":%g,"
+                 "\"workers\":%d,\"shm_cache_size\":%zu,\"upgrade_path\":",
+                 g_config.max_body, g_config.autoindex ? "true" : "false", g_config.rate_limit, g_config.rate_burst,
+                 g_config.bandwidth, g_config.workers, g_config.shm_cache_size);
+    if (g_config.upgrade_path)
+    {
+        append_json_string(resp, g_config.upgrade_path);
+    }
+    else
+    {
+        resp.append("null");
+    }
+    resp.append(",\"bundle_path\":");
+    if (g_config.bundle_path)
+    {
+        append_json_string(resp, g_config.bundle_path);
+    }
+    else
+    {
+        resp.append("null");
+    }
+    resp.appendf(",\"listen_backlog\":%d,\"defer_accept\":%d,\"fastopen\":%d,\"nodelay\":%s,\"cork\":%s,"
+                 "\"zerocopy_min\":%zu,\"tls_port\":%d,\"ktls\":%s,\"h2_streams\":%d",
+                 g_config.listen_backlog, g_config.defer_accept, g_config.fastopen, g_config.nodelay ? "true" : "false",
+                 g_config.cork ? "true" : "false", g_config.zerocopy_min, g_config.tls_port,
+                 g_config.ktls ? "true" : "false", g_config.h2_streams);
+    resp.append(",\"ws_prefix\":");
+    if (g_config.ws_prefix)
+    {
+        append_json_string(resp, g_config.ws_prefix);
+    }
+    else
+    {
+        resp.append("null");
+    }
+    return resp.append("}\n");
+}
+
+static bool status_upstreams(const route_request & /*req*/, route_response &resp, void *arg)
+{
+    const upstream_pool *upstreams = (const upstream_pool *)arg;
+    const std::vector<upstream_group *> &groups = upstreams->groups();
+    resp.append("[");
+    bool first = true;
+    for (size_t i = 0; i < groups.size(); i++)
+    {
+        for (size_t j = 0; j < groups[i]->backends.size(); j++)
+        {
+            const upstream_backend *b = groups[i]->backends[j];
+            unsigned long requests = b->requests.load();
+            resp.append(first ? "{\"prefix\":" : ",{\"prefix\":");
+            append_json_string(resp, groups[i]->prefix.c_str());
+            resp.append(",\"backend\":");
+            append_json_string(resp, b->name.c_str());
+            resp.appendf(",\"requests\":%lu,\"errors\":%lu,\"outstanding\":%d,\"connects\":%lu,\"reuses\":%lu,"
+                         "\"latency_avg_us\":%lu,\"latency_max_us\":%lu,\"bytes\":%lu}",
+                         requests, b->errors.load(), b->outstanding.load(), b->connects.load(), b->reuses.load(),
+                         requests ? b->latency_us.load() / requests : 0, b->latency_max_us.load(), b->bytes.load());
+            first = false;
+        }
+    }
+    return resp.append("]\n");
+}
+
+static bool status_limits(const route_request & /*req*/, route_response &resp, void *arg)
+{
+    rate_limiter *limiter = (rate_limiter *)arg;
+    std::vector<rate_limiter::client_info> top = limiter->top_limited(10);
+    resp.append("[");
+    for (size_t i = 0; i < top.size(); i++)
+    {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &top[i].ip, ip, sizeof(ip));
+        resp.appendf("%s{\"ip\":\"%s\",\"requests\":%lu,\"limited\":%lu,\"paced\":%lu,\"bytes\":%lu}", i ? "," : "",
+                     ip, top[i].requests, top[i].limited, top[i].paced, top[i].bytes);
+    }
+    return resp.append("]\n");
+}
+
+// 共享内存中各个worker最近一次复制的统计，total包括已经退出的worker
+static bool status_workers(const route_request & /*req*/, route_response &resp, void *arg)
+{
+    const stats_segment *segment = (const stats_segment *)arg;
+    resp.appendf("{\"worker\":%d,\"workers\":[", g_worker);
+    for (int i = 0; i < segment->workers(); i++)
+    {
+        const stats_segment::slot &s = segment->worker(i);
+        resp.appendf("%s{\"pid\":%d,\"restarts\":%lu", i ? "," : "", s.pid.load(), s.restarts.load());
+        for (int k = 0; k < stat_counter_count; k++)
+        {
+            resp.appendf(",\"%s\":%lu", stat_counters[k].name, s.values[k].load());
+        }
+        resp.append("}");
+    }
+    unsigned long sum[stats_segment::MAX_COUNTERS];
+    segment->total(sum);
+    resp.append("],\"total\":{");
+    for (int k = 0; k < stat_counter_count; k++)
+    {
+        resp.appendf("%s\"%s\":%lu", k ? "," : "", stat_counters[k].name, sum[k]);
+    }
+    return resp.append("}}\n");
+}
+
+static bool status_shm_cache(const route_request & /*req*/, route_response &resp, void *arg)
+{
+    const shm_cache *cache = (const shm_cache *)arg;
+    resp.appendf("{\"hits\":%lu,\"misses\":%lu,\"stores\":%lu,\"invalidations\":%lu,\"evictions\":%lu,\"classes\":[",
+                 cache->hits(), cache->misses(), cache->stores(), cache->invalidations(), cache->evictions());
+    for (int i = 0; i < cache->classes(); i++)
+    {
+        shm_cache::occupancy o = cache->usage(i);
+        resp.appendf("%s{\"slot_size\":%zu,\"slots\":%u,\"used\":%u,\"pinned\":%u,\"bytes\":%zu}", i ? "," : "",
+                     o.slot_size, o.slots, o.used, o.pinned, o.bytes);
+    }
+    return resp.append("]}\n");
+}
+
+void register_builtin_routes(router &r)
+{
+    unsigned get = router::METHOD_GET | router::METHOD_HEAD;
+    r.add("/status", get, status_all);
+    r.add("/status/:name", get, status_one);
+    r.add("/config", get, config_all);
+}
+
+void register_upstream_routes(router &r, upstream_pool *upstreams)
+{
+    r.add("/status/upstreams", router::METHOD_GET | router::METHOD_HEAD, status_upstreams, upstreams);
+}
+
+void register_limit_routes(router &r, rate_limiter *limiter)
+{
+    r.add("/status/limits", router::METHOD_GET | router::METHOD_HEAD, status_limits, limiter);
+}
+
+void register_worker_routes(router &r, stats_segment *segment)
+{
+    r.add("/status/workers", router::METHOD_GET | router::METHOD_HEAD, status_workers, segment);
+}
+
+void register_shm_cache_routes(router &r, shm_cache *cache)
+{
+    r.add("/status/shm_cache", router::METHOD_GET | router::METHOD_HEAD, status_shm_cache, cache);
+}
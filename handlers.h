@@ -0,0 +1,25 @@
+#ifndef HANDLERS_H
+#define HANDLERS_H
+
+// 服务器自带的动态接口，main在启动时注册到路由表
+//   GET /status             全部运行统计（JSON）
+//   GET /status/:name       单个统计项
+//   GET /config             当前的运行参数
+//   GET /status/upstreams   反向代理各个后端的统计（配置了-P时注册）
+//   GET /status/limits      被限流/限速最多的客户端（配置了-R或-W时注册）
+//   GET /status/workers     多进程模式下所有worker的统计和总数（配置了-w时注册）
+//   GET /status/shm_cache   共享内容缓存的命中、失效和各级别槽的占用（配置了-S时注册）
+
+#include "router.h"
+#include "upstream.h"
+#include "rate_limiter.h"
+#include "prefork.h"
+#include "shm_cache.h"
+
+void register_builtin_routes(router & r);
+void register_upstream_routes(router & r, upstream_pool * upstreams);
+void register_limit_routes(router & r, rate_limiter * limiter);
+void register_worker_routes(router & r, stats_segment * segment);
+void register_shm_cache_routes(router & r, shm_cache * cache);
+
+#endif
@@ -0,0 +1,625 @@
+#include "hpack.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// RFC 7541 附录A，下标0不用
+struct static_field{
+    const char * name;
+    const char * value;
+    int token;
+};
+static const static_field STATIC_TABLE[] = {
+    {"", "", HPACK_OTHER},
+    {":authority", "", HPACK_AUTHORITY},
+    {":method", "GET", HPACK_METHOD},
+    {":method", "POST", HPACK_METHOD},
+    {":path", "/", HPACK_PATH},
+    {":path", "/index.html", HPACK_PATH},
+    {":scheme", "http", HPACK_SCHEME},
+    {":scheme", "https", HPACK_SCHEME},
+    {":status", "200", HPACK_STATUS},
+    {":status", "204", HPACK_STATUS},
+    {":status", "206", HPACK_STATUS},
+    {":status", "304", HPACK_STATUS},
+    {":status", "400", HPACK_STATUS},
+    {":status", "404", HPACK_STATUS},
+    {":status", "500", HPACK_STATUS},
+    {"accept-charset", "", HPACK_OTHER},
+    {"accept-encoding", "gzip, deflate", HPACK_ACCEPT_ENCODING},
+    {"accept-language", "", HPACK_OTHER},
+    {"accept-ranges", "", HPACK_OTHER},
+    {"accept", "", HPACK_OTHER},
+    {"access-control-allow-origin", "", HPACK_OTHER},
+    {"age", "", HPACK_OTHER},
+    {"allow", "", HPACK_OTHER},
+    {"authorization", "", HPACK_OTHER},
+    {"cache-control", "", HPACK_OTHER},
+    {"content-disposition", "", HPACK_OTHER},
+    {"content-encoding", "", HPACK_OTHER},
+    {"content-language", "", HPACK_OTHER},
+    {"content-length", "", HPACK_CONTENT_LENGTH},
+    {"content-location", "", HPACK_OTHER},
+    {"content-range", "", HPACK_OTHER},
+    {"content-type", "", HPACK_OTHER},
+    {"cookie", "", HPACK_OTHER},
+    {"date", "", HPACK_OTHER},
+    {"etag", "", HPACK_OTHER},
+    {"expect", "", HPACK_OTHER},
+    {"expires", "", HPACK_OTHER},
+    {"from", "", HPACK_OTHER},
+    {"host", "", HPACK_OTHER},
+    {"if-match", "", HPACK_OTHER},
+    {"if-modified-since", "", HPACK_IF_MODIFIED_SINCE},
+    {"if-none-match", "", HPACK_IF_NONE_MATCH},
+    {"if-range", "", HPACK_OTHER},
+    {"if-unmodified-since", "", HPACK_OTHER},
+    {"last-modified", "", HPACK_OTHER},
+    {"link", "", HPACK_OTHER},
+    {"location", "", HPACK_OTHER},
+    {"max-forwards", "", HPACK_OTHER},
+    {"proxy-authenticate", "", HPACK_OTHER},
+    {"proxy-authorization", "", HPACK_OTHER},
+    {"range", "", HPACK_OTHER},
+    {"referer", "", HPACK_OTHER},
+    {"refresh", "", HPACK_OTHER},
+    {"retry-after", "", HPACK_OTHER},
+    {"server", "", HPACK_OTHER},
+    {"set-cookie", "", HPACK_OTHER},
+    {"strict-transport-security", "", HPACK_OTHER},
+    {"transfer-encoding", "", HPACK_OTHER},
+    {"user-agent", "", HPACK_OTHER},
+    {"vary", "", HPACK_OTHER},
+    {"via", "", HPACK_OTHER},
+    {"www-authenticate", "", HPACK_OTHER},
+};
+static const uint64_t STATIC_COUNT = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]) - 1;
+static const size_t ENTRY_OVERHEAD = 32; // 每个动态表项额外计入的大小
+
+const char *hpack_static_name(int index)
+{
+    return STATIC_TABLE[index].name;
+}
+
+// RFC 7541 附录B中每个符号的码长，下标256是EOS
+static const uint8_t HUFFMAN_LENGTHS[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+static const int HUFFMAN_MAX_LENGTH = 30;
+
+// 由码长算出的规范哈夫曼码
+struct huffman_table{
+    uint32_t code[257];
+    uint16_t sorted[257];                       // 按(码长, 符号)排列的符号
+    uint32_t first[HUFFMAN_MAX_LENGTH + 1];     // 每个码长的第一个码字
+    uint16_t offset[HUFFMAN_MAX_LENGTH + 1];    // 这个码长的第一个符号在sorted中的下标
+    uint16_t count[HUFFMAN_MAX_LENGTH + 1];
+
+    huffman_table()
+    {
+        uint32_t next = 0;
+        int k = 0;
+        for (int len = 0; len <= HUFFMAN_MAX_LENGTH; len++)
+        {
+            first[len] = next;
+            offset[len] = k;
+            count[len] = 0;
+            for (int sym = 0; sym < 257; sym++)
+            {
+                if (HUFFMAN_LENGTHS[sym] == len)
+                {
+                    code[sym] = next++;
+                    sorted[k++] = sym;
+                    count[len]++;
+                }
+            }
+            next <<= 1;
+        }
+    }
+};
+static const huffman_table huffman;
+
+size_t huffman_length(const char *s, size_t len)
+{
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        bits += HUFFMAN_LENGTHS[(unsigned char)s[i]];
+    }
+    return (bits + 7) / 8;
+}
+
+size_t huffman_encode(const char *s, size_t len, uint8_t *out)
+{
+    uint64_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = s[i];
+        acc = (acc << HUFFMAN_LENGTHS[c]) | huffman.code[c];
+        bits += HUFFMAN_LENGTHS[c];
+        while (bits >= 8)
+        {
+            bits -= 8;
+            out[n++] = (uint8_t)(acc >> bits);
+        }
+    }
+    if (bits > 0)
+    {
+        // 用EOS的前缀（全1）填满最后一个字节
+        out[n++] = (uint8_t)((acc << (8 - bits)) | ((1u << (8 - bits)) - 1));
+    }
+    return n;
+}
+
+long huffman_decode(const uint8_t *in, size_t len, char *out, size_t cap)
+{
+    size_t n = 0;
+    uint32_t code = 0;
+    int bits = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        for (int b = 7; b >= 0; b--)
+        {
+            code = (code << 1) | ((in[i] >> b) & 1);
+            bits++;
+            uint32_t k = code - huffman.first[bits];
+            if (k < huffman.count[bits])
+            {
+                int sym = huffman.sorted[huffman.offset[bits] + k];
+                if (sym == 256 || n >= cap)
+                {
+                    return -1; // 头部中不能出现EOS
+                }
+                out[n++] = (char)sym;
+                code = 0;
+                bits = 0;
+            }
+            else if (bits == HUFFMAN_MAX_LENGTH)
+            {
+                return -1;
+            }
+        }
+    }
+    // 剩下的只能是不超过7位的填充，并且是EOS的前缀
+    if (bits > 7 || code != (1u << bits) - 1)
+    {
+        return -1;
+    }
+    return (long)n;
+}
+
+// 整数表示：前缀放不下时后面每个字节7位，低位在前
+static bool get_int(const uint8_t *&p, const uint8_t *end, int prefix_len, uint64_t &value)
+{
+    if (p >= end)
+    {
+        return false;
+    }
+    uint64_t max = (1u << prefix_len) - 1;
+    value = *p++ & max;
+    if (value < max)
+    {
+        return true;
+    }
+    for (int shift = 0; p < end && shift <= 28; shift += 7)
+    {
+        uint8_t b = *p++;
+        value += (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 字面值的名字：只识别服务器关心的几个
+static int name_token(const char *name, size_t len)
+{
+    static const struct
+    {
+        const char *name;
+        int token;
+    } names[] = {
+        {":authority", HPACK_AUTHORITY},
+        {":method", HPACK_METHOD},
+        {":path", HPACK_PATH},
+        {":scheme", HPACK_SCHEME},
+        {"accept-encoding", HPACK_ACCEPT_ENCODING},
+        {"if-modified-since", HPACK_IF_MODIFIED_SINCE},
+        {"if-none-match", HPACK_IF_NONE_MATCH},
+        {"content-length", HPACK_CONTENT_LENGTH},
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (strlen(names[i].name) == len && memcmp(names[i].name, name, len) == 0)
+        {
+            return names[i].token;
+        }
+    }
+    return HPACK_OTHER;
+}
+
+// 复制到解码缓冲区并以\0结尾，放不下返回NULL
+static char *copy_out(char *buf, size_t cap, size_t &used, const char *s, size_t len)
+{
+    if (used + len + 1 > cap)
+    {
+        return NULL;
+    }
+    char *dst = buf + used;
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+    used += len + 1;
+    return dst;
+}
+
+// 读一个字符串字面值（可能是哈夫曼编码）到解码缓冲区
+static char *get_string(const uint8_t *&p, const uint8_t *end, char *buf, size_t cap, size_t &used, size_t &len)
+{
+    if (p >= end)
+    {
+        return NULL;
+    }
+    bool huff = *p & 0x80;
+    uint64_t n;
+    if (!get_int(p, end, 7, n) || n > (uint64_t)(end - p))
+    {
+        return NULL;
+    }
+    if (!huff)
+    {
+        len = n;
+        char *s = copy_out(buf, cap, used, (const char *)p, n);
+        p += n;
+        return s;
+    }
+    if (used >= cap)
+    {
+        return NULL;
+    }
+    long m = huffman_decode(p, n, buf + used, cap - used - 1);
+    if (m < 0)
+    {
+        return NULL;
+    }
+    p += n;
+    char *s = buf + used;
+    s[m] = '\0';
+    used += m + 1;
+    len = m;
+    return s;
+}
+
+bool hpack_decoder::lookup(uint64_t index, const char *&name, size_t &name_len, const char *&value,
+                           size_t &value_len, int &token) const
+{
+    if (index == 0)
+    {
+        return false;
+    }
+    if (index <= STATIC_COUNT)
+    {
+        // 静态表：编译期的数组，名字对应的字段编号也在表中
+        const static_field &f = STATIC_TABLE[index];
+        name = f.name;
+        name_len = strlen(f.name);
+        value = f.value;
+        value_len = strlen(f.value);
+        token = f.token;
+        return true;
+    }
+    index -= STATIC_COUNT + 1;
+    if (index >= m_table.size())
+    {
+        return false;
+    }
+    const entry &e = m_table[index];
+    name = e.name.data();
+    name_len = e.name.size();
+    value = e.value.data();
+    value_len = e.value.size();
+    token = e.token;
+    return true;
+}
+
+void hpack_decoder::evict(size_t max)
+{
+    while (m_size > max)
+    {
+        const entry &e = m_table.back();
+        m_size -= e.name.size() + e.value.size() + ENTRY_OVERHEAD;
+        m_table.pop_back();
+    }
+}
+
+void hpack_decoder::insert(const char *name, size_t name_len, const char *value, size_t value_len, int token)
+{
+    size_t size = name_len + value_len + ENTRY_OVERHEAD;
+    if (size > m_max_size)
+    {
+        evict(0); // 比整个表还大的项清空动态表，自己也不加入
+        return;
+    }
+    evict(m_max_size - size);
+    entry e;
+    e.name.assign(name, name_len);
+    e.value.assign(value, value_len);
+    e.token = token;
+    m_table.push_front(e);
+    m_size += size;
+}
+
+int hpack_decoder::decode(const uint8_t *in, size_t len, hpack_field *fields, int max_fields, char *buf, size_t cap)
+{
+    const uint8_t *p = in;
+    const uint8_t *end = in + len;
+    size_t used = 0;
+    int count = 0;
+    while (p < end)
+    {
+        uint8_t b = *p;
+        uint64_t index;
+        const char *name, *value;
+        size_t name_len, value_len;
+        int token;
+        if (b & 0x80)
+        {
+            // 索引字段：名字和值都在表中
+            const char *n, *v;
+            if (!get_int(p, end, 7, index) || !lookup(index, n, name_len, v, value_len, token))
+            {
+                return -1;
+            }
+            name = copy_out(buf, cap, used, n, name_len);
+            value = name ? copy_out(buf, cap, used, v, value_len) : NULL;
+        }
+        else if ((b & 0xe0) == 0x20)
+        {
+            // 动态表大小更新，不能超过我们在SETTINGS中声明的大小
+            if (!get_int(p, end, 5, index) || index > DEFAULT_TABLE_SIZE)
+            {
+                return -1;
+            }
+            m_max_size = index;
+            evict(m_max_size);
+            continue;
+        }
+        else
+        {
+            // 字面值：01带索引（加入动态表），0000不索引，0001永不索引
+            bool incremental = (b & 0xc0) == 0x40;
+            if (!get_int(p, end, incremental ? 6 : 4, index))
+            {
+                return -1;
+            }
+            if (index == 0)
+            {
+                name = get_string(p, end, buf, cap, used, name_len);
+                token = name ? name_token(name, name_len) : HPACK_OTHER;
+            }
+            else
+            {
+                const char *n, *v;
+                if (!lookup(index, n, name_len, v, value_len, token))
+                {
+                    return -1;
+                }
+                name = copy_out(buf, cap, used, n, name_len);
+            }
+            value = name ? get_string(p, end, buf, cap, used, value_len) : NULL;
+            if (value && incremental)
+            {
+                insert(name, name_len, value, value_len, token);
+            }
+        }
+        if (!name || !value)
+        {
+            return -1;
+        }
+        if (count < max_fields)
+        {
+            hpack_field &f = fields[count++];
+            f.token = token;
+            f.name.data = name;
+            f.name.len = name_len;
+            f.value.data = value;
+            f.value.len = value_len;
+        }
+    }
+    return count;
+}
+
+void hpack_encoder::set_max_size(size_t size)
+{
+    if (size > hpack_decoder::DEFAULT_TABLE_SIZE)
+    {
+        size = hpack_decoder::DEFAULT_TABLE_SIZE; // 更大的表对响应头部没有用处
+    }
+    if (size != m_max_size)
+    {
+        m_max_size = size;
+        evict(size);
+        m_size_update = true;
+    }
+}
+
+void hpack_encoder::evict(size_t max)
+{
+    while (m_size > max)
+    {
+        entry &e = m_table.back();
+        m_size -= strlen(STATIC_TABLE[e.name].name) + e.value.size() + ENTRY_OVERHEAD;
+        if (m_table.size() <= m_inserted)
+        {
+            m_inserted--; // 这个块自己加入的项，撤销时不用恢复
+        }
+        else
+        {
+            m_evicted.push_back(entry());
+            m_evicted.back().name = e.name;
+            m_evicted.back().value.swap(e.value);
+        }
+        m_table.pop_back();
+    }
+}
+
+void hpack_encoder::begin(uint8_t *out, size_t cap)
+{
+    m_out = out;
+    m_cap = cap;
+    m_len = 0;
+    m_overflow = false;
+    m_block_size = m_size;
+    m_block_size_update = m_size_update;
+    m_inserted = 0;
+    m_evicted.clear();
+    if (m_size_update)
+    {
+        put_int(0x20, 5, m_max_size);
+        m_size_update = false;
+    }
+}
+
+size_t hpack_encoder::finish()
+{
+    if (m_overflow)
+    {
+        rollback();
+        return 0;
+    }
+    return m_len;
+}
+
+// 删掉这个块加入的项，按相反的顺序放回被挤掉的项，编码器的动态表回到块开始时的状态
+void hpack_encoder::rollback()
+{
+    m_table.erase(m_table.begin(), m_table.begin() + m_inserted);
+    while (!m_evicted.empty())
+    {
+        m_table.push_back(entry());
+        m_table.back().name = m_evicted.back().name;
+        m_table.back().value.swap(m_evicted.back().value);
+        m_evicted.pop_back();
+    }
+    m_size = m_block_size;
+    m_size_update = m_block_size_update; // 大小更新没有发出，下一个块重新带上
+    m_inserted = 0;
+}
+
+void hpack_encoder::put_int(uint8_t prefix_bits, int prefix_len, uint64_t value)
+{
+    if (m_len + 8 > m_cap)
+    {
+        m_overflow = true;
+        return;
+    }
+    uint64_t max = (1u << prefix_len) - 1;
+    if (value < max)
+    {
+        m_out[m_len++] = prefix_bits | (uint8_t)value;
+        return;
+    }
+    m_out[m_len++] = prefix_bits | (uint8_t)max;
+    value -= max;
+    while (value >= 0x80)
+    {
+        m_out[m_len++] = (uint8_t)(value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    m_out[m_len++] = (uint8_t)value;
+}
+
+// 哈夫曼编码更短时用哈夫曼编码
+void hpack_encoder::put_string(const char *s, size_t len)
+{
+    size_t huff = huffman_length(s, len);
+    bool use_huff = huff < len;
+    size_t n = use_huff ? huff : len;
+    put_int(use_huff ? 0x80 : 0, 7, n);
+    if (m_overflow || m_len + n > m_cap)
+    {
+        m_overflow = true;
+        return;
+    }
+    if (use_huff)
+    {
+        huffman_encode(s, len, m_out + m_len);
+    }
+    else
+    {
+        memcpy(m_out + m_len, s, len);
+    }
+    m_len += n;
+}
+
+void hpack_encoder::status(int code)
+{
+    for (uint64_t i = HPACK_NAME_STATUS; i <= STATIC_COUNT && STATIC_TABLE[i].token == HPACK_STATUS; i++)
+    {
+        if (atoi(STATIC_TABLE[i].value) == code)
+        {
+            put_int(0x80, 7, i);
+            return;
+        }
+    }
+    char digits[8];
+    int n = snprintf(digits, sizeof(digits), "%d", code);
+    put_int(0, 4, HPACK_NAME_STATUS);
+    put_string(digits, n);
+}
+
+void hpack_encoder::field(int name, const char *value, size_t len, bool indexed)
+{
+    if (!indexed)
+    {
+        put_int(0, 4, name);
+        put_string(value, len);
+        return;
+    }
+    for (size_t i = 0; i < m_table.size(); i++)
+    {
+        const entry &e = m_table[i];
+        if (e.name == name && e.value.size() == len && memcmp(e.value.data(), value, len) == 0)
+        {
+            put_int(0x80, 7, STATIC_COUNT + 1 + i);
+            return;
+        }
+    }
+    put_int(0x40, 6, name);
+    put_string(value, len);
+    if (m_overflow)
+    {
+        return; // 这个块不会发出，不再修改动态表
+    }
+    size_t size = strlen(STATIC_TABLE[name].name) + len + ENTRY_OVERHEAD;
+    if (size > m_max_size)
+    {
+        evict(0);
+        return;
+    }
+    evict(m_max_size - size);
+    entry e;
+    e.name = name;
+    e.value.assign(value, len);
+    m_table.push_front(e);
+    m_size += size;
+    m_inserted++;
+}
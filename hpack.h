@@ -0,0 +1,114 @@
+#ifndef HPACK_H
+#define HPACK_H
+/*
+HTTP/2的头部压缩（HPACK，RFC 7541）。
+
+  1. 静态表：61个常用的头部，编译期的数组，按下标直接取。解码时静态表中的名字直接换成字段编号（hpack_token），
+     服务器关心的:method、:path、accept-encoding等不用比较字符串；:method GET、:path /、:status 200这样
+     完整在静态表中的字段只占一个字节
+  2. 动态表：按连接维护，先进先出，总大小不超过SETTINGS_HEADER_TABLE_SIZE。
+     编码器只把同一个连接上会重复出现的值（content-type、cache-control、vary等）加入动态表，
+     之后的响应中它们也只占一个字节；每个响应都不同的值（content-length、etag、last-modified）不加入，不挤掉有用的条目
+  3. 哈夫曼编码：RFC 7541附录B的编码是规范哈夫曼码（按码长、再按符号排列时码字连续递增），
+     只保存257个符号的码长，启动时算出码字和每个码长的起始码字；解码逐位比较当前码长的范围
+*/
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include "router.h"
+
+// 服务器关心的头部，解码时按静态表的下标或者名字识别
+enum hpack_token { HPACK_OTHER = 0, HPACK_AUTHORITY, HPACK_METHOD, HPACK_PATH, HPACK_SCHEME, HPACK_STATUS,
+    HPACK_ACCEPT_ENCODING, HPACK_IF_MODIFIED_SINCE, HPACK_IF_NONE_MATCH, HPACK_CONTENT_LENGTH };
+
+// 编码响应时用到的静态表下标（名字）
+enum hpack_name { HPACK_NAME_STATUS = 8, HPACK_NAME_ALLOW = 22, HPACK_NAME_CACHE_CONTROL = 24,
+    HPACK_NAME_CONTENT_ENCODING = 26, HPACK_NAME_CONTENT_LENGTH = 28, HPACK_NAME_CONTENT_TYPE = 31,
+    HPACK_NAME_ETAG = 34, HPACK_NAME_LAST_MODIFIED = 44, HPACK_NAME_RETRY_AFTER = 53, HPACK_NAME_VARY = 59 };
+
+// 解码出的一个字段，名字和值以\0结尾，指向调用者的缓冲区
+struct hpack_field{
+    int token;                  // hpack_token
+    str_view name;
+    str_view value;
+};
+
+// 静态表中的名字
+const char * hpack_static_name(int index);
+
+// 哈夫曼编码后的长度；编码写入out（调用者保证空间足够）
+size_t huffman_length(const char * s, size_t len);
+size_t huffman_encode(const char * s, size_t len, uint8_t * out);
+// 解码失败（EOS、填充不对、out放不下）返回-1
+long huffman_decode(const uint8_t * in, size_t len, char * out, size_t cap);
+
+class hpack_decoder{
+public:
+    static const size_t DEFAULT_TABLE_SIZE = 4096; // 服务器不修改SETTINGS_HEADER_TABLE_SIZE
+
+    hpack_decoder():m_size(0), m_max_size(DEFAULT_TABLE_SIZE){}
+
+    // 解码一个完整的头部块，字符串复制到buf中；超过max_fields的字段照常解码（维护动态表）但不输出
+    // 返回字段数，格式错误或者buf放不下返回-1（连接错误COMPRESSION_ERROR，动态表已经不可信）
+    int decode(const uint8_t * in, size_t len, hpack_field * fields, int max_fields, char * buf, size_t cap);
+
+private:
+    struct entry{
+        std::string name;
+        std::string value;
+        int token;
+    };
+    bool lookup(uint64_t index, const char *& name, size_t & name_len, const char *& value, size_t & value_len,
+                int & token) const;
+    void insert(const char * name, size_t name_len, const char * value, size_t value_len, int token);
+    void evict(size_t max);
+
+    std::deque<entry> m_table;  // 下标62是最新的一项，在队头
+    size_t m_size;              // 每项按名字 + 值 + 32计
+    size_t m_max_size;          // 对方用动态表大小更新设置的上限，不超过DEFAULT_TABLE_SIZE
+};
+
+class hpack_encoder{
+public:
+    hpack_encoder():m_size(0), m_max_size(hpack_decoder::DEFAULT_TABLE_SIZE), m_size_update(false), m_inserted(0){}
+
+    // 对方的SETTINGS_HEADER_TABLE_SIZE，下一个头部块开头带上动态表大小更新
+    void set_max_size(size_t size);
+
+    // 开始一个头部块，写到out，最多cap字节
+    void begin(uint8_t * out, size_t cap);
+    // :status，静态表中有的状态码只占一个字节
+    void status(int code);
+    // name是静态表下标（hpack_name）。indexed为true时先在动态表中找同样的值，没有时加入动态表（溢出之后不再加入）
+    void field(int name, const char * value, size_t len, bool indexed);
+    void field(int name, const char * value, bool indexed) { field(name, value, strlen(value), indexed); }
+    // 头部块的长度。超过cap时返回0，并撤销这个块对动态表的修改：块不会发出，对方的动态表没有变
+    size_t finish();
+
+private:
+    struct entry{
+        int name;
+        std::string value;
+    };
+    void put_int(uint8_t prefix_bits, int prefix_len, uint64_t value);
+    void put_string(const char * s, size_t len);
+    void evict(size_t max);
+    void rollback();
+
+    std::deque<entry> m_table;
+    size_t m_size;
+    size_t m_max_size;
+    bool m_size_update;         // 需要在下一个头部块开头写动态表大小更新
+    uint8_t * m_out;
+    size_t m_cap;
+    size_t m_len;
+    bool m_overflow;
+    // 当前头部块对动态表的修改，溢出时撤销
+    size_t m_block_size;        // 块开始时的m_size
+    bool m_block_size_update;   // 块开头写了动态表大小更新
+    size_t m_inserted;          // 队头的这么多项是这个块加入的
+    std::deque<entry> m_evicted; // 这个块挤掉的块开始前就有的项，按挤掉的先后
+};
+
+#endif
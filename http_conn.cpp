@@ -4,9 +4,29 @@
 int http_conn::m_user_count = 0;
 // 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
 int http_conn::m_epollfd = -1;
+// 子线程到主线程的完成队列
+completion_queue *http_conn::m_completions = NULL;
+// 小静态文件的内存缓存
+file_cache *http_conn::m_file_cache = NULL;
+// 动态压缩版本的缓存
+gzip_cache *http_conn::m_gzip_cache = NULL;
+// 动态接口的路由表
+router *http_conn::m_router = NULL;
+// 预先打包的静态文件
+static_bundle *http_conn::m_bundle = NULL;
+// 反向代理的上游
+upstream_pool *http_conn::m_upstreams = NULL;
+// HTTPS的证书和会话缓存
+tls_context *http_conn::m_tls_context = NULL;
+// 主线程的定时器
+timer_queue *http_conn::m_timers = NULL;
+ws_hub *http_conn::m_hub = NULL;
+// 是否正在排空
+std::atomic<bool> http_conn::m_draining(false);
 
 // 定义HTTP响应的一些状态信息
 const char *ok_200_title = "OK";
+const char *not_modified_304_title = "Not Modified";
 const char *error_400_title = "Bad Request";
 const char *error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char *error_403_title = "Forbidden";
@@ -15,9 +35,129 @@ const char *error_404_title = "Not Found";
 const char *error_404_form = "The requested file was not found on this server.\n";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "There was an unusual problem serving the requested file.\n";
+const char *partial_206_title = "Partial Content";
+const char *error_416_title = "Range Not Satisfiable";
+const char *error_416_form = "The requested range is not satisfiable.\n";
+const char *created_201_title = "Created";
+const char *created_201_form = "The file was uploaded.\n";
+const char *error_405_title = "Method Not Allowed";
+const char *error_405_form = "The request method is not supported for this resource.\n";
+const char *error_411_title = "Length Required";
+const char *error_411_form = "The request body needs a Content-Length or chunked encoding.\n";
+const char *error_413_title = "Payload Too Large";
+const char *error_413_form = "The request body is larger than the server allows.\n";
+// 上传的url前缀，之后是保存的文件名
+const char UPLOAD_PREFIX[] = "/upload/";
+// 过载时直接发送的完整响应，预先生成，不经过解析和process_write
+const char overload_503_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 43\r\n"
+    "Content-Type:text/html\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "The server is overloaded, try again later.\n";
+// 上游连接失败或者响应出错，还没有向客户端发送任何内容时回复
+const char bad_gateway_502_response[] =
+    "HTTP/1.1 502 Bad Gateway\r\n"
+    "Content-Length: 38\r\n"
+    "Content-Type:text/html\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "The upstream server is not available.\n";
+// 上游在IDLE_TIMEOUT_US内没有进展，还没有向客户端发送任何内容时回复
+const char gateway_timeout_504_response[] =
+    "HTTP/1.1 504 Gateway Timeout\r\n"
+    "Content-Length: 38\r\n"
+    "Content-Type:text/html\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "The upstream server did not respond.\n";
+// 客户端的请求速率超过限制时直接发送，和503一样不经过解析
+const char too_many_429_response[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Content-Length: 36\r\n"
+    "Content-Type:text/html\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "Too many requests, try again later.\n";
 
-// 网站根目录
-const char *doc_root = "/home/now/myweb/resources";
+// 服务器参数的默认值，main中根据命令行修改
+server_config g_config = {
+    "/home/now/myweb/resources", // 网站根目录
+    false,                       // 默认所有请求都交给线程池
+    64 * 1024 * 1024,            // 内存缓存总大小 64MB
+    256 * 1024,                  // 单个文件不超过256KB才缓存
+    1,                           // 缓存项1秒后重新校验
+    0,                           // 最大连接数由main根据MAX_FD决定
+    "no-cache",                  // 浏览器每次都用条件请求校验，文件没变时返回304
+    32 * 1024 * 1024,            // 压缩缓存总大小 32MB
+    4 * 1024 * 1024,             // 4MB以上的文件不做动态压缩
+    NULL,                        // 默认不接受上传
+    256LL * 1024 * 1024,         // 请求体最大256MB
+    false,                       // 默认不生成目录列表，请求目录返回400
+    0,                           // 默认不限制请求速率
+    0,                           // 突发请求数默认等于每秒的请求数
+    0,                           // 默认不限制发送带宽
+    0,                           // 默认单进程
+    0,                           // 默认不使用共享内容缓存
+    NULL,                        // 默认不支持热升级
+    NULL,                        // 默认不使用打包文件
+    128,                         // 全连接队列128
+    0,                           // 默认不使用TCP_DEFER_ACCEPT
+    0,                           // 默认不使用TCP_FASTOPEN
+    false,                       // 默认保留Nagle
+    false,                       // 默认不使用MSG_MORE
+    0,                           // 默认不使用零拷贝发送
+    0,                           // 默认不监听HTTPS
+    NULL,
+    NULL,
+    true,                        // 内核支持时使用kTLS
+    h2_session::DEFAULT_MAX_STREAMS, // 明文连接支持HTTP/2，每个连接100个流
+    NULL,                        // 默认不接受WebSocket
+};
+
+// 路由处理函数设置的状态码对应的原因短语
+static const char *status_title(int status)
+{
+    switch (status)
+    {
+    case 200:
+        return ok_200_title;
+    case 201:
+        return created_201_title;
+    case 202:
+        return "Accepted";
+    case 204:
+        return "No Content";
+    case 400:
+        return error_400_title;
+    case 403:
+        return error_403_title;
+    case 404:
+        return error_404_title;
+    case 405:
+        return error_405_title;
+    case 409:
+        return "Conflict";
+    case 503:
+        return "Service Unavailable";
+    default:
+        return status >= 500 ? error_500_title : "Unknown";
+    }
+}
+
+// 小于这个大小的文件压缩收益很小，不压缩（HTTP/2的流也用）
+extern const off_t MIN_GZIP_SIZE = 256;
+
+// 格式化HTTP日期 Sun, 06 Nov 1994 08:49:37 GMT
+void http_date(time_t t, char *buf, size_t len)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
 
 // 设置文件描述符非阻塞
 int setnonblocking(int cfd)
@@ -43,21 +183,20 @@ void addlfd(int epollfd, int fd, bool one_shot)
 }
 
 // 添加fd上epoll树
-/*epoll one_shot事件 操作系统最多触发fd上注册的一个可读、可写或者异常事件，且只触发一次，
-除非用 epoll_ctl 函数重置该文件描述符上注册的 EPOLLONESHOT 事件。*/
+/*连接socket统一注册为边沿触发，不再使用EPOLLONESHOT：
+连接的所有权由http_conn::m_owner在主线程和子线程之间交接，子线程处理完请求后直接写回响应，
+只有在socket写缓冲满的时候才通过modfd注册EPOLLOUT，一个请求正常情况下不需要任何epoll_ctl调用。*/
 void addfd(int epollfd, int fd, bool one_shot)
 {
     epoll_event ev;
     ev.data.fd = fd;
-    ev.events = EPOLLIN | EPOLLRDHUP; // 水平触发 若对方连接断开触发EPOLLRDHUP，挂起
-    // ev.events = EPOLLIN | EPOLLET |EPOLLRDHUP; // 边沿触发，lfd都是LT
+    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP; // 边沿触发 若对方连接断开触发EPOLLRDHUP，挂起
     if (one_shot)
     {
         ev.events |= EPOLLONESHOT;
     }
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
-    // 若ET需要设置文件描述符非阻塞，保证一次性读完。LT两个都可以
-    setnonblocking(fd);
+    // ET需要文件描述符非阻塞，保证一次性读完，连接socket由accept4直接设置了非阻塞
 }
 
 // 从epoll中移除监听的文件描述符
@@ -67,12 +206,12 @@ void removefd(int epollfd, int fd)
     close(fd);
 }
 
-// 修改epoll树上要监听的fd的事件，重置socket上的EPOLLONESHOT事件，确保下一次可读时，EPOLLIN事件能被触发
+// 修改epoll树上要监听的fd的事件，只在需要注册/注销EPOLLOUT时调用，连接始终保持边沿触发
 void modfd(int epollfd, int fd, int ev)
 { // ev 要修改的事件
     epoll_event event;
     event.data.fd = fd;
-    event.events = ev | EPOLLONESHOT | EPOLLRDHUP;
+    event.events = ev | EPOLLET | EPOLLRDHUP;
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
@@ -81,25 +220,223 @@ void http_conn::close_conn()
 {
     if (m_sockfd != -1)
     {
+        m_zc.orphan(m_sockfd);         // 关闭后读不到零拷贝的完成通知
+        if (m_h2)
+        {
+            m_h2->close(m_sockfd); // 告诉对方最后处理的流，没有处理的请求可以安全重试
+            delete m_h2;
+            m_h2 = NULL;
+        }
+        if (m_ws)
+        {
+            m_hub->unsubscribe(m_ws);
+            m_ws->close(m_sockfd, m_tls); // 1001：服务器排空或者订阅者太慢
+            delete m_ws;
+            m_ws = NULL;
+        }
+        m_tls.close();                 // close_notify要在fd关闭之前发送
         removefd(m_epollfd, m_sockfd); // fd下树
         m_sockfd = -1;                 // 没用了
         m_user_count--;                // 客户数-1
+        unmap();
+        if (m_body_sink)
+        {
+            // 上传中途断开，丢弃临时文件
+            m_body_sink->abort();
+            delete m_body_sink;
+            m_body_sink = NULL;
+        }
+        if (m_proxy)
+        {
+            end_proxy(false); // 转发中途断开，上游连接不能复用
+        }
+        // 还没有到期的限速定时器作废
+        m_paced = false;
+        m_timer_seq++;
+        // 保持占用状态，同一批epoll事件中残留的该fd事件不会再被处理
+        m_owner.store(CONN_BUSY);
+    }
+}
+
+// 子线程提交完成事件，由主线程执行关闭连接、注册EPOLLOUT等操作
+// 提交之后连接交给主线程，子线程不能再访问
+void http_conn::complete(int type)
+{
+    m_completion.fd = m_sockfd;
+    m_completion.type = type;
+    m_completions->push(&m_completion);
+}
+
+// 发送预先生成的503响应，socket写缓冲满时直接放弃，之后连接会被关闭
+void http_conn::send_overload(int sockfd)
+{
+    send(sockfd, overload_503_response, sizeof(overload_503_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void http_conn::send_overload()
+{
+    send_canned(overload_503_response, sizeof(overload_503_response) - 1);
+}
+
+// 发送预先生成的429响应，之后连接会被关闭
+void http_conn::send_too_many(int sockfd)
+{
+    send(sockfd, too_many_429_response, sizeof(too_many_429_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void http_conn::send_too_many()
+{
+    send_canned(too_many_429_response, sizeof(too_many_429_response) - 1);
+}
+
+// 发送之后连接会被关闭，写缓冲满时直接放弃。TLS握手还没有完成时不能发送明文，HTTP/2和WebSocket连接上不能发送HTTP/1.1的响应，直接关闭
+void http_conn::send_canned(const char *data, size_t len)
+{
+    if (m_tls.handshaking() || m_h2 || m_ws)
+    {
+        return;
+    }
+    if (m_tls.userspace())
+    {
+        m_tls.send(data, len);
+        return;
+    }
+    send(m_sockfd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// 读到数据之后、解析之前检查：每个新请求消耗客户端的一个请求令牌
+bool http_conn::rate_limited()
+{
+    if (!g_limiter || !g_limiter->limits_requests() || m_rate_checked)
+    {
+        return false;
+    }
+    if (m_check_state != CHECK_STATE_REQUESTLINE || m_check_idx != 0 || m_read_idx == 0)
+    {
+        return false; // 不是新请求的开始
+    }
+    m_rate_checked = true;
+    if (g_limiter->allow_request(m_address.sin_addr.s_addr, timer_queue::now_us()))
+    {
+        return false;
+    }
+    g_stats.rate_limited++;
+    return true;
+}
+
+// 子线程：请求在队列中排队太久，被过载控制丢弃
+void http_conn::shed()
+{
+    if (m_producer || m_h2)
+    {
+        // 已经开始发送的流式响应只是等待生成下一批，不能中途换成503；HTTP/2连接上还有其他流
+        process();
+        return;
+    }
+    unmap();
+    send_overload();
+    complete(completion_queue::COMP_CLOSE);
+}
+
+// 主线程注册EPOLLOUT，等待socket可写后继续发送
+void http_conn::wait_out()
+{
+    if (!m_wait_out)
+    {
+        m_wait_out = true;
+        modfd(m_epollfd, m_sockfd, EPOLLIN | EPOLLOUT);
+    }
+}
+
+// 主线程：socket可写了，注销EPOLLOUT
+void http_conn::stop_wait_out()
+{
+    if (m_wait_out)
+    {
+        m_wait_out = false;
+        modfd(m_epollfd, m_sockfd, EPOLLIN);
+    }
+}
+
+// 主线程：带宽令牌不够，注销EPOLLOUT（socket可写也不能发送），m_pace_us之后由定时器继续发送
+void http_conn::wait_pace()
+{
+    if (m_wait_out)
+    {
+        m_wait_out = false;
+        modfd(m_epollfd, m_sockfd, EPOLLIN);
+    }
+    if (!m_paced)
+    {
+        m_paced = true;
+        g_stats.paced_waits++;
+        m_timers->add(timer_queue::now_us() + m_pace_us, m_sockfd, m_timer_seq);
+    }
+}
+
+// 主线程：定时器到期，连接在添加定时器之后没有关闭过时结束等待
+bool http_conn::pace_expired(unsigned seq)
+{
+    if (!m_paced || seq != m_timer_seq)
+    {
+        return false;
+    }
+    m_paced = false;
+    return true;
+}
+
+// 主线程尝试获得连接的所有权
+// 连接被子线程持有时不能读写socket，记录下有新事件，由持有者在释放所有权前处理
+bool http_conn::acquire()
+{
+    int expected = CONN_IDLE;
+    if (m_owner.compare_exchange_strong(expected, CONN_BUSY))
+    {
+        return true;
+    }
+    if (expected == CONN_BUSY)
+    {
+        m_owner.compare_exchange_strong(expected, CONN_BUSY_PENDING);
     }
+    return false;
+}
+
+// 持有者交还所有权
+// 返回false表示持有期间有新事件到达（边沿触发不会再次通知），调用者仍持有连接，需要继续读
+bool http_conn::release()
+{
+    if (m_pipelined)
+    {
+        m_pipelined = false; // 读缓冲区中已经有下一个请求，边沿触发不会再通知，调用者接着读和处理
+        return false;
+    }
+    int expected = CONN_BUSY;
+    if (m_owner.compare_exchange_strong(expected, CONN_IDLE))
+    {
+        return true;
+    }
+    m_owner.store(CONN_BUSY);
+    return false;
 }
 
 // 初始化新连接,
 //  users[cfd].init(cfd, client_addr); 初始化套接字和地址，cfd上树，用户数+1
-void http_conn::init(int sockfd, const sockaddr_in &addr)
+void http_conn::init(int sockfd, const sockaddr_in &addr, bool tls)
 {
     m_sockfd = sockfd;
     m_address = addr;
-    // 端口复用
-    int reuse = 1;
-    setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    // fd上epoll树
-    addfd(m_epollfd, m_sockfd, true); // oneshot
-    m_user_count++;                   // 用户数+1
+    m_file_address = 0;
+    m_bundle_entry = NULL;
+    m_zc.reset();
+    m_tls.start(tls ? m_tls_context : NULL, sockfd);
+    m_wait_out = false;
+    m_paced = false;
+    m_owner.store(CONN_IDLE);
+    m_pipelined = false;
     init();
+    // fd上epoll树，边沿触发，不设置oneshot
+    addfd(m_epollfd, m_sockfd, false);
+    m_user_count++;                   // 用户数+1
 }
 
 // 初始化其他信息
@@ -107,35 +444,77 @@ void http_conn::init()
 {
     m_read_idx = 0;                          // 标识读缓冲区中已读入的客户端数据的最后一位的下一个位置
     m_check_state = CHECK_STATE_REQUESTLINE; // 主状态机当前所处的状态,初始状态为分析请求行
-    m_linger = false;                        // 默认不保持链接  Connection : keep-alive保持连接
+    m_rate_checked = false;                  // 下一个请求重新检查请求速率
+    m_linger = false;                        // 解析请求行时按协议版本设置默认值，Connection头部可以改变
 
     m_method = GET; // 默认请求方式为GET
     m_url = 0;
     m_version = 0;
-    m_content_length = 0;
+    m_content_length = -1; // 没有Content-Length头部
+    m_chunked = false;
+    m_expect_continue = false;
+    m_body_state = BODY_DATA;
+    m_body_remaining = 0;
+    m_body_received = 0;
     m_host = 0;
     m_start_line = 0; // 当前正在解析的行的起始位置
     m_check_idx = 0;  // 当前正在分析的字符在读缓冲区的位置
+    m_request_ready = false;
+    m_request_end = 0;
 
     m_write_idx = 0;
+    m_bytes_to_send = 0;
+    m_bytes_have_send = 0;
+    m_iv_count = 0;
+    m_iv_idx = 0;
+    m_range = 0;
+    m_if_range = 0;
+    m_if_none_match = 0;
+    m_if_modified_since = 0;
+    m_accept_gzip = false;
+    m_mime = MIME_HTML;
+    m_content_type = MIME_TYPES[MIME_HTML].type;
+    m_gzip = false;
+    m_range_count = 0;
+    m_http11 = false;
+    m_header_count = 0;
+    m_body = 0;
     bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, READ_BUFFER_SIZE);
+    bzero(m_write_buf, WRITE_BUFFER_SIZE);
     bzero(m_real_file, FILENAME_LEN);
 }
 
+// 保持连接的响应发送完：读缓冲区中这个请求之后的数据（流水线的下一个请求）移到开头，其余状态重新初始化，
+// 下一次release返回false让持有者接着处理。上传的请求体不在读缓冲区中结束（m_request_end为0），之后的数据不保留
+void http_conn::next_request()
+{
+    int left = m_request_end > 0 ? m_read_idx - m_request_end : 0;
+    if (left <= 0)
+    {
+        init();
+        return;
+    }
+    char tail[READ_BUFFER_SIZE];
+    memcpy(tail, m_read_buf + m_request_end, left);
+    init();
+    memcpy(m_read_buf, tail, left);
+    m_read_idx = left;
+    m_pipelined = true;
+}
+
 // 主线程非阻塞地循环读取客户数据，直到无数据可读或者对方关闭连接
 bool http_conn::read()
 {
-    if (m_read_idx >= READ_BUFFER_SIZE)
+    if (m_tls.handshaking() || m_h2)
     {
-        return false;
+        return true; // 握手的数据由子线程在handshake中读取，HTTP/2的帧由子线程的h2_session读取
     }
     // 读取到的字节
     int n = 0;
-    while (true)
+    while (m_read_idx < READ_BUFFER_SIZE) // 缓冲区满时剩下的数据留在socket中，由持有者消费缓冲区后自己读
     {
         // 从m_read_buf + m_read_idx索引出开始保存数据，大小是READ_BUFFER_SIZE - m_read_idx
-        n = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        n = recv_some(m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx);
         if (n == -1)
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
@@ -154,319 +533,1807 @@ bool http_conn::read()
     // cout << "read_index = " << m_read_idx << "读取到了数据:\n " << m_read_buf << endl;
     return true;
 }
-// 主线程非阻塞 写HTTP响应
-bool http_conn::write()
+
+ssize_t http_conn::recv_some(char *buf, size_t len)
 {
-    int tmp = 0;
-    int bytes_sent = 0; // 已发送字节数
-    int bytes_to_send = m_write_idx; // 写缓冲区待发送的字节数
-    if(bytes_to_send == 0){
-        //响应结束,重新变为等待读
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        init();
-        return true;
-    }
-    while(1){
-        // 分散写数据
-        
-        tmp = writev(m_sockfd, m_iv, m_iv_count); // 将数据写入到套接字文件描述符 m_sockfd 所指向的套接字中count=2或1
-        if ( tmp <= -1 ) {
-            // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
-            // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
-            if( errno == EAGAIN ) {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
-                return true;
-            }
-            unmap();
-            return false;
-        }
-        bytes_to_send -= tmp;
-        bytes_sent += tmp;
-        if ( bytes_to_send <= bytes_sent ) {
-            // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
-            unmap();
-            if(m_linger) {
-                init();
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return true;
-            } else {
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return false;
-            } 
-        }
+    if (m_tls.active())
+    {
+        return m_tls.recv(buf, len);
     }
+    return recv(m_sockfd, buf, len, 0);
 }
-
-// 处理http请求的入口函数，线程池中子线程调用
-void http_conn::process()
+// 非阻塞写HTTP响应，子线程处理完请求后直接调用，写缓冲满时返回WRITE_BLOCKED，交给主线程继续发送
+http_conn::WRITE_STATE http_conn::write(bool produce)
 {
-    // 解析http请求
-    HTTP_CODE read_ret = process_read();
-    if (read_ret == NO_REQUEST)
-    { // 请求不完整
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        return;
+    if (m_h2)
+    {
+        return write_h2();
     }
-
-    // 生成响应,各种错误都直接返回false
-    bool write_ret = process_write(read_ret);
-    if (!write_ret)
+    if (m_ws)
     {
-        close_conn();
+        return write_ws();
     }
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
-}
-
-// 主状态机 逐行解析http请求报文， 请求行，请求头，请求体
-/*
-    主状态机获取一行数据，然后根据状态做不同处理
-*/
-http_conn::HTTP_CODE http_conn::process_read()
-{
-    LINE_STATUS line_status = LINE_OK;
-    HTTP_CODE ret = NO_REQUEST;
-    char *text = 0;
-    // 逐行解析
-    //   解析到一行完整的数据 或者 解析到了请求体，也是完整的数据
-   while (((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK)) 
-                || ((line_status = parse_line()) == LINE_OK))
+    ssize_t tmp = 0;
+    if (m_bytes_to_send == 0 && !m_producer)
     {
-        // cout << "当前check_index: " << m_check_idx;
-        // 获取一行数据
-        text = get_line();
-        m_start_line = m_check_idx; // 当前解析行的起始位置 = 当前正在分析的字符在读缓冲区中的位置
-        cout << "get 1 line: " << text << endl;
-
-       switch (m_check_state)
-        { // 主状态机当前所处的状态
-          // 解析请求行
-        case CHECK_STATE_REQUESTLINE:
-        {
-            ret = parse_req_line(text);
-            if (ret == BAD_REQUEST)
-            { // 请求报文错误
-                return BAD_REQUEST;
-            }
-            break;
-        } // 解析请求头
-        case CHECK_STATE_HEADER:
+        // 没有待发送的数据，响应结束,重新变为等待读
+        next_request();
+        return WRITE_OK;
+    }
+    while (1)
+    {
+        if (m_bytes_to_send == 0)
         {
-            ret = parse_headers(text);
-            if (ret == BAD_REQUEST)
+            // 流式响应的一批发送完了，socket还能写，生成下一批
+            if (!produce)
             {
-                return BAD_REQUEST;
+                // 主线程不调用生成者，交给子线程。EPOLLOUT在这里注销，子线程不操作epoll
+                if (m_wait_out)
+                {
+                    m_wait_out = false;
+                    modfd(m_epollfd, m_sockfd, EPOLLIN);
+                }
+                return WRITE_PRODUCE;
             }
-            else if (ret == GET_REQUEST)
+            if (!fill_stream())
             {
-                return do_request(); // 解析具体的内容url等
+                unmap();
+                return WRITE_CLOSE;
             }
-            break;
-        } // 解析请求体
-        case CHECK_STATE_CONTENT:
+        }
+        // 限速的客户端只发送带宽令牌允许的部分
+        size_t quota = m_bytes_to_send;
+        bool paced = g_limiter && g_limiter->limits_bandwidth();
+        if (paced)
         {
-            ret = parse_content(text);
-            if (ret == GET_REQUEST)
+            quota = g_limiter->send_quota(m_address.sin_addr.s_addr, m_bytes_to_send, timer_queue::now_us(), m_pace_us);
+            if (quota == 0)
             {
-                return do_request(); // 具体的处理
+                return WRITE_PACED;
+            }
+            if (quota < m_tls.retry_len())
+            {
+                quota = m_tls.retry_len(); // 已经加密的记录必须完整重试，稍微超出令牌
             }
-            line_status = LINE_OPEN; // 行数据不完整
-            break;
         }
-        default:
+        // 分散写数据，从第一个没有发送完的iovec开始
+        if (quota < m_bytes_to_send)
         {
-            return INTERNAL_ERROR; // 服务器内部错误
+            tmp = writev_quota(quota);
         }
+        else
+        {
+            tmp = use_zerocopy() ? send_zerocopy() : send_iov(m_iv_count - m_iv_idx);
         }
-    }
-    return NO_REQUEST;
-}
-
-// 0.解析一行得到的读取状态，windows的判断依据\r\n（回车,\r光标移到开头）
-// 从状态机 1.读取到一个完整的行 2.行出错 3.行数据不完整
-http_conn::LINE_STATUS http_conn::parse_line()
-{
-    char temp;
-    // cout << "m_check_idx = " << m_check_idx << endl;
-    // cout << "m_read_idx = " << m_read_idx << endl; 
-    // 遍历一行数据，check_idx检查的字符索引 < 下一次读的索引
-    for (; m_check_idx < m_read_idx; ++m_check_idx)
-    {
-        temp = m_read_buf[m_check_idx]; // 从第0个开始解析
-        if (temp == '\r')
-        { // 光标移到开头
-            if ((m_check_idx + 1) == m_read_idx)
+        int err = errno;
+        if (paced && (size_t)(tmp > 0 ? tmp : 0) < quota)
+        {
+            g_limiter->refund(m_address.sin_addr.s_addr, quota - (tmp > 0 ? tmp : 0)); // 没有发送出去的令牌退回
+        }
+        if (tmp <= -1)
+        {
+            // 如果TCP写缓冲没有空间，由主线程注册EPOLLOUT等待下一轮可写事件后继续发送
+            if (err == EAGAIN)
             {
-                return LINE_OPEN; // 行数据不完整
-            }
-            else if (m_read_buf[m_check_idx + 1] == '\n')
-            {                                     // 遇到\r\n换行符了
-                m_read_buf[m_check_idx++] = '\0'; // \r -> \0
-                m_read_buf[m_check_idx++] = '\0'; // \n -> \0，且 m_check_idx 变到下一行开始位置
-                return LINE_OK;
+                return WRITE_BLOCKED;
             }
-            return LINE_BAD;
+            unmap();
+            return WRITE_CLOSE;
         }
-        else if (temp == '\n')
+        m_bytes_have_send += tmp;
+        m_bytes_to_send -= tmp;
+        // 部分发送，调整iovec，从未发送的位置继续
+        advance_iov(tmp);
+        if (m_bytes_to_send == 0 && m_producer && !m_stream_eof)
         {
-            if ((m_check_idx > 1) && (m_read_buf[m_check_idx - 1] == '\r'))
+            continue; // 流式响应还有内容
+        }
+        if (m_bytes_to_send == 0)
+        {
+            // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
+            unmap();
+            if (m_wait_out)
             {
-                // 第二次读的时候从\n开始读了，前一个是\r， 第一行的
-                m_read_buf[m_check_idx - 1] = '\0'; // \r 变\0
-                m_read_buf[m_check_idx++] = '\0';   // \n -> \0, idx到下一行起始
-                return LINE_OK;
+                // 慢路径结束（只会发生在主线程），注销EPOLLOUT，避免边沿触发下每次发送后的无效唤醒
+                m_wait_out = false;
+                modfd(m_epollfd, m_sockfd, EPOLLIN);
             }
-            return LINE_BAD;
+            if (m_linger)
+            {
+                next_request();
+                return WRITE_OK;
+            }
+            return WRITE_CLOSE;
         }
     }
-    return LINE_OPEN;
 }
 
-// 1. 解析http请求行 请求方法 目标URL HTTP版本
-//  GET /index.html HTTP/1.1
-http_conn::HTTP_CODE http_conn::parse_req_line(char *text)
+// 从第一个没有发送完的iovec开始发送count个
+// 流式响应的下一批马上就会生成时带上MSG_MORE（-T cork），这一批的尾部和下一批合并成满的分段，最后一批不带，立即发出
+ssize_t http_conn::send_iov(int count)
 {
-    // cout << "url0 = " << text << endl;
-    // GET /index.html HTTP/1.1 找到第1个空格或制表符位置
-    m_url = strpbrk(text, " \t"); // 在一个字符串中查找某个字符集合第一次出现的位置
-    if (!m_url)
+    if (m_tls.userspace())
     {
-        return BAD_REQUEST;
+        return m_tls.writev(m_iv + m_iv_idx, count);
     }
-    // GET\0/index.html HTTP/1.1
-    *m_url++ = '\0';
-    char *method = text;
-    if (strcasecmp(method, "GET") == 0) // 忽略大小写比较
-    { 
-        m_method = GET;
-    }
-    else
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = m_iv + m_iv_idx;
+    msg.msg_iovlen = count;
+    int flags = MSG_NOSIGNAL;
+    if (g_config.cork && m_producer && !m_stream_eof)
+    {
+        flags |= MSG_MORE;
+    }
+    return sendmsg(m_sockfd, &msg, flags);
+}
+
+// 只有完整文件或者单个区间（头部 + 一段内容）的响应，内容在缓存项或者打包文件中，发送期间不会被改写
+// 多个区间的分段头部和流式响应的缓冲区会被重复使用，mmap的大文件发送完就munmap，都不使用零拷贝
+// TLS连接上的内容要加密，kTLS也不接受MSG_ZEROCOPY
+bool http_conn::use_zerocopy() const
+{
+    return g_config.zerocopy_min > 0 && !m_tls.active() && m_zc.enabled() && !m_producer && m_iv_count == 2 &&
+           (m_cache_entry || m_bundle_entry) && m_iv[1].iov_len >= g_config.zerocopy_min;
+}
+
+ssize_t http_conn::send_zerocopy()
+{
+    if (m_iv_idx == 0)
+    {
+        // 头部在写缓冲区中，下一个响应会改写它，复制发送；MSG_MORE让它和响应体的开头合并成一个分段
+        return send(m_sockfd, m_iv[0].iov_base, m_iv[0].iov_len, MSG_NOSIGNAL | MSG_MORE);
+    }
+    return m_zc.send(m_sockfd, m_iv[1].iov_base, m_iv[1].iov_len, m_cache_entry);
+}
+
+// 只发送iovec的前quota字节：临时截短最后一个iovec，发送后恢复
+ssize_t http_conn::writev_quota(size_t quota)
+{
+    int end = m_iv_idx;
+    size_t len = 0;
+    while (end < m_iv_count && len + m_iv[end].iov_len < quota)
+    {
+        len += m_iv[end].iov_len;
+        end++;
+    }
+    size_t saved = m_iv[end].iov_len;
+    m_iv[end].iov_len = quota - len;
+    ssize_t ret = m_tls.userspace() ? m_tls.writev(m_iv + m_iv_idx, end + 1 - m_iv_idx)
+                                    : writev(m_sockfd, m_iv + m_iv_idx, end + 1 - m_iv_idx);
+    int saved_errno = errno;
+    m_iv[end].iov_len = saved;
+    errno = saved_errno;
+    return ret;
+}
+
+// 发送了n字节，跳过已经发送完的iovec，调整部分发送的那个
+void http_conn::advance_iov(size_t n)
+{
+    while (n > 0 && m_iv_idx < m_iv_count)
+    {
+        if (n >= m_iv[m_iv_idx].iov_len)
+        {
+            n -= m_iv[m_iv_idx].iov_len;
+            m_iv_idx++;
+        }
+        else
+        {
+            m_iv[m_iv_idx].iov_base = (char *)m_iv[m_iv_idx].iov_base + n;
+            m_iv[m_iv_idx].iov_len -= n;
+            n = 0;
+        }
+    }
+}
+
+// 处理http请求的入口函数，线程池中子线程调用
+// 子线程持有连接的所有权，解析请求后直接写回响应，交还所有权前检查期间是否有新数据到达
+// 关闭连接和注册EPOLLOUT通过完成队列交给主线程
+void http_conn::process()
+{
+    while (true)
+    {
+        if (m_tls.handshaking())
+        {
+            int step = m_tls.handshake();
+            if (step == tls_session::TLS_ERROR)
+            {
+                complete(completion_queue::COMP_CLOSE);
+                return;
+            }
+            if (step == tls_session::TLS_WANT_WRITE)
+            {
+                complete(completion_queue::COMP_WRITE); // 主线程注册EPOLLOUT，可写后交回线程池继续握手
+                return;
+            }
+            if (step == tls_session::TLS_WANT_READ)
+            {
+                if (release())
+                {
+                    return;
+                }
+                continue; // 期间又有数据到达
+            }
+            // 握手完成，第一个请求可能已经和握手的最后一条消息一起到达，解密后留在SSL中，边沿触发不会再通知
+            if (!read())
+            {
+                complete(completion_queue::COMP_CLOSE);
+                return;
+            }
+            if (rate_limited())
+            {
+                send_too_many();
+                complete(completion_queue::COMP_CLOSE);
+                return;
+            }
+        }
+        if (!m_h2 && h2_preface())
+        {
+            // 先验知识的HTTP/2：读缓冲区中的数据从连接序言开始交给会话
+            m_h2 = new h2_session(m_address, g_config.h2_streams);
+            m_h2->start(m_read_buf, m_read_idx);
+        }
+        if (m_h2)
+        {
+            process_h2();
+            return;
+        }
+        WRITE_STATE write_ret = WRITE_OK;
+        if (m_producer)
+        {
+            // 主线程发送完流式响应的一批后交回来，继续生成并发送
+            write_ret = write();
+        }
+        else
+        {
+            // 解析http请求，主线程已经解析完的请求直接找资源
+            HTTP_CODE read_ret = m_request_ready ? GET_REQUEST : process_read();
+            m_request_ready = false;
+            if (read_ret == GET_REQUEST && wants_h2c())
+            {
+                if (!upgrade_h2())
+                {
+                    complete(completion_queue::COMP_CLOSE);
+                    return;
+                }
+                process_h2();
+                return;
+            }
+            if (read_ret == GET_REQUEST && wants_websocket())
+            {
+                if (upgrade_ws())
+                {
+                    complete(completion_queue::COMP_WS); // 之后的读写都在主线程
+                    return;
+                }
+                read_ret = BAD_REQUEST;
+            }
+            if (read_ret == GET_REQUEST)
+            {
+                read_ret = do_request();
+            }
+            if (read_ret == PROXY_REQUEST)
+            {
+                complete(completion_queue::COMP_PROXY); // 上游的连接和转发都在主线程
+                return;
+            }
+            if (read_ret != NO_REQUEST)
+            {
+                // 生成响应,各种错误都直接返回false
+                if (!process_write(read_ret))
+                {
+                    complete(completion_queue::COMP_CLOSE);
+                    return;
+                }
+                write_ret = write();
+            }
+        }
+        if (write_ret == WRITE_CLOSE)
+        {
+            complete(completion_queue::COMP_CLOSE);
+            return;
+        }
+        if (write_ret == WRITE_BLOCKED || write_ret == WRITE_PACED)
+        {
+            complete(completion_queue::COMP_WRITE); // 连接交给主线程继续发送（或者等待限速的定时器）
+            return;
+        }
+        // 请求不完整或者响应已发送完毕，交还所有权
+        if (release())
+        {
+            return;
+        }
+        // 持有期间有新数据到达，边沿触发不会再通知，自己读
+        if (!read())
+        {
+            complete(completion_queue::COMP_CLOSE);
+            return;
+        }
+        if (rate_limited())
+        {
+            send_too_many();
+            complete(completion_queue::COMP_CLOSE);
+            return;
+        }
+    }
+}
+
+// 主线程直接处理请求，省去线程池的加锁、信号量和线程切换
+// 解析完整并且命中内存缓存的请求（以及错误请求）在主线程直接响应，其余的返回false交给线程池
+bool http_conn::process_inline()
+{
+    if (m_check_state == CHECK_STATE_BODY || h2_preface())
+    {
+        return false; // 请求体要写入文件，HTTP/2的会话在子线程处理，交给线程池
+    }
+    HTTP_CODE read_ret = process_read();
+    if (read_ret == NO_REQUEST)
+    {
+        release(); // 请求不完整，等待更多数据
+        return true;
+    }
+    if (read_ret == GET_REQUEST && wants_websocket())
+    {
+        if (upgrade_ws())
+        {
+            g_stats.inline_requests++;
+            start_ws();
+            return true;
+        }
+        read_ret = BAD_REQUEST;
+    }
+    if (read_ret == GET_REQUEST && (m_method == POST || m_method == PUT || wants_h2c()))
+    {
+        m_request_ready = true;
+        return false;
+    }
+    route_match match;
+    if (read_ret == GET_REQUEST && m_method != OPTIONS && find_route(match))
+    {
+        // 处理函数可能比较慢，不在主线程执行
+        m_request_ready = true;
+        return false;
+    }
+    if (read_ret == GET_REQUEST && m_method != OPTIONS && proxied())
+    {
+        // 转发不需要磁盘IO，直接在主线程开始
+        read_ret = start_proxy();
+        if (read_ret == PROXY_REQUEST)
+        {
+            g_stats.inline_requests++;
+            WRITE_STATE write_ret = proxy();
+            if (write_ret == WRITE_CLOSE)
+            {
+                close_conn();
+            }
+            else if (write_ret == WRITE_OK && !release())
+            {
+                return false; // 读缓冲区中还有流水线的下一个请求，交给线程池
+            }
+            return true;
+        }
+    }
+    if (read_ret == GET_REQUEST && m_method == OPTIONS)
+    {
+        read_ret = OPTIONS_REQUEST;
+    }
+    else if (read_ret == GET_REQUEST && find_bundle_entry())
+    {
+        read_ret = use_bundle_entry();
+    }
+    else if (read_ret == GET_REQUEST && !resolve_file())
+    {
+        read_ret = FORBIDDEN_REQUEST;
+    }
+    else if (read_ret == GET_REQUEST)
+    {
+        m_mime = mime_lookup(m_real_file);
+        m_content_type = MIME_TYPES[m_mime].type;
+        m_cache_entry = m_file_cache->lookup(m_real_file);
+        if (!m_cache_entry || !select_encoding(true))
+        {
+            // 冷文件、大文件或者需要查找预压缩文件，需要磁盘IO，交给线程池
+            m_cache_entry.reset();
+            m_request_ready = true;
+            return false;
+        }
+        read_ret = use_cache_entry();
+    }
+    g_stats.inline_requests++;
+    if (!process_write(read_ret))
+    {
+        close_conn();
+        return true;
+    }
+    WRITE_STATE write_ret = write();
+    if (write_ret == WRITE_CLOSE)
+    {
+        close_conn();
+    }
+    else if (write_ret == WRITE_BLOCKED)
+    {
+        wait_out();
+    }
+    else if (write_ret == WRITE_PACED)
+    {
+        wait_pace();
+    }
+    else if (!release())
+    {
+        // 只有主线程会设置待处理标记，主线程持有时只在读缓冲区中还有流水线的下一个请求时失败，交给线程池
+        return false;
+    }
+    return true;
+}
+
+// 服务器接受的方法，OPTIONS的回复和405的Allow头部共用；设置了上传目录时接受POST和PUT
+const char *http_conn::allowed_methods()
+{
+    return g_config.upload_dir ? "GET, HEAD, OPTIONS, POST, PUT" : "GET, HEAD, OPTIONS";
+}
+
+// 请求头部的值（以\0结尾），没有时返回NULL
+const char *http_conn::find_header(const char *name) const
+{
+    size_t len = strlen(name);
+    for (int i = 0; i < m_header_count; i++)
+    {
+        if (m_headers[i].name.len == len && strncasecmp(m_headers[i].name.data, name, len) == 0)
+        {
+            return m_headers[i].value.data;
+        }
+    }
+    return NULL;
+}
+
+// 逗号分隔的列表中有没有token（大小写不敏感），例如 Upgrade: websocket, h2c
+bool http_conn::has_token(const char *value, const char *token)
+{
+    if (!value)
+    {
+        return false;
+    }
+    size_t token_len = strlen(token);
+    while (*value)
+    {
+        value += strspn(value, " \t,");
+        size_t len = strcspn(value, " \t,");
+        if (len == token_len && strncasecmp(value, token, len) == 0)
+        {
+            return true;
+        }
+        value += len;
+    }
+    return false;
+}
+
+// 明文连接的第一个请求行是"PRI * HTTP/2.0"：客户端已知服务器支持HTTP/2
+bool http_conn::h2_preface() const
+{
+    return g_config.h2_streams > 0 && !m_tls.active() && m_check_state == CHECK_STATE_REQUESTLINE &&
+           m_check_idx == 0 && m_read_idx >= 4 && memcmp(m_read_buf, "PRI ", 4) == 0;
+}
+
+// HTTP/1.1请求带Upgrade: h2c和HTTP2-Settings，并且没有请求体（请求体之后才能切换协议）
+bool http_conn::wants_h2c() const
+{
+    if (g_config.h2_streams <= 0 || m_tls.active() || !m_http11 || m_content_length > 0 || m_chunked)
+    {
+        return false;
+    }
+    return has_token(find_header("Upgrade"), "h2c") && find_header("HTTP2-Settings");
+}
+
+// 回复101之后这个请求作为流1处理，请求之后已经读到的数据（客户端的连接序言）交给会话
+bool http_conn::upgrade_h2()
+{
+    h2_request req;
+    req.method = m_method;
+    req.path = m_url;
+    req.accept_gzip = m_accept_gzip;
+    req.has_body = false;
+    req.if_none_match = m_if_none_match;
+    req.if_modified_since = m_if_modified_since;
+    req.headers = m_headers;
+    req.header_count = m_header_count;
+    m_h2 = new h2_session(m_address, g_config.h2_streams);
+    return m_h2->upgrade(find_header("HTTP2-Settings"), req, m_read_buf + m_check_idx, m_read_idx - m_check_idx);
+}
+
+// 子线程：会话读帧、处理请求、发送，直到socket没有数据并且输出发送完
+void http_conn::process_h2()
+{
+    while (true)
+    {
+        int ret = m_h2->run(m_sockfd);
+        if (ret == h2_session::H2_CLOSE)
+        {
+            complete(completion_queue::COMP_CLOSE);
+            return;
+        }
+        if (ret == h2_session::H2_BLOCKED)
+        {
+            complete(completion_queue::COMP_WRITE); // 写缓冲满，交给主线程等待EPOLLOUT
+            return;
+        }
+        if (release())
+        {
+            return;
+        }
+        // 持有期间有新数据到达，run会自己读socket
+    }
+}
+
+// 主线程：EPOLLOUT到达后继续发送，只发送不处理帧
+http_conn::WRITE_STATE http_conn::write_h2()
+{
+    int ret = m_h2->flush(m_sockfd);
+    if (ret == h2_session::H2_CLOSE)
+    {
+        return WRITE_CLOSE;
+    }
+    if (ret == h2_session::H2_BLOCKED)
+    {
+        return WRITE_BLOCKED;
+    }
+    if (m_wait_out)
+    {
+        m_wait_out = false;
+        modfd(m_epollfd, m_sockfd, EPOLLIN);
+    }
+    // 输出缓冲区满时暂停处理的帧交给子线程
+    return m_h2->pending() ? WRITE_PRODUCE : WRITE_OK;
+}
+
+// GET 前缀/频道 HTTP/1.1 带Upgrade: websocket（Connection: Upgrade由浏览器一起发送，不单独检查）
+bool http_conn::wants_websocket() const
+{
+    if (!m_hub || m_method != GET || !m_http11 || m_content_length > 0 || m_chunked)
+    {
+        return false;
+    }
+    return strncmp(m_url, g_config.ws_prefix, strlen(g_config.ws_prefix)) == 0 &&
+           has_token(find_header("Upgrade"), "websocket");
+}
+
+// 版本必须是13，Sec-WebSocket-Key是16字节的base64；不满足时返回400
+bool http_conn::upgrade_ws()
+{
+    const char *key = find_header("Sec-WebSocket-Key");
+    const char *version = find_header("Sec-WebSocket-Version");
+    char accept[32];
+    if (!key || !version || atoi(version) != 13 || !ws_accept_key(key, accept, sizeof(accept)))
+    {
+        return false;
+    }
+    const char *channel = m_url + strlen(g_config.ws_prefix);
+    m_ws = new ws_session(this, channel, strcspn(channel, "?"), accept);
+    // 请求之后已经读到的数据是第一帧的开始，移到读缓冲区开头
+    m_read_idx -= m_check_idx;
+    memmove(m_read_buf, m_read_buf + m_check_idx, m_read_idx);
+    g_stats.ws_upgrades++;
+    return true;
+}
+
+// 主线程：订阅频道之后和可读事件一样处理，发送101
+void http_conn::start_ws()
+{
+    m_hub->subscribe(m_ws);
+    process_ws();
+}
+
+// 主线程持有连接：消费读缓冲区中的帧（消息放进广播队列，ping/close的回复放进发送队列），发送，交还所有权
+void http_conn::process_ws()
+{
+    while (true)
+    {
+        while (true)
+        {
+            // 读缓冲区满时socket中可能还有数据，边沿触发不会再通知，先全部消费
+            bool full = m_read_idx == READ_BUFFER_SIZE;
+            m_ws->consume(m_hub, m_read_buf, m_read_idx);
+            m_read_idx = 0;
+            if (!full)
+            {
+                break;
+            }
+            if (!read())
+            {
+                close_conn();
+                return;
+            }
+        }
+        if (m_ws->m_overflow)
+        {
+            g_stats.ws_dropped++;
+            close_conn();
+            return;
+        }
+        WRITE_STATE ret = write_ws();
+        if (ret == WRITE_CLOSE)
+        {
+            close_conn();
+            return;
+        }
+        if (ret == WRITE_BLOCKED)
+        {
+            wait_out();
+            return;
+        }
+        if (release())
+        {
+            return;
+        }
+        if (!read())
+        {
+            close_conn();
+            return;
+        }
+    }
+}
+
+http_conn::WRITE_STATE http_conn::write_ws()
+{
+    int ret = m_ws->flush(m_sockfd, m_tls);
+    if (ret == ws_session::WS_CLOSE)
+    {
+        return WRITE_CLOSE;
+    }
+    if (ret == ws_session::WS_BLOCKED)
+    {
+        return WRITE_BLOCKED;
+    }
+    if (m_wait_out)
+    {
+        m_wait_out = false;
+        modfd(m_epollfd, m_sockfd, EPOLLIN);
+    }
+    return WRITE_OK;
+}
+
+// 主状态机 逐行解析http请求报文， 请求行，请求头，请求体
+/*
+    主状态机获取一行数据，然后根据状态做不同处理
+*/
+http_conn::HTTP_CODE http_conn::process_read()
+{
+    if (m_check_state == CHECK_STATE_BODY)
+    {
+        return receive_body(); // 继续接收上传的请求体
+    }
+    LINE_STATUS line_status = LINE_OK;
+    HTTP_CODE ret = NO_REQUEST;
+    char *text = 0;
+    // 逐行解析
+    //   解析到一行完整的数据 或者 解析到了请求体，也是完整的数据
+   while (((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK)) 
+                || ((line_status = parse_line()) == LINE_OK))
+    {
+        // cout << "当前check_index: " << m_check_idx;
+        // 获取一行数据
+        text = get_line();
+        m_start_line = m_check_idx; // 当前解析行的起始位置 = 当前正在分析的字符在读缓冲区中的位置
+        // cout << "get 1 line: " << text << endl; // inline模式下解析在主线程，每行同步写stdout会拖慢事件循环
+
+       switch (m_check_state)
+        { // 主状态机当前所处的状态
+          // 解析请求行
+        case CHECK_STATE_REQUESTLINE:
+        {
+            ret = parse_req_line(text);
+            if (ret == BAD_REQUEST)
+            { // 请求报文错误
+                return BAD_REQUEST;
+            }
+            break;
+        } // 解析请求头
+        case CHECK_STATE_HEADER:
+        {
+            ret = parse_headers(text);
+            if (ret == BAD_REQUEST)
+            {
+                return BAD_REQUEST;
+            }
+            else if (ret == GET_REQUEST)
+            {
+                m_request_end = m_check_idx; // 没有请求体，请求在空行之后结束
+                return GET_REQUEST; // 请求解析完毕，由调用者找具体的资源
+            }
+            break;
+        } // 解析请求体
+        case CHECK_STATE_CONTENT:
+        {
+            ret = parse_content(text);
+            if (ret == GET_REQUEST)
+            {
+                m_request_end = m_check_idx + m_content_length;
+                return GET_REQUEST;
+            }
+            line_status = LINE_OPEN; // 行数据不完整
+            break;
+        }
+        default:
+        {
+            return INTERNAL_ERROR; // 服务器内部错误
+        }
+        }
+    }
+    if (m_read_idx >= READ_BUFFER_SIZE)
+    {
+        return BAD_REQUEST; // 缓冲区满了请求头还不完整
+    }
+    return NO_REQUEST;
+}
+
+// 0.解析一行得到的读取状态，windows的判断依据\r\n（回车,\r光标移到开头）
+// 从状态机 1.读取到一个完整的行 2.行出错 3.行数据不完整
+http_conn::LINE_STATUS http_conn::parse_line()
+{
+    char temp;
+    // cout << "m_check_idx = " << m_check_idx << endl;
+    // cout << "m_read_idx = " << m_read_idx << endl; 
+    // 遍历一行数据，check_idx检查的字符索引 < 下一次读的索引
+    for (; m_check_idx < m_read_idx; ++m_check_idx)
+    {
+        temp = m_read_buf[m_check_idx]; // 从第0个开始解析
+        if (temp == '\r')
+        { // 光标移到开头
+            if ((m_check_idx + 1) == m_read_idx)
+            {
+                return LINE_OPEN; // 行数据不完整
+            }
+            else if (m_read_buf[m_check_idx + 1] == '\n')
+            {                                     // 遇到\r\n换行符了
+                m_read_buf[m_check_idx++] = '\0'; // \r -> \0
+                m_read_buf[m_check_idx++] = '\0'; // \n -> \0，且 m_check_idx 变到下一行开始位置
+                return LINE_OK;
+            }
+            return LINE_BAD;
+        }
+        else if (temp == '\n')
+        {
+            if ((m_check_idx > 1) && (m_read_buf[m_check_idx - 1] == '\r'))
+            {
+                // 第二次读的时候从\n开始读了，前一个是\r， 第一行的
+                m_read_buf[m_check_idx - 1] = '\0'; // \r 变\0
+                m_read_buf[m_check_idx++] = '\0';   // \n -> \0, idx到下一行起始
+                return LINE_OK;
+            }
+            return LINE_BAD;
+        }
+    }
+    return LINE_OPEN;
+}
+
+// 1. 解析http请求行 请求方法 目标URL HTTP版本
+//  GET /index.html HTTP/1.1
+http_conn::HTTP_CODE http_conn::parse_req_line(char *text)
+{
+    // cout << "url0 = " << text << endl;
+    // GET /index.html HTTP/1.1 找到第1个空格或制表符位置
+    m_url = strpbrk(text, " \t"); // 在一个字符串中查找某个字符集合第一次出现的位置
+    if (!m_url)
+    {
+        return BAD_REQUEST;
+    }
+    // GET\0/index.html HTTP/1.1
+    *m_url++ = '\0';
+    char *method = text;
+    if (strcasecmp(method, "GET") == 0) // 忽略大小写比较
+    { 
+        m_method = GET;
+    }
+    else if (strcasecmp(method, "HEAD") == 0)
+    {
+        m_method = HEAD; // 和GET一样的头部，不发送内容
+    }
+    else if (strcasecmp(method, "OPTIONS") == 0)
+    {
+        m_method = OPTIONS;
+    }
+    else if (strcasecmp(method, "POST") == 0)
+    {
+        m_method = POST;
+    }
+    else if (strcasecmp(method, "PUT") == 0)
+    {
+        m_method = PUT;
+    }
+    else if (strcasecmp(method, "DELETE") == 0)
+    {
+        m_method = DELETE; // 只有路由表中的接口可能接受
+    }
+    else
+    {
+        return BAD_REQUEST;
+    }
+
+    // /index.html HTTP/1.1 找第二个制表符， 获得m_url和 m_version
+    m_version = strpbrk(m_url, " \t");
+    if (!m_version)
+    {   // 没有http版本号
+        return BAD_REQUEST; // 请求语法错误
+    }
+    *m_version++ = '\0';
+    // HTTP/1.1默认保持连接，HTTP/1.0默认关闭，之后可以被Connection头部改变
+    if (strcasecmp(m_version, "HTTP/1.1") == 0)
+    {
+        m_linger = true;
+        m_http11 = true;
+    }
+    else if (strcasecmp(m_version, "HTTP/1.0") == 0)
+    {
+        m_linger = false;
+        m_http11 = false;
+    }
+    else
+    {
+        return BAD_REQUEST;
+    }
+
+    // OPTIONS * 询问整个服务器支持的方法
+    if (m_method == OPTIONS && strcmp(m_url, "*") == 0)
+    {
+        m_check_state = CHECK_STATE_HEADER;
+        return NO_REQUEST;
+    }
+
+    // http://192.168.110.129:10000/index.html
+    if (strncasecmp(m_url, "http://", 7) == 0)
+    {
+        m_url += 7;                 // 192.168.110.129:10000/index.html
+        m_url = strchr(m_url, '/'); // 在一个字符串中查找某个字符第一次出现的位置
+        // murl = /index.html 文件名
+    }
+    if (!m_url || m_url[0] != '/')
     {
         return BAD_REQUEST;
     }
+    m_check_state = CHECK_STATE_HEADER; // 主状态机检查状态变成检查请求头
+    return NO_REQUEST;                  // 请求不完整，需要继续解析请求报文
+}
+
+// 2.解析请求头
+// 解析HTTP请求的一个头部信息
+http_conn::HTTP_CODE http_conn::parse_headers(char *text)
+{
+    // 遇到空行，表示头部字段解析完毕
+    if (text[0] == '\0')
+    {
+        // 上传的请求体不放进读缓冲区，由do_request流式接收
+        bool proxied = this->proxied();
+        if ((m_method == POST || m_method == PUT) && !proxied)
+        {
+            return GET_REQUEST;
+        }
+        // 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体，
+        // 状态机转移到CHECK_STATE_CONTENT状态
+        // 转发给上游的请求体必须完整地放进读缓冲区，放不下时由start_proxy返回413
+        if (m_content_length > 0 && (!proxied || m_content_length < READ_BUFFER_SIZE - m_check_idx))
+        {
+            m_check_state = CHECK_STATE_CONTENT;
+            return NO_REQUEST;
+        }
+        // 否则说明我们已经得到了一个完整的HTTP请求
+        return GET_REQUEST;
+    }
+    // 记录所有头部的视图，路由处理函数可以读取任意头部
+    char *colon = strchr(text, ':');
+    if (colon && m_header_count < MAX_HEADERS)
+    {
+        header_view &h = m_headers[m_header_count++];
+        h.name.data = text;
+        h.name.len = colon - text;
+        const char *value = colon + 1 + strspn(colon + 1, " \t");
+        h.value.data = value;
+        h.value.len = strlen(value);
+    }
+    if (strncasecmp(text, "Connection:", 11) == 0)
+    {
+        // 处理Connection 头部字段  Connection: keep-alive，可能是逗号分隔的多个选项
+        text += 11; // 到空格了
+        while (*text)
+        {
+            text += strspn(text, " \t,"); // text 指针移动到选项的第一个字符处
+            size_t len = strcspn(text, " \t,");
+            if (len == 10 && strncasecmp(text, "keep-alive", 10) == 0)
+            {
+                m_linger = true;
+            }
+            else if (len == 5 && strncasecmp(text, "close", 5) == 0)
+            {
+                m_linger = false;
+                break; // close优先
+            }
+            text += len;
+        }
+    }
+    else if (strncasecmp(text, "Content-Length:", 15) == 0)
+    {
+        // 处理Content-Length头部字段
+        text += 15;
+        text += strspn(text, " \t");  // 返回text开头到包含\t的长度
+        m_content_length = atoll(text);
+        if (m_content_length < 0)
+        {
+            return BAD_REQUEST;
+        }
+    }
+    else if (strncasecmp(text, "Transfer-Encoding:", 18) == 0)
+    {
+        // Transfer-Encoding: chunked
+        text += 18;
+        text += strspn(text, " \t");
+        if (strcasecmp(text, "chunked") != 0)
+        {
+            return BAD_REQUEST; // 不支持其他传输编码
+        }
+        m_chunked = true;
+    }
+    else if (strncasecmp(text, "Expect:", 7) == 0)
+    {
+        text += 7;
+        text += strspn(text, " \t");
+        m_expect_continue = (strcasecmp(text, "100-continue") == 0);
+    }
+    else if (strncasecmp(text, "Accept-Encoding:", 16) == 0)
+    {
+        text += 16;
+        m_accept_gzip = accepts_gzip(text);
+    }
+    else if (strncasecmp(text, "Range:", 6) == 0)
+    {
+        // Range: bytes=0-499,1000-
+        text += 6;
+        text += strspn(text, " \t");
+        m_range = text;
+    }
+    else if (strncasecmp(text, "If-None-Match:", 14) == 0)
+    {
+        text += 14;
+        text += strspn(text, " \t");
+        m_if_none_match = text;
+    }
+    else if (strncasecmp(text, "If-Modified-Since:", 18) == 0)
+    {
+        text += 18;
+        text += strspn(text, " \t");
+        m_if_modified_since = text;
+    }
+    else if (strncasecmp(text, "If-Range:", 9) == 0)
+    {
+        text += 9;
+        text += strspn(text, " \t");
+        m_if_range = text;
+    }
+    else if (strncasecmp(text, "Host:", 5) == 0)
+    {
+        // 处理Host头部字段 Host: 192.168.198.133:10000
+        text += 5;
+        text += strspn(text, " \t");
+        m_host = text;
+    }
+    // 其他头部不需要解析，路由处理函数从m_headers中读取
+    return NO_REQUEST;
+}
+// 3.解析请求体 没有真正解析请求体，只是判断它是否被完整的读入了
+// 请求体是m_body开始的m_content_length字节，不写结束符：请求体可能正好到读缓冲区的末尾
+http_conn::HTTP_CODE http_conn::parse_content(char *text)
+{
+    if (m_read_idx >= (m_content_length + m_check_idx))
+    {
+        m_body = text;
+        return GET_REQUEST;
+    }
+    return NO_REQUEST;
+}
+
+// 路径中有没有..段（包括百分号编码的%2e），有时拼接后会跑到网站根目录之外
+bool http_conn::escapes_root(const char *path, size_t len)
+{
+    const char *end = path + len;
+    while (path < end)
+    {
+        const char *seg = path;
+        while (path < end && *path != '/')
+        {
+            path++;
+        }
+        int dots = 0;
+        const char *p = seg;
+        while (p < path)
+        {
+            if (*p == '.')
+            {
+                p++;
+            }
+            else if (path - p >= 3 && p[0] == '%' && p[1] == '2' && (p[2] == 'e' || p[2] == 'E'))
+            {
+                p += 3;
+            }
+            else
+            {
+                break;
+            }
+            dots++;
+        }
+        if (p == path && dots == 2)
+        {
+            return true;
+        }
+        path++; // 跳过'/'
+    }
+    return false;
+}
+
+// 拼接网站根目录和请求的url，得到目标文件的完整路径；url中有..段时返回false（403）
+bool http_conn::resolve_file()
+{
+    if (escapes_root(m_url, strcspn(m_url, "?")))
+    {
+        return false;
+    }
+    // /home/now/myweb/resources
+    strcpy(m_real_file, g_config.doc_root);
+    int len = strlen(g_config.doc_root);
+    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
+    return true;
+}
+
+// 4.具体的处理
+// 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
+// 如果目标文件存在、对所有用户可读，且不是目录，小文件读入内存缓存，
+// 大文件使用mmap将其映射到内存地址m_file_address处，并告诉调用者获取文件成功
+http_conn::HTTP_CODE http_conn::do_request()
+{
+    if (m_method == OPTIONS)
+    {
+        return OPTIONS_REQUEST;
+    }
+    // 动态接口优先于静态文件，处理函数拿不到请求体，带请求体的请求不查路由表
+    if (m_content_length <= 0 && !m_chunked)
+    {
+        route_match match;
+        const router::route *r = find_route(match);
+        if (r)
+        {
+            return run_route(r, match);
+        }
+    }
+    // 匹配代理前缀的请求全部转发给上游
+    if (proxied())
+    {
+        return start_proxy();
+    }
+    if (m_method == POST || m_method == PUT)
+    {
+        return start_upload();
+    }
+    if (m_method == DELETE)
+    {
+        return METHOD_NOT_ALLOWED;
+    }
+    // 打包文件中的内容不需要访问文件系统
+    if (find_bundle_entry())
+    {
+        return use_bundle_entry();
+    }
+    if (!resolve_file())
+    {
+        return FORBIDDEN_REQUEST; // ..段会跑到网站根目录之外
+    }
+    m_mime = mime_lookup(m_real_file);
+    m_content_type = MIME_TYPES[m_mime].type;
+    // 先查内存缓存，命中时不需要stat
+    m_cache_entry = m_file_cache->lookup(m_real_file);
+    if (m_cache_entry)
+    {
+        m_file_stat = m_cache_entry->st;
+    }
+    else
+    {
+        // 获取m_real_file文件的相关的状态信息，-1失败，0成功
+        if (stat(m_real_file, &m_file_stat) < 0)
+        {
+            return NO_RESOURCE; // 服务器没有资源
+        }
+        // 判断访问权限
+        if (!(m_file_stat.st_mode & S_IROTH))
+        {
+            return FORBIDDEN_REQUEST; // 没有访问权限
+        }
+        // 判断是否是目录
+        if (S_ISDIR(m_file_stat.st_mode))
+        {
+            if (g_config.autoindex)
+            {
+                return start_listing(); // 生成目录列表
+            }
+            return BAD_REQUEST; // 请求语法错误
+        }
+    }
+
+    // 选择编码，可能换成内存中的压缩版本，或者磁盘上的.gz文件
+    select_encoding(false);
+    if (m_cache_entry)
+    {
+        return use_cache_entry();
+    }
 
-    // /index.html HTTP/1.1 找第二个制表符， 获得m_url和 m_version
-    m_version = strpbrk(m_url, " \t");
-    if (!m_version)
-    {   // 没有http版本号
-        return BAD_REQUEST; // 请求语法错误
+    // 客户端缓存仍然有效，只返回304，不需要打开和映射文件
+    if (not_modified())
+    {
+        return NOT_MODIFIED;
     }
-    *m_version++ = '\0';
-    if (strcasecmp(m_version, "HTTP/1.1") != 0)
+
+    // HEAD只需要stat得到的头部信息，不打开也不映射文件
+    if (m_method == HEAD)
     {
-        return BAD_REQUEST; // 忽略大小写判断一样
+        m_file_address = 0;
+        return FILE_REQUEST;
     }
 
-    // http://192.168.110.129:10000/index.html
-    if (strncasecmp(m_url, "http://", 7) == 0)
+    // 小文件读入内存缓存，之后的请求可以在主线程直接响应
+    m_cache_entry = m_file_cache->load(m_real_file, m_file_stat);
+    if (m_cache_entry)
     {
-        m_url += 7;                 // 192.168.110.129:10000/index.html
-        m_url = strchr(m_url, '/'); // 在一个字符串中查找某个字符第一次出现的位置
-        // murl = /index.html 文件名
+        m_file_address = m_cache_entry->data;
+        return FILE_REQUEST;
     }
-    if (!m_url || m_url[0] != '/')
+
+    // 以只读方式打开文件
+    int fd = open(m_real_file, O_RDONLY);
+    // 创建内存映射，资源映射到地址上,写的时候要把地址发送给客户端
+    m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return FILE_REQUEST; // 文件请求,获取文件成功
+}
+
+// POST/PUT /upload/文件名：检查请求，创建临时文件，之后请求体边收边写入
+// 出错时请求体没有被读完，连接不能继续使用
+http_conn::HTTP_CODE http_conn::start_upload()
+{
+    m_body_linger = m_linger; // 请求体读完之前出错时不能保持连接
+    m_linger = false;
+    if (!g_config.upload_dir)
     {
-        return BAD_REQUEST;
+        return METHOD_NOT_ALLOWED;
     }
-    m_check_state = CHECK_STATE_HEADER; // 主状态机检查状态变成检查请求头
-    return NO_REQUEST;                  // 请求不完整，需要继续解析请求报文
+    const char *name = m_url + sizeof(UPLOAD_PREFIX) - 1;
+    if (strncmp(m_url, UPLOAD_PREFIX, sizeof(UPLOAD_PREFIX) - 1) != 0 || !file_upload::valid_name(name))
+    {
+        return FORBIDDEN_REQUEST;
+    }
+    if (!m_chunked && m_content_length < 0)
+    {
+        return LENGTH_REQUIRED;
+    }
+    if (!m_chunked && m_content_length > g_config.max_body)
+    {
+        return PAYLOAD_TOO_LARGE;
+    }
+    // 响应中的Location，之后m_url所在的读缓冲区会被请求体覆盖
+    snprintf(m_real_file, FILENAME_LEN, "%s%s", UPLOAD_PREFIX, name);
+    try
+    {
+        m_body_sink = new file_upload(g_config.upload_dir, name);
+    }
+    catch (...)
+    {
+        return INTERNAL_ERROR;
+    }
+    if (m_expect_continue && m_read_idx == m_check_idx)
+    {
+        // 客户端在等待服务器同意后才发送请求体
+        static const char continue_100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        send_canned(continue_100, sizeof(continue_100) - 1);
+    }
+    m_check_state = CHECK_STATE_BODY;
+    m_body_received = 0;
+    if (m_chunked)
+    {
+        m_body_state = BODY_CHUNK_SIZE;
+    }
+    else
+    {
+        m_body_state = (m_content_length > 0) ? BODY_DATA : BODY_DONE;
+        m_body_remaining = m_content_length;
+    }
+    return receive_body();
 }
 
-// 2.解析请求头
-// 解析HTTP请求的一个头部信息
-http_conn::HTTP_CODE http_conn::parse_headers(char *text)
+// 子线程接收请求体：先消费读缓冲区，数据阶段缓冲区为空时直接splice（TLS连接的数据要解密，不能splice），否则读入缓冲区继续解析
+// socket暂时没有数据时返回NO_REQUEST交还连接，下次可读时从这里继续
+http_conn::HTTP_CODE http_conn::receive_body()
 {
-    // 遇到空行，表示头部字段解析完毕
-    if (text[0] == '\0')
+    while (true)
     {
-        // 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体，
-        // 状态机转移到CHECK_STATE_CONTENT状态
-        if (m_content_length != 0)
+        HTTP_CODE ret = consume_body();
+        if (ret != NO_REQUEST)
+        {
+            return finish_body(ret);
+        }
+        // 已经交给body_sink的数据不再需要，不完整的分块行移到缓冲区开头
+        m_read_idx -= m_check_idx;
+        memmove(m_read_buf, m_read_buf + m_check_idx, m_read_idx);
+        m_check_idx = 0;
+        m_start_line = 0;
+
+        if (m_read_idx == 0 && (m_body_state == BODY_DATA || m_body_state == BODY_CHUNK_DATA) && !m_tls.active())
+        {
+            ssize_t n = m_body_sink->splice_from(m_sockfd, m_body_remaining);
+            if (n > 0)
+            {
+                g_stats.upload_spliced += n;
+                m_body_received += n;
+                m_body_remaining -= n;
+                if (m_body_remaining == 0)
+                {
+                    m_body_state = (m_body_state == BODY_DATA) ? BODY_DONE : BODY_CHUNK_END;
+                }
+                continue;
+            }
+            if (n == 0)
+            {
+                return finish_body(CLOSED_CONNECTION);
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return NO_REQUEST;
+            }
+            if (errno != ENOSYS)
+            {
+                return finish_body(INTERNAL_ERROR);
+            }
+        }
+
+        if (m_read_idx >= READ_BUFFER_SIZE)
+        {
+            return finish_body(BAD_REQUEST); // 分块大小或者尾部字段的一行超过了缓冲区
+        }
+        int n = recv_some(m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx);
+        if (n > 0)
+        {
+            m_read_idx += n;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
         {
-            m_check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
         }
-        // 否则说明我们已经得到了一个完整的HTTP请求
-        return GET_REQUEST;
+        return finish_body(CLOSED_CONNECTION);
     }
-    else if (strncasecmp(text, "Connection:", 11) == 0)
+}
+
+// 解析读缓冲区[m_check_idx, m_read_idx)中的请求体，数据部分交给body_sink
+// 请求体完整时返回CREATED，需要更多数据时返回NO_REQUEST
+http_conn::HTTP_CODE http_conn::consume_body()
+{
+    while (m_body_state != BODY_DONE)
     {
-        // 处理Connection 头部字段  Connection: keep-alive
-        text += 11; // 到空格了
-        text += strspn(text, " \t"); // text 指针移动到\t后的第一个的字符处
-        if (strcasecmp(text, "keep-alive") == 0)
+        if (m_check_idx >= m_read_idx)
+        {
+            return NO_REQUEST;
+        }
+        if (m_body_state == BODY_DATA || m_body_state == BODY_CHUNK_DATA)
+        {
+            long long n = m_read_idx - m_check_idx;
+            if (n > m_body_remaining)
+            {
+                n = m_body_remaining; // 之后的数据属于下一个分块的头部
+            }
+            if (!m_body_sink->write(m_read_buf + m_check_idx, n))
+            {
+                return INTERNAL_ERROR;
+            }
+            m_check_idx += n;
+            m_body_received += n;
+            m_body_remaining -= n;
+            if (m_body_remaining == 0)
+            {
+                m_body_state = (m_body_state == BODY_DATA) ? BODY_DONE : BODY_CHUNK_END;
+            }
+            continue;
+        }
+        // 其余状态都以一行为单位
+        char *line = m_read_buf + m_check_idx;
+        char *end = (char *)memchr(line, '\n', m_read_idx - m_check_idx);
+        if (!end)
+        {
+            return NO_REQUEST;
+        }
+        m_check_idx += end - line + 1;
+        if (end > line && end[-1] == '\r')
+        {
+            end--;
+        }
+        *end = '\0';
+        switch (m_body_state)
         {
-            m_linger = true;
+        case BODY_CHUNK_END:
+            if (line[0] != '\0')
+            {
+                return BAD_REQUEST; // 分块数据比声明的长
+            }
+            m_body_state = BODY_CHUNK_SIZE;
+            break;
+        case BODY_CHUNK_SIZE:
+        {
+            // 1a3f;name=value  分块扩展忽略
+            char *next;
+            long long size = strtoll(line, &next, 16);
+            if (next == line || size < 0 || (*next != '\0' && *next != ';' && *next != ' ' && *next != '\t'))
+            {
+                return BAD_REQUEST;
+            }
+            if (size > g_config.max_body - m_body_received)
+            {
+                return PAYLOAD_TOO_LARGE;
+            }
+            m_body_remaining = size;
+            m_body_state = (size == 0) ? BODY_TRAILER : BODY_CHUNK_DATA;
+            break;
+        }
+        case BODY_TRAILER:
+            if (line[0] == '\0')
+            {
+                m_body_state = BODY_DONE; // 尾部字段不使用，空行结束
+            }
+            break;
+        default:
+            return INTERNAL_ERROR;
         }
     }
-    else if (strncasecmp(text, "Content-Length:", 15) == 0)
+    return CREATED;
+}
+
+// 请求体完整时保存文件，出错时丢弃临时文件，连接关闭
+http_conn::HTTP_CODE http_conn::finish_body(HTTP_CODE ret)
+{
+    g_stats.upload_bytes += m_body_received;
+    if (ret == CREATED)
     {
-        // 处理Content-Length头部字段
-        text += 15;
-        text += strspn(text, " \t");  // 返回text开头到包含\t的长度
-        m_content_length = atol(text);
+        if (m_body_sink->finish())
+        {
+            g_stats.uploads++;
+            m_linger = m_body_linger; // 请求体已经读完，连接可以继续使用
+        }
+        else
+        {
+            ret = INTERNAL_ERROR;
+        }
     }
-    else if (strncasecmp(text, "Host:", 5) == 0)
+    else
     {
-        // 处理Host头部字段 Host: 192.168.198.133:10000
-        text += 5;
-        text += strspn(text, " \t");
-        m_host = text;
+        m_body_sink->abort();
+    }
+    delete m_body_sink;
+    m_body_sink = NULL;
+    m_check_state = CHECK_STATE_REQUESTLINE;
+    return ret;
+}
+
+const router::route *http_conn::find_route(route_match &match)
+{
+    if (!m_router || m_router->size() == 0)
+    {
+        return NULL;
+    }
+    return m_router->lookup(m_url, strcspn(m_url, "?"), match);
+}
+
+// 处理函数把响应写进m_stream_buf，和流式响应一样在响应结束时释放
+http_conn::HTTP_CODE http_conn::run_route(const router::route *r, const route_match &match)
+{
+    if (!(r->methods & (1u << m_method)))
+    {
+        return METHOD_NOT_ALLOWED;
+    }
+    size_t path_len = strcspn(m_url, "?");
+    route_request req;
+    req.method = m_method;
+    req.path.data = m_url;
+    req.path.len = path_len;
+    req.query.data = m_url + path_len + (m_url[path_len] == '?' ? 1 : 0);
+    req.query.len = strlen(req.query.data);
+    req.headers = m_headers;
+    req.header_count = m_header_count;
+    req.match = &match;
+
+    m_stream_buf = new char[STREAM_BUFFER_SIZE];
+    route_response resp(m_stream_buf, STREAM_BUFFER_SIZE);
+    if (!r->handler(req, resp, r->arg) || resp.overflow())
+    {
+        return INTERNAL_ERROR;
+    }
+    m_route_status = resp.status;
+    m_route_type = resp.content_type;
+    m_route_len = resp.size();
+    return ROUTE_RESPONSE;
+}
+
+bool http_conn::proxied() const
+{
+    return m_upstreams && m_url && m_upstreams->match(m_url);
+}
+
+// 写好发给上游的请求报文：去掉逐跳头部，加上X-Forwarded-For，和上游之间总是保持连接
+// 请求体在读缓冲区中，请求报文在这里复制一份，之后读缓冲区可以被下一个请求覆盖
+http_conn::HTTP_CODE http_conn::start_proxy()
+{
+    if (m_chunked || (m_content_length > 0 && !m_body))
+    {
+        m_linger = false; // 请求体没有读完，连接不能继续使用
+        return m_chunked ? LENGTH_REQUIRED : PAYLOAD_TOO_LARGE;
+    }
+    static const char *method_names[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT"};
+    upstream_group *group = m_upstreams->match(m_url);
+    m_proxy = new proxy_session(m_upstreams, group, this, m_method == HEAD, m_http11, keep_alive(),
+                                m_method != POST);
+    bool ok = m_proxy->appendf("%s %s HTTP/1.1\r\n", method_names[m_method], m_url);
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &m_address.sin_addr, client_ip, sizeof(client_ip));
+    const header_view *forwarded = NULL;
+    bool has_host = false;
+    static const char *hop_by_hop[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+                                       "Upgrade", "Transfer-Encoding", "Expect"};
+    for (int i = 0; i < m_header_count; i++)
+    {
+        const header_view &h = m_headers[i];
+        bool skip = false;
+        for (size_t j = 0; j < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); j++)
+        {
+            if (h.name.len == strlen(hop_by_hop[j]) && strncasecmp(h.name.data, hop_by_hop[j], h.name.len) == 0)
+            {
+                skip = true;
+                break;
+            }
+        }
+        if (h.name.len == 15 && strncasecmp(h.name.data, "X-Forwarded-For", 15) == 0)
+        {
+            forwarded = &h; // 追加客户端地址
+            continue;
+        }
+        if (h.name.len == 4 && strncasecmp(h.name.data, "Host", 4) == 0)
+        {
+            has_host = true;
+        }
+        if (!skip)
+        {
+            ok = ok && m_proxy->appendf("%.*s: %.*s\r\n", (int)h.name.len, h.name.data, (int)h.value.len, h.value.data);
+        }
+    }
+    if (!has_host)
+    {
+        ok = ok && m_proxy->appendf("Host: %s\r\n", group->backends[0]->name.c_str());
+    }
+    if (forwarded)
+    {
+        ok = ok && m_proxy->appendf("X-Forwarded-For: %.*s, %s\r\n", (int)forwarded->value.len,
+                                    forwarded->value.data, client_ip);
     }
     else
     {
-        printf("oop! unknow header %s\n", text);
+        ok = ok && m_proxy->appendf("X-Forwarded-For: %s\r\n", client_ip);
     }
-    return NO_REQUEST;
+    ok = ok && m_proxy->append("Connection: keep-alive\r\n\r\n", strlen("Connection: keep-alive\r\n\r\n"));
+    if (m_content_length > 0)
+    {
+        ok = ok && m_proxy->append(m_body, m_content_length);
+    }
+    if (!ok)
+    {
+        delete m_proxy;
+        m_proxy = NULL;
+        return BAD_REQUEST; // 头部太多，超过了请求报文的缓冲区
+    }
+    return PROXY_REQUEST;
 }
-// 3.解析请求体 没有真正解析请求体，只是判断它是否被完整的读入了
-http_conn::HTTP_CODE http_conn::parse_content(char *text)
+
+void http_conn::end_proxy(bool ok)
+{
+    m_proxy->finish(ok);
+    delete m_proxy;
+    m_proxy = NULL;
+    if (m_proxying)
+    {
+        m_proxying = false;
+        m_timer_seq++; // 超时定时器作废（代理期间不会有限速的定时器）
+    }
+}
+
+// 主线程：代理的超时定时器到期。期间有进展时从最后一次进展重新计时，返回true表示上游超时
+bool http_conn::proxy_expired(unsigned seq)
+{
+    if (!m_proxying || seq != m_timer_seq)
+    {
+        return false;
+    }
+    uint64_t deadline = m_proxy_active_us + proxy_session::IDLE_TIMEOUT_US;
+    if (timer_queue::now_us() < deadline)
+    {
+        m_timers->add(deadline, m_sockfd, m_timer_seq);
+        return false;
+    }
+    return true;
+}
+
+// 主线程：上游超时，还没有发送响应时回复504，关闭上游连接（不放回连接池），之后关闭客户端连接
+void http_conn::proxy_timeout()
+{
+    g_stats.proxy_timeouts++;
+    if (!m_proxy->responded())
+    {
+        send_canned(gateway_timeout_504_response, sizeof(gateway_timeout_504_response) - 1);
+    }
+    end_proxy(false);
+}
+
+// 主线程推进代理会话，只在等待客户端可写时注册EPOLLOUT
+http_conn::WRITE_STATE http_conn::proxy()
+{
+    m_proxy_active_us = timer_queue::now_us();
+    if (!m_proxying)
+    {
+        // 主线程接手时添加超时定时器，会话结束时序号加一作废
+        m_timers->add(m_proxy_active_us + proxy_session::IDLE_TIMEOUT_US, m_sockfd, m_timer_seq);
+    }
+    m_proxying = true;
+    // kTLS的连接和明文连接一样splice，用户态加密的连接由代理会话调用SSL_write
+    switch (m_proxy->pump(m_sockfd, m_tls.userspace() ? &m_tls : NULL))
+    {
+    case proxy_session::PROXY_WAIT:
+        return WRITE_BLOCKED;
+    case proxy_session::PROXY_CLIENT_BLOCKED:
+        wait_out();
+        return WRITE_BLOCKED;
+    case proxy_session::PROXY_DONE:
+    {
+        bool keep = m_linger && m_proxy->keepalive();
+        end_proxy(true);
+        if (m_wait_out)
+        {
+            m_wait_out = false;
+            modfd(m_epollfd, m_sockfd, EPOLLIN);
+        }
+        if (keep)
+        {
+            next_request();
+            return WRITE_OK;
+        }
+        return WRITE_CLOSE;
+    }
+    default:
+        if (!m_proxy->responded())
+        {
+            send_canned(bad_gateway_502_response, sizeof(bad_gateway_502_response) - 1);
+        }
+        end_proxy(false);
+        return WRITE_CLOSE;
+    }
+}
+
+// 目录列表的长度事先不知道，边生成边用分块编码发送
+http_conn::HTTP_CODE http_conn::start_listing()
+{
+    if (m_method == HEAD)
+    {
+        return STREAM_REQUEST; // 只有头部，不需要读目录
+    }
+    try
+    {
+        m_producer = new dir_listing(m_real_file, m_url);
+    }
+    catch (...)
+    {
+        return FORBIDDEN_REQUEST;
+    }
+    return STREAM_REQUEST;
+}
+
+// 使用命中的内存缓存项
+http_conn::HTTP_CODE http_conn::use_cache_entry()
+{
+    m_file_stat = m_cache_entry->st;
+    if (not_modified())
+    {
+        m_cache_entry.reset();
+        return NOT_MODIFIED;
+    }
+    m_file_address = m_cache_entry->data;
+    return FILE_REQUEST;
+}
+
+bool http_conn::find_bundle_entry()
+{
+    if (!m_bundle)
+    {
+        return false;
+    }
+    m_bundle_entry = m_bundle->find(m_url, strcspn(m_url, "?"));
+    return m_bundle_entry != NULL;
+}
+
+// 打包时已经压缩好了gzip版本、拼好了校验头部，这里只填m_file_stat中响应会用到的字段（大小、修改时间、分隔符用的编号）
+http_conn::HTTP_CODE http_conn::use_bundle_entry()
+{
+    const bundle_entry &e = *m_bundle_entry;
+    g_stats.bundle_hits++;
+    m_mime = e.mime;
+    m_content_type = MIME_TYPES[m_mime].type;
+    m_gzip = m_accept_gzip && e.gz_size > 0;
+    memset(&m_file_stat, 0, sizeof(m_file_stat));
+    m_file_stat.st_size = m_gzip ? e.gz_size : e.size;
+    m_file_stat.st_mtime = e.mtime;
+    m_file_stat.st_ino = e.id;
+    if (not_modified())
+    {
+        return NOT_MODIFIED; // 304的校验头部也用打包好的，发送完后由unmap清除
+    }
+    m_file_address = (char *)m_bundle->data(e, m_gzip);
+    return FILE_REQUEST;
+}
+
+// 选择响应的编码：客户端接受gzip并且是可压缩的类型时，依次尝试
+// 1.后台压缩好的版本 2.内存缓存中的.gz文件 3.磁盘上的.gz文件（只在子线程）4.提交后台压缩，这次发送原始内容
+// 找到内存中的压缩版本时替换m_cache_entry；使用磁盘上的.gz文件时替换m_real_file和m_file_stat，m_cache_entry置空
+// 主线程不做系统调用，需要stat磁盘上的.gz文件时返回false
+bool http_conn::select_encoding(bool on_reactor)
+{
+    m_gzip = false;
+    const struct stat &st = m_cache_entry ? m_cache_entry->st : m_file_stat;
+    if (!m_accept_gzip || !MIME_TYPES[m_mime].compressible || st.st_size < MIN_GZIP_SIZE)
+    {
+        return true;
+    }
+    file_entry_ptr gz = m_gzip_cache->lookup(st);
+    if (gz)
+    {
+        if (gz->data)
+        {
+            m_cache_entry = gz;
+            m_gzip = true;
+        }
+        return true; // data为空表示压缩不划算，发送原始内容
+    }
+    char gz_path[FILENAME_LEN + 3];
+    snprintf(gz_path, sizeof(gz_path), "%s.gz", m_real_file);
+    file_entry_ptr sibling = m_file_cache->lookup(gz_path);
+    if (sibling)
+    {
+        m_cache_entry = sibling;
+        m_gzip = true;
+        return true;
+    }
+    if (on_reactor)
+    {
+        return false;
+    }
+    struct stat gz_stat;
+    if (stat(gz_path, &gz_stat) == 0 && S_ISREG(gz_stat.st_mode) && (gz_stat.st_mode & S_IROTH) &&
+        gz_stat.st_mtime >= st.st_mtime && strlen(gz_path) < FILENAME_LEN)
+    {
+        // 预压缩文件不比原文件旧，直接发送它
+        strcpy(m_real_file, gz_path);
+        m_file_stat = gz_stat;
+        m_cache_entry.reset();
+        m_gzip = true;
+        return true;
+    }
+    if (m_method != HEAD)
+    {
+        m_gzip_cache->submit(m_real_file, st); // HEAD不读文件内容，不触发压缩
+    }
+    return true;
+}
+
+// Accept-Encoding: gzip, deflate, br  或者 gzip;q=0 表示不接受
+bool http_conn::accepts_gzip(const char *value)
 {
-    if (m_read_idx >= (m_content_length + m_check_idx))
+    bool accept = false;
+    const char *p = value;
+    while ((p = strcasestr(p, "gzip")) != NULL)
     {
-        text[m_content_length] = '\0';
-        return GET_REQUEST;
+        p += 4;
+        const char *q = p + strspn(p, " \t");
+        if (*q == ';')
+        {
+            q += 1 + strspn(q + 1, " \t");
+            if (strncasecmp(q, "q=", 2) == 0 && atof(q + 2) <= 0)
+            {
+                return false;
+            }
+        }
+        accept = true;
     }
-    return NO_REQUEST;
+    return accept;
 }
 
-// 4.具体的处理
-// 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
-// 如果目标文件存在、对所有用户可读，且不是目录，则使用mmap将其
-// 映射到内存地址m_file_address处，并告诉调用者获取文件成功
-http_conn::HTTP_CODE http_conn::do_request()
+// 强实体标签 "inode-大小-修改时间"，文件内容变化时至少有一项会变
+// 压缩版本是不同的表示，实体标签必须不同
+void http_conn::format_etag(const struct stat &st, bool gzip, char *buf, size_t len)
 {
-    // /home/now/myweb/resources
-    strcpy(m_real_file, doc_root);
-    int len = strlen(doc_root);
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
-    // 获取m_real_file文件的相关的状态信息，-1失败，0成功
-    if (stat(m_real_file, &m_file_stat) < 0)
+    snprintf(buf, len, "\"%lx-%llx-%llx%s\"", (unsigned long)st.st_ino, (unsigned long long)st.st_size,
+             (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec, gzip ? "-gz" : "");
+}
+
+void http_conn::make_etag()
+{
+    if (m_bundle_entry)
     {
-        return NO_RESOURCE; // 服务器没有资源
+        size_t len;
+        const char *h = m_bundle->headers(*m_bundle_entry, m_gzip, len);
+        size_t etag_len = m_gzip ? m_bundle_entry->gz_etag_len : m_bundle_entry->etag_len;
+        memcpy(m_etag, h + strlen("ETag: "), etag_len);
+        m_etag[etag_len] = '\0';
+        return;
     }
-    // 判断访问权限
-    if (!(m_file_stat.st_mode & S_IROTH))
+    format_etag(m_file_stat, m_gzip, m_etag, sizeof(m_etag));
+}
+
+// 条件请求：If-None-Match优先，其中任意一个标签和当前文件一致（弱比较）即未修改；
+// 没有If-None-Match时，文件修改时间不晚于If-Modified-Since即未修改
+bool http_conn::not_modified()
+{
+    make_etag();
+    return still_valid(m_if_none_match, m_if_modified_since, m_etag, m_file_stat.st_mtime);
+}
+
+bool http_conn::still_valid(const char *if_none_match, const char *if_modified_since, const char *etag, time_t mtime)
+{
+    if (if_none_match)
     {
-        return FORBIDDEN_REQUEST; // 没有访问权限
+        const char *p = if_none_match;
+        if (strcmp(p, "*") == 0)
+        {
+            return true;
+        }
+        size_t etag_len = strlen(etag);
+        while (*p)
+        {
+            p += strspn(p, " \t,");
+            if (strncmp(p, "W/", 2) == 0)
+            {
+                p += 2;
+            }
+            if (strncmp(p, etag, etag_len) == 0)
+            {
+                return true;
+            }
+            p += strcspn(p, ","); // 下一个标签
+        }
+        return false;
     }
-    // 判断是否是目录
-    if (S_ISDIR(m_file_stat.st_mode))
+    if (if_modified_since)
     {
-        return BAD_REQUEST; // 请求语法错误
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+        {
+            return false;
+        }
+        return mtime <= timegm(&tm);
     }
-
-    // 以只读方式打开文件
-    int fd = open(m_real_file, O_RDONLY);
-    // 创建内存映射，资源映射到地址上,写的时候要把地址发送给客户端
-    m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
-    return FILE_REQUEST; // 文件请求,获取文件成功
+    return false;
 }
 
 // 对内存映射区执行munmap操作 取消映射一个HTTP连接中的文件
 void http_conn::unmap()
 {
-    if (m_file_address)
+    end_stream();
+    if (m_bundle_entry)
+    {
+        // 打包文件一直映射着
+        m_bundle_entry = NULL;
+        m_file_address = 0;
+    }
+    else if (m_cache_entry)
+    {
+        // 内容在内存缓存中，只释放引用
+        m_cache_entry.reset();
+        m_file_address = 0;
+    }
+    else if (m_file_address)
     {                                                // 如果文件地址有效
         munmap(m_file_address, m_file_stat.st_size); // 使用 munmap 取消映射
         m_file_address = 0;                          // 将文件地址置为 0，表示取消映射完成
@@ -499,7 +2366,11 @@ bool http_conn::add_response(const char *format, ...)
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
 bool http_conn::process_write(HTTP_CODE ret)
 {   
-    
+    if (ret != FILE_REQUEST && ret != NOT_MODIFIED)
+    {
+        m_mime = MIME_HTML; // 错误页面
+        m_content_type = MIME_TYPES[MIME_HTML].type;
+    }
     switch (ret)
     {
     case INTERNAL_ERROR:
@@ -534,15 +2405,158 @@ bool http_conn::process_write(HTTP_CODE ret)
             return false;
         }
         break;
-    case FILE_REQUEST:
+    case NOT_MODIFIED:
+        // 只有头部，没有内容，也不需要Content-Length
+        g_stats.file_responses++;
+        g_stats.not_modified++;
+        add_status_line(304, not_modified_304_title);
+        add_vary();
+        add_validators();
+        add_linger();
+        if (!add_blank_line())
+        {
+            return false;
+        }
+        break;
+    case CREATED:
+        add_status_line(201, created_201_title);
+        add_response("Location: %s\r\n", m_real_file);
+        add_headers(strlen(created_201_form));
+        if (!add_content(created_201_form))
+        {
+            return false;
+        }
+        break;
+    case METHOD_NOT_ALLOWED:
+        add_status_line(405, error_405_title);
+        add_response("Allow: %s\r\n", allowed_methods());
+        add_headers(strlen(error_405_form));
+        if (!add_content(error_405_form))
+        {
+            return false;
+        }
+        break;
+    case LENGTH_REQUIRED:
+        add_status_line(411, error_411_title);
+        add_headers(strlen(error_411_form));
+        if (!add_content(error_411_form))
+        {
+            return false;
+        }
+        break;
+    case PAYLOAD_TOO_LARGE:
+        add_status_line(413, error_413_title);
+        add_headers(strlen(error_413_form));
+        if (!add_content(error_413_form))
+        {
+            return false;
+        }
+        break;
+    case ROUTE_RESPONSE:
+        add_status_line(m_route_status, status_title(m_route_status));
+        add_response("Content-Type:%s\r\n", m_route_type);
+        add_response("Cache-Control: no-store\r\n"); // 动态内容
+        add_content_length(m_route_len);
+        add_linger();
+        if (!add_blank_line())
+        {
+            return false;
+        }
+        m_iv[0].iov_base = m_write_buf;
+        m_iv[0].iov_len = m_write_idx;
+        m_iv_count = 1;
+        m_bytes_to_send = m_write_idx;
+        if (m_method != HEAD && m_route_len > 0)
+        {
+            m_iv[1].iov_base = m_stream_buf;
+            m_iv[1].iov_len = m_route_len;
+            m_iv_count = 2;
+            m_bytes_to_send += m_route_len;
+        }
+        return true;
+    case STREAM_REQUEST:
+        // HTTP/1.0不支持分块编码，不发送长度，发送完后关闭连接
+        m_stream_chunked = m_http11;
+        if (!m_stream_chunked)
+        {
+            m_linger = false;
+        }
+        add_status_line(200, ok_200_title);
+        add_response("Content-Type:text/html; charset=utf-8\r\n");
+        if (m_stream_chunked)
+        {
+            add_response("Transfer-Encoding: chunked\r\n");
+        }
+        add_linger();
+        if (!add_blank_line())
+        {
+            return false;
+        }
+        if (!m_producer)
+        {
+            break; // HEAD
+        }
+        // 头部和第一批内容一起发送
+        m_stream_buf = new char[STREAM_BUFFER_SIZE];
+        m_stream_eof = false;
+        m_iv[0].iov_base = m_write_buf;
+        m_iv[0].iov_len = m_write_idx;
+        m_iv_count = 1;
+        m_bytes_to_send = m_write_idx;
+        return fill_stream();
+    case OPTIONS_REQUEST:
         add_status_line(200, ok_200_title);
-        add_headers(m_file_stat.st_size);
+        add_response("Allow: %s\r\n", allowed_methods());
+        add_content_length(0);
+        add_linger();
+        if (!add_blank_line())
+        {
+            return false;
+        }
+        break;
+    case FILE_REQUEST:
+    {
+        g_stats.file_responses++;
+        if (m_gzip)
+        {
+            g_stats.gzip_responses++;
+        }
+        int range = (m_method == HEAD) ? 0 : parse_range(); // HEAD忽略Range
+        if (range > 0)
+        {
+            return prepare_ranges(); // 206 部分内容
+        }
+        if (range < 0)
+        {
+            // 请求的区间都超出了文件大小
+            unmap();
+            m_mime = MIME_HTML;
+            m_content_type = MIME_TYPES[MIME_HTML].type;
+            add_status_line(416, error_416_title);
+            add_response("Content-Range: bytes */%lld\r\n", (long long)m_file_stat.st_size);
+            add_headers(strlen(error_416_form));
+            if (!add_content(error_416_form))
+            {
+                return false;
+            }
+            break;
+        }
+        if (!add_file_headers(RESP_200, m_file_stat.st_size))
+        {
+            return false;
+        }
+        if (m_method == HEAD)
+        {
+            break; // 只发送头部
+        }
         m_iv[0].iov_base = m_write_buf; // 起始位置是写缓冲区
         m_iv[0].iov_len = m_write_idx;
         m_iv[1].iov_base = m_file_address; // 目标文件映射到内存中的地址
         m_iv[1].iov_len = m_file_stat.st_size;
         m_iv_count = 2;
+        m_bytes_to_send = m_write_idx + m_file_stat.st_size;
         return true;
+    }
     default:
         return false;
     }
@@ -550,6 +2564,255 @@ bool http_conn::process_write(HTTP_CODE ret)
     m_iv[0].iov_base = m_write_buf;
     m_iv[0].iov_len = m_write_idx;
     m_iv_count = 1;
+    m_bytes_to_send = m_write_idx;
+    return true;
+}
+
+// 向生成者要下一批数据，多次生成的内容合并成一个分块，和分块的头尾一起由一次writev发送
+// 上一批全部发送完之后才会调用，发送不出去时不会继续生成
+bool http_conn::fill_stream()
+{
+    if (m_bytes_to_send == 0)
+    {
+        m_iv_count = 0;
+        m_iv_idx = 0;
+    }
+    size_t n = 0;
+    while (n < (size_t)STREAM_BUFFER_SIZE)
+    {
+        ssize_t ret = m_producer->produce(m_stream_buf + n, STREAM_BUFFER_SIZE - n);
+        if (ret < 0)
+        {
+            return false;
+        }
+        if (ret == 0)
+        {
+            m_stream_eof = true;
+            break;
+        }
+        n += ret;
+    }
+    if (m_stream_chunked && n > 0)
+    {
+        int len = snprintf(m_chunk_head, sizeof(m_chunk_head), "%zx\r\n", n);
+        m_iv[m_iv_count].iov_base = m_chunk_head;
+        m_iv[m_iv_count].iov_len = len;
+        m_iv_count++;
+    }
+    if (n > 0)
+    {
+        m_iv[m_iv_count].iov_base = m_stream_buf;
+        m_iv[m_iv_count].iov_len = n;
+        m_iv_count++;
+    }
+    if (m_stream_chunked)
+    {
+        // 分块数据之后的\r\n，最后一批再加上表示结束的0长度分块
+        static const char chunk_tail[] = "\r\n0\r\n\r\n";
+        const char *tail = chunk_tail;
+        size_t tail_len = 0;
+        if (n > 0)
+        {
+            tail_len = m_stream_eof ? 7 : 2;
+        }
+        else if (m_stream_eof)
+        {
+            tail += 2;
+            tail_len = 5;
+        }
+        if (tail_len > 0)
+        {
+            m_iv[m_iv_count].iov_base = (char *)tail;
+            m_iv[m_iv_count].iov_len = tail_len;
+            m_iv_count++;
+        }
+        n += (n > 0 ? strlen(m_chunk_head) : 0) + tail_len;
+    }
+    m_bytes_to_send += n;
+    return true;
+}
+
+void http_conn::end_stream()
+{
+    if (m_producer)
+    {
+        delete m_producer;
+        m_producer = NULL;
+    }
+    if (m_stream_buf)
+    {
+        delete[] m_stream_buf;
+        m_stream_buf = NULL;
+    }
+}
+
+// 解析Range头部 bytes=0-499,500-,-200
+// 语法错误或者区间太多时忽略Range返回完整文件，所有区间都无法满足时返回-1
+int http_conn::parse_range()
+{
+    m_range_count = 0;
+    if (!m_range || strncasecmp(m_range, "bytes=", 6) != 0)
+    {
+        return 0;
+    }
+    if (m_if_range && !if_range_matches())
+    {
+        return 0; // 文件已经变化，返回完整的新文件
+    }
+    off_t size = m_file_stat.st_size;
+    const char *p = m_range + 6;
+    while (*p)
+    {
+        p += strspn(p, " \t,");
+        if (*p == '\0')
+        {
+            break;
+        }
+        off_t start, end;
+        char *next;
+        if (*p == '-')
+        {
+            // 后缀区间：最后n个字节
+            long long n = strtoll(p + 1, &next, 10);
+            if (next == p + 1 || n <= 0)
+            {
+                return 0;
+            }
+            start = (n >= size) ? 0 : size - n;
+            end = size - 1;
+        }
+        else
+        {
+            start = strtoll(p, &next, 10);
+            if (next == p || *next != '-')
+            {
+                return 0;
+            }
+            p = next + 1;
+            if (*p >= '0' && *p <= '9')
+            {
+                end = strtoll(p, &next, 10);
+                if (end < start)
+                {
+                    return 0;
+                }
+            }
+            else
+            {
+                end = size - 1; // 0- 到文件结尾
+                next = (char *)p;
+            }
+        }
+        p = next;
+        p += strspn(p, " \t");
+        if (*p != '\0' && *p != ',')
+        {
+            return 0;
+        }
+        if (start >= size || size == 0)
+        {
+            continue; // 这个区间无法满足，跳过
+        }
+        if (end >= size)
+        {
+            end = size - 1;
+        }
+        if (m_range_count == MAX_RANGES)
+        {
+            m_range_count = 0;
+            return 0;
+        }
+        m_ranges[m_range_count][0] = start;
+        m_ranges[m_range_count][1] = end;
+        m_range_count++;
+    }
+    return m_range_count > 0 ? 1 : -1;
+}
+
+// If-Range 可以是实体标签或者HTTP日期，和当前文件一致时Range才生效
+bool http_conn::if_range_matches()
+{
+    if (strncmp(m_if_range, "W/", 2) == 0)
+    {
+        return false; // If-Range要求强比较
+    }
+    if (m_if_range[0] == '"')
+    {
+        make_etag();
+        return strcmp(m_etag, m_if_range) == 0;
+    }
+    char date[64];
+    http_date(m_file_stat.st_mtime, date, sizeof(date));
+    return strcmp(date, m_if_range) == 0;
+}
+
+// 填充206响应，文件区间直接指向mmap或者内存缓存，和完整文件一样由writev发送
+bool http_conn::prepare_ranges()
+{
+    long long size = m_file_stat.st_size;
+    m_iv[0].iov_base = m_write_buf;
+    if (m_range_count == 1)
+    {
+        long long start = m_ranges[0][0], end = m_ranges[0][1];
+        if (!add_file_headers(RESP_206, end - start + 1))
+        {
+            return false;
+        }
+        m_iv[0].iov_len = m_write_idx;
+        m_iv[1].iov_base = m_file_address + start;
+        m_iv[1].iov_len = end - start + 1;
+        m_iv_count = 2;
+        m_bytes_to_send = m_write_idx + (end - start + 1);
+        return true;
+    }
+
+    // 多个区间：multipart/byteranges，每个分段有自己的头部，Content-Type不是文件的类型，不使用预生成的前缀
+    add_status_line(206, partial_206_title);
+    add_response("Accept-Ranges: bytes\r\n");
+    add_vary();
+    add_validators();
+    char boundary[32];
+    snprintf(boundary, sizeof(boundary), "%016llx", (unsigned long long)m_file_stat.st_ino * 2654435761u ^ (unsigned long long)m_file_stat.st_mtime);
+    int part_idx = 0;
+    long long body_len = 0;
+    m_iv_count = 1;
+    for (int i = 0; i < m_range_count; i++)
+    {
+        long long start = m_ranges[i][0], end = m_ranges[i][1];
+        int len = snprintf(m_part_buf + part_idx, PART_BUFFER_SIZE - part_idx,
+                           "\r\n--%s\r\nContent-Type:%s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                           boundary, m_content_type, start, end, size);
+        if (len < 0 || len >= PART_BUFFER_SIZE - part_idx)
+        {
+            return false;
+        }
+        m_iv[m_iv_count].iov_base = m_part_buf + part_idx;
+        m_iv[m_iv_count].iov_len = len;
+        m_iv[m_iv_count + 1].iov_base = m_file_address + start;
+        m_iv[m_iv_count + 1].iov_len = end - start + 1;
+        m_iv_count += 2;
+        part_idx += len;
+        body_len += len + (end - start + 1);
+    }
+    int len = snprintf(m_part_buf + part_idx, PART_BUFFER_SIZE - part_idx, "\r\n--%s--\r\n", boundary);
+    if (len < 0 || len >= PART_BUFFER_SIZE - part_idx)
+    {
+        return false;
+    }
+    m_iv[m_iv_count].iov_base = m_part_buf + part_idx;
+    m_iv[m_iv_count].iov_len = len;
+    m_iv_count++;
+    body_len += len;
+
+    add_content_length(body_len);
+    add_response("Content-Type:multipart/byteranges; boundary=%s\r\n", boundary);
+    add_linger();
+    if (!add_blank_line())
+    {
+        return false;
+    }
+    m_iv[0].iov_len = m_write_idx;
+    m_bytes_to_send = m_write_idx + body_len;
     return true;
 }
 
@@ -558,22 +2821,122 @@ bool http_conn::add_status_line(int status, const char *title)
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
-bool http_conn::add_headers(int content_len)
+bool http_conn::add_headers(long long content_len)
 {
     add_content_length(content_len);
     add_content_type();
     add_linger();
-    add_blank_line();
+    return add_blank_line();
+}
+
+// 缓存校验相关的头部，客户端下次用If-None-Match/If-Modified-Since发起条件请求
+// 每个文件响应都会经过这里，不使用vsnprintf
+bool http_conn::add_validators()
+{
+    if (m_bundle_entry)
+    {
+        // 打包时拼好的ETag、Content-Encoding和Last-Modified
+        size_t len;
+        const char *h = m_bundle->headers(*m_bundle_entry, m_gzip, len);
+        add_bytes(h, len);
+        return add_cache_control();
+    }
+    char date[64];
+    http_date(m_file_stat.st_mtime, date, sizeof(date));
+    make_etag();
+    add_bytes("ETag: ", strlen("ETag: "));
+    add_bytes(m_etag, strlen(m_etag));
+    add_bytes("\r\n", strlen("\r\n"));
+    if (m_gzip)
+    {
+        add_bytes("Content-Encoding: gzip\r\n", strlen("Content-Encoding: gzip\r\n"));
+    }
+    add_cache_control();
+    add_bytes("Last-Modified: ", strlen("Last-Modified: "));
+    add_bytes(date, strlen(date));
+    return add_bytes("\r\n", strlen("\r\n"));
+}
+
+bool http_conn::add_cache_control()
+{
+    if (!g_config.cache_control || !g_config.cache_control[0])
+    {
+        return true;
+    }
+    add_bytes("Cache-Control: ", strlen("Cache-Control: "));
+    add_bytes(g_config.cache_control, strlen(g_config.cache_control));
+    return add_bytes("\r\n", strlen("\r\n"));
+}
+
+// 同一个url根据Accept-Encoding有不同的表示，共享缓存需要区分
+bool http_conn::add_vary()
+{
+    if (!MIME_TYPES[m_mime].compressible)
+    {
+        return true;
+    }
+    return add_bytes("Vary: Accept-Encoding\r\n", strlen("Vary: Accept-Encoding\r\n"));
+}
+
+bool http_conn::add_bytes(const char *data, size_t len)
+{
+    if (m_write_idx + len >= WRITE_BUFFER_SIZE)
+    {
+        return false;
+    }
+    memcpy(m_write_buf + m_write_idx, data, len);
+    m_write_idx += len;
+    return true;
+}
+
+// 文件响应的头部：状态行、Accept-Ranges、Content-Type、Vary、Connection在编译期拼好，
+// 一次memcpy写入，再追加校验头部和Content-Length的数字
+bool http_conn::add_file_headers(RESP_STATUS status, long long content_len)
+{
+    const header_prefix &prefix = response_prefix(status, m_mime, keep_alive());
+    if (!add_bytes(prefix.data, prefix.len) || !add_validators())
+    {
+        return false;
+    }
+    char digits[48];
+    int n;
+    if (status == RESP_206)
+    {
+        // 单个区间，m_ranges[0]由parse_range填好
+        add_bytes("Content-Range: bytes ", strlen("Content-Range: bytes "));
+        n = format_decimal(digits, (unsigned long long)m_ranges[0][0]);
+        digits[n++] = '-';
+        n += format_decimal(digits + n, (unsigned long long)m_ranges[0][1]);
+        digits[n++] = '/';
+        add_bytes(digits, n);
+        n = format_decimal(digits, (unsigned long long)m_file_stat.st_size);
+        add_bytes(digits, n);
+        add_bytes("\r\n", strlen("\r\n"));
+    }
+    n = format_decimal(digits, (unsigned long long)content_len);
+    add_bytes("Content-Length: ", strlen("Content-Length: "));
+    add_bytes(digits, n);
+    return add_bytes("\r\n\r\n", strlen("\r\n\r\n"));
+}
+
+bool http_conn::add_content_length(long long content_len)
+{
+    return add_response("Content-Length: %lld\r\n", content_len);
 }
 
-bool http_conn::add_content_length(int content_len)
+// 响应写Connection头部之前调用：排空时不再保持连接，返回这个响应之后是否保持连接
+bool http_conn::keep_alive()
 {
-    return add_response("Content-Length: %d\r\n", content_len);
+    if (m_draining.load(std::memory_order_relaxed))
+    {
+        m_linger = false; // 进程即将退出，告诉客户端这个连接不再复用
+    }
+    return m_linger;
 }
 
 bool http_conn::add_linger()
 {
-    return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
+    return add_response("Connection: %s\r\n", keep_alive() ? "keep-alive" : "close");
 }
 
 bool http_conn::add_blank_line()
@@ -583,10 +2946,14 @@ bool http_conn::add_blank_line()
 
 bool http_conn::add_content(const char *content)
 {
+    if (m_method == HEAD)
+    {
+        return true; // HEAD的错误响应也只有头部
+    }
     return add_response("%s", content);
 }
 
 bool http_conn::add_content_type()
 {
-    return add_response("Content-Type:%s\r\n", "text/html");
+    return add_response("Content-Type:%s\r\n", m_content_type);
 }
@@ -21,17 +21,50 @@
 #include <errno.h>
 #include "locker.h"
 #include <sys/uio.h>
+#include <atomic>
+#include "completion_queue.h"
+#include "file_cache.h"
+#include "gzip_cache.h"
+#include "config.h"
+#include "server_stats.h"
+#include "mime_table.h"
+#include "upload.h"
+#include "producer.h"
+#include "router.h"
+#include "upstream.h"
+#include "proxy.h"
+#include "rate_limiter.h"
+#include "timer_queue.h"
+#include "static_bundle.h"
+#include "zerocopy.h"
+#include "tls.h"
+#include "h2.h"
+#include "websocket.h"
 
 class http_conn{
 public:
     static int m_epollfd; //所有socket上的事件都被注册到同一个epoll上
-    static int m_user_count; //统计用户数量
+    static int m_user_count; //统计用户数量，只有主线程修改
+    static completion_queue * m_completions; // 子线程向主线程提交完成事件的队列
+    static file_cache * m_file_cache; // 小静态文件的内存缓存
+    static gzip_cache * m_gzip_cache; // 动态压缩版本的缓存
+    static router * m_router; // 动态接口的路由表，启动时注册，之后只读
+    static static_bundle * m_bundle; // 预先打包的静态文件，没有配置-b时为空
+    static upstream_pool * m_upstreams; // 反向代理的上游，没有配置时为空
+    static tls_context * m_tls_context; // HTTPS监听的证书和会话缓存，没有配置-H时为空
+    static timer_queue * m_timers; // 主线程的定时器（限速的连接等待令牌，代理的上游超时）
+    static ws_hub * m_hub; // WebSocket的频道和广播队列，没有配置-s时为空
+    static std::atomic<bool> m_draining; // 热升级后正在排空：响应以Connection: close结束，不再保持连接
     static const int FILENAME_LEN = 200;        // url文件名的最大长度
     static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区的大小
     static const int WRITE_BUFFER_SIZE = 1024;  // 写缓冲区的大小
+    static const int MAX_RANGES = 8;            // Range请求最多支持的区间数，超过时返回完整文件
+    static const int PART_BUFFER_SIZE = 2048;   // multipart/byteranges各分段头部的缓冲区大小
+    static const int STREAM_BUFFER_SIZE = 16384; // 流式响应每一批的最大数据量，开始流式响应时才分配
+    static const int MAX_HEADERS = 32;          // 交给路由处理函数的请求头部个数上限
 
     // 用于解析请求报文的 请求方法、主、从状态机、响应结果
-    // HTTP请求方法，这里只支持GET
+    // HTTP请求方法，支持GET、HEAD、OPTIONS，配置了上传目录时支持POST、PUT
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
     
     // 有限状态机，主从状态机
@@ -40,8 +73,20 @@ public:
         CHECK_STATE_REQUESTLINE : 当前正在分析请求行
         CHECK_STATE_HEADER : 当前正在分析头部字段
         CHECK_STATE_CONTENT : 当前正在解析请求体
+        CHECK_STATE_BODY : 正在把POST/PUT的请求体流式交给body_sink
     */
-    enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
+    enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT, CHECK_STATE_BODY };
+
+    /*
+        流式接收请求体时的状态
+        BODY_DATA       :   Content-Length的数据
+        BODY_CHUNK_SIZE :   等待分块大小的一行
+        BODY_CHUNK_DATA :   分块的数据
+        BODY_CHUNK_END  :   分块数据之后的\r\n
+        BODY_TRAILER    :   最后一个分块之后的尾部字段，遇到空行结束
+        BODY_DONE       :   请求体接收完毕
+    */
+    enum BODY_STATE { BODY_DATA = 0, BODY_CHUNK_SIZE, BODY_CHUNK_DATA, BODY_CHUNK_END, BODY_TRAILER, BODY_DONE };
         
     /*
         从状态机的三种可能状态，即行的读取状态，分别表示 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
@@ -59,24 +104,91 @@ public:
         FILE_REQUEST        :   文件请求,获取文件成功
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
+        NOT_MODIFIED        :   条件请求的校验值和文件一致，返回不带内容的304
+        OPTIONS_REQUEST     :   OPTIONS请求，只返回Allow头部
+        STREAM_REQUEST      :   响应内容由body_producer边生成边发送（目录列表）
+        ROUTE_RESPONSE      :   路由表中的处理函数已经生成了响应
+        PROXY_REQUEST       :   转发给上游的请求报文已经准备好，交给主线程发送和转发响应
+        CREATED             :   上传的文件已经保存
+        METHOD_NOT_ALLOWED  :   没有配置上传目录时的POST/PUT
+        LENGTH_REQUIRED     :   POST/PUT既没有Content-Length也不是分块传输
+        PAYLOAD_TOO_LARGE   :   请求体超过了最大大小
     */
     enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, 
-        FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+        FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, NOT_MODIFIED, OPTIONS_REQUEST,
+        CREATED, METHOD_NOT_ALLOWED, LENGTH_REQUIRED, PAYLOAD_TOO_LARGE, STREAM_REQUEST, ROUTE_RESPONSE,
+        PROXY_REQUEST };
+
+    /*
+        连接的所有权状态，同一时刻只有一个线程操作该连接的socket
+        CONN_IDLE           :   空闲，主线程可以读取数据并分发给子线程
+        CONN_BUSY           :   被子线程（或等待EPOLLOUT的主线程）持有
+        CONN_BUSY_PENDING   :   持有期间又有新的事件到达，持有者释放前需要再读一次
+    */
+    enum OWNER_STATE { CONN_IDLE = 0, CONN_BUSY, CONN_BUSY_PENDING };
+
+    /*
+        一次写操作的结果
+        WRITE_OK        :   响应发送完毕，保持连接
+        WRITE_BLOCKED   :   socket写缓冲满，已注册EPOLLOUT，由主线程继续发送
+        WRITE_CLOSE     :   出错或者不保持连接，需要关闭
+        WRITE_PRODUCE   :   流式响应的一批已经发送完，需要交给子线程生成下一批（只在主线程调用write(false)时返回）
+        WRITE_PACED     :   客户端的带宽令牌用完了，由主线程的定时器在令牌补足后继续发送
+    */
+    enum WRITE_STATE { WRITE_OK = 0, WRITE_BLOCKED, WRITE_CLOSE, WRITE_PRODUCE, WRITE_PACED };
 
 
 public:
-    http_conn(){}
+    http_conn():m_sockfd(-1), m_h2(NULL), m_ws(NULL), m_body_sink(NULL), m_producer(NULL), m_stream_buf(NULL), m_proxy(NULL), m_proxying(false),
+        m_owner(CONN_BUSY), m_wait_out(false), m_paced(false), m_timer_seq(0){} // 没有初始化的连接不会被acquire，上游连接残留的事件不会误关闭它
     ~http_conn(){}
 
 public:
-    void init(int sockfd, const sockaddr_in & addr); // 初始化新接受的连接
+    void init(int sockfd, const sockaddr_in & addr, bool tls = false); // 初始化新接受的连接，tls：从HTTPS端口接受的
     void close_conn(); // 关闭连接
-    bool read(); // 主线程非阻塞读客户端数据
-    bool write(); // 主线程将相应非阻塞写入socket
-    void process(); // 子线程处理客户端请求，http请求的入口函数。解析http请求报文，找到对应资源，等主线程可以写了之后把资源写回去
+    bool read(); // 非阻塞读客户端数据（由连接的持有者调用）
+    WRITE_STATE write(bool produce = true); // 将响应非阻塞写入socket，写不完时才注册EPOLLOUT。produce为false时不调用生成者
+    void process(); // 子线程处理客户端请求，http请求的入口函数。解析http请求报文，找到对应资源，并直接写回响应
+    bool process_inline(); // 主线程直接处理命中内存缓存的请求，返回false表示需要交给线程池
+    void shed(); // 子线程：请求排队太久被丢弃，返回503并关闭连接
+    void send_overload(); // 发送预先生成的503响应（尽力发送，不等待可写）
+    static void send_overload(int sockfd); // 还没有初始化成http_conn的连接（accept时超过最大连接数）
+    static void send_too_many(int sockfd); // 发送预先生成的429响应（请求速率超过限制）
+    void send_too_many(); // 已经初始化的连接（TLS连接上要加密发送）
+    bool rate_limited(); // 新请求到达时检查客户端的请求速率，超过时返回true
+
+    bool acquire(); // 主线程尝试获得连接的所有权，失败时记录有新事件待处理
+    bool release(); // 持有者交还所有权，返回false表示期间有新事件，所有权仍在调用者手中
+    bool waiting_out() const { return m_wait_out; } // 是否在等待EPOLLOUT继续发送
+    bool idle() const { return m_owner.load() == CONN_IDLE && !(m_h2 && m_h2->busy()); } // 打开着、没有被持有并且没有进行中的请求（保持连接等待下一个请求）
+    bool reap_zerocopy() { return m_sockfd != -1 && m_zc.reap(m_sockfd); } // 主线程：EPOLLERR是零拷贝的完成通知时返回true
+    bool handshaking() const { return m_tls.handshaking(); } // TLS握手还没有完成，可读时交给子线程继续
+    bool h2() const { return m_h2 != NULL; } // HTTP/2连接，可读时总是交给子线程
+    bool websocket() const { return m_ws != NULL; } // 升级后的WebSocket连接，只由主线程处理
+    bool ws_overflow() const { return m_ws && m_ws->m_overflow; } // 订阅者读得太慢，发送队列满了
+    void start_ws(); // 主线程：握手完成，订阅频道，发送101和之后的帧
+    void process_ws(); // 主线程：解析读到的帧并发送回复，之后交还所有权
+    void wait_out(); // 主线程注册EPOLLOUT，等待socket可写后继续发送
+    void stop_wait_out(); // 主线程注销EPOLLOUT
+    WRITE_STATE proxy(); // 主线程推进反向代理，上游或者客户端socket上有事件时调用
+    bool proxying() const { return m_proxying; } // 主线程正在为这个连接转发上游的响应
+    bool proxy_expired(unsigned seq); // 代理的超时定时器到期，返回true表示上游超时
+    void proxy_timeout(); // 上游超时：回复504（还没有发送响应时）并放弃上游连接，之后调用者关闭连接
+    void wait_pace(); // 主线程添加定时器，带宽令牌补足后继续发送
+    bool pacing() const { return m_paced; } // 是否在等待限速的定时器
+    bool pace_expired(unsigned seq); // 定时器到期，序号一致时结束等待，返回true表示需要继续发送
+
+    // HTTP/1.1和HTTP/2的响应共用的判断
+    static bool accepts_gzip(const char * value); // Accept-Encoding的值是否接受gzip
+    static const char * allowed_methods(); // Allow头部的值
+    static bool escapes_root(const char * path, size_t len); // 路径中有..段（包括%2e%2e）
+    static void format_etag(const struct stat & st, bool gzip, char * buf, size_t len); // inode、大小和修改时间的强实体标签
+    static bool still_valid(const char * if_none_match, const char * if_modified_since, const char * etag, time_t mtime); // 条件请求命中（返回304）
     
 private:    
     void init(); // 初始化其他信息
+    void next_request(); // 保持连接：保留读缓冲区中的下一个请求，其余重新初始化
+    void complete(int type); // 子线程提交完成事件，交给主线程处理
     HTTP_CODE process_read(); // 解析http请求， 请求行，请求头，请求体
     bool process_write(HTTP_CODE ret); // 填充http响应
 
@@ -85,20 +197,65 @@ private:
     HTTP_CODE parse_headers(char * text); // 解析请求头
     HTTP_CODE parse_content(char * text); // 解析请求体
     HTTP_CODE do_request(); // 具体的处理
+    HTTP_CODE start_upload(); // 检查POST/PUT请求，创建body_sink后开始接收请求体
+    HTTP_CODE receive_body(); // 接收请求体，socket暂时没有数据时返回NO_REQUEST
+    HTTP_CODE consume_body(); // 把读缓冲区中的请求体交给body_sink
+    HTTP_CODE finish_body(HTTP_CODE ret); // 请求体结束（完成或者出错），释放body_sink
+    HTTP_CODE start_listing(); // 目录请求：创建目录列表的生成者
+    const router::route * find_route(route_match & match); // 按url（不含查询字符串）查找路由
+    HTTP_CODE run_route(const router::route * r, const route_match & match); // 调用处理函数生成响应
+    bool proxied() const; // url匹配反向代理的前缀
+    HTTP_CODE start_proxy(); // 创建代理会话，写好发给上游的请求报文
+    void end_proxy(bool ok); // 结束代理会话，上游连接放回连接池或者关闭
+    bool fill_stream(); // 向生成者要下一批数据，按分块编码填充iovec
+    void end_stream(); // 释放生成者和发送窗口
+    bool resolve_file(); // 拼接doc_root和m_url得到m_real_file，url中有..段时返回false
+    HTTP_CODE use_cache_entry(); // 使用命中的内存缓存项，条件请求命中时返回NOT_MODIFIED
+    bool find_bundle_entry(); // 在打包文件中查找url，命中时设置m_bundle_entry
+    HTTP_CODE use_bundle_entry(); // 使用打包文件中的内容，不做系统调用
+    bool select_encoding(bool on_reactor); // 选择gzip或者原始内容，主线程无法确定时返回false
+    bool not_modified(); // 根据If-None-Match/If-Modified-Since判断客户端的缓存是否仍然有效
+    void make_etag(); // 用inode、大小和修改时间生成强实体标签
+    const char * find_header(const char * name) const; // 请求头部的值，没有时返回NULL
+    static bool has_token(const char * value, const char * token); // 逗号分隔的列表中有没有token
+    bool h2_preface() const; // 读缓冲区以HTTP/2的连接序言开始（先验知识）
+    bool wants_h2c() const; // 请求带Upgrade: h2c，可以升级
+    bool upgrade_h2(); // 回复101，这个请求作为流1
+    void process_h2(); // 子线程：读帧、处理流、发送
+    WRITE_STATE write_h2(); // 主线程：可写后继续发送HTTP/2的输出
+    bool wants_websocket() const; // 请求带Upgrade: websocket，路径在-s的前缀下
+    bool upgrade_ws(); // 检查握手的头部，创建会话并把101放进发送队列
+    WRITE_STATE write_ws(); // 发送WebSocket连接的发送队列
     LINE_STATUS parse_line(); // 解析某一行得到的读取状态， 从状态机 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
 
     char* get_line() {return m_read_buf + m_start_line;}
 
     // 这一组函数被process_write调用以填充HTTP应答。
     void unmap();
+    ssize_t recv_some(char * buf, size_t len); // recv，TLS连接经过SSL_read
+    void send_canned(const char * data, size_t len); // 尽力发送预先生成的响应（握手中的TLS连接上不发送）
+    void advance_iov(size_t n); // 发送了n字节后调整iovec
+    ssize_t send_iov(int count); // writev，需要时带上MSG_MORE
+    bool use_zerocopy() const; // 响应体足够大并且在不会被改写的内存中
+    ssize_t send_zerocopy(); // 头部普通发送，响应体用MSG_ZEROCOPY
+    ssize_t writev_quota(size_t quota); // 只发送iovec中的前quota字节（限速）
+    int parse_range(); // 解析Range头部，0：返回完整文件 1：返回部分内容 -1：区间无法满足
+    bool if_range_matches(); // If-Range中的校验值是否和当前文件一致
+    bool prepare_ranges(); // 填充206响应（单区间或者multipart/byteranges）
     bool add_response( const char* format, ... );
     bool add_content( const char* content );
     bool add_content_type();
     bool add_status_line( int status, const char* title );
-    bool add_headers( int content_length );
-    bool add_content_length( int content_length );
+    bool add_headers( long long content_length );
+    bool add_content_length( long long content_length );
+    bool keep_alive(); // 排空时清除m_linger，返回是否保持连接
     bool add_linger();
     bool add_blank_line();
+    bool add_validators(); // ETag、Content-Encoding、Cache-Control、Last-Modified
+    bool add_cache_control(); // 配置了-C时的Cache-Control头部
+    bool add_vary(); // 可压缩类型的Vary头部
+    bool add_bytes( const char* data, size_t len ); // 不经过格式化直接追加
+    bool add_file_headers( RESP_STATUS status, long long content_length ); // 编译期前缀 + 校验头部 + Content-Length
 
 private:
     
@@ -118,21 +275,84 @@ private:
 
     char m_real_file[ FILENAME_LEN ]; // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
     char* m_url; // 客户请求的目标文件的文件名
-    char* m_version; // HTTP协议版本号，我们仅支持HTTP1.1
+    char* m_version; // HTTP协议版本号，支持HTTP/1.0和HTTP/1.1
     char* m_host; // 主机名
-    int m_content_length; // HTTP请求的消息总长度
+    long long m_content_length; // HTTP请求的消息总长度，-1表示没有Content-Length
+    bool m_chunked; // Transfer-Encoding: chunked
+    bool m_expect_continue; // Expect: 100-continue，开始接收请求体前先回复100
+    char* m_range; // Range头部的值，没有时为0
+    char* m_if_range; // If-Range头部的值
+    char* m_if_none_match; // If-None-Match头部的值
+    char* m_if_modified_since; // If-Modified-Since头部的值
+    bool m_accept_gzip; // 客户端Accept-Encoding接受gzip
+    int m_mime; // 响应内容在MIME_TYPES中的下标
+    const char* m_content_type; // 响应内容的MIME类型
+    bool m_gzip; // 发送的是gzip压缩版本（预压缩的.gz文件或者动态压缩的结果）
     bool m_linger; // 判断HTTP请求是否要保持连接
 
     struct stat m_file_stat;  // 目标文件的状态。判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
-    char* m_file_address; // 请求的目标文件被mmap到内存中的起始位置（内存映射）
+    char m_etag[64]; // 目标文件的实体标签，make_etag生成
+    char* m_file_address; // 请求的目标文件被mmap到内存中的起始位置（内存映射），或者内存缓存中的内容
+    file_entry_ptr m_cache_entry; // 命中内存缓存时持有的缓存项，发送完之前不会被释放
+    const bundle_entry* m_bundle_entry; // 命中打包文件时的文件项，m_file_address指向映射的内容
+    zerocopy_tracker m_zc; // 零拷贝发送的完成通知和发送期间保留的缓存项
+    tls_session m_tls; // HTTPS连接的握手和加密，明文连接上不做任何事情
+    bool m_request_ready; // 请求已经在主线程解析完，子线程直接从do_request开始
+    int m_request_end; // 完整的请求（包括读缓冲区中的请求体）在读缓冲区中的结束位置，0表示没有
+    bool m_pipelined; // next_request保留了下一个请求，下一次release返回false
+    h2_session* m_h2; // 切换到HTTP/2之后的会话，之后读写都由它处理
+    ws_session* m_ws; // 升级成WebSocket之后的会话
+
+    // 流式接收请求体，读缓冲区作为窗口，已经交给body_sink的数据会被覆盖
+    body_sink* m_body_sink; // 请求体的接收者，请求结束或者连接关闭时释放
+    BODY_STATE m_body_state;
+    long long m_body_remaining; // Content-Length或者当前分块中还没有收到的字节数
+    long long m_body_received; // 已经收到的请求体字节数
+    bool m_body_linger; // 请求体接收完之后是否保持连接
+
+    // 流式响应，上一批完全发送之后才生成下一批
+    body_producer* m_producer; // 响应内容的生成者，响应结束或者连接关闭时释放
+    char* m_stream_buf; // 发送窗口，STREAM_BUFFER_SIZE字节
+    char m_chunk_head[16]; // 分块大小的一行
+    bool m_stream_chunked; // 使用分块编码（HTTP/1.1），否则以关闭连接表示结束
+    bool m_stream_eof; // 生成者已经结束，最后一批已经放进iovec
+    bool m_http11; // 请求是HTTP/1.1
+
+    // 交给路由处理函数的请求头部，指向读缓冲区
+    header_view m_headers[MAX_HEADERS];
+    int m_header_count;
+    int m_route_status; // 处理函数设置的状态码
+    const char* m_route_type; // 处理函数设置的Content-Type（必须是静态字符串）
+    size_t m_route_len; // 响应内容的长度，内容在m_stream_buf中
+
+    // 反向代理
+    char* m_body; // 转发给上游的请求体，完整地在读缓冲区中，长度是m_content_length（没有结束符）
+    proxy_session* m_proxy; // 代理会话，子线程创建，之后只在主线程访问
+    bool m_proxying; // 主线程已经接手代理会话，只有主线程读写
+    uint64_t m_proxy_active_us; // 代理最后一次有事件的时间
     
     char m_write_buf[WRITE_BUFFER_SIZE]; // 写缓冲区
     int m_write_idx; // 写缓冲区中待发送的字节数(已写入数据的最后一位的下一个位置)
 
     /*我们将采用writev来执行写操作，所以定义下面两个成员，
         iovec 结构体数组指定了要写入的缓冲区和每个缓冲区的长度，m_iv_count表示被写内存块的数量*/
-    struct iovec m_iv[2];                   
+    struct iovec m_iv[2 + 2 * MAX_RANGES + 1]; // 响应头、（分段头、文件区间）...、结尾分隔符
     int m_iv_count;
+    int m_iv_idx; // 第一个还没有发送完的iovec
+    size_t m_bytes_to_send; // 剩余待发送的字节数
+    size_t m_bytes_have_send; // 已发送的字节数
+
+    off_t m_ranges[MAX_RANGES][2]; // 请求的区间 [起始, 结束]（包含结束位置）
+    int m_range_count;
+    char m_part_buf[PART_BUFFER_SIZE]; // multipart/byteranges各分段的头部和结尾分隔符
+
+    std::atomic<int> m_owner; // 连接的所有权状态 OWNER_STATE
+    bool m_wait_out; // 是否注册了EPOLLOUT，只有主线程修改
+    bool m_paced; // 是否在等待限速的定时器，只有主线程修改
+    unsigned m_timer_seq; // 定时器的序号，连接关闭时加一，之前添加的定时器失效
+    uint64_t m_pace_us; // write返回WRITE_PACED时需要等待的时间
+    bool m_rate_checked; // 当前请求是否已经消耗过请求令牌（请求分多次到达时只检查一次）
+    completion m_completion; // 提交给主线程的完成事件
 
 };
 
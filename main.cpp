@@ -4,6 +4,7 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <error.h>
 #include <fcntl.h>
@@ -12,17 +13,248 @@
 #include "threadpool.h"
 #include <signal.h>
 #include "http_conn.h"
+#include "config.h"
+#include "server_stats.h"
+#include "handlers.h"
+#include "prefork.h"
+#include "upgrade.h"
+#include "tcp_profile.h"
+#include "tls.h"
 
 using namespace std;
 
 #define MAX_FD 65535 // 最大的文件描述符个数
 #define MAX_EVENT_NUMBER 12000  // 监听的最大的事件数量
+#define ACCEPT_BATCH 64 // 一次监听事件最多接受的连接数，剩下的由水平触发的下一轮处理
 
 // 添加文件描述符到epoll中、删除fd、修改epoll上的fd
 extern void addlfd(int epollfd, int fd, bool one_shot); // epoll one_shot事件
 extern void removefd(int epollfd, int fd);
 extern void modfd(int epollfd, int fd, int ev);
 
+// 收到SIGUSR1时在主循环中打印统计信息
+static volatile sig_atomic_t dump_stats = 0;
+void stats_handler(int /*sig*/){
+    dump_stats = 1;
+}
+
+// 主线程读完数据后分发请求：开启inline模式时先尝试在主线程直接处理，否则交给线程池
+void dispatch(http_conn * conn, threadpool<http_conn> * pool){
+    if(conn->websocket()){
+        // 升级后的WebSocket连接只在主线程处理：解析帧、发布消息、发送回复
+        conn->process_ws();
+        return;
+    }
+    if(conn->handshaking() || conn->h2()){
+        // TLS握手的签名和密钥交换比较慢，不在主线程做，交给子线程推进；HTTP/2连接的帧也由子线程处理
+        if(!pool->append(conn)){
+            conn->close_conn();
+        }
+        return;
+    }
+    if(conn->rate_limited()){
+        // 客户端请求太快，不解析直接回复429
+        conn->send_too_many();
+        conn->close_conn();
+        return;
+    }
+    if(g_config.inline_dispatch && conn->process_inline()){
+        return;
+    }
+    if(!pool->append(conn)){
+        // 请求队列满了，立即返回503并关闭，而不是让连接一直挂着
+        conn->send_overload();
+        conn->close_conn();
+        return;
+    }
+    g_stats.offloaded_requests++;
+}
+
+// 主线程推进反向代理（上游socket上有事件，客户端可写，或者子线程交来了新的代理请求）
+void proxy_response(http_conn * conn, threadpool<http_conn> * pool){
+    http_conn::WRITE_STATE ret = conn->proxy();
+    if(ret == http_conn::WRITE_CLOSE){
+        conn->close_conn();
+    }else if(ret == http_conn::WRITE_OK && !conn->release()){
+        // 转发期间客户端发来了下一个请求
+        if(conn->read()){
+            dispatch(conn, pool);
+        }else{
+            conn->close_conn();
+        }
+    }
+}
+
+// 主线程继续发送连接上的响应（子线程发送时写缓冲满，或者EPOLLOUT到达）
+void send_response(http_conn * conn, threadpool<http_conn> * pool){
+    if(conn->proxying()){
+        proxy_response(conn, pool);
+        return;
+    }
+    if(conn->handshaking()){
+        // TLS握手的写缓冲满（子线程不等待）：先注册EPOLLOUT，可写后交回线程池继续握手
+        if(!conn->waiting_out()){
+            conn->wait_out();
+        }else{
+            conn->stop_wait_out();
+            if(!pool->append(conn)){
+                conn->close_conn();
+            }
+        }
+        return;
+    }
+    http_conn::WRITE_STATE ret = conn->write(false);
+    if(ret == http_conn::WRITE_CLOSE){
+        conn->close_conn();
+    }else if(ret == http_conn::WRITE_BLOCKED){
+        conn->wait_out(); // 写缓冲满，注册EPOLLOUT
+    }else if(ret == http_conn::WRITE_PACED){
+        conn->wait_pace(); // 带宽令牌用完，定时器到期后继续发送
+    }else if(ret == http_conn::WRITE_PRODUCE){
+        // 流式响应的这一批发送完了，下一批交给子线程生成，主线程不执行生成者
+        if(!pool->append(conn)){
+            conn->close_conn();
+        }
+    }else if(!conn->release()){
+        // 发送期间有新数据到达
+        if(conn->read()){
+            dispatch(conn, pool);
+        }else{
+            conn->close_conn();
+        }
+    }
+}
+
+// 主线程投递广播：消息已经追加到订阅者的发送队列，空闲的连接直接发送，
+// 等待EPOLLOUT的连接可写后一起发送，发送队列溢出的连接关闭
+void deliver_broadcast(http_conn * conn, threadpool<http_conn> * pool){
+    if(conn->ws_overflow()){
+        g_stats.ws_dropped++;
+        conn->close_conn();
+    }else if(conn->idle() && conn->acquire()){
+        send_response(conn, pool);
+    }
+}
+
+// 收到SIGQUIT或者热升级完成后排空
+static volatile sig_atomic_t drain_requested = 0;
+void drain_handler(int /*sig*/){
+    drain_requested = 1;
+}
+
+// 排空时关闭所有空闲的保持连接（没有被持有、等待下一个请求）
+void close_idle(http_conn * users){
+    for(int fd = 0; fd < MAX_FD; fd++){
+        if(users[fd].idle() && users[fd].acquire()){
+            users[fd].close_conn();
+        }
+    }
+}
+
+// 按旧进程交来的列表预先读入缓存，新进程开始接受连接时热点文件已经在内存中
+// 只读网站目录中的普通文件；多进程模式下第一个worker读入共享内容缓存，其他worker直接命中
+void prewarm(const std::vector<std::string> & hot){
+    size_t root_len = strlen(g_config.doc_root);
+    int loaded = 0;
+    for(size_t i = 0; i < hot.size(); i++){
+        const char * path = hot[i].c_str();
+        struct stat st;
+        if(strncmp(path, g_config.doc_root, root_len) != 0 || stat(path, &st) < 0 || !S_ISREG(st.st_mode)){
+            continue;
+        }
+        if(http_conn::m_file_cache->load(path, st)){
+            loaded++;
+        }
+    }
+    if(!hot.empty()){
+        cout << "prewarmed " << loaded << " of " << hot.size() << " hot files" << endl;
+    }
+}
+
+// 预留的空闲文件描述符，fd用尽（EMFILE）时关闭它腾出一个fd，接受连接后回复503再关闭，
+// 否则连接一直留在全连接队列中，水平触发的lfd会让主线程空转
+static int spare_fd = -1;
+
+// 拒绝一个连接：发送预先生成的503响应后关闭（HTTPS连接还没有握手，不能发送明文，直接关闭）
+void reject_conn(int cfd, bool tls){
+    if(!tls){
+        http_conn::send_overload(cfd);
+    }
+    close(cfd);
+    g_stats.rejected_conns++;
+}
+
+// 监听socket可读，循环接受新连接直到全连接队列为空或者达到批量上限，tls：HTTPS的监听socket
+void accept_conns(int lfd, http_conn * users, bool tls){
+    for(int i = 0; i < ACCEPT_BATCH; i++){
+        struct sockaddr_in client_addr;
+        socklen_t client_addrlen = sizeof(client_addr);
+        // accept4直接设置非阻塞和close-on-exec，不需要再调用fcntl
+        int cfd = accept4(lfd, (struct sockaddr*)&client_addr, &client_addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(cfd < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                break; // 全连接队列空了
+            }
+            if(errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            if((errno == EMFILE || errno == ENFILE) && spare_fd >= 0){
+                // fd用尽，用预留的fd接受这个连接并拒绝
+                close(spare_fd);
+                cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if(cfd >= 0){
+                    reject_conn(cfd, tls);
+                }
+                spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                continue;
+            }
+            cout <<"accept error is " << errno << endl;
+            break;
+        }
+
+        if(cfd >= MAX_FD || http_conn::m_user_count >= g_config.max_conns){
+            // 最大连接数满了
+            // 给客户端响应报文：服务器正忙，关闭连接
+            reject_conn(cfd, tls);
+            continue;
+        }
+        if(g_limiter && !g_limiter->admit(client_addr.sin_addr.s_addr, timer_queue::now_us())){
+            // 这个IP的请求令牌已经用完，不初始化连接，直接回复429
+            if(!tls){
+                http_conn::send_too_many(cfd);
+            }
+            close(cfd);
+            g_stats.rate_limited++;
+            continue;
+        }
+
+        // init将新连接users[cfd]初始化(cfd上epoll树) users 数组中cfd作为user索引
+        // http_conn * users = new http_conn[MAX_FD];
+        users[cfd].init(cfd, client_addr, tls);
+        g_stats.accepted_conns++;
+    }
+}
+
+// 创建监听socket并bind到port，失败时退出
+int bind_port(int port){
+    int fd = socket(PF_INET, SOCK_STREAM, 0); //协议族PF_INET
+
+    //端口复用 （bind之前）
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    //绑定
+    struct sockaddr_in addr; 
+    addr.sin_addr.s_addr = INADDR_ANY; //可以访问任意ip地址
+    addr.sin_family = AF_INET; // 设置地址族为 IPv4
+    addr.sin_port = htons(port);
+
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        perror("bind");
+        exit(-1);
+    }
+    return fd;
+}
+
 // 注册一个信号处理函数，sig 表示要注册的信号，handler 表示处理该信号的处理函数
 // 声明了一个函数指针 handler，该指针指向一个函数，该函数的返回类型为 void，接受一个 int 类型的参数
 void addsig(int sig, void(handler)(int)){
@@ -38,15 +270,206 @@ void addsig(int sig, void(handler)(int)){
 // 在命令行参数中，argv[0] 通常是可执行文件名，所以端口号在argv[1] ./my_program 8080
 int main(int argc, char* argv[]){
     if(argc <= 1){
-        cout <<"按照如下格式运行：" << basename(argv[0]) << " port number" << endl;
+        cout <<"按照如下格式运行：" << basename(argv[0]) << " port number [-r doc_root] [-m pool|inline] [-c cache_mb] [-n max_conns] [-C cache_control] [-P prefix=host:port,...] [-R rate[:burst]] [-W kb_per_sec] [-w workers] [-S shm_cache_mb] [-U upgrade_socket] [-b bundle] [-T backlog=N,defer=sec,fastopen=N,nodelay,cork] [-Z zerocopy_kb] [-H tls_port:cert.pem:key.pem[:noktls]] [-2 h2_streams] [-s ws_prefix]" << endl;
         return 1;
     }
     //获取端口号 ./my_program 8080
     int port = atoi(argv[1]); // 将字符串转换为整数
 
+    // 端口号之后的可选参数
+    // -r 网站根目录  -m 请求分发模式 pool：全部交给线程池 inline：命中缓存的请求在主线程处理  -c 内存缓存大小(MB)
+    // -n 最大连接数，超过后新连接直接回复503  -C 文件响应的Cache-Control头部（空字符串表示不发送）
+    // -u 上传目录，POST/PUT /upload/文件名 保存到这里  -B 请求体的最大大小(MB)  -l 请求目录时生成目录列表
+    // -P 反向代理 前缀=host:port[,host:port...]，可以指定多次
+    // -R 每个IP每秒的请求数[:突发请求数]，超过时回复429  -W 每个IP的发送带宽(KB/s)
+    // -w 多进程模式的worker进程数，主进程监视并重启退出的worker  -S 跨进程共享的文件内容缓存大小(MB)
+    // -U 热升级的控制socket路径，路径上有旧进程时接管它的监听socket
+    // -b packer/bundle_pack生成的打包文件，其中的路径直接从映射的内容响应
+    // -T 监听socket的TCP参数（见tcp_profile.h）  -Z 不小于这个大小(KB)的内存中响应体用MSG_ZEROCOPY发送
+    // -H 在另一个端口上监听HTTPS，noktls表示不把记录层交给内核（见tls.h）
+    // -2 每个HTTP/2连接同时处理的流数，0表示不支持HTTP/2（见h2.h）
+    // -s 以这个前缀开始的路径可以升级为WebSocket，前缀之后是频道名（见websocket.h）
+    int opt;
+    optind = 2;
+    std::vector<const char *> proxy_specs;
+    while((opt = getopt(argc, argv, "r:m:c:n:C:u:B:lP:R:W:w:S:U:b:T:Z:H:2:s:")) != -1){
+        switch(opt){
+        case 'r':
+            g_config.doc_root = optarg;
+            break;
+        case 'm':
+            g_config.inline_dispatch = (strcmp(optarg, "inline") == 0);
+            break;
+        case 'c':
+            g_config.cache_capacity = (size_t)atoi(optarg) * 1024 * 1024;
+            break;
+        case 'n':
+            g_config.max_conns = atoi(optarg);
+            break;
+        case 'C':
+            g_config.cache_control = optarg;
+            break;
+        case 'u':
+            g_config.upload_dir = optarg;
+            break;
+        case 'B':
+            g_config.max_body = atoll(optarg) * 1024 * 1024;
+            break;
+        case 'l':
+            g_config.autoindex = true;
+            break;
+        case 'P':
+            proxy_specs.push_back(optarg);
+            break;
+        case 'R':
+            g_config.rate_limit = atof(optarg);
+            if(strchr(optarg, ':')){
+                g_config.rate_burst = atof(strchr(optarg, ':') + 1);
+            }
+            break;
+        case 'W':
+            g_config.bandwidth = atof(optarg) * 1024;
+            break;
+        case 'w':
+            g_config.workers = atoi(optarg);
+            break;
+        case 'S':
+            g_config.shm_cache_size = (size_t)atoi(optarg) * 1024 * 1024;
+            break;
+        case 'U':
+            g_config.upgrade_path = optarg;
+            break;
+        case 'b':
+            g_config.bundle_path = optarg;
+            break;
+        case 'Z':
+            g_config.zerocopy_min = (size_t)atoi(optarg) * 1024;
+            break;
+        case 'H':
+            if(!parse_tls_spec(optarg)){
+                cout << "bad tls spec " << optarg << endl;
+                return 1;
+            }
+            break;
+        case '2':
+            g_config.h2_streams = atoi(optarg);
+            break;
+        case 's':
+            g_config.ws_prefix = optarg;
+            break;
+        case 'T':
+            if(!parse_tcp_profile(optarg)){
+                cout << "bad tcp profile " << optarg << endl;
+                return 1;
+            }
+            break;
+        default:
+            return 1;
+        }
+    }
+
     // 对SIGPIPE管道破裂信号（进程尝试给一个已关闭写端的管道写数据）进行处理
     addsig(SIGPIPE, SIG_IGN); // 处理方式设置为了忽略，系统不会发送 SIGPIPE 信号给程序，程序将继续执行
 
+    // 热升级：-U的路径上有旧进程时直接接管它的监听socket，否则自己创建
+    int lfd = -1;
+    int tls_lfd = -1;               // HTTPS的监听socket
+    int ready_conn = -1;            // 准备好之后通知旧进程停止接受
+    std::vector<std::string> hot;   // 旧进程交来的热点文件，启动时预先读入缓存
+    if(g_config.upgrade_path && upgrade_inherit(g_config.upgrade_path, lfd, tls_lfd, hot, ready_conn)){
+        cout << "inherited listen socket from old process, " << hot.size() << " hot files" << endl;
+        if(tls_lfd >= 0 && g_config.tls_port <= 0){
+            close(tls_lfd); // 新版本不再监听HTTPS
+            tls_lfd = -1;
+        }
+    }else{
+        // 创建监听套接字
+        lfd = bind_port(port);
+    }
+    if(g_config.tls_port > 0 && tls_lfd < 0){
+        tls_lfd = bind_port(g_config.tls_port);
+    }
+    // listen，接管的socket也重新应用-T的参数
+    if(!apply_listen_profile(lfd) || (tls_lfd >= 0 && !apply_listen_profile(tls_lfd))){
+        exit(-1);
+    }
+    if(tls_lfd >= 0){
+        // 用户态加密时一个响应分成多次SSL_write，最后一个不满的记录会被Nagle扣住等前面的ACK（客户端延迟确认40ms），
+        // HTTPS连接总是关闭Nagle（accept得到的连接继承）
+        int one = 1;
+        setsockopt(tls_lfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    int ctrl_fd = -1;
+    if(g_config.upgrade_path){
+        ctrl_fd = upgrade_listen(g_config.upgrade_path);
+        if(ctrl_fd < 0){
+            cout << "cannot listen on upgrade socket " << g_config.upgrade_path << endl;
+            exit(-1);
+        }
+    }
+
+    // 跨进程共享的文件内容缓存，在fork之前映射，所有worker和重启的worker共用
+    if(g_config.shm_cache_size > 0){
+        try{
+            g_shm_cache = new shm_cache(g_config.shm_cache_size, g_config.cache_max_file);
+        } catch(...){
+            exit(-1);
+        }
+    }
+    // 打包文件在fork之前映射，所有worker共用同一份page cache
+    if(g_config.bundle_path){
+        try{
+            http_conn::m_bundle = new static_bundle(g_config.bundle_path);
+        } catch(...){
+            cout << "cannot load bundle " << g_config.bundle_path << endl;
+            exit(-1);
+        }
+        cout << "bundle " << g_config.bundle_path << ": " << http_conn::m_bundle->count() << " files" << endl;
+    }
+    // TLS上下文在fork之前创建，所有worker的会话票据密钥相同，客户端连到哪个worker都能恢复会话
+    if(g_config.tls_port > 0){
+        try{
+            http_conn::m_tls_context = new tls_context(g_config.tls_cert, g_config.tls_key, g_config.ktls);
+        } catch(...){
+            cout << "cannot load certificate " << g_config.tls_cert << " or key " << g_config.tls_key << endl;
+            exit(-1);
+        }
+    }
+    // 多进程模式：主进程在这里fork出worker后只负责监视，worker继续执行下面的初始化
+    // 线程、缓存和epoll都在fork之后由每个worker自己创建
+    if(g_config.workers > 0){
+        fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK); // 所有worker共享这个打开的文件
+        if(tls_lfd >= 0){
+            fcntl(tls_lfd, F_SETFL, fcntl(tls_lfd, F_GETFL) | O_NONBLOCK);
+        }
+        stats_segment * segment = NULL;
+        try{
+            segment = new stats_segment(g_config.workers);
+        } catch(...){
+            exit(-1);
+        }
+        run_master(segment, lfd, tls_lfd, ctrl_fd, ready_conn);
+        ctrl_fd = -1; // worker中已经关闭，由主进程处理升级
+        ready_conn = -1;
+    }
+    // kill -USR1 打印运行统计（多进程模式下发给主进程打印所有worker的总数，发给worker打印它自己的）
+    addsig(SIGUSR1, stats_handler);
+    // kill -QUIT 停止接受新连接，处理完现有连接后退出
+    addsig(SIGQUIT, drain_handler);
+
+    // 小静态文件的内存缓存
+    http_conn::m_file_cache = new file_cache(g_config.cache_capacity, g_config.cache_max_file, g_config.cache_revalidate);
+    // 动态压缩版本的缓存，带一个后台压缩线程
+    try{
+        http_conn::m_gzip_cache = new gzip_cache(g_config.gzip_capacity, g_config.gzip_max_file);
+    } catch(...){
+        exit(-1);
+    }
+    // 动态接口的路由表，启动时注册完，之后只读
+    http_conn::m_router = new router;
+    register_builtin_routes(*http_conn::m_router);
+    prewarm(hot);
+
     //创建和初始化线程池 http连接的类
     threadpool<http_conn> * pool = NULL;
     try{
@@ -57,88 +480,301 @@ int main(int argc, char* argv[]){
 
     // 创建一个数组保存所有客户端信息, users指向首地址
     http_conn * users = new http_conn[MAX_FD];
-
-    // 创建监听套接字
-    int lfd = socket(PF_INET, SOCK_STREAM, 0); //协议族PF_INET
-
-    //端口复用 （bind之前）
-    int reuse = 1;
-    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    //绑定
-    int ret = 0;
-    struct sockaddr_in addr; 
-    addr.sin_addr.s_addr = INADDR_ANY; //可以访问任意ip地址
-    addr.sin_family = AF_INET; // 设置地址族为 IPv4
-    addr.sin_port = htons(port);
-
-    ret = bind(lfd, (struct sockaddr *)&addr, sizeof(addr));
-    // listen
-    ret = listen(lfd, 128);
+    if(g_config.max_conns <= 0 || g_config.max_conns > MAX_FD){
+        g_config.max_conns = MAX_FD;
+    }
+    // 预留一个fd，用于fd用尽时拒绝连接
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
     // 创建epoll对象(建议值)
     //events传出参数，内核告诉y
     epoll_event events[MAX_EVENT_NUMBER];
     int epollfd = epoll_create(10);
     // 需要监听的fd上epoll树 http_conn
-    addlfd(epollfd, lfd, false); // lfd不需要设置ontshot
+    if(g_segment){
+        // 所有worker的epoll都监听同一个lfd，EPOLLEXCLUSIVE让一个新连接只唤醒其中一个
+        epoll_event lev;
+        lev.data.fd = lfd;
+        lev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, lfd, &lev);
+        if(tls_lfd >= 0){
+            lev.data.fd = tls_lfd;
+            epoll_ctl(epollfd, EPOLL_CTL_ADD, tls_lfd, &lev);
+        }
+    }else{
+        addlfd(epollfd, lfd, false); // lfd不需要设置ontshot
+        if(tls_lfd >= 0){
+            addlfd(epollfd, tls_lfd, false);
+        }
+    }
     http_conn::m_epollfd = epollfd;
 
+    // 子线程到主线程的完成队列，eventfd上epoll树（水平触发）
+    completion_queue * completions = NULL;
+    try{
+        completions = new completion_queue;
+    } catch(...){
+        exit(-1);
+    }
+    epoll_event comp_ev;
+    comp_ev.data.fd = completions->fd();
+    comp_ev.events = EPOLLIN;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, completions->fd(), &comp_ev);
+    http_conn::m_completions = completions;
+
+    // 反向代理的上游，连接注册在同一个epoll上
+    upstream_pool * upstreams = NULL;
+    if(!proxy_specs.empty()){
+        upstreams = new upstream_pool(epollfd, MAX_FD);
+        for(size_t i = 0; i < proxy_specs.size(); i++){
+            if(!upstreams->add_group(proxy_specs[i])){
+                cout << "bad proxy spec " << proxy_specs[i] << endl;
+                exit(-1);
+            }
+        }
+        http_conn::m_upstreams = upstreams;
+        register_upstream_routes(*http_conn::m_router, upstreams);
+    }
+
+    // 按IP限流和限速，限速的连接由主线程的定时器恢复发送
+    timer_queue * timers = NULL;
+    try{
+        timers = new timer_queue;
+    } catch(...){
+        exit(-1);
+    }
+    epoll_event timer_ev;
+    timer_ev.data.fd = timers->fd();
+    timer_ev.events = EPOLLIN;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, timers->fd(), &timer_ev);
+    http_conn::m_timers = timers;
+    if(g_config.rate_limit > 0 || g_config.bandwidth > 0){
+        g_limiter = new rate_limiter(g_config.rate_limit, g_config.rate_burst, g_config.bandwidth);
+        register_limit_routes(*http_conn::m_router, g_limiter);
+    }
+    if(g_segment){
+        register_worker_routes(*http_conn::m_router, g_segment);
+    }
+    if(g_shm_cache){
+        register_shm_cache_routes(*http_conn::m_router, g_shm_cache);
+    }
+    // WebSocket的频道和广播队列，publish用eventfd唤醒主线程
+    ws_hub * hub = NULL;
+    if(g_config.ws_prefix){
+        try{
+            hub = new ws_hub;
+        } catch(...){
+            exit(-1);
+        }
+        epoll_event hub_ev;
+        hub_ev.data.fd = hub->fd();
+        hub_ev.events = EPOLLIN;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, hub->fd(), &hub_ev);
+        http_conn::m_hub = hub;
+    }
+    uint64_t last_publish = 0;
+
+    // 热升级的控制socket和等待新进程就绪的连接（多进程模式下由主进程处理）
+    int handoff_conn = -1;
+    if(ctrl_fd >= 0){
+        epoll_event ctrl_ev;
+        ctrl_ev.data.fd = ctrl_fd;
+        ctrl_ev.events = EPOLLIN;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, ctrl_fd, &ctrl_ev);
+    }
+    if(ready_conn >= 0){
+        upgrade_ready(ready_conn); // 开始接受连接，旧进程可以排空了
+    }
+    bool draining = false;
+    uint64_t drain_deadline = 0;
+    uint64_t last_sweep = 0;
+
     while(true){
         // 循环监听等待事件发生 >0 等待事件的超时时间(ms)。 0：不阻塞， -1：阻塞直到检测到fd变化
-        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        // 多进程模式下至少每秒醒来一次，把统计复制到共享内存；排空时检查连接是否都关闭了
+        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, (g_segment || draining) ? 1000 : -1);
         if (num < 0 && errno != EINTR){
             cout << "epoll failure" << endl;
             break;
         }
+        if(dump_stats){
+            dump_stats = 0;
+            g_stats.dump(stdout);
+            if(upstreams){
+                upstreams->dump(stdout);
+            }
+            if(g_limiter){
+                g_limiter->dump(stdout);
+            }
+            if(g_shm_cache){
+                g_shm_cache->dump(stdout);
+            }
+        }
         // 循环遍历事件数组
         for(int i = 0; i < num; i++){
             int sockfd = events[i].data.fd;
+            // 零拷贝发送的完成通知在socket的错误队列中，也以EPOLLERR报告，读完后不是连接出错
+            if((events[i].events & EPOLLERR) && !(events[i].events & (EPOLLRDHUP | EPOLLHUP)) &&
+               sockfd < MAX_FD && users[sockfd].reap_zerocopy()){
+                events[i].events &= ~EPOLLERR;
+            }
             if(sockfd == lfd){
                 // 有客户端连接进来
-                struct sockaddr_in client_addr;
-                socklen_t client_addrlen = sizeof(client_addr);
-                int cfd = accept(lfd, (struct sockaddr*)&client_addr, &client_addrlen);
-                if(cfd < 0){
-                    cout <<"error is " << errno << endl;
+                accept_conns(lfd, users, false);
+            }
+            else if(sockfd == tls_lfd){
+                accept_conns(tls_lfd, users, true);
+            }
+            else if(sockfd == completions->fd()){
+                // 子线程提交的完成事件，批量执行socket和epoll操作
+                completion * c = completions->pop_all();
+                while(c){
+                    completion * next = c->next; // 处理之后节点可能被子线程重新使用
+                    if(c->type == completion_queue::COMP_CLOSE){
+                        users[c->fd].close_conn();
+                    }else if(c->type == completion_queue::COMP_PROXY){
+                        proxy_response(users + c->fd, pool);
+                    }else if(c->type == completion_queue::COMP_WS){
+                        users[c->fd].start_ws();
+                    }else{
+                        send_response(users + c->fd, pool);
+                    }
+                    c = next;
                 }
-
-                if(http_conn::m_user_count >= MAX_FD){
-                    // 最大连接数满了
-                    // 给客户端响应报文：服务器正忙，关闭连接
-                    close(cfd);
-                    continue;
+            }
+            else if(sockfd == ctrl_fd){
+                // 新版本的进程请求接管监听socket
+                if(handoff_conn >= 0){
+                    close(accept4(ctrl_fd, NULL, NULL, SOCK_CLOEXEC)); // 已经有一个升级在进行
+                }else{
+                    handoff_conn = upgrade_handoff(ctrl_fd, lfd, tls_lfd, hot_files());
+                    if(handoff_conn >= 0){
+                        epoll_event hev;
+                        hev.data.fd = handoff_conn;
+                        hev.events = EPOLLIN;
+                        epoll_ctl(epollfd, EPOLL_CTL_ADD, handoff_conn, &hev);
+                    }
                 }
-
-                // init将新连接users[cfd]初始化(cfd上epoll树) users 数组中cfd作为user索引
-                // http_conn * users = new http_conn[MAX_FD];
-                users[cfd].init(cfd, client_addr);
-            } // 其他事件
-            // 对方异常断开或错误， 关闭连接
-            else if(events[i].events & (EPOLLRDHUP |EPOLLHUP | EPOLLERR)){
-                users[sockfd].close_conn(); 
-            } // 读事件（有客户端数据发来）
-            else if(events[i].events & EPOLLIN){
-                // 主线程非阻塞读，一次性全读完了
-                if(users[sockfd].read()){ 
-                    // 主线程把读取的数据封装成请求对象(http_conn对象)添加到请求队列中
-                    pool->append(users + sockfd); // 首地址+sockfd就是users[sockfd]的地址，
+            }
+            else if(sockfd == handoff_conn){
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, handoff_conn, NULL);
+                if(upgrade_confirmed(handoff_conn)){
+                    cout << "listen socket handed over, draining" << endl;
+                    drain_requested = 1;
+                }
+                handoff_conn = -1; // 新进程没有就绪就退出时继续服务
+            }
+            else if(sockfd == timers->fd()){
+                // 限速的连接等待时间到了，继续发送；代理的上游超时
+                timers->expire([&](int fd, unsigned seq){
+                    if(users[fd].pace_expired(seq)){
+                        send_response(users + fd, pool);
+                    }else if(users[fd].proxy_expired(seq)){
+                        // 上游没有响应，不再占着客户端连接和上游连接
+                        users[fd].proxy_timeout();
+                        users[fd].close_conn();
+                    }
+                });
+            }
+            else if(hub && sockfd == hub->fd()){
+                // 有消息发布：一批消息追加到所有订阅者的发送队列，每个订阅者一次writev
+                hub->deliver([&](void * owner){
+                    deliver_broadcast((http_conn *)owner, pool);
+                });
+            }
+            else if(upstreams && upstreams->is_upstream(sockfd)){
+                // 上游连接上的事件：交给正在使用它的客户连接，空闲连接被上游关闭时从连接池中删除
+                http_conn * conn = (http_conn *)upstreams->owner(sockfd);
+                if(conn){
+                    proxy_response(conn, pool);
                 }else{
-                    users[sockfd].close_conn();//失败关闭连接
+                    upstreams->on_idle_event(sockfd, events[i].events);
                 }
-            } // 写事件（主线程响应）
-            else if(events[i].events & EPOLLOUT){
-                // 主线程非阻塞写
-                if(!users[sockfd].write()){
+            } // 其他事件
+            // 对方异常断开或错误，连接空闲时直接关闭，被持有时交给持有者（读到0或出错后关闭）
+            else if(events[i].events & (EPOLLRDHUP |EPOLLHUP | EPOLLERR)){
+                if(users[sockfd].waiting_out()){
+                    // 等待EPOLLOUT的连接由主线程持有，继续写会出错并关闭
+                    send_response(users + sockfd, pool);
+                }else if(users[sockfd].proxying() || users[sockfd].pacing()){
+                    // 正在等待上游的响应或者限速的定时器，客户端已经断开，不再等待
                     users[sockfd].close_conn();
+                }else if(users[sockfd].acquire()){
+                    users[sockfd].close_conn();
+                }
+            } else {
+                // 写事件（socket写缓冲满之后子线程注册了EPOLLOUT，主线程继续发送）
+                if((events[i].events & EPOLLOUT) && users[sockfd].waiting_out()){
+                    send_response(users + sockfd, pool);
+                }
+                // 读事件（有客户端数据发来），边沿触发，EPOLLIN和EPOLLOUT可能同时到达
+                // 连接被子线程持有时acquire只记录事件，由持有者处理
+                if((events[i].events & EPOLLIN) && users[sockfd].acquire()){
+                    // 主线程非阻塞读，一次性全读完了
+                    if(users[sockfd].read()){ 
+                        // 主线程直接处理，或者把读取的数据封装成请求对象(http_conn对象)添加到请求队列中
+                        dispatch(users + sockfd, pool); // 首地址+sockfd就是users[sockfd]的地址，
+                    }else{
+                        users[sockfd].close_conn();//失败关闭连接
+                    }
                 }
             }
         }
+        if(drain_requested && !draining){
+            // 停止接受新连接：lfd从epoll删除并关闭（新进程或者其他worker还持有它，全连接队列中的连接不会丢失）
+            draining = true;
+            drain_deadline = timer_queue::now_us() + DRAIN_SECONDS * 1000000ULL;
+            epoll_ctl(epollfd, EPOLL_CTL_DEL, lfd, NULL);
+            close(lfd);
+            lfd = -1;
+            if(tls_lfd >= 0){
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, tls_lfd, NULL);
+                close(tls_lfd);
+                tls_lfd = -1;
+            }
+            if(ctrl_fd >= 0){
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, ctrl_fd, NULL);
+                close(ctrl_fd);
+                ctrl_fd = -1;
+            }
+            http_conn::m_draining = true;
+        }
+        if(draining){
+            uint64_t now = timer_queue::now_us();
+            if(now - last_sweep >= 200000){
+                // 关闭等待下一个请求的保持连接，正在处理的连接在响应发送完后关闭
+                last_sweep = now;
+                close_idle(users);
+            }
+            if(http_conn::m_user_count == 0 || now >= drain_deadline){
+                cout << "drained, " << http_conn::m_user_count << " connections left" << endl;
+                exit(0);
+            }
+        }
+        if(g_segment){
+            // 只有主线程写自己的槽，复制的间隔限制在PUBLISH_US，请求路径上没有额外的操作
+            uint64_t now = timer_queue::now_us();
+            if(now - last_publish >= stats_segment::PUBLISH_US){
+                g_segment->publish(g_worker);
+                last_publish = now;
+            }
+        }
     }
 
     close(epollfd);
     close(lfd);
+    close(spare_fd);
     delete [] users;
     delete pool;
+    delete completions;
+    delete http_conn::m_file_cache;
+    delete http_conn::m_gzip_cache;
+    delete upstreams;
+    delete timers;
+    delete g_limiter;
+    delete g_shm_cache;
+    delete http_conn::m_bundle;
+    delete http_conn::m_tls_context;
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,214 @@
+#ifndef MIME_TABLE_H
+#define MIME_TABLE_H
+/*
+编译期生成的MIME类型表和响应头前缀。
+
+1.扩展名到MIME类型：编译期在64个槽位里搜索一个没有冲突的哈希种子（完美哈希），
+  运行时只需要对扩展名算一次哈希、比较一次字符串，不再逐个strcasecmp。
+2.响应头前缀：对每个(状态码, MIME类型, 是否保持连接)组合，编译期拼好
+  状态行、Accept-Ranges、Content-Type、Vary、Connection，
+  运行时发送文件时只需要一次memcpy，再追加校验头部和Content-Length的数字。
+*/
+#include <stddef.h>
+#include <stdint.h>
+
+struct mime_info{
+    const char * ext;       // 扩展名，不带点，小写
+    const char * type;      // MIME类型
+    bool compressible;      // 文本类的内容压缩效果好，图片视频等已经压缩过
+};
+
+// 下标0是找不到扩展名时的默认类型
+constexpr mime_info MIME_TYPES[] = {
+    {"",      "application/octet-stream", false},
+    {"html",  "text/html",                true},
+    {"htm",   "text/html",                true},
+    {"css",   "text/css",                 true},
+    {"js",    "application/javascript",   true},
+    {"json",  "application/json",         true},
+    {"txt",   "text/plain",               true},
+    {"xml",   "application/xml",          true},
+    {"svg",   "image/svg+xml",            true},
+    {"png",   "image/png",                false},
+    {"jpg",   "image/jpeg",               false},
+    {"jpeg",  "image/jpeg",               false},
+    {"gif",   "image/gif",                false},
+    {"ico",   "image/x-icon",             false},
+    {"webp",  "image/webp",               false},
+    {"woff",  "font/woff",                false},
+    {"woff2", "font/woff2",               false},
+    {"pdf",   "application/pdf",          false},
+    {"mp4",   "video/mp4",                false},
+    {"wasm",  "application/wasm",         true},
+};
+constexpr int MIME_COUNT = sizeof(MIME_TYPES) / sizeof(MIME_TYPES[0]);
+constexpr int MIME_DEFAULT = 0;
+constexpr int MIME_HTML = 1;    // 错误页面
+
+constexpr int MIME_SLOTS = 64;  // 槽位数，必须是2的幂
+constexpr size_t MIME_EXT_MAX = 8; // 更长的扩展名不可能在表中
+
+constexpr char ascii_lower(char c){
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+// 带种子的FNV-1a，大小写不敏感
+constexpr uint32_t mime_hash(const char * s, size_t len, uint32_t seed){
+    uint32_t h = 2166136261u ^ seed;
+    for(size_t i = 0; i < len; ++i){
+        h ^= (unsigned char)ascii_lower(s[i]);
+        h *= 16777619u;
+    }
+    return (h ^ (h >> 15)) & (MIME_SLOTS - 1);
+}
+
+constexpr size_t const_strlen(const char * s){
+    size_t n = 0;
+    while(s[n]) ++n;
+    return n;
+}
+
+// 这个种子能否让表中所有扩展名落在不同的槽位
+constexpr bool mime_seed_ok(uint32_t seed){
+    bool used[MIME_SLOTS] = {};
+    for(int i = 1; i < MIME_COUNT; ++i){
+        uint32_t slot = mime_hash(MIME_TYPES[i].ext, const_strlen(MIME_TYPES[i].ext), seed);
+        if(used[slot]) return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+constexpr uint32_t mime_find_seed(){
+    for(uint32_t seed = 0; seed < 100000; ++seed){
+        if(mime_seed_ok(seed)) return seed;
+    }
+    return UINT32_MAX;
+}
+
+constexpr uint32_t MIME_SEED = mime_find_seed();
+
+// 整个表（顺序、扩展名、类型、是否可压缩）的FNV-1a，打包文件中的mime下标只在同样的表下有意义
+constexpr uint32_t mime_table_hash(){
+    uint32_t h = 2166136261u;
+    for(int i = 0; i < MIME_COUNT; ++i){
+        for(const char * p = MIME_TYPES[i].ext; ; ++p){
+            h = (h ^ (unsigned char)*p) * 16777619u; // 包括结尾的\0，作为分隔
+            if(!*p) break;
+        }
+        for(const char * p = MIME_TYPES[i].type; ; ++p){
+            h = (h ^ (unsigned char)*p) * 16777619u;
+            if(!*p) break;
+        }
+        h = (h ^ (MIME_TYPES[i].compressible ? 1u : 0u)) * 16777619u;
+    }
+    return h;
+}
+constexpr uint32_t MIME_TABLE_HASH = mime_table_hash();
+static_assert(MIME_SEED != UINT32_MAX, "no perfect hash seed for MIME_TYPES");
+
+struct mime_slots{
+    int8_t index[MIME_SLOTS];   // 槽位对应MIME_TYPES的下标，0表示空
+};
+
+constexpr mime_slots mime_build_slots(){
+    mime_slots s{};
+    for(int i = 1; i < MIME_COUNT; ++i){
+        s.index[mime_hash(MIME_TYPES[i].ext, const_strlen(MIME_TYPES[i].ext), MIME_SEED)] = i;
+    }
+    return s;
+}
+
+inline constexpr mime_slots MIME_SLOT_TABLE = mime_build_slots();
+
+// 按路径的扩展名得到MIME_TYPES的下标，找不到时返回MIME_DEFAULT
+inline int mime_lookup(const char * path){
+    const char * dot = NULL;
+    const char * p = path;
+    for(; *p; ++p){
+        if(*p == '.') dot = p;
+        else if(*p == '/') dot = NULL; // 目录名中的点不算
+    }
+    if(!dot) return MIME_DEFAULT;
+    const char * ext = dot + 1;
+    size_t len = p - ext;
+    if(len == 0 || len > MIME_EXT_MAX) return MIME_DEFAULT;
+    int i = MIME_SLOT_TABLE.index[mime_hash(ext, len, MIME_SEED)];
+    if(i == 0) return MIME_DEFAULT;
+    // 同一个槽位可能是别的扩展名，需要确认
+    const char * e = MIME_TYPES[i].ext;
+    for(size_t k = 0; k < len; ++k){
+        if(ascii_lower(ext[k]) != e[k]) return MIME_DEFAULT;
+    }
+    return e[len] == '\0' ? i : MIME_DEFAULT;
+}
+
+/*
+    响应头前缀
+    RESP_200    :   完整文件
+    RESP_206    :   单个区间（Content-Range在后面追加）
+*/
+enum RESP_STATUS { RESP_200 = 0, RESP_206, RESP_STATUS_COUNT };
+
+constexpr size_t HEADER_PREFIX_MAX = 160;
+
+struct header_prefix{
+    char data[HEADER_PREFIX_MAX];
+    size_t len;
+};
+
+constexpr void prefix_append(header_prefix & p, const char * s){
+    while(*s) p.data[p.len++] = *s++; // 越界时编译失败
+}
+
+constexpr header_prefix make_header_prefix(int status, int mime, bool keep_alive){
+    header_prefix p{};
+    prefix_append(p, status == RESP_200 ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 206 Partial Content\r\n");
+    prefix_append(p, "Accept-Ranges: bytes\r\n");
+    prefix_append(p, "Content-Type:");
+    prefix_append(p, MIME_TYPES[mime].type);
+    prefix_append(p, "\r\n");
+    if(MIME_TYPES[mime].compressible){
+        // 同一个url根据Accept-Encoding有不同的表示，共享缓存需要区分
+        prefix_append(p, "Vary: Accept-Encoding\r\n");
+    }
+    prefix_append(p, keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+    return p;
+}
+
+struct header_prefix_table{
+    header_prefix prefix[RESP_STATUS_COUNT][MIME_COUNT][2];
+};
+
+constexpr header_prefix_table make_header_prefix_table(){
+    header_prefix_table t{};
+    for(int s = 0; s < RESP_STATUS_COUNT; ++s){
+        for(int m = 0; m < MIME_COUNT; ++m){
+            t.prefix[s][m][0] = make_header_prefix(s, m, false);
+            t.prefix[s][m][1] = make_header_prefix(s, m, true);
+        }
+    }
+    return t;
+}
+
+inline constexpr header_prefix_table HEADER_PREFIXES = make_header_prefix_table();
+
+inline const header_prefix & response_prefix(RESP_STATUS status, int mime, bool keep_alive){
+    return HEADER_PREFIXES.prefix[status][mime][keep_alive ? 1 : 0];
+}
+
+// 无符号整数转十进制，返回写入的字符数，buf至少20字节
+inline int format_decimal(char * buf, unsigned long long v){
+    char tmp[20];
+    int n = 0;
+    do{
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    }while(v);
+    for(int i = 0; i < n; ++i){
+        buf[i] = tmp[n - 1 - i];
+    }
+    return n;
+}
+
+#endif
@@ -0,0 +1,331 @@
+/*
+离线打包工具：把网站目录编译成一个打包文件，服务器用 -b 打包文件 启动时映射它（格式见static_bundle.h）。
+
+每个普通文件生成一个文件项：内容按页对齐（小文件不跨页），可压缩的类型再用zlib最高级别压缩一份，
+压缩后没有变小的不保存；ETag用内容的哈希（同样的内容在不同机器上打包得到同样的ETag），
+ETag、Content-Encoding和Last-Modified的头部在这里拼好，服务器发送时只需要memcpy。
+路径索引是CHD完美哈希：桶按大小从大到小依次找一个种子，使桶中所有路径落到还空着的不同槽上。
+
+编译运行：
+    g++ -O2 bundle_pack.cpp -lz -o bundle_pack && ./bundle_pack ../resources resources.bundle
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "../static_bundle.h"
+#include "../mime_table.h"
+
+const size_t MIN_GZIP_SIZE = 256; // 和服务器的动态压缩一致，太小的文件压缩不划算
+
+struct source_file{
+    std::string path;   // 以/开头，相对网站目录
+    std::string full;
+    struct stat st;
+};
+
+static std::vector<source_file> files;
+static size_t root_len;
+
+static int collect(const char *fpath, const struct stat *sb, int typeflag, struct FTW * /*ftwbuf*/)
+{
+    if (typeflag == FTW_F && S_ISREG(sb->st_mode))
+    {
+        source_file f;
+        f.full = fpath;
+        f.path = fpath + root_len;
+        f.st = *sb;
+        files.push_back(f);
+    }
+    return 0;
+}
+
+static bool read_all(const std::string &path, size_t size, std::string &out)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    out.resize(size);
+    size_t got = 0;
+    while (got < size)
+    {
+        ssize_t n = read(fd, &out[got], size - got);
+        if (n <= 0)
+        {
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+    return got == size;
+}
+
+static bool gzip(const std::string &src, std::string &out)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return false;
+    }
+    out.resize(deflateBound(&zs, src.size()));
+    zs.next_in = (Bytef *)src.data();
+    zs.avail_in = src.size();
+    zs.next_out = (Bytef *)&out[0];
+    zs.avail_out = out.size();
+    bool ok = deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < src.size();
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return ok;
+}
+
+// 内容区的下一个位置：不小于一页的内容从页边界开始，小内容16字节对齐，放不下当前页的剩余部分时移到下一页
+static uint64_t place(uint64_t pos, uint64_t size)
+{
+    if (size >= BUNDLE_PAGE)
+    {
+        return (pos + BUNDLE_PAGE - 1) / BUNDLE_PAGE * BUNDLE_PAGE;
+    }
+    pos = (pos + 15) / 16 * 16;
+    if (pos / BUNDLE_PAGE != (pos + size - 1) / BUNDLE_PAGE)
+    {
+        pos = (pos + BUNDLE_PAGE - 1) / BUNDLE_PAGE * BUNDLE_PAGE;
+    }
+    return pos;
+}
+
+static uint64_t page_align(uint64_t n)
+{
+    return (n + BUNDLE_PAGE - 1) / BUNDLE_PAGE * BUNDLE_PAGE;
+}
+
+static std::string validators(const char *etag, bool gz, time_t mtime)
+{
+    char date[64];
+    struct tm tm;
+    gmtime_r(&mtime, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    std::string s = "ETag: ";
+    s += etag;
+    s += "\r\n";
+    if (gz)
+    {
+        s += "Content-Encoding: gzip\r\n";
+    }
+    s += "Last-Modified: ";
+    s += date;
+    s += "\r\n";
+    return s;
+}
+
+// CHD：返回false表示有两个路径的哈希完全相同，找不到种子
+static bool build_index(const std::vector<uint64_t> &hashes, uint32_t nbuckets, uint32_t nslots,
+                        std::vector<uint32_t> &disp, std::vector<uint32_t> &slots)
+{
+    std::vector<std::vector<uint32_t> > buckets(nbuckets);
+    for (uint32_t i = 0; i < hashes.size(); i++)
+    {
+        buckets[bundle_bucket(hashes[i], nbuckets)].push_back(i);
+    }
+    std::vector<uint32_t> order(nbuckets);
+    for (uint32_t b = 0; b < nbuckets; b++)
+    {
+        order[b] = b;
+    }
+    std::sort(order.begin(), order.end(),
+              [&](uint32_t a, uint32_t b) { return buckets[a].size() > buckets[b].size(); });
+
+    disp.assign(nbuckets, 0);
+    slots.assign(nslots, BUNDLE_EMPTY);
+    std::vector<uint32_t> taken;
+    for (uint32_t k = 0; k < nbuckets && !buckets[order[k]].empty(); k++)
+    {
+        const std::vector<uint32_t> &keys = buckets[order[k]];
+        uint32_t seed = 0;
+        for (;; seed++)
+        {
+            if (seed > (1u << 24))
+            {
+                return false;
+            }
+            taken.clear();
+            bool ok = true;
+            for (size_t j = 0; j < keys.size() && ok; j++)
+            {
+                uint32_t s = bundle_slot(hashes[keys[j]], seed, nslots);
+                ok = slots[s] == BUNDLE_EMPTY && std::find(taken.begin(), taken.end(), s) == taken.end();
+                taken.push_back(s);
+            }
+            if (ok)
+            {
+                break;
+            }
+        }
+        disp[order[k]] = seed;
+        for (size_t j = 0; j < keys.size(); j++)
+        {
+            slots[taken[j]] = keys[j];
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s doc_root output.bundle\n", argv[0]);
+        return 1;
+    }
+    std::string root = argv[1];
+    while (root.size() > 1 && root[root.size() - 1] == '/')
+    {
+        root.erase(root.size() - 1);
+    }
+    root_len = root.size();
+    if (nftw(root.c_str(), collect, 64, FTW_PHYS) != 0)
+    {
+        perror("nftw");
+        return 1;
+    }
+    if (files.empty())
+    {
+        fprintf(stderr, "no files under %s\n", root.c_str());
+        return 1;
+    }
+    uint32_t count = files.size();
+    uint32_t nbuckets = count / 4 + 1;          // 平均每个桶4个路径
+    uint32_t nslots = count + count / 4 + 1;    // 负载0.8，最后几个桶也能很快找到种子
+
+    std::vector<uint64_t> hashes(count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        hashes[i] = bundle_hash(files[i].path.data(), files[i].path.size());
+    }
+    std::vector<uint32_t> disp, slots;
+    if (!build_index(hashes, nbuckets, nslots, disp, slots))
+    {
+        fprintf(stderr, "hash collision, cannot build index\n");
+        return 1;
+    }
+
+    // 字符串区和内容区，偏移先相对各自的起点，最后再加上区的偏移
+    std::vector<bundle_entry> entries(count);
+    std::string strings;
+    std::vector<std::pair<uint64_t, std::string> > blobs; // 内容区中的位置和内容
+    uint64_t data_pos = 0;
+    size_t gz_count = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const source_file &f = files[i];
+        bundle_entry &e = entries[i];
+        memset(&e, 0, sizeof(e));
+        std::string content;
+        if (!read_all(f.full, f.st.st_size, content))
+        {
+            fprintf(stderr, "cannot read %s\n", f.full.c_str());
+            return 1;
+        }
+        e.path_off = strings.size();
+        e.path_len = f.path.size();
+        strings += f.path;
+        e.mime = mime_lookup(f.path.c_str());
+        e.size = content.size();
+        e.mtime = f.st.st_mtime;
+        e.id = bundle_hash(content.data(), content.size());
+
+        char etag[64];
+        snprintf(etag, sizeof(etag), "\"b%016llx\"", (unsigned long long)e.id);
+        std::string h = validators(etag, false, f.st.st_mtime);
+        e.headers_off = strings.size();
+        e.headers_len = h.size();
+        e.etag_len = strlen(etag);
+        strings += h;
+
+        data_pos = place(data_pos, e.size);
+        e.data_off = data_pos;
+        data_pos += e.size;
+        std::string gz;
+        if (MIME_TYPES[e.mime].compressible && e.size >= MIN_GZIP_SIZE && gzip(content, gz))
+        {
+            snprintf(etag, sizeof(etag), "\"b%016llx-gz\"", (unsigned long long)e.id);
+            h = validators(etag, true, f.st.st_mtime);
+            e.gz_headers_off = strings.size();
+            e.gz_headers_len = h.size();
+            e.gz_etag_len = strlen(etag);
+            strings += h;
+            e.gz_size = gz.size();
+            data_pos = place(data_pos, e.gz_size);
+            e.gz_off = data_pos;
+            data_pos += e.gz_size;
+            gz_count++;
+        }
+        blobs.push_back(std::make_pair(e.data_off, content));
+        if (e.gz_size)
+        {
+            blobs.push_back(std::make_pair(e.gz_off, gz));
+        }
+    }
+
+    bundle_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+    hdr.version = BUNDLE_VERSION;
+    hdr.mime_count = sizeof(MIME_TYPES) / sizeof(MIME_TYPES[0]);
+    hdr.mime_hash = MIME_TABLE_HASH;
+    hdr.count = count;
+    hdr.nbuckets = nbuckets;
+    hdr.nslots = nslots;
+    hdr.disp_off = page_align(sizeof(hdr));
+    hdr.slots_off = page_align(hdr.disp_off + nbuckets * sizeof(uint32_t));
+    hdr.entries_off = page_align(hdr.slots_off + nslots * sizeof(uint32_t));
+    hdr.strings_off = page_align(hdr.entries_off + count * sizeof(bundle_entry));
+    hdr.data_off = page_align(hdr.strings_off + strings.size());
+    hdr.file_size = page_align(hdr.data_off + data_pos);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        entries[i].data_off += hdr.data_off;
+        if (entries[i].gz_size)
+        {
+            entries[i].gz_off += hdr.data_off;
+        }
+    }
+
+    // 先写到临时文件再rename，正在运行的服务器映射的旧文件不受影响
+    std::string tmp = std::string(argv[2]) + ".tmp";
+    FILE *out = fopen(tmp.c_str(), "wb");
+    if (!out)
+    {
+        perror(tmp.c_str());
+        return 1;
+    }
+    std::string image(hdr.file_size, '\0');
+    memcpy(&image[0], &hdr, sizeof(hdr));
+    memcpy(&image[hdr.disp_off], disp.data(), nbuckets * sizeof(uint32_t));
+    memcpy(&image[hdr.slots_off], slots.data(), nslots * sizeof(uint32_t));
+    memcpy(&image[hdr.entries_off], entries.data(), count * sizeof(bundle_entry));
+    memcpy(&image[hdr.strings_off], strings.data(), strings.size());
+    for (size_t i = 0; i < blobs.size(); i++)
+    {
+        memcpy(&image[hdr.data_off + blobs[i].first], blobs[i].second.data(), blobs[i].second.size());
+    }
+    if (fwrite(image.data(), 1, image.size(), out) != image.size() || fclose(out) != 0 ||
+        rename(tmp.c_str(), argv[2]) != 0)
+    {
+        perror(argv[2]);
+        return 1;
+    }
+    printf("%u files (%zu gzip variants), %u buckets, %u slots, %llu bytes\n", count, gz_count, nbuckets, nslots,
+           (unsigned long long)hdr.file_size);
+    return 0;
+}
@@ -0,0 +1,351 @@
+#include "prefork.h"
+#include "server_stats.h"
+#include "shm_cache.h"
+#include "upgrade.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <exception>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+stats_segment *g_segment = NULL;
+int g_worker = -1;
+
+stats_segment::stats_segment(int workers) : m_workers(workers)
+{
+    if (workers <= 0 || stat_counter_count > MAX_COUNTERS)
+    {
+        throw std::exception();
+    }
+    // fork之前映射，所有worker继承同一段共享内存；匿名映射的内容初始为0
+    m_size = sizeof(slot) * (workers + 1);
+    void *p = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        throw std::exception();
+    }
+    m_slots = (slot *)p;
+}
+
+stats_segment::~stats_segment()
+{
+    munmap(m_slots, m_size);
+}
+
+void stats_segment::publish(int i)
+{
+    slot &s = worker(i);
+    for (int k = 0; k < stat_counter_count; k++)
+    {
+        s.values[k].store((g_stats.*stat_counters[k].field).load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+}
+
+void stats_segment::retire(int i)
+{
+    slot &s = worker(i);
+    for (int k = 0; k < stat_counter_count; k++)
+    {
+        m_slots[0].values[k] += s.values[k].exchange(0);
+    }
+    s.pid.store(0);
+}
+
+void stats_segment::total(unsigned long *out) const
+{
+    for (int k = 0; k < stat_counter_count; k++)
+    {
+        out[k] = 0;
+        for (int i = 0; i <= m_workers; i++)
+        {
+            out[k] += m_slots[i].values[k].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void stats_segment::dump(FILE *out) const
+{
+    unsigned long sum[MAX_COUNTERS];
+    total(sum);
+    fprintf(out, "workers %d\n", m_workers);
+    for (int k = 0; k < stat_counter_count; k++)
+    {
+        fprintf(out, "total_%s %lu\n", stat_counters[k].name, sum[k]);
+    }
+    for (int i = 0; i < m_workers; i++)
+    {
+        const slot &s = worker(i);
+        unsigned long requests = 0;
+        for (int k = 0; k < stat_counter_count; k++)
+        {
+            if (stat_counters[k].field == &server_stats::inline_requests ||
+                stat_counters[k].field == &server_stats::offloaded_requests)
+            {
+                requests += s.values[k].load();
+            }
+        }
+        fprintf(out, "worker %d pid %d restarts %lu requests %lu\n", i, s.pid.load(), s.restarts.load(), requests);
+    }
+    fflush(out);
+}
+
+// 主进程的信号只设置标记，在sigsuspend返回后处理
+static volatile sig_atomic_t child_exited = 0;
+static volatile sig_atomic_t master_stop = 0;
+static volatile sig_atomic_t master_dump = 0;
+static volatile sig_atomic_t master_quit = 0;
+
+static void master_handler(int sig)
+{
+    if (sig == SIGCHLD)
+    {
+        child_exited = 1;
+    }
+    else if (sig == SIGUSR1)
+    {
+        master_dump = 1;
+    }
+    else if (sig == SIGQUIT)
+    {
+        master_quit = 1;
+    }
+    else
+    {
+        master_stop = 1;
+    }
+}
+
+static const int master_signals[] = {SIGCHLD, SIGTERM, SIGINT, SIGUSR1, SIGQUIT};
+static const int master_signal_count = sizeof(master_signals) / sizeof(master_signals[0]);
+
+static uint64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int run_master(stats_segment *segment, int lfd, int tls_lfd, int ctrl_fd, int ready_conn)
+{
+    int workers = segment->workers();
+    std::vector<pid_t> pids(workers, 0);
+    std::vector<uint64_t> started(workers, 0);
+    pid_t master = getpid();
+
+    // 信号在sigsuspend之外一直屏蔽，检查标记和等待之间不会丢失信号
+    sigset_t block, old;
+    sigemptyset(&block);
+    for (int i = 0; i < master_signal_count; i++)
+    {
+        sigaddset(&block, master_signals[i]);
+    }
+    sigprocmask(SIG_BLOCK, &block, &old);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = master_handler;
+    sigfillset(&sa.sa_mask);
+    for (int i = 0; i < master_signal_count; i++)
+    {
+        sigaction(master_signals[i], &sa, NULL);
+    }
+
+    int running = 0;
+    int next = 0; // 下一个需要fork的worker，-1表示没有
+    int handoff = -1; // 已经把lfd交给新进程，等待它的就绪通知
+    while (true)
+    {
+        // fork所有空着的位置（启动时全部，之后是退出的worker）
+        for (; next >= 0 && next < workers; next++)
+        {
+            if (pids[next] != 0 || master_stop)
+            {
+                continue;
+            }
+            uint64_t now = monotonic_ms();
+            if (started[next] != 0 && now - started[next] < 1000)
+            {
+                // 刚启动就退出（配置错误、资源不足），等一秒再fork，避免不停地fork
+                sleep(1);
+                now = monotonic_ms();
+            }
+            fflush(stdout); // 缓冲区中还没有输出的内容不能被子进程再输出一次
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                // worker：恢复默认的信号处理，主进程退出时跟着退出
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = SIG_DFL;
+                for (int i = 0; i < master_signal_count; i++)
+                {
+                    sigaction(master_signals[i], &sa, NULL);
+                }
+                sigprocmask(SIG_SETMASK, &old, NULL);
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+                if (getppid() != master)
+                {
+                    exit(0); // prctl之前主进程已经退出了
+                }
+                // 控制socket只有主进程使用
+                if (ctrl_fd >= 0)
+                {
+                    close(ctrl_fd);
+                }
+                if (ready_conn >= 0)
+                {
+                    close(ready_conn);
+                }
+                if (handoff >= 0)
+                {
+                    close(handoff);
+                }
+                g_segment = segment;
+                g_worker = next;
+                return next;
+            }
+            if (pid < 0)
+            {
+                perror("fork");
+                continue; // 下一次有worker退出时再试
+            }
+            if (started[next] != 0)
+            {
+                segment->worker(next).restarts++;
+            }
+            pids[next] = pid;
+            started[next] = now;
+            segment->worker(next).pid.store(pid);
+            running++;
+        }
+        next = -1;
+        if (ready_conn >= 0)
+        {
+            upgrade_ready(ready_conn); // worker已经在接受连接，旧进程可以开始排空
+            ready_conn = -1;
+        }
+        if (master_stop && running == 0)
+        {
+            exit(0);
+        }
+
+        // 等待信号或者控制socket上的事件，信号只在ppoll期间解除屏蔽
+        struct pollfd pfds[2];
+        int npfd = 0;
+        if (ctrl_fd >= 0)
+        {
+            pfds[npfd].fd = ctrl_fd;
+            pfds[npfd].events = POLLIN;
+            npfd++;
+        }
+        if (handoff >= 0)
+        {
+            pfds[npfd].fd = handoff;
+            pfds[npfd].events = POLLIN;
+            npfd++;
+        }
+        if (ppoll(pfds, npfd, NULL, &old) > 0)
+        {
+            for (int i = 0; i < npfd; i++)
+            {
+                if (!pfds[i].revents)
+                {
+                    continue;
+                }
+                if (pfds[i].fd == ctrl_fd && handoff < 0)
+                {
+                    handoff = upgrade_handoff(ctrl_fd, lfd, tls_lfd, hot_files());
+                }
+                else if (pfds[i].fd == ctrl_fd)
+                {
+                    close(accept4(ctrl_fd, NULL, NULL, SOCK_CLOEXEC)); // 已经有一个升级在进行
+                }
+                else if (upgrade_confirmed(handoff))
+                {
+                    printf("listen socket handed over, draining workers\n");
+                    fflush(stdout);
+                    handoff = -1;
+                    master_quit = 1;
+                }
+                else
+                {
+                    handoff = -1; // 新进程没有就绪就退出了，继续服务
+                }
+            }
+        }
+
+        if (master_dump)
+        {
+            master_dump = 0;
+            segment->dump(stdout);
+            if (g_shm_cache)
+            {
+                g_shm_cache->dump(stdout);
+            }
+        }
+        if (master_quit == 1 && !master_stop)
+        {
+            // 排空：worker停止接受、处理完现有连接后退出，不再重新fork
+            master_quit = 2;
+            master_stop = 2;
+            if (ctrl_fd >= 0)
+            {
+                close(ctrl_fd);
+                ctrl_fd = -1;
+            }
+            for (int i = 0; i < workers; i++)
+            {
+                if (pids[i] != 0)
+                {
+                    kill(pids[i], SIGQUIT);
+                }
+            }
+        }
+        if (master_stop == 1)
+        {
+            // 只转发一次，之后等所有worker退出
+            master_stop = 2;
+            for (int i = 0; i < workers; i++)
+            {
+                if (pids[i] != 0)
+                {
+                    kill(pids[i], SIGTERM);
+                }
+            }
+        }
+        if (child_exited)
+        {
+            child_exited = 0;
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            {
+                for (int i = 0; i < workers; i++)
+                {
+                    if (pids[i] != pid)
+                    {
+                        continue;
+                    }
+                    if (WIFSIGNALED(status))
+                    {
+                        printf("worker %d (pid %d) killed by signal %d\n", i, pid, WTERMSIG(status));
+                    }
+                    else
+                    {
+                        printf("worker %d (pid %d) exited with status %d\n", i, pid, WEXITSTATUS(status));
+                    }
+                    fflush(stdout);
+                    segment->retire(i);
+                    pids[i] = 0;
+                    running--;
+                    next = 0; // 从头找空着的位置重新fork
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+/*
+多进程模式（-w N）。
+
+主进程创建监听socket之后fork出N个worker，每个worker运行原来的epoll + 线程池，共享同一个监听socket
+（EPOLLEXCLUSIVE，一个新连接只唤醒一个worker）。主进程不处理请求，只负责监视：worker退出或者崩溃时
+重新fork一个，收到SIGTERM/SIGINT时结束所有worker后退出，收到SIGQUIT或者热升级（upgrade.h）时
+让worker排空后退出。一个worker出错不会影响其他worker的连接。
+
+统计：fork之前用MAP_SHARED|MAP_ANONYMOUS映射一段共享内存，每个worker一个按缓存行对齐的槽，
+worker的主线程定期把自己的g_stats复制到槽里（每个槽只有一个写者，请求路径上不增加任何操作），
+主进程和GET /status/workers读取所有槽求和。退出的worker的计数在重新fork之前累加到retired槽，总数不会倒退。
+*/
+#include <atomic>
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+class stats_segment{
+public:
+    static const int MAX_COUNTERS = 64;     // 槽中计数的个数上限，不小于stat_counter_count
+    static const int PUBLISH_US = 100000;   // worker最多每100ms复制一次统计
+
+    // 每个进程一个槽，对齐到缓存行，不同worker写自己的槽时不会互相使缓存行失效
+    struct slot{
+        std::atomic<int> pid;                       // 0表示槽没有在用
+        std::atomic<unsigned long> restarts;        // 这个位置上的worker被重新fork的次数
+        std::atomic<unsigned long> values[MAX_COUNTERS]; // 按stat_counters的顺序
+    } __attribute__((aligned(64)));
+
+    explicit stats_segment(int workers);
+    ~stats_segment();
+
+    int workers() const { return m_workers; }
+    slot & worker(int i) { return m_slots[i + 1]; }
+    const slot & worker(int i) const { return m_slots[i + 1]; }
+
+    void publish(int i);                        // worker：把自己的g_stats复制到第i个槽
+    void retire(int i);                         // 主进程：第i个worker退出，计数累加到retired槽后清零
+    void total(unsigned long * out) const;      // 所有槽（包括retired）的和，out有stat_counter_count个元素
+    void dump(FILE * out) const;
+
+private:
+    slot * m_slots;     // m_slots[0]是已经退出的worker的累计，之后是每个worker
+    int m_workers;
+    size_t m_size;
+};
+
+extern stats_segment * g_segment;   // 单进程模式为空
+extern int g_worker;                // 当前worker的编号，单进程模式为-1
+
+// 主进程：fork出segment->workers()个worker并监视它们
+// 只在worker进程中返回，返回值是worker的编号；主进程收到SIGTERM/SIGINT并等所有worker退出后直接exit
+// tls_lfd是HTTPS的监听socket（没有时为-1），和lfd一起被worker继承、交给新进程
+// ctrl_fd是热升级的控制socket（没有时为-1）：新进程接管lfd之后，主进程让所有worker排空（SIGQUIT）后退出，
+// 收到SIGQUIT时也一样；ready_conn不是-1时在第一次fork完worker后通知旧进程已经就绪
+int run_master(stats_segment * segment, int lfd, int tls_lfd, int ctrl_fd, int ready_conn);
+
+#endif
@@ -0,0 +1,95 @@
+#include "producer.h"
+#include <string.h>
+
+dir_listing::dir_listing(const char *path, const char *url)
+    : m_url(url), m_pending_off(0), m_eof(false)
+{
+    m_dir = opendir(path);
+    if (!m_dir)
+    {
+        throw std::exception();
+    }
+    if (m_url.empty() || m_url[m_url.size() - 1] != '/')
+    {
+        m_url += '/';
+    }
+    m_pending = "<!DOCTYPE html>\n<html><head><meta charset=\"UTF-8\"><title>Index of ";
+    append_escaped(m_url.c_str());
+    m_pending += "</title></head>\n<body><h1>Index of ";
+    append_escaped(m_url.c_str());
+    m_pending += "</h1><hr><pre>\n<a href=\"../\">../</a>\n";
+}
+
+dir_listing::~dir_listing()
+{
+    closedir(m_dir);
+}
+
+void dir_listing::append_escaped(const char *s)
+{
+    for (; *s; s++)
+    {
+        switch (*s)
+        {
+        case '<':
+            m_pending += "&lt;";
+            break;
+        case '>':
+            m_pending += "&gt;";
+            break;
+        case '&':
+            m_pending += "&amp;";
+            break;
+        case '"':
+            m_pending += "&quot;";
+            break;
+        default:
+            m_pending += *s;
+        }
+    }
+}
+
+ssize_t dir_listing::produce(char *buf, size_t len)
+{
+    size_t n = 0;
+    while (n < len)
+    {
+        if (m_pending_off == m_pending.size())
+        {
+            if (m_eof)
+            {
+                break;
+            }
+            // 上一项已经全部交出，读下一项
+            m_pending.clear();
+            m_pending_off = 0;
+            struct dirent *ent = readdir(m_dir);
+            if (!ent)
+            {
+                m_pending = "</pre><hr></body></html>\n";
+                m_eof = true;
+                continue;
+            }
+            if (ent->d_name[0] == '.')
+            {
+                continue; // 隐藏文件（包括上传的临时文件）
+            }
+            bool dir = (ent->d_type == DT_DIR);
+            m_pending += "<a href=\"";
+            append_escaped(m_url.c_str());
+            append_escaped(ent->d_name);
+            m_pending += dir ? "/\">" : "\">";
+            append_escaped(ent->d_name);
+            m_pending += dir ? "/</a>\n" : "</a>\n";
+        }
+        size_t copy = m_pending.size() - m_pending_off;
+        if (copy > len - n)
+        {
+            copy = len - n;
+        }
+        memcpy(buf + n, m_pending.data() + m_pending_off, copy);
+        m_pending_off += copy;
+        n += copy;
+    }
+    return n;
+}
@@ -0,0 +1,42 @@
+#ifndef PRODUCER_H
+#define PRODUCER_H
+/*
+流式响应的内容生成者。
+
+事先不知道长度的响应（目录列表等生成的内容）不再需要全部生成后再计算Content-Length，
+http_conn用分块传输编码（HTTP/1.0客户端用关闭连接表示结束）边生成边发送：
+每次上一批数据完全写入socket之后才向生成者要下一批，socket写不动时生成者不会被调用，
+每个连接占用的内存只有一个固定大小的发送窗口，第一个字节的发送时间和响应的总大小无关。
+*/
+#include <sys/types.h>
+#include <dirent.h>
+#include <exception>
+#include <string>
+
+// 响应内容的生成者，在子线程中调用（socket可写之后主线程把连接交回线程池）
+class body_producer{
+public:
+    virtual ~body_producer(){}
+    // 生成最多len字节到buf，返回生成的字节数，0表示内容结束，-1表示出错（连接会被关闭）
+    virtual ssize_t produce(char * buf, size_t len) = 0;
+};
+
+// 目录列表，每次生成时继续readdir，大目录也不需要一次读完
+class dir_listing : public body_producer{
+public:
+    dir_listing(const char * path, const char * url); // 打开目录失败时抛出异常
+    ~dir_listing();
+
+    ssize_t produce(char * buf, size_t len);
+
+private:
+    void append_escaped(const char * s); // HTML转义后追加到m_pending
+
+    DIR * m_dir;
+    std::string m_url;      // 目录的url，以/结尾
+    std::string m_pending;  // 已经生成但还没有交给调用者的内容
+    size_t m_pending_off;
+    bool m_eof;             // readdir结束，页尾已经放进m_pending
+};
+
+#endif
@@ -0,0 +1,558 @@
+#include "proxy.h"
+#include "config.h"
+#include "tls.h"
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 头部名字的比较，line指向一行的开头
+static bool header_is(const char *line, size_t len, const char *name)
+{
+    size_t n = strlen(name);
+    return len > n && strncasecmp(line, name, n) == 0 && line[n] == ':';
+}
+
+// Connection头部中是否有token（逗号分隔，大小写不敏感）
+static bool has_token(const char *value, const char *end, const char *token)
+{
+    size_t n = strlen(token);
+    while (value < end)
+    {
+        value += strspn(value, " \t,");
+        const char *stop = value;
+        while (stop < end && *stop != ',' && *stop != ' ' && *stop != '\t' && *stop != '\r')
+        {
+            stop++;
+        }
+        if ((size_t)(stop - value) == n && strncasecmp(value, token, n) == 0)
+        {
+            return true;
+        }
+        value = (stop > value) ? stop : value + 1;
+    }
+    return false;
+}
+
+proxy_session::proxy_session(upstream_pool *pool, upstream_group *group, void *owner, bool head, bool chunked,
+                             bool keepalive, bool retryable)
+    : m_pool(pool), m_group(group), m_backend(NULL), m_owner(owner), m_fd(-1), m_pipe_bytes(0), m_state(S_INIT),
+      m_body(B_DONE), m_remaining(0), m_head(head), m_chunked(chunked), m_keepalive(keepalive),
+      m_retryable(retryable), m_reused(false), m_retried(false), m_reusable(false), m_responded(false),
+      m_start_us(0), m_bytes(0), m_req_len(0), m_req_sent(0), m_in_start(0), m_in_end(0), m_out_start(0),
+      m_out_end(0)
+{
+    m_pipe[0] = m_pipe[1] = -1;
+}
+
+proxy_session::~proxy_session()
+{
+    if (m_pipe[0] >= 0)
+    {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+    }
+}
+
+bool proxy_session::append(const char *data, size_t len)
+{
+    if (m_req_len + len > REQUEST_SIZE)
+    {
+        return false;
+    }
+    memcpy(m_req + m_req_len, data, len);
+    m_req_len += len;
+    return true;
+}
+
+bool proxy_session::appendf(const char *format, ...)
+{
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(m_req + m_req_len, REQUEST_SIZE - m_req_len, format, arg_list);
+    va_end(arg_list);
+    if (len < 0 || (size_t)len >= REQUEST_SIZE - m_req_len)
+    {
+        return false;
+    }
+    m_req_len += len;
+    return true;
+}
+
+bool proxy_session::connect_backend(bool fresh)
+{
+    bool connecting;
+    m_fd = m_pool->acquire(m_backend, m_owner, m_reused, connecting, fresh);
+    if (m_fd < 0)
+    {
+        return false;
+    }
+    m_state = connecting ? S_CONNECT : S_SEND;
+    return true;
+}
+
+// 空闲期间被上游关闭的连接，在还没有收到任何响应时换新连接重发一次
+bool proxy_session::retry()
+{
+    if (!m_reused || m_retried || !m_retryable || m_in_end > 0)
+    {
+        return false;
+    }
+    m_pool->release(m_backend, m_fd, false);
+    m_fd = -1;
+    m_retried = true;
+    m_req_sent = 0;
+    return connect_backend(true);
+}
+
+void proxy_session::finish(bool ok)
+{
+    if (!m_backend)
+    {
+        return; // 还没有选择后端
+    }
+    upstream_pool::record(m_backend, now_us() - m_start_us, ok);
+    m_backend->bytes += m_bytes;
+    if (m_fd >= 0)
+    {
+        // 多余的数据说明上游的响应和声明的长度不一致，连接不再复用
+        bool reusable = ok && m_reusable && m_in_start == m_in_end && m_pipe_bytes == 0;
+        m_pool->release(m_backend, m_fd, reusable);
+        m_fd = -1;
+    }
+    m_backend = NULL;
+}
+
+bool proxy_session::copy_out(const char *data, size_t len)
+{
+    if (m_out_end + len > OUT_SIZE)
+    {
+        return false;
+    }
+    memcpy(m_out + m_out_end, data, len);
+    m_out_end += len;
+    return true;
+}
+
+// 解析上游的响应头部，改写逐跳头部后放进m_out，确定响应体的边界
+int proxy_session::parse_head()
+{
+    while (true)
+    {
+        const char *end = (const char *)memmem(m_in, m_in_end, "\r\n\r\n", 4);
+        if (!end)
+        {
+            return (m_in_end == IN_SIZE) ? -1 : 0; // 头部超过了缓冲区
+        }
+        size_t head_len = end + 4 - m_in;
+        if (head_len < 12 || strncmp(m_in, "HTTP/1.", 7) != 0)
+        {
+            return -1;
+        }
+        int status = atoi(m_in + 9);
+        if (status >= 100 && status < 200)
+        {
+            // 100 Continue之类的中间响应，丢弃，后面还有最终响应
+            memmove(m_in, m_in + head_len, m_in_end - head_len);
+            m_in_end -= head_len;
+            continue;
+        }
+        bool upstream_close = (m_in[7] == '0'); // HTTP/1.0默认不保持连接
+        bool chunked = false;
+        long long length = -1;
+        const char *line = (const char *)memchr(m_in, '\n', head_len) + 1;
+        // 状态行原样转发
+        m_out_start = m_out_end = 0;
+        copy_out(m_in, line - m_in);
+        while (line < end + 2)
+        {
+            const char *eol = (const char *)memchr(line, '\n', end + 4 - line);
+            size_t len = eol + 1 - line;
+            const char *colon = (const char *)memchr(line, ':', len);
+            const char *value = colon ? colon + 1 : eol;
+            if (header_is(line, len, "Connection"))
+            {
+                if (has_token(value, eol, "close"))
+                {
+                    upstream_close = true;
+                }
+                else if (has_token(value, eol, "keep-alive"))
+                {
+                    upstream_close = false;
+                }
+                line = eol + 1;
+                continue; // 逐跳头部，由代理重新生成
+            }
+            if (header_is(line, len, "Keep-Alive") || header_is(line, len, "Proxy-Connection"))
+            {
+                line = eol + 1;
+                continue;
+            }
+            if (header_is(line, len, "Transfer-Encoding"))
+            {
+                chunked = has_token(value, eol, "chunked");
+                if (!m_chunked)
+                {
+                    line = eol + 1;
+                    continue; // HTTP/1.0客户端收到的是去掉分块格式的内容
+                }
+            }
+            else if (header_is(line, len, "Content-Length"))
+            {
+                length = atoll(value);
+            }
+            copy_out(line, len);
+            line = eol + 1;
+        }
+
+        if (m_head || status == 204 || status == 304)
+        {
+            m_body = B_DONE;
+        }
+        else if (chunked)
+        {
+            m_body = B_CHUNK_SIZE;
+            if (!m_chunked)
+            {
+                m_keepalive = false; // 没有长度，以关闭连接表示结束
+            }
+        }
+        else if (length >= 0)
+        {
+            m_remaining = length;
+            m_body = (length > 0) ? B_LENGTH : B_DONE;
+        }
+        else
+        {
+            // 以上游关闭连接表示结束，两边的连接都不能复用
+            m_body = B_CLOSE;
+            upstream_close = true;
+            m_keepalive = false;
+        }
+        m_reusable = !upstream_close;
+        const char *conn = m_keepalive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        if (!copy_out(conn, strlen(conn)))
+        {
+            return -1;
+        }
+        m_in_start = head_len;
+        return 1;
+    }
+}
+
+// 处理缓冲区[m_in_start, m_in_end)中的响应体，调用时m_out已经发送完
+int proxy_session::consume_input()
+{
+    m_out_start = m_out_end = 0;
+    while (m_in_start < m_in_end && m_body != B_DONE)
+    {
+        size_t avail = m_in_end - m_in_start;
+        size_t room = OUT_SIZE - m_out_end;
+        if (room == 0)
+        {
+            return 0;
+        }
+        if (m_body == B_LENGTH || m_body == B_CHUNK_DATA || m_body == B_CLOSE)
+        {
+            size_t n = avail < room ? avail : room;
+            if (m_body != B_CLOSE && (long long)n > m_remaining)
+            {
+                n = m_remaining;
+            }
+            copy_out(m_in + m_in_start, n);
+            m_in_start += n;
+            if (m_body != B_CLOSE)
+            {
+                m_remaining -= n;
+                if (m_remaining == 0)
+                {
+                    m_body = (m_body == B_LENGTH) ? B_DONE : B_CHUNK_END;
+                }
+            }
+            continue;
+        }
+        // 分块格式的一行
+        char *line = m_in + m_in_start;
+        char *nl = (char *)memchr(line, '\n', avail);
+        if (!nl)
+        {
+            if (m_in_start == 0 && m_in_end == IN_SIZE)
+            {
+                return -1; // 一行超过了缓冲区
+            }
+            break;
+        }
+        size_t len = nl + 1 - line;
+        if (m_chunked)
+        {
+            if (len > room)
+            {
+                return 0;
+            }
+            copy_out(line, len); // 分块格式原样转发
+        }
+        m_in_start += len;
+        bool empty = (len == 1 || (len == 2 && line[0] == '\r'));
+        switch (m_body)
+        {
+        case B_CHUNK_END:
+            if (!empty)
+            {
+                return -1;
+            }
+            m_body = B_CHUNK_SIZE;
+            break;
+        case B_CHUNK_SIZE:
+        {
+            char *next;
+            long long size = strtoll(line, &next, 16);
+            if (next == line || size < 0)
+            {
+                return -1;
+            }
+            m_remaining = size;
+            m_body = (size == 0) ? B_TRAILER : B_CHUNK_DATA;
+            break;
+        }
+        case B_TRAILER:
+            if (empty)
+            {
+                m_body = B_DONE;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+    if (m_in_start == m_in_end)
+    {
+        m_in_start = m_in_end = 0;
+    }
+    if (m_out_end > 0 || m_body == B_DONE)
+    {
+        return 0;
+    }
+    // 不完整的一行移到缓冲区开头，等待更多数据
+    memmove(m_in, m_in + m_in_start, m_in_end - m_in_start);
+    m_in_end -= m_in_start;
+    m_in_start = 0;
+    return 1;
+}
+
+int proxy_session::pump(int client_fd, tls_session *tls)
+{
+    while (true)
+    {
+        switch (m_state)
+        {
+        case S_INIT:
+            m_start_us = now_us();
+            m_backend = m_pool->choose(m_group, m_start_us);
+            m_backend->outstanding++;
+            if (!connect_backend(false))
+            {
+                m_pool->mark_down(m_backend, m_start_us);
+                return PROXY_ERROR;
+            }
+            break;
+        case S_CONNECT:
+        {
+            // 非阻塞connect，可写或者出错时完成
+            struct pollfd p;
+            p.fd = m_fd;
+            p.events = POLLOUT;
+            if (poll(&p, 1, 0) == 0)
+            {
+                return PROXY_WAIT;
+            }
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+            {
+                m_pool->mark_down(m_backend, now_us());
+                return PROXY_ERROR;
+            }
+            m_state = S_SEND;
+            break;
+        }
+        case S_SEND:
+        {
+            ssize_t n = send(m_fd, m_req + m_req_sent, m_req_len - m_req_sent, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return PROXY_WAIT;
+                }
+                if (!retry())
+                {
+                    return PROXY_ERROR;
+                }
+                break;
+            }
+            m_req_sent += n;
+            if (m_req_sent == m_req_len)
+            {
+                m_state = S_HEAD;
+            }
+            break;
+        }
+        case S_HEAD:
+        {
+            ssize_t n = recv(m_fd, m_in + m_in_end, IN_SIZE - m_in_end, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                return PROXY_WAIT;
+            }
+            if (n <= 0)
+            {
+                if (retry())
+                {
+                    break;
+                }
+                return PROXY_ERROR;
+            }
+            m_in_end += n;
+            int ret = parse_head();
+            if (ret < 0)
+            {
+                return PROXY_ERROR;
+            }
+            if (ret > 0)
+            {
+                m_state = S_BODY;
+            }
+            break;
+        }
+        case S_BODY:
+        {
+            // 1.缓冲区中的内容（响应头部、分块格式、和头部一起读到的响应体）
+            // 后面还有响应体时带上MSG_MORE（-T cork），头部等响应体到了一起发出；最后一次splice不带提示，立即发出
+            if (m_out_start < m_out_end)
+            {
+                int flags = MSG_NOSIGNAL | ((g_config.cork && (m_pipe_bytes > 0 || m_body != B_DONE)) ? MSG_MORE : 0);
+                ssize_t n = tls ? tls->send(m_out + m_out_start, m_out_end - m_out_start)
+                                : send(client_fd, m_out + m_out_start, m_out_end - m_out_start, flags);
+                if (n < 0)
+                {
+                    return (errno == EAGAIN || errno == EWOULDBLOCK) ? PROXY_CLIENT_BLOCKED : PROXY_ERROR;
+                }
+                m_responded = true;
+                m_out_start += n;
+                m_bytes += n;
+                break;
+            }
+            // 2.管道中的响应体
+            if (m_pipe_bytes > 0)
+            {
+                ssize_t n = splice(m_pipe[0], NULL, client_fd, NULL, m_pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n < 0)
+                {
+                    return (errno == EAGAIN || errno == EWOULDBLOCK) ? PROXY_CLIENT_BLOCKED : PROXY_ERROR;
+                }
+                m_pipe_bytes -= n;
+                m_bytes += n;
+                break;
+            }
+            if (m_body == B_DONE)
+            {
+                return PROXY_DONE;
+            }
+            // 3.缓冲区中还有上游的数据
+            if (m_in_start < m_in_end)
+            {
+                int ret = consume_input();
+                if (ret < 0)
+                {
+                    return PROXY_ERROR;
+                }
+                if (ret == 0)
+                {
+                    break;
+                }
+            }
+            // 4.数据部分直接splice：上游socket -> 管道，下一轮 管道 -> 客户端socket
+            //   客户端需要用户态加密时读进m_out，下一轮SSL_write
+            if (m_in_end == 0 && (m_body == B_LENGTH || m_body == B_CHUNK_DATA || m_body == B_CLOSE))
+            {
+                size_t len = tls ? OUT_SIZE : SPLICE_SIZE;
+                if (m_body != B_CLOSE && m_remaining < (long long)len)
+                {
+                    len = m_remaining;
+                }
+                ssize_t n;
+                if (tls)
+                {
+                    m_out_start = m_out_end = 0;
+                    n = recv(m_fd, m_out, len, 0);
+                }
+                else
+                {
+                    if (m_pipe[0] < 0 && pipe2(m_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+                    {
+                        m_pipe[0] = m_pipe[1] = -1;
+                        return PROXY_ERROR;
+                    }
+                    n = splice(m_fd, NULL, m_pipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                }
+                if (n > 0)
+                {
+                    if (tls)
+                    {
+                        m_out_end = n;
+                    }
+                    else
+                    {
+                        m_pipe_bytes = n;
+                    }
+                    if (m_body != B_CLOSE)
+                    {
+                        m_remaining -= n;
+                        if (m_remaining == 0)
+                        {
+                            m_body = (m_body == B_LENGTH) ? B_DONE : B_CHUNK_END;
+                        }
+                    }
+                    break;
+                }
+                if (n == 0)
+                {
+                    if (m_body == B_CLOSE)
+                    {
+                        m_body = B_DONE;
+                        break;
+                    }
+                    return PROXY_ERROR; // 响应体不完整
+                }
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? PROXY_WAIT : PROXY_ERROR;
+            }
+            // 5.分块格式的一行，读进缓冲区解析
+            ssize_t n = recv(m_fd, m_in + m_in_end, IN_SIZE - m_in_end, 0);
+            if (n > 0)
+            {
+                m_in_end += n;
+                break;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                return PROXY_WAIT;
+            }
+            return PROXY_ERROR;
+        }
+        }
+    }
+}
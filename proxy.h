@@ -0,0 +1,100 @@
+#ifndef PROXY_H
+#define PROXY_H
+/*
+一次反向代理请求：把请求发给上游，读取响应头部后改写逐跳头部转发给客户端，响应体用splice
+从上游socket经过管道直接送到客户端socket，不经过用户态缓冲区。
+
+会话由子线程（或者inline模式的主线程）创建并写好请求报文，之后全部在主线程推进：
+上游socket和客户端socket上的任何事件都调用pump，pump一直做到某一方EAGAIN为止。
+管道里还有没发出去的数据时不再从上游读取，客户端慢时背压自然传到上游。
+
+响应体的边界按Content-Length、分块编码或者上游关闭连接确定，分块的大小行读入缓冲区解析，
+分块数据用splice；HTTP/1.0客户端不支持分块编码，去掉分块格式只转发数据，结束后关闭连接。
+客户端是用户态加密的TLS连接时不能splice，响应体读进m_out后交给SSL_write。
+*/
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "upstream.h"
+
+class tls_session;
+
+class proxy_session{
+public:
+    /*
+        pump的结果
+        PROXY_WAIT              :   等待上游socket上的事件
+        PROXY_CLIENT_BLOCKED    :   客户端socket写缓冲满，需要注册EPOLLOUT
+        PROXY_DONE              :   响应已经完整转发
+        PROXY_ERROR             :   出错，客户端连接需要关闭（还没有发送任何内容时可以先回复502）
+    */
+    enum STATUS { PROXY_WAIT = 0, PROXY_CLIENT_BLOCKED, PROXY_DONE, PROXY_ERROR };
+
+    static const size_t REQUEST_SIZE = 4096;    // 请求报文（请求行、头部和完整的请求体）
+    static const size_t IN_SIZE = 8192;         // 上游响应头部和分块大小行的缓冲区
+    static const size_t OUT_SIZE = 16384;       // 改写后的响应头部和缓冲区中的响应体
+    static const size_t SPLICE_SIZE = 65536;    // 每次splice的最大字节数（管道的默认容量）
+    static const uint64_t IDLE_TIMEOUT_US = 30 * 1000000ULL; // 上游和客户端都没有进展的最长时间，超过时回复504
+
+    // head：HEAD请求，响应没有内容  chunked：客户端支持分块编码  keepalive：客户端要求保持连接
+    // retryable：复用的空闲连接已经被上游关闭时，可以在新连接上重发（非幂等的请求不重发）
+    proxy_session(upstream_pool * pool, upstream_group * group, void * owner, bool head, bool chunked,
+                  bool keepalive, bool retryable);
+    ~proxy_session();
+
+    // 写请求报文，超过REQUEST_SIZE时返回false
+    bool append(const char * data, size_t len);
+    bool appendf(const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+    // 主线程推进，第一次调用时选择后端并取得连接；tls不为空时发给客户端的内容经过它加密
+    int pump(int client_fd, tls_session * tls = NULL);
+    // 结束会话，记录统计，连接可以复用时放回空闲列表
+    void finish(bool ok);
+
+    bool responded() const { return m_responded; }  // 已经向客户端发送了内容
+    bool keepalive() const { return m_keepalive; }  // 响应结束后客户端连接是否可以保持
+
+private:
+    enum STATE { S_INIT = 0, S_CONNECT, S_SEND, S_HEAD, S_BODY };
+    enum BODY { B_LENGTH = 0, B_CHUNK_SIZE, B_CHUNK_DATA, B_CHUNK_END, B_TRAILER, B_CLOSE, B_DONE };
+
+    bool connect_backend(bool fresh);
+    bool retry(); // 复用的连接已经失效，换一个新连接重发
+    int parse_head(); // 1：头部完整  0：需要更多数据  -1：出错
+    int consume_input(); // 缓冲区中的响应体交给m_out  0：有进展  1：需要更多数据  -1：出错
+    bool copy_out(const char * data, size_t len);
+
+    upstream_pool * m_pool;
+    upstream_group * m_group;
+    upstream_backend * m_backend;
+    void * m_owner;
+    int m_fd;               // 到上游的连接
+    int m_pipe[2];          // splice的中转管道，第一次需要时创建
+    size_t m_pipe_bytes;    // 管道中还没有发给客户端的字节数
+    STATE m_state;
+    BODY m_body;
+    long long m_remaining;  // Content-Length或者当前分块中还没有转发的字节数
+
+    bool m_head;
+    bool m_chunked;         // 客户端支持分块编码，分块格式原样转发
+    bool m_keepalive;
+    bool m_retryable;
+    bool m_reused;
+    bool m_retried;
+    bool m_reusable;        // 上游连接在响应结束后可以复用
+    bool m_responded;
+    uint64_t m_start_us;
+    unsigned long m_bytes;  // 转发给客户端的字节数
+
+    char m_req[REQUEST_SIZE];
+    size_t m_req_len;
+    size_t m_req_sent;
+    char m_in[IN_SIZE];
+    size_t m_in_start;
+    size_t m_in_end;
+    char m_out[OUT_SIZE];
+    size_t m_out_start;
+    size_t m_out_end;
+};
+
+#endif
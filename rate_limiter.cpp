@@ -0,0 +1,182 @@
+#include "rate_limiter.h"
+#include <algorithm>
+#include <arpa/inet.h>
+
+rate_limiter *g_limiter = NULL;
+
+rate_limiter::rate_limiter(double rate, double burst, double bandwidth)
+    : m_rate(rate), m_burst(std::max(burst > 0 ? burst : rate, 1.0)), m_bandwidth(bandwidth)
+{
+    // 请求桶至少能放下一个请求的令牌，否则-R 0.5这样的速率会拒绝所有请求
+    // 带宽桶容量为1秒的量，至少能一次发送MIN_SEND
+    m_bw_burst = std::max(bandwidth, (double)MIN_SEND);
+    for (int i = 0; i < STRIPES; i++)
+    {
+        m_stripes[i].last_sweep_us = 0;
+    }
+}
+
+rate_limiter::bucket &rate_limiter::find(stripe &s, uint32_t ip, uint64_t now_us)
+{
+    if (now_us - s.last_sweep_us > SWEEP_US)
+    {
+        // 惰性过期：顺便清理这一段中长时间没有出现的IP
+        s.last_sweep_us = now_us;
+        for (auto it = s.clients.begin(); it != s.clients.end();)
+        {
+            if (now_us - it->second.last_us > EXPIRE_US)
+            {
+                it = s.clients.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+    auto it = s.clients.find(ip);
+    if (it == s.clients.end())
+    {
+        bucket b;
+        b.req_tokens = m_burst;
+        b.bw_tokens = m_bw_burst;
+        b.last_us = now_us;
+        b.info.ip = ip;
+        b.info.requests = 0;
+        b.info.limited = 0;
+        b.info.paced = 0;
+        b.info.bytes = 0;
+        return s.clients.insert(std::make_pair(ip, b)).first->second;
+    }
+    bucket &b = it->second;
+    if (now_us > b.last_us)
+    {
+        double elapsed = (now_us - b.last_us) / 1e6;
+        b.req_tokens = std::min(m_burst, b.req_tokens + elapsed * m_rate);
+        b.bw_tokens = std::min(m_bw_burst, b.bw_tokens + elapsed * m_bandwidth);
+        b.last_us = now_us;
+    }
+    return b;
+}
+
+bool rate_limiter::admit(uint32_t ip, uint64_t now_us)
+{
+    if (m_rate <= 0)
+    {
+        return true;
+    }
+    stripe &s = stripe_of(ip);
+    s.lock.lock();
+    bucket &b = find(s, ip, now_us);
+    bool ok = b.req_tokens >= 1;
+    if (!ok)
+    {
+        b.info.limited++;
+    }
+    s.lock.unlock();
+    return ok;
+}
+
+bool rate_limiter::allow_request(uint32_t ip, uint64_t now_us)
+{
+    if (m_rate <= 0)
+    {
+        return true;
+    }
+    stripe &s = stripe_of(ip);
+    s.lock.lock();
+    bucket &b = find(s, ip, now_us);
+    bool ok = b.req_tokens >= 1;
+    if (ok)
+    {
+        b.req_tokens -= 1;
+        b.info.requests++;
+    }
+    else
+    {
+        b.info.limited++;
+    }
+    s.lock.unlock();
+    return ok;
+}
+
+size_t rate_limiter::send_quota(uint32_t ip, size_t want, uint64_t now_us, uint64_t &wait_us)
+{
+    wait_us = 0;
+    if (m_bandwidth <= 0)
+    {
+        return want;
+    }
+    stripe &s = stripe_of(ip);
+    s.lock.lock();
+    bucket &b = find(s, ip, now_us);
+    // 剩下的不多时一次发完，否则至少攒够MIN_SEND，避免令牌很少时频繁发送小包
+    double need = std::min((double)want, (double)MIN_SEND);
+    size_t quota = 0;
+    if (b.bw_tokens >= need)
+    {
+        quota = std::min(want, (size_t)b.bw_tokens);
+        b.bw_tokens -= quota;
+        b.info.bytes += quota;
+    }
+    else
+    {
+        wait_us = (uint64_t)((need - b.bw_tokens) / m_bandwidth * 1e6) + 1;
+        b.info.paced++;
+    }
+    s.lock.unlock();
+    return quota;
+}
+
+void rate_limiter::refund(uint32_t ip, size_t bytes)
+{
+    if (m_bandwidth <= 0 || bytes == 0)
+    {
+        return;
+    }
+    stripe &s = stripe_of(ip);
+    s.lock.lock();
+    auto it = s.clients.find(ip);
+    if (it != s.clients.end())
+    {
+        it->second.bw_tokens = std::min(m_bw_burst, it->second.bw_tokens + bytes);
+        it->second.info.bytes -= std::min((unsigned long)bytes, it->second.info.bytes);
+    }
+    s.lock.unlock();
+}
+
+std::vector<rate_limiter::client_info> rate_limiter::top_limited(size_t n)
+{
+    std::vector<client_info> all;
+    for (int i = 0; i < STRIPES; i++)
+    {
+        m_stripes[i].lock.lock();
+        for (auto it = m_stripes[i].clients.begin(); it != m_stripes[i].clients.end(); ++it)
+        {
+            if (it->second.info.limited > 0 || it->second.info.paced > 0)
+            {
+                all.push_back(it->second.info);
+            }
+        }
+        m_stripes[i].lock.unlock();
+    }
+    size_t k = std::min(n, all.size());
+    std::partial_sort(all.begin(), all.begin() + k, all.end(), [](const client_info &a, const client_info &b) {
+        return a.limited + a.paced > b.limited + b.paced;
+    });
+    all.resize(k);
+    return all;
+}
+
+void rate_limiter::dump(FILE *out)
+{
+    std::vector<client_info> top = top_limited(10);
+    for (size_t i = 0; i < top.size(); i++)
+    {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &top[i].ip, ip, sizeof(ip));
+        fprintf(out, "limited %s requests %lu limited %lu paced %lu bytes %lu\n", ip, top[i].requests, top[i].limited,
+                top[i].paced, top[i].bytes);
+    }
+    fflush(out);
+}
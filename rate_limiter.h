@@ -0,0 +1,82 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+/*
+按客户端IP的限流和限速。
+
+每个IP两个令牌桶：请求桶（每个请求一个令牌，-R 速率[:突发]）和带宽桶（每个字节一个令牌，-W KB/s）。
+表按IP哈希分成STRIPES个分段，每段一把锁和一个哈希表，不同IP的线程基本不会争用同一把锁。
+令牌按上次访问以来经过的时间补充，不需要后台线程；访问某一段时顺便删除长时间没有出现的IP（惰性过期）。
+
+请求桶在接受连接和读到新请求时检查，没有令牌时直接回复429；
+带宽桶在发送响应时检查，令牌不够时连接进入等待，由主线程的定时器在令牌补足后继续发送。
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+#include <unordered_map>
+#include "locker.h"
+
+class rate_limiter{
+public:
+    static const int STRIPES = 64;
+    static const uint64_t EXPIRE_US = 60 * 1000000ULL;  // 超过这么久没有出现的IP被删除
+    static const uint64_t SWEEP_US = 10 * 1000000ULL;   // 每段最多这么久清理一次
+    static const size_t MIN_SEND = 16 * 1024;            // 限速时每次至少攒够这么多字节再发送
+
+    // 某个IP的统计，用于导出被限制最多的客户端
+    struct client_info{
+        uint32_t ip;            // 网络字节序
+        unsigned long requests;
+        unsigned long limited;  // 回复429的次数
+        unsigned long paced;    // 因为带宽限制等待的次数
+        unsigned long bytes;    // 发送的字节数
+    };
+
+    // rate：每秒请求数，burst：请求桶容量，bandwidth：每秒字节数，0表示不限制
+    rate_limiter(double rate, double burst, double bandwidth);
+
+    bool limits_requests() const { return m_rate > 0; }
+    bool limits_bandwidth() const { return m_bandwidth > 0; }
+
+    // 新连接：请求桶已经空了时返回false（不消耗令牌）
+    bool admit(uint32_t ip, uint64_t now_us);
+    // 新请求：消耗一个令牌，没有令牌时返回false并记录一次限制
+    bool allow_request(uint32_t ip, uint64_t now_us);
+    // 准备发送want字节，返回现在可以发送的字节数（已经扣除）；返回0时wait_us是需要等待的时间
+    size_t send_quota(uint32_t ip, size_t want, uint64_t now_us, uint64_t & wait_us);
+    // 实际发送的比申请的少，退还剩下的令牌
+    void refund(uint32_t ip, size_t bytes);
+
+    // 被限制次数最多的n个客户端
+    std::vector<client_info> top_limited(size_t n);
+    void dump(FILE * out);
+
+private:
+    struct bucket{
+        double req_tokens;
+        double bw_tokens;
+        uint64_t last_us;   // 上次补充令牌的时间
+        client_info info;
+    };
+    struct stripe{
+        locker lock;
+        std::unordered_map<uint32_t, bucket> clients;
+        uint64_t last_sweep_us;
+        char pad[64];       // 相邻的段不共享缓存行
+    };
+
+    // 调用者持有段的锁，返回补充过令牌的桶
+    bucket & find(stripe & s, uint32_t ip, uint64_t now_us);
+    stripe & stripe_of(uint32_t ip) { return m_stripes[(ip * 2654435761u) >> 26]; }
+
+    double m_rate;
+    double m_burst;
+    double m_bandwidth;
+    double m_bw_burst;
+    stripe m_stripes[STRIPES];
+};
+
+extern rate_limiter * g_limiter; // 没有配置-R/-W时为空
+
+#endif
@@ -0,0 +1,277 @@
+#include "router.h"
+#include <stdio.h>
+#include <stdarg.h>
+
+str_view route_request::header(const char *name) const
+{
+    size_t len = strlen(name);
+    for (int i = 0; i < header_count; i++)
+    {
+        if (headers[i].name.len == len && strncasecmp(headers[i].name.data, name, len) == 0)
+        {
+            return headers[i].value;
+        }
+    }
+    str_view none = {"", 0};
+    return none;
+}
+
+str_view route_request::param(const char *name) const
+{
+    for (int i = 0; i < match->count; i++)
+    {
+        if (strcmp(match->names[i], name) == 0)
+        {
+            return match->values[i];
+        }
+    }
+    str_view none = {"", 0};
+    return none;
+}
+
+bool route_response::append(const char *data, size_t len)
+{
+    if (m_len + len > m_cap)
+    {
+        m_overflow = true;
+        return false;
+    }
+    memcpy(m_buf + m_len, data, len);
+    m_len += len;
+    return true;
+}
+
+bool route_response::appendf(const char *format, ...)
+{
+    if (m_overflow)
+    {
+        return false;
+    }
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(m_buf + m_len, m_cap - m_len, format, arg_list);
+    va_end(arg_list);
+    if (len < 0 || (size_t)len >= m_cap - m_len)
+    {
+        m_overflow = true;
+        return false;
+    }
+    m_len += len;
+    return true;
+}
+
+router::router() : m_root(new node)
+{
+}
+
+router::~router()
+{
+    destroy(m_root);
+    for (size_t i = 0; i < m_routes.size(); i++)
+    {
+        delete m_routes[i];
+    }
+}
+
+void router::destroy(node *n)
+{
+    for (size_t i = 0; i < n->children.size(); i++)
+    {
+        destroy(n->children[i]);
+    }
+    if (n->param)
+    {
+        destroy(n->param);
+    }
+    delete n;
+}
+
+// 把静态字符串插入基数树，返回字符串结束处的节点，必要时拆分已有的边
+router::node *router::insert_static(node *n, const char *s, size_t len)
+{
+    while (len > 0)
+    {
+        std::vector<node *> &children = n->children;
+        size_t i = 0;
+        while (i < children.size() && (unsigned char)children[i]->label[0] < (unsigned char)s[0])
+        {
+            i++;
+        }
+        if (i == children.size() || children[i]->label[0] != s[0])
+        {
+            // 没有首字节相同的边，新建一条
+            node *child = new node;
+            child->label.assign(s, len);
+            children.insert(children.begin() + i, child);
+            return child;
+        }
+        node *c = children[i];
+        size_t common = 0;
+        while (common < len && common < c->label.size() && c->label[common] == s[common])
+        {
+            common++;
+        }
+        if (common < c->label.size())
+        {
+            // 拆分边：公共部分成为新的中间节点
+            node *mid = new node;
+            mid->label = c->label.substr(0, common);
+            c->label.erase(0, common);
+            mid->children.push_back(c);
+            children[i] = mid;
+            c = mid;
+        }
+        n = c;
+        s += common;
+        len -= common;
+    }
+    return n;
+}
+
+bool router::add(const char *pattern, unsigned methods, route_handler handler, void *arg)
+{
+    if (!pattern || pattern[0] != '/' || !handler)
+    {
+        return false;
+    }
+    route *r = new route;
+    r->handler = handler;
+    r->arg = arg;
+    r->methods = methods;
+    r->pattern = pattern;
+
+    node *n = m_root;
+    const char *p = pattern;
+    bool is_prefix = false;
+    while (*p)
+    {
+        if (*p == ':')
+        {
+            // 参数段，到下一个/为止
+            const char *end = strchr(p, '/');
+            if (!end)
+            {
+                end = p + strlen(p);
+            }
+            std::string name(p + 1, end - p - 1);
+            if (name.empty() || (p > pattern && p[-1] != '/'))
+            {
+                delete r;
+                return false;
+            }
+            if (!n->param)
+            {
+                n->param = new node;
+                n->param->param_name = name;
+            }
+            else if (n->param->param_name != name)
+            {
+                delete r; // 同一位置的参数名必须一致
+                return false;
+            }
+            n = n->param;
+            p = end;
+        }
+        else if (*p == '*')
+        {
+            if (p[1] != '\0')
+            {
+                delete r; // *只能在最后
+                return false;
+            }
+            is_prefix = true;
+            break;
+        }
+        else
+        {
+            size_t len = strcspn(p, ":*");
+            n = insert_static(n, p, len);
+            p += len;
+        }
+    }
+    const route *&slot = is_prefix ? n->prefix : n->exact;
+    if (slot)
+    {
+        delete r;
+        return false;
+    }
+    slot = r;
+    m_routes.push_back(r);
+    return true;
+}
+
+const router::route *router::lookup(const char *path, size_t len, route_match &match) const
+{
+    match.count = 0;
+    return this->match(m_root, path, path + len, match);
+}
+
+// 从节点n、url的位置p开始匹配，静态边 > 参数 > 前缀，失败时回溯
+const router::route *router::match(const node *n, const char *p, const char *end, route_match &m) const
+{
+    if (p == end && n->exact)
+    {
+        return n->exact;
+    }
+    if (p < end)
+    {
+        // 子节点按首字节排序，二分查找
+        const std::vector<node *> &children = n->children;
+        size_t lo = 0, hi = children.size();
+        while (lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+            if ((unsigned char)children[mid]->label[0] < (unsigned char)*p)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        if (lo < children.size() && children[lo]->label[0] == *p)
+        {
+            const node *c = children[lo];
+            size_t len = c->label.size();
+            if ((size_t)(end - p) >= len && memcmp(p, c->label.data(), len) == 0)
+            {
+                const route *r = match(c, p + len, end, m);
+                if (r)
+                {
+                    return r;
+                }
+            }
+        }
+        if (n->param && m.count < route_match::MAX_PARAMS)
+        {
+            const char *seg = (const char *)memchr(p, '/', end - p);
+            if (!seg)
+            {
+                seg = end;
+            }
+            if (seg > p)
+            {
+                int idx = m.count++;
+                m.names[idx] = n->param->param_name.c_str();
+                m.values[idx].data = p;
+                m.values[idx].len = seg - p;
+                const route *r = match(n->param, seg, end, m);
+                if (r)
+                {
+                    return r;
+                }
+                m.count = idx;
+            }
+        }
+    }
+    if (n->prefix && m.count < route_match::MAX_PARAMS)
+    {
+        int idx = m.count++;
+        m.names[idx] = "*";
+        m.values[idx].data = p;
+        m.values[idx].len = end - p;
+        return n->prefix;
+    }
+    return NULL;
+}
@@ -0,0 +1,128 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+/*
+进程内动态接口的路由表。
+
+启动时注册处理函数，路由表是压缩的基数树（边上是字符串而不是单个字符），支持三种匹配：
+    /status             精确匹配
+    /api/users/:id      参数匹配，:id匹配一段不含/的非空字符串
+    /static/ *          前缀匹配（模式以*结尾，*前面没有空格），匹配剩下的全部（可以为空）
+同一位置上静态边优先于参数，参数优先于前缀。
+启动完成后路由表只读，多个线程可以同时查找；查找不分配内存，参数以指向url的视图返回。
+*/
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+#include <vector>
+
+// 指向请求报文（读缓冲区）中的一段字符串，不以\0结尾
+struct str_view{
+    const char * data;
+    size_t len;
+
+    bool empty() const { return len == 0; }
+    bool equals(const char * s) const { return strlen(s) == len && memcmp(s, data, len) == 0; }
+};
+
+struct header_view{
+    str_view name;
+    str_view value;
+};
+
+// 一次匹配的结果，放在调用者的栈上
+struct route_match{
+    static const int MAX_PARAMS = 8;
+    int count;
+    const char * names[MAX_PARAMS];  // 参数名，指向路由表
+    str_view values[MAX_PARAMS];     // 参数值，指向url
+};
+
+// 交给处理函数的请求，所有内容都是视图，在处理函数返回后失效
+struct route_request{
+    int method;                     // http_conn::METHOD
+    str_view path;                  // 不含查询字符串
+    str_view query;                 // ?之后的部分
+    const header_view * headers;    // 全部请求头部
+    int header_count;
+    const route_match * match;
+
+    str_view header(const char * name) const; // 大小写不敏感，没有时返回空视图
+    str_view param(const char * name) const;  // :name或者*，没有时返回空视图
+};
+
+// 处理函数写入的响应，内容放在连接的固定大小的缓冲区中
+class route_response{
+public:
+    route_response(char * buf, size_t cap)
+        : status(200), content_type("application/json"), m_buf(buf), m_cap(cap), m_len(0), m_overflow(false){}
+
+    int status;
+    const char * content_type;
+
+    bool append(const char * data, size_t len);
+    bool append(const char * s) { return append(s, strlen(s)); }
+    bool appendf(const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+    const char * data() const { return m_buf; }
+    size_t size() const { return m_len; }
+    bool overflow() const { return m_overflow; } // 内容超过缓冲区，调用者返回500
+
+private:
+    char * m_buf;
+    size_t m_cap;
+    size_t m_len;
+    bool m_overflow;
+};
+
+// 返回false表示处理出错，调用者返回500
+typedef bool (*route_handler)(const route_request & req, route_response & resp, void * arg);
+
+class router{
+public:
+    // 允许的请求方法，按http_conn::METHOD的位
+    static const unsigned METHOD_GET = 1u << 0;
+    static const unsigned METHOD_POST = 1u << 1;
+    static const unsigned METHOD_HEAD = 1u << 2;
+    static const unsigned METHOD_PUT = 1u << 3;
+    static const unsigned METHOD_DELETE = 1u << 4;
+
+    struct route{
+        route_handler handler;
+        void * arg;
+        unsigned methods;
+        std::string pattern;
+    };
+
+    router();
+    ~router();
+
+    // 启动时注册，pattern语法错误或者和已有的路由冲突时返回false
+    bool add(const char * pattern, unsigned methods, route_handler handler, void * arg = NULL);
+
+    // 查找path（不含查询字符串）对应的路由，没有时返回NULL，不分配内存
+    const route * lookup(const char * path, size_t len, route_match & match) const;
+
+    size_t size() const { return m_routes.size(); }
+
+private:
+    struct node{
+        std::string label;              // 从父节点到这里的静态字符串
+        std::vector<node *> children;   // 静态子节点，按label首字节排序，首字节互不相同
+        node * param;                   // :name 子节点
+        std::string param_name;
+        const route * exact;            // 在这里结束的路由
+        const route * prefix;           // 在这里以*结束的路由
+
+        node() : param(NULL), exact(NULL), prefix(NULL){}
+    };
+
+    node * insert_static(node * n, const char * s, size_t len);
+    const route * match(const node * n, const char * p, const char * end, route_match & m) const;
+    static void destroy(node * n);
+
+    node * m_root;
+    std::vector<route *> m_routes;
+};
+
+#endif
@@ -0,0 +1,130 @@
+#include "server_stats.h"
+
+server_stats g_stats;
+
+// 统计项的名字和对应的成员
+const stat_counter stat_counters[] = {
+    {"accepted_conns", &server_stats::accepted_conns},
+    {"rejected_conns", &server_stats::rejected_conns},
+    {"inline_requests", &server_stats::inline_requests},
+    {"offloaded_requests", &server_stats::offloaded_requests},
+    {"cache_hits", &server_stats::cache_hits},
+    {"cache_misses", &server_stats::cache_misses},
+    {"cache_coalesced", &server_stats::cache_coalesced},
+    {"file_responses", &server_stats::file_responses},
+    {"not_modified", &server_stats::not_modified},
+    {"gzip_responses", &server_stats::gzip_responses},
+    {"gzip_compressed", &server_stats::gzip_compressed},
+    {"queue_rejected", &server_stats::queue_rejected},
+    {"queue_shed", &server_stats::queue_shed},
+    {"queue_dequeued", &server_stats::queue_dequeued},
+    {"queue_sojourn_us", &server_stats::queue_sojourn_us},
+    {"queue_sojourn_max_us", &server_stats::queue_sojourn_max_us},
+    {"uploads", &server_stats::uploads},
+    {"upload_bytes", &server_stats::upload_bytes},
+    {"upload_spliced", &server_stats::upload_spliced},
+    {"rate_limited", &server_stats::rate_limited},
+    {"paced_waits", &server_stats::paced_waits},
+    {"proxy_timeouts", &server_stats::proxy_timeouts},
+    {"bundle_hits", &server_stats::bundle_hits},
+    {"zerocopy_sends", &server_stats::zerocopy_sends},
+    {"zerocopy_completions", &server_stats::zerocopy_completions},
+    {"zerocopy_copied", &server_stats::zerocopy_copied},
+    {"zerocopy_bytes", &server_stats::zerocopy_bytes},
+    {"zerocopy_latency_us", &server_stats::zerocopy_latency_us},
+    {"zerocopy_latency_max_us", &server_stats::zerocopy_latency_max_us},
+    {"tls_handshakes", &server_stats::tls_handshakes},
+    {"tls_resumed", &server_stats::tls_resumed},
+    {"tls_ktls", &server_stats::tls_ktls},
+    {"tls_failures", &server_stats::tls_failures},
+    {"h2_connections", &server_stats::h2_connections},
+    {"h2_upgrades", &server_stats::h2_upgrades},
+    {"h2_streams", &server_stats::h2_streams},
+    {"h2_refused", &server_stats::h2_refused},
+    {"h2_resets", &server_stats::h2_resets},
+    {"h2_header_bytes", &server_stats::h2_header_bytes},
+    {"h2_header_plain", &server_stats::h2_header_plain},
+    {"ws_upgrades", &server_stats::ws_upgrades},
+    {"ws_messages", &server_stats::ws_messages},
+    {"ws_published", &server_stats::ws_published},
+    {"ws_deliveries", &server_stats::ws_deliveries},
+    {"ws_writev", &server_stats::ws_writev},
+    {"ws_dropped", &server_stats::ws_dropped},
+};
+const int stat_counter_count = sizeof(stat_counters) / sizeof(stat_counters[0]);
+
+// 记录一个请求的排队时间
+void server_stats::record_sojourn(unsigned long us)
+{
+    queue_dequeued++;
+    queue_sojourn_us += us;
+    unsigned long max = queue_sojourn_max_us.load();
+    while (us > max && !queue_sojourn_max_us.compare_exchange_weak(max, us))
+    {
+    }
+}
+
+// 打印统计信息
+void server_stats::dump(FILE * out)
+{
+    time_t now = time(NULL);
+    unsigned long accepted = accepted_conns.load();
+    fprintf(out, "accepted_conns %lu\n", accepted);
+    if (m_last_dump != 0 && now > m_last_dump)
+    {
+        // 距离上次打印的平均接受速率
+        fprintf(out, "accept_rate_per_sec %lu\n", (accepted - m_last_accepted) / (now - m_last_dump));
+    }
+    m_last_dump = now;
+    m_last_accepted = accepted;
+    fprintf(out, "rejected_conns %lu\n", rejected_conns.load());
+    fprintf(out, "inline_requests %lu\n", inline_requests.load());
+    fprintf(out, "offloaded_requests %lu\n", offloaded_requests.load());
+    fprintf(out, "cache_hits %lu\n", cache_hits.load());
+    fprintf(out, "cache_misses %lu\n", cache_misses.load());
+    fprintf(out, "cache_coalesced %lu\n", cache_coalesced.load());
+    unsigned long files = file_responses.load();
+    fprintf(out, "file_responses %lu\n", files);
+    fprintf(out, "not_modified %lu\n", not_modified.load());
+    fprintf(out, "not_modified_ratio %.3f\n", files ? (double)not_modified.load() / files : 0.0);
+    fprintf(out, "gzip_responses %lu\n", gzip_responses.load());
+    fprintf(out, "gzip_compressed %lu\n", gzip_compressed.load());
+    fprintf(out, "queue_rejected %lu\n", queue_rejected.load());
+    fprintf(out, "queue_shed %lu\n", queue_shed.load());
+    unsigned long dequeued = queue_dequeued.load();
+    fprintf(out, "queue_sojourn_avg_us %lu\n", dequeued ? queue_sojourn_us.load() / dequeued : 0);
+    fprintf(out, "queue_sojourn_max_us %lu\n", queue_sojourn_max_us.load());
+    fprintf(out, "uploads %lu\n", uploads.load());
+    fprintf(out, "upload_bytes %lu\n", upload_bytes.load());
+    fprintf(out, "upload_spliced %lu\n", upload_spliced.load());
+    fprintf(out, "rate_limited %lu\n", rate_limited.load());
+    fprintf(out, "paced_waits %lu\n", paced_waits.load());
+    fprintf(out, "proxy_timeouts %lu\n", proxy_timeouts.load());
+    fprintf(out, "bundle_hits %lu\n", bundle_hits.load());
+    unsigned long zc_done = zerocopy_completions.load();
+    fprintf(out, "zerocopy_sends %lu\n", zerocopy_sends.load());
+    fprintf(out, "zerocopy_copied %lu\n", zerocopy_copied.load());
+    fprintf(out, "zerocopy_bytes %lu\n", zerocopy_bytes.load());
+    fprintf(out, "zerocopy_latency_avg_us %lu\n", zc_done ? zerocopy_latency_us.load() / zc_done : 0);
+    fprintf(out, "zerocopy_latency_max_us %lu\n", zerocopy_latency_max_us.load());
+    fprintf(out, "tls_handshakes %lu\n", tls_handshakes.load());
+    fprintf(out, "tls_resumed %lu\n", tls_resumed.load());
+    fprintf(out, "tls_ktls %lu\n", tls_ktls.load());
+    fprintf(out, "tls_failures %lu\n", tls_failures.load());
+    fprintf(out, "h2_connections %lu\n", h2_connections.load());
+    fprintf(out, "h2_upgrades %lu\n", h2_upgrades.load());
+    fprintf(out, "h2_streams %lu\n", h2_streams.load());
+    fprintf(out, "h2_refused %lu\n", h2_refused.load());
+    fprintf(out, "h2_resets %lu\n", h2_resets.load());
+    unsigned long h2_plain = h2_header_plain.load();
+    fprintf(out, "h2_header_bytes %lu\n", h2_header_bytes.load());
+    fprintf(out, "h2_header_ratio %.3f\n", h2_plain ? (double)h2_header_bytes.load() / h2_plain : 0.0);
+    fprintf(out, "ws_upgrades %lu\n", ws_upgrades.load());
+    fprintf(out, "ws_messages %lu\n", ws_messages.load());
+    fprintf(out, "ws_published %lu\n", ws_published.load());
+    unsigned long ws_frames = ws_deliveries.load();
+    fprintf(out, "ws_deliveries %lu\n", ws_frames);
+    fprintf(out, "ws_frames_per_writev %.2f\n", ws_writev.load() ? (double)ws_frames / ws_writev.load() : 0.0);
+    fprintf(out, "ws_dropped %lu\n", ws_dropped.load());
+    fflush(out);
+}
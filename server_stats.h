@@ -0,0 +1,76 @@
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+// 服务器运行统计，各个线程原子地累加，收到SIGUSR1时由主线程打印
+
+#include <atomic>
+#include <stdio.h>
+#include <time.h>
+
+struct server_stats{
+    std::atomic<unsigned long> accepted_conns;      // 接受的连接数
+    std::atomic<unsigned long> rejected_conns;      // 超过最大连接数或者fd用尽被拒绝的连接数
+    std::atomic<unsigned long> inline_requests;     // 在主线程直接处理的请求数
+    std::atomic<unsigned long> offloaded_requests;  // 交给线程池处理的请求数
+    std::atomic<unsigned long> cache_hits;          // 内存文件缓存命中次数
+    std::atomic<unsigned long> cache_misses;        // 内存文件缓存未命中次数
+    std::atomic<unsigned long> cache_coalesced;     // 未命中时等待其他线程读入同一个文件的次数
+    std::atomic<unsigned long> file_responses;      // 文件请求的响应数（200/206/304）
+    std::atomic<unsigned long> not_modified;        // 其中以304响应的个数
+    std::atomic<unsigned long> gzip_responses;      // 以gzip编码发送的响应数
+    std::atomic<unsigned long> gzip_compressed;     // 后台压缩完成的文件数
+    std::atomic<unsigned long> queue_rejected;      // 请求队列满被拒绝的请求数
+    std::atomic<unsigned long> queue_shed;          // 排队超时被CoDel丢弃的请求数
+    std::atomic<unsigned long> queue_dequeued;      // 从请求队列取出的请求数
+    std::atomic<unsigned long> queue_sojourn_us;    // 累计排队时间（微秒）
+    std::atomic<unsigned long> queue_sojourn_max_us; // 最大排队时间（微秒）
+    std::atomic<unsigned long> uploads;             // 保存成功的上传数
+    std::atomic<unsigned long> upload_bytes;        // 收到的请求体字节数
+    std::atomic<unsigned long> upload_spliced;      // 其中splice直接写入文件的字节数
+    std::atomic<unsigned long> rate_limited;        // 超过请求速率回复429的次数
+    std::atomic<unsigned long> paced_waits;         // 超过发送带宽等待定时器的次数
+    std::atomic<unsigned long> proxy_timeouts;      // 上游长时间没有进展被放弃的代理请求数
+    std::atomic<unsigned long> bundle_hits;         // 直接从打包文件响应的请求数
+    std::atomic<unsigned long> zerocopy_sends;      // MSG_ZEROCOPY发送的次数
+    std::atomic<unsigned long> zerocopy_completions; // 收到的完成通知（按发送计）
+    std::atomic<unsigned long> zerocopy_copied;     // 其中内核仍然复制了的发送，这些连接改回普通发送
+    std::atomic<unsigned long> zerocopy_bytes;      // 真正没有复制的字节数
+    std::atomic<unsigned long> zerocopy_latency_us; // 累计从发送到完成通知的时间（微秒）
+    std::atomic<unsigned long> zerocopy_latency_max_us; // 最长的完成时间（微秒）
+    std::atomic<unsigned long> tls_handshakes;      // 完成的TLS握手数
+    std::atomic<unsigned long> tls_resumed;         // 其中恢复会话的（会话ID或者票据），没有证书签名
+    std::atomic<unsigned long> tls_ktls;            // 其中发送交给内核加密的（kTLS）
+    std::atomic<unsigned long> tls_failures;        // 握手失败的连接数
+    std::atomic<unsigned long> h2_connections;      // HTTP/2连接数（先验知识和升级）
+    std::atomic<unsigned long> h2_upgrades;         // 其中从HTTP/1.1升级（Upgrade: h2c）的
+    std::atomic<unsigned long> h2_streams;          // 处理的流（请求）数
+    std::atomic<unsigned long> h2_refused;          // 超过同时处理的流数被拒绝的流
+    std::atomic<unsigned long> h2_resets;           // 对方取消的和要求改用HTTP/1.1的流
+    std::atomic<unsigned long> h2_header_bytes;     // 响应头部块HPACK编码后的字节数
+    std::atomic<unsigned long> h2_header_plain;     // 同样的头部用HTTP/1.1的文本表示的字节数
+    std::atomic<unsigned long> ws_upgrades;         // 升级成WebSocket的连接数
+    std::atomic<unsigned long> ws_messages;         // 客户端发来的消息数
+    std::atomic<unsigned long> ws_published;        // 广播的消息数（客户端的消息和publish调用）
+    std::atomic<unsigned long> ws_deliveries;       // 追加到订阅者发送队列的帧数
+    std::atomic<unsigned long> ws_writev;           // WebSocket连接上的writev次数，一次发送多帧时小于帧数
+    std::atomic<unsigned long> ws_dropped;          // 发送队列溢出被关闭的订阅者
+
+    void record_sojourn(unsigned long us);
+    void dump(FILE * out);
+
+private:
+    time_t m_last_dump;             // 上次打印的时间，用于计算接受连接的速率
+    unsigned long m_last_accepted;
+};
+
+extern server_stats g_stats;
+
+// 统计项的名字和对应的成员，/status、/status/:name和多进程模式的共享统计共用
+struct stat_counter{
+    const char * name;
+    std::atomic<unsigned long> server_stats::*field;
+};
+extern const stat_counter stat_counters[];
+extern const int stat_counter_count;
+
+#endif
@@ -0,0 +1,414 @@
+#include "shm_cache.h"
+#include <exception>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+shm_cache *g_shm_cache = NULL;
+
+static size_t round_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+shm_cache::shm_cache(size_t total, size_t max_file)
+{
+    // 槽的大小从max_file/32到max_file，内容区平均分给各个级别
+    static const int shifts[CLASSES] = {5, 3, 1, 0};
+    size_t sizes[CLASSES];
+    uint32_t counts[CLASSES];
+    uint32_t nslots = 0;
+    for (int i = 0; i < CLASSES; i++)
+    {
+        sizes[i] = round_up(max_file >> shifts[i], 4096);
+        counts[i] = total / CLASSES / sizes[i];
+        if (counts[i] == 0)
+        {
+            counts[i] = 1;
+        }
+        nslots += counts[i];
+    }
+    uint32_t nbuckets = 1;
+    while (nbuckets < nslots * 2)
+    {
+        nbuckets <<= 1;
+    }
+
+    size_t meta_off = round_up(sizeof(header), 64);
+    size_t bucket_off = meta_off + sizeof(slot_meta) * nslots;
+    size_t data_off = round_up(bucket_off + sizeof(std::atomic<uint32_t>) * nbuckets, 4096);
+    size_t data_size = 0;
+    for (int i = 0; i < CLASSES; i++)
+    {
+        data_size += sizes[i] * counts[i];
+    }
+    m_map_size = data_off + data_size;
+    // 匿名共享映射的内容初始全为0：所有槽为空，所有桶为空
+    void *p = mmap(NULL, m_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        throw std::exception();
+    }
+    char *base = (char *)p;
+    m_header = (header *)base;
+    m_slots = (slot_meta *)(base + meta_off);
+    m_buckets = (std::atomic<uint32_t> *)(base + bucket_off);
+    m_data = base + data_off;
+
+    uint32_t first = 0;
+    for (int i = 0; i < CLASSES; i++)
+    {
+        m_header->classes[i].slot_size = sizes[i];
+        m_header->classes[i].first = first;
+        m_header->classes[i].count = counts[i];
+        first += counts[i];
+    }
+    m_header->nslots = nslots;
+    m_header->nbuckets = nbuckets;
+}
+
+shm_cache::~shm_cache()
+{
+    munmap(m_header, m_map_size);
+}
+
+// FNV-1a
+uint64_t shm_cache::hash_path(const char *path)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (; *path; path++)
+    {
+        h ^= (unsigned char)*path;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+bool shm_cache::same_version(const slot_meta &m, const struct stat &st)
+{
+    return m.ino == (uint64_t)st.st_ino && m.size == (int64_t)st.st_size && m.mtime == (int64_t)st.st_mtime;
+}
+
+char *shm_cache::slot_data(uint32_t slot) const
+{
+    // 各级别的内容区依次排列
+    char *p = m_data;
+    for (int i = 0; i < CLASSES; i++)
+    {
+        const size_class &c = m_header->classes[i];
+        if (slot < c.first + c.count)
+        {
+            return p + (slot - c.first) * c.slot_size;
+        }
+        p += c.slot_size * c.count;
+    }
+    return NULL;
+}
+
+// 成为槽的唯一写者。先占住seq再检查refs，和读者的顺序相反，两者不会同时成功
+bool shm_cache::claim(uint32_t slot, uint32_t &seq)
+{
+    slot_meta &m = m_slots[slot];
+    uint32_t s = m.seq.load();
+    if ((s & 1) || !m.seq.compare_exchange_strong(s, s + 1))
+    {
+        return false;
+    }
+    if (m.refs.load() != 0)
+    {
+        m.seq.store(s); // 有读者，内容没有改过，恢复原来的序号
+        return false;
+    }
+    seq = s + 1;
+    return true;
+}
+
+void shm_cache::unlink(uint32_t slot)
+{
+    slot_meta &m = m_slots[slot];
+    uint32_t b = m.bucket.load();
+    if (b != 0)
+    {
+        uint32_t expected = slot + 1;
+        m_buckets[b - 1].compare_exchange_strong(expected, 0);
+        m.bucket.store(0);
+    }
+}
+
+int shm_cache::get(const char *path, const struct stat &st, const char *&data, size_t &size)
+{
+    uint64_t h = hash_path(path);
+    uint32_t mask = m_header->nbuckets - 1;
+    for (int i = 0; i < PROBES; i++)
+    {
+        uint32_t v = m_buckets[(h + i) & mask].load();
+        if (v == 0)
+        {
+            continue;
+        }
+        uint32_t slot = v - 1;
+        slot_meta &m = m_slots[slot];
+        uint32_t s = m.seq.load();
+        if ((s & 1) || !m.valid || m.hash != h || strncmp(m.path, path, PATH_MAX_LEN) != 0)
+        {
+            continue;
+        }
+        // 先引用再确认序号没有变化，之后写者不能再改写这个槽
+        m.refs.fetch_add(1);
+        if (m.seq.load() != s)
+        {
+            m.refs.fetch_sub(1);
+            continue;
+        }
+        if (!same_version(m, st))
+        {
+            // 文件已经变化，旧版本从索引中删除，没有读者之后槽会被重新使用
+            m.refs.fetch_sub(1);
+            uint32_t ws;
+            if (claim(slot, ws))
+            {
+                unlink(slot);
+                m.valid = false;
+                m.seq.store(ws + 1);
+                m_header->invalidations++;
+            }
+            continue;
+        }
+        m.last_used.store((uint32_t)time(NULL), std::memory_order_relaxed);
+        data = slot_data(slot);
+        size = m.size;
+        m_header->hits++;
+        return slot;
+    }
+    m_header->misses++;
+    return -1;
+}
+
+// 在级别cls中选一个槽：优先空槽，否则是扫描范围内最久没有用的没有读者的槽
+int shm_cache::find_victim(int cls, uint32_t &seq)
+{
+    size_class &c = m_header->classes[cls];
+    uint32_t start = c.hand.fetch_add(EVICT_SCAN, std::memory_order_relaxed);
+    uint32_t n = c.count < (uint32_t)EVICT_SCAN ? c.count : EVICT_SCAN;
+    int best = -1;
+    uint32_t best_used = 0;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t slot = c.first + (start + i) % c.count;
+        slot_meta &m = m_slots[slot];
+        if (m.refs.load() != 0 || (m.seq.load() & 1))
+        {
+            continue;
+        }
+        if (!m.valid)
+        {
+            if (claim(slot, seq))
+            {
+                return slot;
+            }
+            continue;
+        }
+        uint32_t used = m.last_used.load(std::memory_order_relaxed);
+        if (best < 0 || used < best_used)
+        {
+            best = slot;
+            best_used = used;
+        }
+    }
+    if (best >= 0 && claim(best, seq))
+    {
+        return best;
+    }
+    return -1;
+}
+
+int shm_cache::put(const char *path, const struct stat &st, const char *&data, size_t &size)
+{
+    size_t len = strlen(path);
+    if (len >= PATH_MAX_LEN)
+    {
+        return -1;
+    }
+    int cls = 0;
+    while (cls < CLASSES && m_header->classes[cls].slot_size < (size_t)st.st_size)
+    {
+        cls++;
+    }
+    if (cls == CLASSES)
+    {
+        return -1;
+    }
+    // 这个级别的槽都在被使用时借用更大的级别
+    uint32_t seq;
+    int slot = -1;
+    for (; cls < CLASSES && slot < 0; cls++)
+    {
+        slot = find_victim(cls, seq);
+    }
+    if (slot < 0)
+    {
+        return -1; // 扫描到的槽都在被使用
+    }
+    slot_meta &m = m_slots[slot];
+    if (m.valid)
+    {
+        unlink(slot);
+        m.valid = false;
+        m_header->evictions++;
+    }
+
+    // 持有奇数seq，直接把文件读进槽里
+    char *p = slot_data(slot);
+    size_t want = st.st_size;
+    size_t got = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        while (got < want)
+        {
+            ssize_t n = read(fd, p + got, want - got);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                break;
+            }
+            got += n;
+        }
+        close(fd);
+    }
+    if (fd < 0 || got != want)
+    {
+        m.seq.store(seq + 1); // 读失败，槽保持为空
+        return -1;
+    }
+    uint64_t h = hash_path(path);
+    m.hash = h;
+    m.ino = st.st_ino;
+    m.size = st.st_size;
+    m.mtime = st.st_mtime;
+    memcpy(m.path, path, len + 1);
+    m.valid = true;
+    m.last_used.store((uint32_t)time(NULL), std::memory_order_relaxed);
+    uint32_t mask = m_header->nbuckets - 1;
+    for (int i = 0; i < PROBES; i++)
+    {
+        uint32_t b = (h + i) & mask;
+        uint32_t expected = 0;
+        if (m_buckets[b].compare_exchange_strong(expected, slot + 1))
+        {
+            m.bucket.store(b + 1);
+            break;
+        }
+    }
+    // 没有空桶时内容只给自己用，没有读者之后会被淘汰
+    m.refs.fetch_add(1);
+    m.seq.store(seq + 1);
+    m_header->stores++;
+    data = p;
+    size = want;
+    return slot;
+}
+
+void shm_cache::release(int slot)
+{
+    m_slots[slot].refs.fetch_sub(1);
+}
+
+std::vector<std::string> shm_cache::hot_paths(size_t n) const
+{
+    std::vector<std::pair<uint32_t, std::string> > all;
+    for (uint32_t i = 0; i < m_header->nslots; i++)
+    {
+        const slot_meta &m = m_slots[i];
+        uint32_t s = m.seq.load();
+        if ((s & 1) || !m.valid)
+        {
+            continue;
+        }
+        std::string path(m.path, strnlen(m.path, PATH_MAX_LEN));
+        uint32_t used = m.last_used.load(std::memory_order_relaxed);
+        if (m.seq.load() == s)
+        {
+            all.push_back(std::make_pair(used, path)); // 复制期间没有被改写
+        }
+    }
+    std::sort(all.begin(), all.end(), [](const std::pair<uint32_t, std::string> &a, const std::pair<uint32_t, std::string> &b) {
+        return a.first > b.first;
+    });
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < all.size() && i < n; i++)
+    {
+        paths.push_back(all[i].second);
+    }
+    return paths;
+}
+
+shm_cache::occupancy shm_cache::usage(int cls) const
+{
+    const size_class &c = m_header->classes[cls];
+    occupancy o;
+    o.slot_size = c.slot_size;
+    o.slots = c.count;
+    o.used = 0;
+    o.pinned = 0;
+    o.bytes = 0;
+    for (uint32_t i = c.first; i < c.first + c.count; i++)
+    {
+        const slot_meta &m = m_slots[i];
+        if (m.valid)
+        {
+            o.used++;
+            o.bytes += m.size;
+        }
+        if (m.refs.load(std::memory_order_relaxed) > 0)
+        {
+            o.pinned++;
+        }
+    }
+    return o;
+}
+
+unsigned long shm_cache::hits() const
+{
+    return m_header->hits.load();
+}
+
+unsigned long shm_cache::misses() const
+{
+    return m_header->misses.load();
+}
+
+unsigned long shm_cache::stores() const
+{
+    return m_header->stores.load();
+}
+
+unsigned long shm_cache::invalidations() const
+{
+    return m_header->invalidations.load();
+}
+
+unsigned long shm_cache::evictions() const
+{
+    return m_header->evictions.load();
+}
+
+void shm_cache::dump(FILE *out) const
+{
+    fprintf(out, "shm_cache hits %lu misses %lu stores %lu invalidations %lu evictions %lu\n", hits(), misses(),
+            stores(), invalidations(), evictions());
+    for (int i = 0; i < CLASSES; i++)
+    {
+        occupancy o = usage(i);
+        fprintf(out, "shm_cache class %zu slots %u used %u pinned %u bytes %zu\n", o.slot_size, o.slots, o.used,
+                o.pinned, o.bytes);
+    }
+    fflush(out);
+}
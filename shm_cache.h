@@ -0,0 +1,117 @@
+#ifndef SHM_CACHE_H
+#define SHM_CACHE_H
+/*
+跨进程共享的文件内容缓存（-S 大小MB）。
+
+在fork worker之前用MAP_SHARED|MAP_ANONYMOUS映射，所有worker（包括之后重启的worker）看到同一份内容：
+同一台机器上的热点文件只占一份内存，新启动的worker不需要从磁盘重新读。
+每个进程的file_cache读文件时先在这里查找，命中时缓存项直接指向共享内存，不复制；
+未命中时把文件直接读进共享内存的槽中，之后其他进程就能命中。
+
+内存分成几个大小级别的定长槽，每个槽有一个元数据头：
+  seq   序号，偶数表示内容稳定，奇数表示有一个写者正在修改。写者用CAS把偶数改成奇数来独占这个槽，
+        同一时刻每个槽最多一个写者，写完之后加一变回偶数
+  refs  正在使用这个槽的缓存项个数，大于0时不能被淘汰或者改写
+索引是开放寻址的哈希表，每个桶是一个原子的槽号，查找不加锁：读取桶中的槽，比较路径和文件版本，
+增加refs之后再检查seq没有变化（变化了说明期间被改写，放弃）。写者先把seq改成奇数再检查refs，
+读者先增加refs再检查seq，两边都用顺序一致的原子操作，不会出现读者使用一个正在被改写的槽。
+
+文件变化（inode、大小或修改时间不同）时，查找到的旧版本被从索引中删除（失效），
+没有读者之后它的槽会被重新使用。
+*/
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+class shm_cache{
+public:
+    static const int CLASSES = 4;       // 槽的大小级别个数
+    static const int PATH_MAX_LEN = 256;
+    static const int PROBES = 16;       // 查找和插入最多检查的桶数
+    static const int EVICT_SCAN = 32;   // 淘汰时最多检查的槽数
+
+    // 各个级别的占用情况
+    struct occupancy{
+        size_t slot_size;
+        unsigned slots;
+        unsigned used;      // 有内容（包括已经失效还被引用的）的槽数
+        unsigned pinned;    // refs大于0的槽数
+        size_t bytes;       // 有效内容的字节数
+    };
+
+    // total：共享内存中内容区的总大小，max_file：能放入的最大文件
+    shm_cache(size_t total, size_t max_file);
+    ~shm_cache();
+
+    // 查找path的这个版本，命中时增加引用并返回槽号，data和size指向共享内存中的内容；未命中返回-1
+    int get(const char * path, const struct stat & st, const char *& data, size_t & size);
+    // 把文件读入一个空闲的槽并加入索引，成功时和get一样返回带引用的槽号；没有可用的槽或者读失败返回-1
+    int put(const char * path, const struct stat & st, const char *& data, size_t & size);
+    // 缓存项不再使用这个槽
+    void release(int slot);
+    // 最近使用的最多n个文件的路径
+    std::vector<std::string> hot_paths(size_t n) const;
+
+    int classes() const { return CLASSES; }
+    occupancy usage(int cls) const;
+    unsigned long hits() const;
+    unsigned long misses() const;
+    unsigned long stores() const;
+    unsigned long invalidations() const;
+    unsigned long evictions() const;
+    void dump(FILE * out) const;
+
+private:
+    struct slot_meta{
+        std::atomic<uint32_t> seq;
+        std::atomic<int32_t> refs;
+        std::atomic<uint32_t> bucket;       // 在索引中的桶号+1，0表示不在索引中
+        std::atomic<uint32_t> last_used;    // 最近一次命中的时间（秒），淘汰时选最久没有用的
+        // 以下字段只有持有奇数seq的写者修改
+        bool valid;
+        uint64_t hash;
+        uint64_t ino;
+        int64_t size;
+        int64_t mtime;
+        char path[PATH_MAX_LEN];
+    } __attribute__((aligned(64)));
+
+    struct size_class{
+        size_t slot_size;
+        uint32_t first;                     // 第一个槽的编号
+        uint32_t count;
+        std::atomic<uint32_t> hand;         // 淘汰时的扫描起点
+    };
+
+    struct header{
+        size_class classes[CLASSES];
+        uint32_t nslots;
+        uint32_t nbuckets;                  // 2的幂
+        std::atomic<unsigned long> hits;
+        std::atomic<unsigned long> misses;
+        std::atomic<unsigned long> stores;
+        std::atomic<unsigned long> invalidations;
+        std::atomic<unsigned long> evictions;
+    };
+
+    static uint64_t hash_path(const char * path);
+    static bool same_version(const slot_meta & m, const struct stat & st);
+    char * slot_data(uint32_t slot) const;
+    bool claim(uint32_t slot, uint32_t & seq);      // 成为写者：seq从偶数改成奇数，并且没有读者
+    void unlink(uint32_t slot);                     // 写者：从索引中删除
+    int find_victim(int cls, uint32_t & seq);       // 在级别cls中找一个可以改写的槽并成为它的写者
+
+    header * m_header;
+    slot_meta * m_slots;
+    std::atomic<uint32_t> * m_buckets;      // 槽号+1，0表示空
+    char * m_data;
+    size_t m_map_size;
+};
+
+extern shm_cache * g_shm_cache; // 没有配置-S时为空
+
+#endif
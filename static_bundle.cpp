@@ -0,0 +1,87 @@
+#include "static_bundle.h"
+#include "mime_table.h"
+#include <exception>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// 区的偏移和大小都在文件之内
+static bool in_file(uint64_t off, uint64_t len, uint64_t size)
+{
+    return off <= size && len <= size - off;
+}
+
+static_bundle::static_bundle(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw std::exception();
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(bundle_header))
+    {
+        close(fd);
+        throw std::exception();
+    }
+    m_size = st.st_size;
+    void *p = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        throw std::exception();
+    }
+    m_base = (const char *)p;
+    m_header = (const bundle_header *)m_base;
+    const bundle_header &h = *m_header;
+    uint64_t mime_count = sizeof(MIME_TYPES) / sizeof(MIME_TYPES[0]);
+    if (memcmp(h.magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) != 0 || h.version != BUNDLE_VERSION ||
+        h.mime_count != mime_count || h.mime_hash != MIME_TABLE_HASH || h.file_size != m_size || h.nbuckets == 0 || h.nslots == 0 ||
+        !in_file(h.disp_off, (uint64_t)h.nbuckets * sizeof(uint32_t), m_size) ||
+        !in_file(h.slots_off, (uint64_t)h.nslots * sizeof(uint32_t), m_size) ||
+        !in_file(h.entries_off, (uint64_t)h.count * sizeof(bundle_entry), m_size) ||
+        !in_file(h.strings_off, h.data_off - h.strings_off, m_size) || h.data_off < h.strings_off)
+    {
+        munmap(p, m_size);
+        throw std::exception();
+    }
+    m_disp = (const uint32_t *)(m_base + h.disp_off);
+    m_slots = (const uint32_t *)(m_base + h.slots_off);
+    m_entries = (const bundle_entry *)(m_base + h.entries_off);
+    m_strings = m_base + h.strings_off;
+    m_strings_size = h.data_off - h.strings_off;
+    // 索引很小，提前读入；内容按需缺页
+    madvise(p, h.strings_off, MADV_WILLNEED);
+}
+
+static_bundle::~static_bundle()
+{
+    munmap((void *)m_base, m_size);
+}
+
+// 文件项中的偏移在用到时才检查，启动时不用扫描所有文件项
+const bundle_entry *static_bundle::find(const char *path, size_t len) const
+{
+    uint64_t h = bundle_hash(path, len);
+    uint32_t seed = m_disp[bundle_bucket(h, m_header->nbuckets)];
+    uint32_t idx = m_slots[bundle_slot(h, seed, m_header->nslots)];
+    if (idx >= m_header->count)
+    {
+        return NULL;
+    }
+    const bundle_entry &e = m_entries[idx];
+    if (e.path_len != len || !in_file(e.path_off, len, m_strings_size) ||
+        memcmp(m_strings + e.path_off, path, len) != 0)
+    {
+        return NULL;
+    }
+    if (e.mime >= m_header->mime_count || !in_file(e.data_off, e.size, m_size) ||
+        !in_file(e.gz_off, e.gz_size, m_size) || !in_file(e.headers_off, e.headers_len, m_strings_size) ||
+        !in_file(e.gz_headers_off, e.gz_headers_len, m_strings_size))
+    {
+        return NULL; // 损坏的打包文件
+    }
+    return &e;
+}
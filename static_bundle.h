@@ -0,0 +1,116 @@
+#ifndef STATIC_BUNDLE_H
+#define STATIC_BUNDLE_H
+/*
+预先打包的静态文件（-b 打包文件）。
+
+离线用packer/bundle_pack把网站目录编译成一个文件，启动时整个映射进来（只读、MAP_SHARED，所有worker共用page cache），
+命中的请求不做任何文件系统的系统调用：不拼路径、不stat、不open、不mmap，响应体直接指向映射的内容。
+启动只检查文件头，不读索引和内容，几十万个文件也是毫秒级；没有打包的路径（上传的文件、目录列表等）照常走文件系统。
+
+文件格式（本机字节序，所有区都按页对齐）：
+  头部       魔数、版本、MIME表的大小和哈希（和编译时的mime_table.h不一致时拒绝加载）、各个区的偏移
+  位移表     nbuckets个uint32，完美哈希（CHD：hash and displace）的每个桶的种子
+  槽表       nslots个uint32，文件项的下标，空槽为EMPTY
+  文件项     每个文件一个bundle_entry
+  字符串区   路径和预先生成的校验头部："ETag: ...\r\n[Content-Encoding: gzip\r\n]Last-Modified: ...\r\n"
+  内容区     原始内容和可选的gzip版本；不小于一页的内容从页边界开始，小文件挤在一起但不跨页
+查找：路径的哈希h决定桶，用桶的种子再混合一次得到槽，槽中的文件项比较一次路径确认（不在包中的路径也会落到某个槽）。
+*/
+#include <stdint.h>
+#include <stddef.h>
+
+const char BUNDLE_MAGIC[8] = {'W', 'E', 'B', 'B', 'N', 'D', 'L', '1'};
+const uint32_t BUNDLE_VERSION = 2;
+const uint32_t BUNDLE_EMPTY = 0xffffffffu;
+const uint32_t BUNDLE_PAGE = 4096;
+
+struct bundle_header{
+    char magic[8];
+    uint32_t version;
+    uint32_t mime_count;    // 打包时MIME_TYPES的个数，文件项中的mime是它的下标
+    uint32_t count;         // 文件数
+    uint32_t nbuckets;
+    uint32_t nslots;
+    uint32_t mime_hash;     // 打包时的MIME_TABLE_HASH，表的顺序或者内容变了时下标对应的类型不同
+    uint64_t disp_off;
+    uint64_t slots_off;
+    uint64_t entries_off;
+    uint64_t strings_off;
+    uint64_t data_off;
+    uint64_t file_size;     // 整个打包文件的大小，截断的文件拒绝加载
+};
+
+struct bundle_entry{
+    uint32_t path_off;      // 字符串区中的路径（以/开头，相对网站根目录）
+    uint32_t path_len;
+    uint32_t mime;
+    uint32_t reserved;
+    uint64_t size;          // 原始内容
+    uint64_t data_off;      // 相对文件开头
+    uint64_t gz_size;       // gzip版本，0表示没有（不可压缩或者压缩后没有变小）
+    uint64_t gz_off;
+    int64_t mtime;          // 源文件的修改时间，Last-Modified
+    uint64_t id;            // 内容的哈希，ETag和multipart的分隔符用
+    uint32_t headers_off;   // 预先生成的校验头部，以"ETag: "开头
+    uint32_t headers_len;
+    uint32_t gz_headers_off;
+    uint32_t gz_headers_len;
+    uint32_t etag_len;      // 头部中ETag值的长度
+    uint32_t gz_etag_len;
+};
+
+// FNV-1a，打包和查找共用
+inline uint64_t bundle_hash(const char * s, size_t len){
+    uint64_t h = 1469598103934665603ULL;
+    for(size_t i = 0; i < len; i++){
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// 用桶的种子把路径的哈希混合成槽号（splitmix64的终结步骤）
+inline uint32_t bundle_slot(uint64_t h, uint32_t seed, uint32_t nslots){
+    uint64_t x = h + (seed + 1) * 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return (uint32_t)(x % nslots);
+}
+
+inline uint32_t bundle_bucket(uint64_t h, uint32_t nbuckets){
+    return (uint32_t)((h >> 32) % nbuckets);
+}
+
+class static_bundle{
+public:
+    // 映射打包文件并检查文件头，失败抛出异常
+    explicit static_bundle(const char * path);
+    ~static_bundle();
+
+    // 按url中的路径（不含查询串）查找，不在包中返回NULL；只读内存，不做系统调用
+    const bundle_entry * find(const char * path, size_t len) const;
+
+    const char * data(const bundle_entry & e, bool gz) const {
+        return m_base + (gz ? e.gz_off : e.data_off);
+    }
+    // 校验头部，ETag的值从第6个字符开始
+    const char * headers(const bundle_entry & e, bool gz, size_t & len) const {
+        len = gz ? e.gz_headers_len : e.headers_len;
+        return m_strings + (gz ? e.gz_headers_off : e.headers_off);
+    }
+    uint32_t count() const { return m_header->count; }
+    size_t size() const { return m_size; }
+
+private:
+    const char * m_base;
+    size_t m_size;
+    const bundle_header * m_header;
+    const uint32_t * m_disp;
+    const uint32_t * m_slots;
+    const bundle_entry * m_entries;
+    const char * m_strings;
+    size_t m_strings_size;
+};
+
+#endif
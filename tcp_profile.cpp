@@ -0,0 +1,110 @@
+#include "tcp_profile.h"
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// 一项的名字是否是name，value指向=之后（没有=时为NULL）
+static bool key_is(const char *item, size_t len, const char *name, const char *&value)
+{
+    size_t n = strlen(name);
+    if (len < n || strncmp(item, name, n) != 0)
+    {
+        return false;
+    }
+    if (len == n)
+    {
+        value = NULL;
+        return true;
+    }
+    if (item[n] != '=')
+    {
+        return false;
+    }
+    value = item + n + 1;
+    return true;
+}
+
+bool parse_tcp_profile(const char *spec)
+{
+    const char *p = spec;
+    while (*p)
+    {
+        size_t len = strcspn(p, ",");
+        const char *value;
+        if (key_is(p, len, "backlog", value) && value)
+        {
+            g_config.listen_backlog = atoi(value);
+        }
+        else if (key_is(p, len, "defer", value) && value)
+        {
+            g_config.defer_accept = atoi(value);
+        }
+        else if (key_is(p, len, "fastopen", value) && value)
+        {
+            g_config.fastopen = atoi(value);
+        }
+        else if (key_is(p, len, "nodelay", value) && !value)
+        {
+            g_config.nodelay = true;
+        }
+        else if (key_is(p, len, "cork", value) && !value)
+        {
+            g_config.cork = true;
+        }
+        else
+        {
+            return false;
+        }
+        p += len;
+        if (*p == ',')
+        {
+            p++;
+        }
+    }
+    return g_config.listen_backlog > 0 && g_config.defer_accept >= 0 && g_config.fastopen >= 0;
+}
+
+// 可选的优化，失败时（比如内核不支持）只打印出来，不影响启动
+static void set_option(int lfd, int opt, int value, const char *name)
+{
+    if (setsockopt(lfd, IPPROTO_TCP, opt, &value, sizeof(value)) < 0)
+    {
+        perror(name);
+    }
+}
+
+bool apply_listen_profile(int lfd)
+{
+    if (g_config.defer_accept > 0)
+    {
+        set_option(lfd, TCP_DEFER_ACCEPT, g_config.defer_accept, "TCP_DEFER_ACCEPT");
+    }
+    if (g_config.fastopen > 0)
+    {
+        set_option(lfd, TCP_FASTOPEN, g_config.fastopen, "TCP_FASTOPEN");
+    }
+    if (g_config.nodelay)
+    {
+        set_option(lfd, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (g_config.zerocopy_min > 0)
+    {
+        // SO_ZEROCOPY同样被accept得到的连接继承，之后才能用MSG_ZEROCOPY发送
+        int one = 1;
+        if (setsockopt(lfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+        {
+            perror("SO_ZEROCOPY");
+            g_config.zerocopy_min = 0;
+        }
+    }
+    if (listen(lfd, g_config.listen_backlog) < 0)
+    {
+        perror("listen");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,26 @@
+#ifndef TCP_PROFILE_H
+#define TCP_PROFILE_H
+/*
+监听socket的TCP参数（-T backlog=N,defer=秒,fastopen=N,nodelay,cork）。
+
+  backlog   全连接队列长度，默认128，实际不超过net.core.somaxconn
+  defer     TCP_DEFER_ACCEPT：三次握手完成后等到客户端发来数据（最多这么多秒）才放进全连接队列，
+            主线程accept到的连接马上就能读到请求，只连不发的连接不占用连接表和epoll。
+            等待数据的连接占用半连接队列（大小跟backlog有关），溢出后内核用SYN cookie直接建立连接，不再推迟，backlog要足够大
+  fastopen  TCP_FASTOPEN的队列长度：带有效cookie的重复客户端在SYN中带上请求，省掉一个往返。
+            需要net.ipv4.tcp_fastopen打开服务端（第2位）
+  nodelay   TCP_NODELAY：关闭Nagle，响应的最后一个小分段不用等前一个分段的ACK
+  cork      后面还有内容时（代理的响应头部之后的响应体、流式响应的下一批）发送带上MSG_MORE，
+            头部和小的响应体合并成一个分段；和nodelay一起使用，最后一次发送不带提示，立即发出。
+            上游的响应体迟迟不来时，已经发送的头部最多被内核推迟200ms
+TCP_NODELAY在监听socket上设置，Linux上accept得到的连接会继承，每个连接不需要再调用setsockopt。
+热升级接管的监听socket同样重新应用一遍（listen可以对已经在监听的socket修改队列长度）。
+*/
+
+// 解析-T的参数写入g_config，格式错误返回false
+bool parse_tcp_profile(const char * spec);
+// 对已经bind（或者从旧进程接管）的监听socket设置选项并listen，listen失败返回false
+// 配置了-Z时同时打开SO_ZEROCOPY（zerocopy.h）
+bool apply_listen_profile(int lfd);
+
+#endif
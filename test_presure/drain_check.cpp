@@ -0,0 +1,145 @@
+/*
+排空（SIGQUIT或者热升级）期间正在处理的文件响应必须以Connection: close结束，并在响应体之后干净地关闭连接，
+不能告诉客户端keep-alive后再被close_idle从客户端下面关掉。
+一个保持连接上先请求大文件，客户端先不读，服务器写满socket的缓冲区后等待EPOLLOUT（连接不空闲，close_idle不关闭它）；
+这时给服务器发SIGQUIT，排空开始后再发第二个请求（大文件发送完后处理），然后读完两个响应。
+第二个响应在排空开始之后生成，检查它的Connection头部和之后的EOF。
+
+编译运行（大文件要比socket的缓冲区大得多，例如64MB）：
+    dd if=/dev/urandom of=root/big.bin bs=1M count=64; echo hi > root/index.html
+    ./web 9006 -r root &
+    g++ -O2 drain_check.cpp -o drain_check
+    ./drain_check 127.0.0.1 9006 /big.bin /index.html $!
+输出PASS时退出码为0，服务器在检查之后排空退出
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <string>
+
+// 读一个响应：返回头部（不含空行），内容读完后丢弃；出错或者提前EOF返回空字符串
+static std::string read_response(int fd, std::string &pending)
+{
+    char buf[65536];
+    size_t end;
+    while ((end = pending.find("\r\n\r\n")) == std::string::npos)
+    {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0)
+        {
+            return "";
+        }
+        pending.append(buf, n);
+    }
+    std::string head = pending.substr(0, end + 2);
+    pending.erase(0, end + 4);
+    const char *cl = strcasestr(head.c_str(), "\r\nContent-Length:");
+    if (!cl)
+    {
+        return ""; // 文件响应都带Content-Length
+    }
+    long long left = atoll(cl + 17);
+    if ((long long)pending.size() >= left)
+    {
+        pending.erase(0, left);
+        return head;
+    }
+    left -= pending.size();
+    pending.clear();
+    while (left > 0)
+    {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0)
+        {
+            return "";
+        }
+        if (n > left)
+        {
+            pending.append(buf + left, n - left); // 响应之后多出来的字节
+            n = left;
+        }
+        left -= n;
+    }
+    return head;
+}
+
+static int fail(const char *what, const std::string &head)
+{
+    printf("FAIL: %s\n%s", what, head.c_str());
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 6)
+    {
+        fprintf(stderr, "usage: %s ip port big_path small_path server_pid\n", argv[0]);
+        return 1;
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[2]));
+    inet_pton(AF_INET, argv[1], &addr.sin_addr);
+    int pid = atoi(argv[5]);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct timeval tv = {10, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (const sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect");
+        return 1;
+    }
+    char req[1024];
+    int len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", argv[3], argv[1]);
+    if (write(fd, req, len) != len)
+    {
+        perror("write");
+        return 1;
+    }
+    usleep(300 * 1000); // 服务器发送第一个响应直到socket的缓冲区满
+    if (kill(pid, SIGQUIT) < 0)
+    {
+        perror("kill");
+        return 1;
+    }
+    usleep(500 * 1000); // 排空开始，close_idle至少扫过一次
+    // 第二个请求在排空开始之后才发送，它的响应一定在排空之后生成
+    len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", argv[4], argv[1]);
+    if (write(fd, req, len) != len)
+    {
+        perror("write");
+        return 1;
+    }
+
+    std::string pending;
+    std::string first = read_response(fd, pending);
+    if (first.empty())
+    {
+        return fail("first response incomplete (connection closed under the client)", first);
+    }
+    std::string second = read_response(fd, pending);
+    if (second.empty())
+    {
+        return fail("second response missing or incomplete", second);
+    }
+    if (!strcasestr(second.c_str(), "\r\nConnection: close\r\n"))
+    {
+        return fail("response generated while draining does not say Connection: close", second);
+    }
+    char c;
+    if (!pending.empty() || read(fd, &c, 1) != 0)
+    {
+        return fail("connection not closed cleanly after the response", second);
+    }
+    close(fd);
+    printf("PASS: in-flight response during drain ended with Connection: close and EOF\n");
+    return 0;
+}
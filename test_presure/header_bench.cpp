@@ -0,0 +1,120 @@
+/*
+响应头生成的微基准：比较原来逐行vsnprintf的add_response方式和编译期前缀 + memcpy的方式。
+只测头部中固定的部分（状态行、Accept-Ranges、Content-Type、Vary、Connection、Content-Length）
+以及按扩展名查MIME类型，不包括ETag、Last-Modified等两种方式相同的部分。
+
+编译运行：
+    g++ -O2 header_bench.cpp -o header_bench && ./header_bench
+*/
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "../mime_table.h"
+
+static char buf[1024];
+static int idx;
+
+static bool add_response(const char *format, ...)
+{
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(buf + idx, sizeof(buf) - 1 - idx, format, arg_list);
+    va_end(arg_list);
+    if (len < 0 || len >= (int)sizeof(buf) - 1 - idx)
+    {
+        return false;
+    }
+    idx += len;
+    return true;
+}
+
+// 原来的线性查找
+static const char *mime_type_linear(const char *path)
+{
+    static const char *const types[][2] = {
+        {".html", "text/html"}, {".htm", "text/html"}, {".css", "text/css"},
+        {".js", "application/javascript"}, {".json", "application/json"},
+        {".txt", "text/plain"}, {".xml", "application/xml"}, {".svg", "image/svg+xml"},
+        {".png", "image/png"}, {".jpg", "image/jpeg"}, {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"}, {".ico", "image/x-icon"}, {".webp", "image/webp"},
+        {".woff", "font/woff"}, {".woff2", "font/woff2"}, {".pdf", "application/pdf"},
+        {".mp4", "video/mp4"}, {".wasm", "application/wasm"},
+    };
+    const char *dot = strrchr(path, '.');
+    if (dot && !strchr(dot, '/'))
+    {
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        {
+            if (strcasecmp(dot, types[i][0]) == 0)
+            {
+                return types[i][1];
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+static bool is_compressible(const char *type)
+{
+    return strncmp(type, "text/", 5) == 0 || strcmp(type, "application/javascript") == 0 ||
+           strcmp(type, "application/json") == 0 || strcmp(type, "application/xml") == 0 ||
+           strcmp(type, "image/svg+xml") == 0 || strcmp(type, "application/wasm") == 0;
+}
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main()
+{
+    const char *paths[] = {"/home/now/myweb/resources/index.html", "/home/now/myweb/resources/images/image1.jpg",
+                           "/home/now/myweb/resources/app.js", "/home/now/myweb/resources/font.woff2",
+                           "/home/now/myweb/resources/big.bin"};
+    const int npaths = sizeof(paths) / sizeof(paths[0]);
+    const int rounds = 5000000;
+    unsigned long sink = 0;
+
+    double t0 = now_sec();
+    for (int i = 0; i < rounds; i++)
+    {
+        const char *path = paths[i % npaths];
+        const char *type = mime_type_linear(path);
+        idx = 0;
+        add_response("%s %d %s\r\n", "HTTP/1.1", 200, "OK");
+        add_response("Accept-Ranges: bytes\r\n");
+        if (is_compressible(type))
+        {
+            add_response("Vary: Accept-Encoding\r\n");
+        }
+        add_response("Content-Length: %lld\r\n", (long long)(i & 0xfffff));
+        add_response("Content-Type:%s\r\n", type);
+        add_response("Connection: %s\r\n", (i & 1) ? "keep-alive" : "close");
+        add_response("%s", "\r\n");
+        sink += idx + buf[idx / 2];
+    }
+    double t1 = now_sec();
+    for (int i = 0; i < rounds; i++)
+    {
+        const char *path = paths[i % npaths];
+        const header_prefix &p = response_prefix(RESP_200, mime_lookup(path), i & 1);
+        memcpy(buf, p.data, p.len);
+        idx = p.len;
+        memcpy(buf + idx, "Content-Length: ", 16);
+        idx += 16;
+        idx += format_decimal(buf + idx, i & 0xfffff);
+        memcpy(buf + idx, "\r\n\r\n", 4);
+        idx += 4;
+        sink += idx + buf[idx / 2];
+    }
+    double t2 = now_sec();
+
+    printf("add_response:     %.1f ns/response\n", (t1 - t0) / rounds * 1e9);
+    printf("constexpr prefix: %.1f ns/response\n", (t2 - t1) / rounds * 1e9);
+    printf("(%lu)\n", sink);
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*
+HPACK编码器在头部块溢出时的动态表检查：溢出的块不会发出，编码器必须撤销这个块对动态表的修改，
+否则之后的块引用对方没有的动态表项，两边的动态表不一致。
+每个发出的块都交给解码器，检查解码出的字段和编码的一样；溢出的块只交给编码器。
+  1. 溢出的块在溢出前加入了新的项：之后同样的值必须重新按字面量加入，不能按下标引用
+  2. 溢出的块加入的项挤掉了之前的项（小的动态表）：之后仍然可以按下标引用被挤掉的项
+  3. 溢出的块开头带了动态表大小更新：下一个块重新带上
+
+编译运行：
+    g++ -O2 hpack_test.cpp ../hpack.cpp -o hpack_test && ./hpack_test
+输出PASS时退出码为0
+*/
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "../hpack.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+// 把编码好的块交给解码器，检查解码出的字段值
+static bool decodes_to(hpack_decoder &dec, const uint8_t *block, size_t len, const char *const *values, int count)
+{
+    hpack_field fields[16];
+    char buf[4096];
+    int n = dec.decode(block, len, fields, 16, buf, sizeof(buf));
+    if (n != count)
+    {
+        return false;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (fields[i].value.len != strlen(values[i]) || memcmp(fields[i].value.data, values[i], fields[i].value.len) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 按下标引用的字段只占一个字节（下标小于127）
+static bool indexed_reference(const uint8_t *block, size_t len)
+{
+    return len == 1 && (block[0] & 0x80);
+}
+
+int main()
+{
+    uint8_t out[4096];
+    std::string long_value(200, 'x');
+
+    {
+        hpack_encoder enc;
+        hpack_decoder dec;
+        const char *first[] = {"text/html"};
+        enc.begin(out, sizeof(out));
+        enc.field(HPACK_NAME_CONTENT_TYPE, "text/html", true);
+        size_t len = enc.finish();
+        check(len > 0 && decodes_to(dec, out, len, first, 1), "first block");
+
+        // 溢出的块：先加入cache-control，再放不下一个长的值
+        enc.begin(out, 40);
+        enc.field(HPACK_NAME_CACHE_CONTROL, "no-cache", true);
+        enc.field(HPACK_NAME_VARY, long_value.c_str(), true);
+        enc.field(HPACK_NAME_ETAG, "\"abc\"", true);
+        check(enc.finish() == 0, "overflowing block reports 0");
+
+        // 之后的块：cache-control不在对方的动态表中，必须按字面量重新加入；text/html仍然是下标62
+        const char *next[] = {"no-cache", "text/html"};
+        enc.begin(out, sizeof(out));
+        enc.field(HPACK_NAME_CACHE_CONTROL, "no-cache", true);
+        enc.field(HPACK_NAME_CONTENT_TYPE, "text/html", true);
+        len = enc.finish();
+        check(len > 0 && decodes_to(dec, out, len, next, 2), "block after overflow decodes to the same fields");
+
+        enc.begin(out, sizeof(out));
+        enc.field(HPACK_NAME_CACHE_CONTROL, "no-cache", true);
+        len = enc.finish();
+        check(indexed_reference(out, len), "entry inserted after overflow is referenced by index");
+        const char *again[] = {"no-cache"};
+        check(decodes_to(dec, out, len, again, 1), "indexed reference decodes");
+    }
+
+    {
+        // 小的动态表：溢出的块加入的项挤掉了之前的项，撤销后之前的项还在
+        hpack_encoder enc;
+        hpack_decoder dec;
+        enc.set_max_size(100);
+        const char *first[] = {"text/html"};
+        enc.begin(out, sizeof(out));
+        enc.field(HPACK_NAME_CONTENT_TYPE, "text/html", true);
+        size_t len = enc.finish();
+        check(len > 0 && decodes_to(dec, out, len, first, 1), "size update and first block");
+
+        enc.set_max_size(90); // 下一个块开头带大小更新
+        enc.begin(out, 60);
+        enc.field(HPACK_NAME_CACHE_CONTROL, "max-age=3600, public", true); // 挤掉text/html
+        enc.field(HPACK_NAME_VARY, long_value.c_str(), true);
+        check(enc.finish() == 0, "overflowing block with eviction reports 0");
+
+        enc.begin(out, sizeof(out));
+        enc.field(HPACK_NAME_CONTENT_TYPE, "text/html", true);
+        len = enc.finish();
+        check(len == 3 && out[0] == 0x3f && out[1] == 90 - 31, "size update repeated in the next block");
+        check(len > 0 && (out[len - 1] & 0x80), "evicted entry restored and referenced by index");
+        check(decodes_to(dec, out, len, first, 1), "block after rolled back eviction decodes");
+    }
+
+    if (failures)
+    {
+        return 1;
+    }
+    printf("PASS: dynamic table unchanged by overflowing header blocks\n");
+    return 0;
+}
@@ -0,0 +1,109 @@
+/*
+路由表查找的微基准：注册几千条精确、参数、前缀路由，测量每次查找的时间，
+并统计查找期间的内存分配次数（应该为0）。
+
+编译运行：
+    g++ -O2 router_bench.cpp ../router.cpp -o router_bench && ./router_bench
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <new>
+#include "../router.h"
+
+// 统计operator new的调用次数
+static unsigned long alloc_count = 0;
+void *operator new(size_t size)
+{
+    alloc_count++;
+    void *p = malloc(size);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static bool dummy(const route_request &, route_response &, void *)
+{
+    return true;
+}
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main()
+{
+    const int services = 1000;
+    router r;
+    char pattern[128];
+    for (int i = 0; i < services; i++)
+    {
+        snprintf(pattern, sizeof(pattern), "/api/v1/service%d/items", i);
+        r.add(pattern, router::METHOD_GET, dummy);
+        snprintf(pattern, sizeof(pattern), "/api/v1/service%d/items/:id", i);
+        r.add(pattern, router::METHOD_GET, dummy);
+        snprintf(pattern, sizeof(pattern), "/api/v1/service%d/items/:id/history", i);
+        r.add(pattern, router::METHOD_GET, dummy);
+        snprintf(pattern, sizeof(pattern), "/assets/bundle%d/*", i);
+        r.add(pattern, router::METHOD_GET, dummy);
+    }
+    printf("routes: %zu\n", r.size());
+
+    // 预先生成查找的url：命中各种路由以及不存在的路径
+    const int npaths = 4096;
+    static char paths[npaths][96];
+    static size_t lens[npaths];
+    for (int i = 0; i < npaths; i++)
+    {
+        int s = rand() % services;
+        switch (i % 5)
+        {
+        case 0:
+            lens[i] = snprintf(paths[i], 96, "/api/v1/service%d/items", s);
+            break;
+        case 1:
+            lens[i] = snprintf(paths[i], 96, "/api/v1/service%d/items/%d", s, rand());
+            break;
+        case 2:
+            lens[i] = snprintf(paths[i], 96, "/api/v1/service%d/items/%d/history", s, rand());
+            break;
+        case 3:
+            lens[i] = snprintf(paths[i], 96, "/assets/bundle%d/js/app.%d.js", s, rand());
+            break;
+        default:
+            lens[i] = snprintf(paths[i], 96, "/api/v1/service%d/missing/%d", s, rand());
+            break;
+        }
+    }
+
+    const int rounds = 5000000;
+    unsigned long found = 0;
+    unsigned long allocs = alloc_count;
+    double t0 = now_sec();
+    for (int i = 0; i < rounds; i++)
+    {
+        route_match m;
+        int k = i & (npaths - 1);
+        if (r.lookup(paths[k], lens[k], m))
+        {
+            found += m.count + 1;
+        }
+    }
+    double t1 = now_sec();
+    printf("lookup: %.1f ns/op, allocations during lookups: %lu (%lu)\n", (t1 - t0) / rounds * 1e9,
+           alloc_count - allocs, found);
+    return 0;
+}
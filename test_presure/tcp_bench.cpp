@@ -0,0 +1,154 @@
+/*
+监听socket的TCP参数（-T）的基准：每次新建一个连接发送一个请求（Connection: close），测量
+  connect  从开始连接到连接建立（TCP_FASTOPEN时是带数据的SYN发出）
+  first    从开始连接到收到响应的第一个字节
+  segs     这个响应收到的数据分段数（TCP_INFO的tcpi_data_segs_in），看头部和响应体有没有合并
+以及idle模式：只建立连接不发送数据，服务器用defer时这些连接不会被accept（对比/status/accepted_conns）。
+
+编译运行：
+    g++ -O2 tcp_bench.cpp -o tcp_bench
+    ./tcp_bench 127.0.0.1 port /index.html 2000          普通连接
+    ./tcp_bench 127.0.0.1 port /index.html 2000 fastopen 客户端用MSG_FASTOPEN（需要net.ipv4.tcp_fastopen=3）
+    ./tcp_bench 127.0.0.1 port / 200 idle                建立200个不发送数据的连接，1秒后关闭
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <vector>
+#include <algorithm>
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// 一次请求；失败返回false
+static bool one_request(const sockaddr_in &addr, const char *req, bool fastopen, double &connect_us,
+                        double &first_us, unsigned &segs)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    double start = now_us();
+    size_t len = strlen(req);
+    ssize_t sent;
+    if (fastopen)
+    {
+        // 有cookie时请求在SYN中发出，否则内核退回普通的三次握手
+        sent = sendto(fd, req, len, MSG_FASTOPEN, (const sockaddr *)&addr, sizeof(addr));
+        connect_us = now_us() - start;
+    }
+    else
+    {
+        if (connect(fd, (const sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            close(fd);
+            return false;
+        }
+        connect_us = now_us() - start;
+        sent = send(fd, req, len, 0);
+    }
+    if (sent != (ssize_t)len)
+    {
+        close(fd);
+        return false;
+    }
+    char buf[65536];
+    bool first = true;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        if (first)
+        {
+            first_us = now_us() - start;
+            first = false;
+        }
+    }
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_len);
+    segs = info.tcpi_data_segs_in;
+    close(fd);
+    return !first;
+}
+
+static double percentile(std::vector<double> &v, double p)
+{
+    std::sort(v.begin(), v.end());
+    return v.empty() ? 0 : v[(size_t)(p * (v.size() - 1))];
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 5)
+    {
+        fprintf(stderr, "usage: %s ip port path count [fastopen|idle]\n", argv[0]);
+        return 1;
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[2]));
+    inet_pton(AF_INET, argv[1], &addr.sin_addr);
+    int count = atoi(argv[4]);
+    const char *mode = argc > 5 ? argv[5] : "";
+
+    if (strcmp(mode, "idle") == 0)
+    {
+        std::vector<int> fds;
+        for (int i = 0; i < count; i++)
+        {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (fd >= 0 && connect(fd, (const sockaddr *)&addr, sizeof(addr)) == 0)
+            {
+                fds.push_back(fd);
+            }
+        }
+        printf("%zu idle connections open, check /status/accepted_conns now\n", fds.size());
+        fflush(stdout);
+        sleep(1);
+        for (size_t i = 0; i < fds.size(); i++)
+        {
+            close(fds[i]);
+        }
+        return 0;
+    }
+
+    char req[512];
+    snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", argv[3], argv[1]);
+    bool fastopen = strcmp(mode, "fastopen") == 0;
+    std::vector<double> connects, firsts;
+    unsigned long segs_total = 0;
+    int failed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        double c = 0, f = 0;
+        unsigned segs = 0;
+        if (!one_request(addr, req, fastopen, c, f, segs))
+        {
+            failed++;
+            continue;
+        }
+        connects.push_back(c);
+        firsts.push_back(f);
+        segs_total += segs;
+    }
+    int ok = count - failed;
+    printf("%d requests, %d failed\n", count, failed);
+    printf("connect   p50 %.1f us  p99 %.1f us\n", percentile(connects, 0.5), percentile(connects, 0.99));
+    printf("first     p50 %.1f us  p99 %.1f us\n", percentile(firsts, 0.5), percentile(firsts, 0.99));
+    printf("segments  %.2f per response\n", ok ? (double)segs_total / ok : 0.0);
+    return 0;
+}
@@ -0,0 +1,250 @@
+/*
+HTTPS监听（-H）的基准，需要OpenSSL：
+  full      每个请求新建连接并做完整握手（Connection: close），测握手速率和首字节延迟
+  resume    同样每个请求新建连接，但带上一个连接拿到的会话（TLS 1.3票据），服务器不做证书签名
+  keepalive 一个连接上连续请求count次，测大文件的吞吐（对比服务器用-H port:cert:key和-H port:cert:key:noktls，
+            /status/tls_ktls不为0说明握手后发送交给了内核）
+服务器的CPU时间：传入服务器的pid时读/proc/pid/stat，输出每个请求花的CPU微秒数。
+
+编译运行：
+    openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -keyout key.pem -out cert.pem -days 30 -subj /CN=localhost
+    ./web 9006 -H 9443:cert.pem:key.pem
+    g++ -O2 tls_bench.cpp -lssl -lcrypto -o tls_bench
+    ./tls_bench 127.0.0.1 9443 /index.html 2000 full [server_pid]
+    ./tls_bench 127.0.0.1 9443 /index.html 2000 resume [server_pid]
+    ./tls_bench 127.0.0.1 9443 /big.bin 500 keepalive [server_pid]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// 服务器进程的用户态+内核态CPU时间（微秒），没有pid时为0
+static double server_cpu_us(int pid)
+{
+    if (pid <= 0)
+    {
+        return 0;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        return 0;
+    }
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    // 进程名可能有空格，从最后一个)之后数字段：utime是第14个，stime是第15个
+    char *p = strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    {
+        return 0;
+    }
+    return (utime + stime) * 1e6 / sysconf(_SC_CLK_TCK);
+}
+
+static int connect_to(const sockaddr_in &addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// 读一个响应：头部之后按Content-Length读完内容，返回内容的字节数，出错返回-1
+static long read_response(SSL *ssl, double start, double &first_us)
+{
+    static char buf[65536];
+    std::string head;
+    long length = -1; // 头部读完之前为-1
+    long body = 0;
+    while (length < 0 || body < length)
+    {
+        int n = SSL_read(ssl, buf, sizeof(buf));
+        if (n <= 0)
+        {
+            return -1;
+        }
+        if (head.empty())
+        {
+            first_us = now_us() - start;
+        }
+        if (length >= 0)
+        {
+            body += n;
+            continue;
+        }
+        head.append(buf, n);
+        size_t end = head.find("\r\n\r\n");
+        if (end == std::string::npos)
+        {
+            continue;
+        }
+        const char *cl = strcasestr(head.c_str(), "\r\nContent-Length:");
+        if (!cl || cl > head.c_str() + end)
+        {
+            return -1; // 基准只请求静态文件，都带Content-Length
+        }
+        length = atol(cl + 17);
+        body = head.size() - end - 4;
+    }
+    return body;
+}
+
+static double percentile(std::vector<double> &v, double p)
+{
+    std::sort(v.begin(), v.end());
+    return v.empty() ? 0 : v[(size_t)(p * (v.size() - 1))];
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 6)
+    {
+        fprintf(stderr, "usage: %s ip port path count full|resume|keepalive [server_pid]\n", argv[0]);
+        return 1;
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[2]));
+    inet_pton(AF_INET, argv[1], &addr.sin_addr);
+    const char *path = argv[3];
+    int count = atoi(argv[4]);
+    const char *mode = argv[5];
+    int pid = argc > 6 ? atoi(argv[6]) : 0;
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL); // 自签名证书
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+
+    bool keepalive = strcmp(mode, "keepalive") == 0;
+    bool resume = strcmp(mode, "resume") == 0;
+    char req[512];
+    snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n", path, argv[1],
+             keepalive ? "keep-alive" : "close");
+
+    std::vector<double> handshakes, firsts;
+    SSL_SESSION *session = NULL;
+    int failed = 0, resumed = 0;
+    double bytes = 0;
+    double cpu_start = server_cpu_us(pid);
+    double start = now_us();
+    SSL *ssl = NULL;
+    int fd = -1;
+    for (int i = 0; i < count; i++)
+    {
+        double t0 = now_us();
+        if (!ssl)
+        {
+            fd = connect_to(addr);
+            if (fd < 0)
+            {
+                failed++;
+                continue;
+            }
+            ssl = SSL_new(ctx);
+            SSL_set_fd(ssl, fd);
+            if (resume && session)
+            {
+                SSL_set_session(ssl, session);
+            }
+            if (SSL_connect(ssl) != 1)
+            {
+                SSL_free(ssl);
+                close(fd);
+                ssl = NULL;
+                failed++;
+                continue;
+            }
+            handshakes.push_back(now_us() - t0);
+            if (SSL_session_reused(ssl))
+            {
+                resumed++;
+            }
+        }
+        double first = 0;
+        long n = -1;
+        if (SSL_write(ssl, req, strlen(req)) > 0)
+        {
+            n = read_response(ssl, t0, first);
+        }
+        if (n < 0)
+        {
+            failed++;
+        }
+        else
+        {
+            bytes += n;
+            firsts.push_back(first);
+        }
+        if (!keepalive || n < 0)
+        {
+            if (resume)
+            {
+                // TLS 1.3的票据在握手之后到达，读完响应时已经处理了；和浏览器一样每次用最新的票据
+                if (session)
+                {
+                    SSL_SESSION_free(session);
+                }
+                session = SSL_get1_session(ssl);
+            }
+            SSL_shutdown(ssl);
+            SSL_free(ssl);
+            close(fd);
+            ssl = NULL;
+        }
+    }
+    double elapsed = now_us() - start;
+    double cpu = server_cpu_us(pid) - cpu_start;
+    if (ssl)
+    {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        close(fd);
+    }
+    int ok = count - failed;
+    printf("%d requests, %d failed, %d handshakes (%d resumed)\n", count, failed, (int)handshakes.size(), resumed);
+    printf("handshake p50 %.1f us  p99 %.1f us\n", percentile(handshakes, 0.5), percentile(handshakes, 0.99));
+    printf("first     p50 %.1f us  p99 %.1f us\n", percentile(firsts, 0.5), percentile(firsts, 0.99));
+    printf("rate      %.0f requests/s  %.1f MB/s\n", ok * 1e6 / elapsed, bytes / elapsed);
+    if (pid > 0 && ok > 0)
+    {
+        printf("server    %.1f cpu us per request\n", cpu / ok);
+    }
+    if (session)
+    {
+        SSL_SESSION_free(session);
+    }
+    SSL_CTX_free(ctx);
+    return 0;
+}
@@ -23,12 +23,15 @@
 #include <strings.h>
 #include <time.h>
 #include <signal.h>
+#include <sys/time.h>
 
 /* values */
 volatile int timerexpired=0;
 int speed=0;
 int failed=0;
 int bytes=0;
+long long lat_total=0; /* sum of successful request latencies, usec */
+long long lat_max=0;
 /* globals */
 int http10=1; /* 0 - http/0.9, 1 - http/1.0, 2 - http/1.1 */
 /* Allow: GET, HEAD, OPTIONS, TRACE */
@@ -294,6 +297,7 @@ void build_request(const char *url)
 static int bench(void)
 {
   int i,j,k;	
+  long long l,m;
   pid_t pid=0;
   FILE *f;
 
@@ -354,7 +358,7 @@ static int bench(void)
 		 return 3;
 	 }
 	 /* fprintf(stderr,"Child - %d %d\n",speed,failed); */
-	 fprintf(f,"%d %d %d\n",speed,failed,bytes);
+	 fprintf(f,"%d %d %d %lld %lld\n",speed,failed,bytes,lat_total,lat_max);
 	 fclose(f);
 	 return 0;
   } else
@@ -372,8 +376,8 @@ static int bench(void)
 
 	  while(1)
 	  {
-		  pid=fscanf(f,"%d %d %d",&i,&j,&k);
-		  if(pid<2)
+		  pid=fscanf(f,"%d %d %d %lld %lld",&i,&j,&k,&l,&m);
+		  if(pid<5)
                   {
                        fprintf(stderr,"Some of our childrens died.\n");
                        break;
@@ -381,6 +385,8 @@ static int bench(void)
 		  speed+=i;
 		  failed+=j;
 		  bytes+=k;
+		  lat_total+=l;
+		  if(m>lat_max) lat_max=m;
 		  /* fprintf(stderr,"*Knock* %d %d read=%d\n",speed,failed,pid); */
 		  if(--clients==0) break;
 	  }
@@ -391,6 +397,9 @@ static int bench(void)
 		  (int)(bytes/(float)benchtime),
 		  speed,
 		  failed);
+  printf("Latency: avg %.1f usec, max %lld usec.\n",
+		  speed>0?lat_total/(double)speed:0.0,
+		  lat_max);
   }
   return i;
 }
@@ -401,6 +410,8 @@ void benchcore(const char *host,const int port,const char *req)
  char buf[1500];
  int s,i;
  struct sigaction sa;
+ struct timeval start,end;
+ long long lat;
 
  /* setup alarm signal handler */
  sa.sa_handler=alarm_handler;
@@ -421,6 +432,7 @@ void benchcore(const char *host,const int port,const char *req)
        }
        return;
     }
+    gettimeofday(&start,NULL);
     s=Socket(host,port);                          
     if(s<0) { failed++;continue;} 
     if(rlen!=write(s,req,rlen)) {failed++;close(s);continue;}
@@ -448,5 +460,9 @@ void benchcore(const char *host,const int port,const char *req)
     }
     if(close(s)) {failed++;continue;}
     speed++;
+    gettimeofday(&end,NULL);
+    lat=(end.tv_sec-start.tv_sec)*1000000LL+(end.tv_usec-start.tv_usec);
+    lat_total+=lat;
+    if(lat>lat_max) lat_max=lat;
  }
 }
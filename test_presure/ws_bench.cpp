@@ -0,0 +1,286 @@
+/*
+WebSocket广播（-s）的扇出基准：先建立subscribers个订阅同一个频道的连接，再用另一个连接发布messages条消息，
+每条消息等所有订阅者都收到后再发下一条，测从发布到最后一个订阅者收到（扇出完成）的延迟和第一个订阅者收到的延迟。
+所有订阅者收到的帧大小相同（服务器发出的帧不带掩码），按字节数计帧，不解析内容。
+服务器的CPU时间：传入服务器的pid时读/proc/pid/stat，输出每条消息花的CPU微秒数（包括发布者自己收到的那一份）。
+
+编译运行（订阅者多时需要调大fd上限，基准自己调到订阅者数 + 100）：
+    ./web 9006 -s /ws/
+    g++ -O2 ws_bench.cpp -o ws_bench
+    ulimit -n 20000; ./ws_bench 127.0.0.1 9006 /ws/bench 10000 200 [server_pid] [payload_bytes]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// 服务器进程的用户态+内核态CPU时间（微秒），没有pid时为0
+static double server_cpu_us(int pid)
+{
+    if (pid <= 0)
+    {
+        return 0;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        return 0;
+    }
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    // 进程名可能有空格，从最后一个)之后数字段：utime是第14个，stime是第15个
+    char *p = strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    {
+        return 0;
+    }
+    return (utime + stime) * 1e6 / sysconf(_SC_CLK_TCK);
+}
+
+// 连接并完成握手（阻塞），返回fd，失败返回-1。服务器在101之前不会发送帧，握手响应之后没有多余的数据
+static int ws_connect(const sockaddr_in &addr, const char *host, const char *path)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    char req[512];
+    int len = snprintf(req, sizeof(req),
+                       "GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n",
+                       path, host);
+    if (write(fd, req, len) != len)
+    {
+        close(fd);
+        return -1;
+    }
+    std::string head;
+    char buf[1024];
+    while (head.find("\r\n\r\n") == std::string::npos)
+    {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        head.append(buf, n);
+    }
+    if (head.compare(0, 12, "HTTP/1.1 101") != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// 客户端发出的帧必须带掩码
+static std::string masked_frame(const char *payload, size_t len)
+{
+    std::string f;
+    f.push_back((char)0x82); // FIN + BINARY
+    if (len < 126)
+    {
+        f.push_back((char)(0x80 | len));
+    }
+    else
+    {
+        f.push_back((char)(0x80 | 126));
+        f.push_back((char)(len >> 8));
+        f.push_back((char)len);
+    }
+    const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    f.append((const char *)mask, 4);
+    for (size_t i = 0; i < len; i++)
+    {
+        f.push_back(payload[i] ^ mask[i & 3]);
+    }
+    return f;
+}
+
+static double percentile(std::vector<double> &v, double p)
+{
+    std::sort(v.begin(), v.end());
+    return v.empty() ? 0 : v[(size_t)(p * (v.size() - 1))];
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 6)
+    {
+        fprintf(stderr, "usage: %s ip port path subscribers messages [server_pid] [payload_bytes]\n", argv[0]);
+        return 1;
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[2]));
+    inet_pton(AF_INET, argv[1], &addr.sin_addr);
+    const char *path = argv[3];
+    int subscribers = atoi(argv[4]);
+    int messages = atoi(argv[5]);
+    int pid = argc > 6 ? atoi(argv[6]) : 0;
+    size_t payload = argc > 7 ? atol(argv[7]) : 64;
+    if (payload < 16 || payload > 65535)
+    {
+        fprintf(stderr, "payload_bytes must be between 16 and 65535\n");
+        return 1;
+    }
+    // 服务器发出的帧：2字节帧头（内容小于126字节）或者4字节
+    size_t frame_len = payload + (payload < 126 ? 2 : 4);
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t)subscribers + 100)
+    {
+        rl.rlim_cur = std::min<rlim_t>(rl.rlim_max, subscribers + 100);
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    int epfd = epoll_create1(0);
+    std::vector<int> fds;
+    std::vector<size_t> partial; // 每个连接当前帧已经收到的字节数
+    double t0 = now_us();
+    for (int i = 0; i < subscribers; i++)
+    {
+        int fd = ws_connect(addr, argv[1], path);
+        if (fd < 0)
+        {
+            fprintf(stderr, "subscriber %d: connect/handshake failed: %s\n", i, strerror(errno));
+            return 1;
+        }
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = fds.size();
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        fds.push_back(fd);
+        partial.push_back(0);
+    }
+    // 发布者也在同一个频道中，收到的那一份读掉，不计入
+    int publisher = ws_connect(addr, argv[1], path);
+    if (publisher < 0)
+    {
+        fprintf(stderr, "publisher: connect/handshake failed\n");
+        return 1;
+    }
+    epoll_event pev;
+    pev.events = EPOLLIN;
+    pev.data.u32 = subscribers;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, publisher, &pev);
+    printf("%d subscribers connected in %.0f ms\n", subscribers, (now_us() - t0) / 1e3);
+
+    std::vector<char> body(payload, 'x');
+    std::vector<double> fanout, first;
+    std::vector<epoll_event> events(1024);
+    static char buf[65536];
+    int failed = 0;
+    double cpu_start = server_cpu_us(pid);
+    double start = now_us();
+    for (int m = 0; m < messages; m++)
+    {
+        memcpy(&body[0], &m, sizeof(m));
+        std::string frame = masked_frame(&body[0], body.size());
+        double sent = now_us();
+        if (write(publisher, frame.data(), frame.size()) != (ssize_t)frame.size())
+        {
+            fprintf(stderr, "publisher write failed\n");
+            return 1;
+        }
+        int received = 0;
+        double first_us = 0;
+        while (received < subscribers)
+        {
+            int n = epoll_wait(epfd, &events[0], events.size(), 5000);
+            if (n <= 0)
+            {
+                break; // 5秒内没有新数据，这条消息算失败
+            }
+            for (int i = 0; i < n; i++)
+            {
+                uint32_t idx = events[i].data.u32;
+                int fd = idx == (uint32_t)subscribers ? publisher : fds[idx];
+                ssize_t r;
+                while ((r = read(fd, buf, sizeof(buf))) > 0)
+                {
+                    if (idx == (uint32_t)subscribers)
+                    {
+                        continue;
+                    }
+                    partial[idx] += r;
+                    while (partial[idx] >= frame_len)
+                    {
+                        partial[idx] -= frame_len;
+                        if (received++ == 0)
+                        {
+                            first_us = now_us() - sent;
+                        }
+                    }
+                }
+                if (r == 0)
+                {
+                    fprintf(stderr, "connection %u closed by server\n", idx);
+                    return 1;
+                }
+            }
+        }
+        if (received < subscribers)
+        {
+            failed++;
+            continue;
+        }
+        fanout.push_back(now_us() - sent);
+        first.push_back(first_us);
+    }
+    double elapsed = now_us() - start;
+    double cpu = server_cpu_us(pid) - cpu_start;
+    int ok = messages - failed;
+    printf("%d messages x %d subscribers (%zu byte payload), %d incomplete\n", messages, subscribers, payload, failed);
+    printf("first   p50 %.1f us  p99 %.1f us\n", percentile(first, 0.5), percentile(first, 0.99));
+    printf("fan-out p50 %.1f us  p99 %.1f us  max %.1f us\n", percentile(fanout, 0.5), percentile(fanout, 0.99),
+           percentile(fanout, 1.0));
+    printf("rate    %.0f deliveries/s\n", ok * (double)subscribers * 1e6 / elapsed);
+    if (pid > 0 && ok > 0)
+    {
+        printf("server  %.1f cpu us per message  %.3f cpu us per delivery\n", cpu / ok, cpu / ok / (subscribers + 1));
+    }
+    for (size_t i = 0; i < fds.size(); i++)
+    {
+        close(fds[i]);
+    }
+    close(publisher);
+    close(epfd);
+    return 0;
+}
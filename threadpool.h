@@ -8,11 +8,19 @@
 
 主子线程共享任务池资源，主线程向请求队列中添加任务，而工作线程循环从请求队列中取出任务并执行。
 通过使用互斥锁和信号量来实现线程之间的同步和通信
+
+过载控制：队列满时append返回false，由调用者立即拒绝；每个任务记录入队时间，
+子线程取任务时按CoDel算法判断排队延迟，持续超过目标延迟时丢弃（调用任务的shed()），
+保证被处理的请求延迟有界，而不是无限排队。
 */
 #include <list>
 #include <iostream>
 #include <pthread.h>
+#include <math.h>
+#include <time.h>
+#include <stdint.h>
 #include "locker.h"
+#include "server_stats.h"
 
 using namespace std;
 // 线程池定义为模板类
@@ -21,14 +29,22 @@ class threadpool{
 public:
 /*thread_number是线程池中线程的数量，
     max_requests是请求队列中最多允许的请求数量*/
-    threadpool(int thread_number = 8, int max_requests = 10000);
+    threadpool(int thread_number = 8, int max_requests = 10000, int target_ms = 5, int interval_ms = 100);
     ~threadpool();
-    bool append(T * request); // 添加任务
+    bool append(T * request); // 添加任务，队列满时返回false
 
 private:
    /*工作线程运行的函数，它不断从工作队列中取出任务并执行之*/
     static void * worker(void * arg); // 静态函数，静态函数中不能访问非静态成员
     void run(); // 启动线程池
+    static uint64_t now_us(); // 单调时钟，微秒
+    bool should_shed(uint64_t sojourn, uint64_t now); // CoDel，调用者持有队列锁
+
+    // 请求队列中的任务，带入队时间
+    struct request_item{
+        T * request;
+        uint64_t enqueue_us;
+    };
 private:
     // 线程数量
     int m_thread_number;
@@ -38,7 +54,15 @@ private:
     // 请求队列中最多允许的请求数量
     int m_max_requests;
     // 请求队列 ->双向链表 头尾均可插入删除
-    std::list<T *> m_workqueue;
+    std::list<request_item> m_workqueue;
+
+    // CoDel状态（由队列锁保护）
+    uint64_t m_target_us;       // 目标排队延迟
+    uint64_t m_interval_us;     // 观察窗口
+    uint64_t m_first_above_us;  // 排队延迟开始持续超过目标的截止时间，0表示没有超过
+    uint64_t m_drop_next_us;    // 丢弃状态下下一次丢弃的时间
+    unsigned m_drop_count;      // 本轮丢弃状态已丢弃的个数
+    bool m_dropping;            // 是否处于丢弃状态
    
     // 保护请求队列的互斥锁
     locker m_queuelocker;
@@ -50,8 +74,10 @@ private:
 };
 
 template<typename T>
-threadpool<T>::threadpool(int thread_number, int max_requests):m_thread_number(thread_number), 
-    m_max_requests(max_requests),m_stop(false), m_threads(NULL){
+threadpool<T>::threadpool(int thread_number, int max_requests, int target_ms, int interval_ms):m_thread_number(thread_number), 
+    m_threads(NULL), m_max_requests(max_requests),
+    m_target_us(target_ms * 1000), m_interval_us(interval_ms * 1000),
+    m_first_above_us(0), m_drop_next_us(0), m_drop_count(0), m_dropping(false), m_stop(false){
     if(thread_number <= 0 || max_requests <= 0)
         throw std::exception();
     // 线程池
@@ -86,15 +112,20 @@ template<typename T>
 bool threadpool<T>::append(T * request){
     m_queuelocker.lock(); // 互斥锁上锁
     //请求队列线程数大于最大允许任务数，报错
-    if(m_workqueue.size() > m_max_requests){
+    if(m_workqueue.size() >= (size_t)m_max_requests){
         m_queuelocker.unlock();
+        g_stats.queue_rejected++;
         return false;
     }
-    // 请求队列中添加任务
-    m_workqueue.push_back(request);
+    // 请求队列中添加任务，记录入队时间
+    request_item item;
+    item.request = request;
+    item.enqueue_us = now_us();
+    m_workqueue.push_back(item);
     m_queuelocker.unlock(); //解锁
     // 添加了一个信号量增加1，信号量是请求队列中的任务数
     m_queuestat.post(); 
+    return true;
 }  
 
 template<typename T>
@@ -104,6 +135,52 @@ void * threadpool<T>::worker(void * arg){
     return pool;
 }
 
+template<typename T>
+uint64_t threadpool<T>::now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// CoDel：排队延迟在一个观察窗口内一直高于目标才进入丢弃状态，
+// 丢弃状态下按 interval/sqrt(count) 的间隔丢弃，直到排队延迟回到目标以下
+template<typename T>
+bool threadpool<T>::should_shed(uint64_t sojourn, uint64_t now){
+    bool above = false;
+    if(sojourn < m_target_us || m_workqueue.empty()){
+        m_first_above_us = 0; // 排队延迟正常，或者队列已经排空
+    }else if(m_first_above_us == 0){
+        m_first_above_us = now + m_interval_us;
+    }else if(now >= m_first_above_us){
+        above = true;
+    }
+
+    if(m_dropping){
+        if(!above){
+            m_dropping = false;
+            return false;
+        }
+        if(now >= m_drop_next_us){
+            m_drop_count++;
+            m_drop_next_us += (uint64_t)(m_interval_us / sqrt((double)m_drop_count));
+            return true;
+        }
+        return false;
+    }
+    if(above){
+        // 进入丢弃状态，如果刚退出不久，沿用之前的丢弃速度
+        m_dropping = true;
+        if(m_drop_count > 2 && now - m_drop_next_us < 16 * m_interval_us){
+            m_drop_count -= 2;
+        }else{
+            m_drop_count = 1;
+        }
+        m_drop_next_us = now + (uint64_t)(m_interval_us / sqrt((double)m_drop_count));
+        return true;
+    }
+    return false;
+}
+
 // 选一个子线程做任务
 template<typename T>
 void threadpool<T>::run(){
@@ -116,12 +193,24 @@ void threadpool<T>::run(){
             m_queuelocker.unlock(); //互斥锁解锁，直接循环
             continue;
         }
-        T * request = m_workqueue.front();
+        request_item item = m_workqueue.front();
         m_workqueue.pop_front();
+        // 统计排队时间，判断是否需要丢弃
+        uint64_t now = now_us();
+        uint64_t sojourn = now - item.enqueue_us;
+        bool shed = should_shed(sojourn, now);
         m_queuelocker.unlock();
+        g_stats.record_sojourn(sojourn);
+        T * request = item.request;
         if(!request){ // 任务不存在，直接循环
             continue;
         }
+        if(shed){
+            // 排队太久，直接返回过载响应
+            g_stats.queue_shed++;
+            request->shed();
+            continue;
+        }
         // 做任务，任务类
         request->process(); // 处理http请求的入口函数，线程池中子线程调用
     }
@@ -0,0 +1,91 @@
+#ifndef TIMER_QUEUE_H
+#define TIMER_QUEUE_H
+/*
+主线程的定时器。
+
+定时器放在最小堆中，timerfd总是设置为堆顶的到期时间，timerfd注册在主线程的epoll上，
+到期时主线程取出所有到期的定时器执行。只有主线程访问，不需要加锁。
+
+定时器不能取消：每个定时器带着连接在添加时的序号，连接关闭或者状态变化时序号加一，
+到期时序号不一致的定时器直接忽略。
+*/
+#include <exception>
+#include <vector>
+#include <queue>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+class timer_queue{
+public:
+    timer_queue():m_armed(0){
+        m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if(m_timerfd < 0){
+            throw std::exception();
+        }
+    }
+    ~timer_queue(){
+        close(m_timerfd);
+    }
+
+    int fd() const { return m_timerfd; }
+
+    static uint64_t now_us(){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    // deadline_us时刻对fd执行回调，seq是添加时连接的序号
+    void add(uint64_t deadline_us, int fd, unsigned seq){
+        timer t = {deadline_us, fd, seq};
+        m_heap.push(t);
+        if(m_armed == 0 || deadline_us < m_armed){
+            arm(deadline_us);
+        }
+    }
+
+    // timerfd可读时调用，对每个到期的定时器调用f(fd, seq)，之后按新的堆顶重新设置timerfd
+    template<class F>
+    void expire(F f){
+        uint64_t count;
+        ssize_t ret = read(m_timerfd, &count, sizeof(count));
+        (void)ret;
+        m_armed = 0;
+        uint64_t now = now_us();
+        while(!m_heap.empty() && m_heap.top().deadline_us <= now){
+            timer t = m_heap.top();
+            m_heap.pop();
+            f(t.fd, t.seq);
+        }
+        if(!m_heap.empty()){
+            arm(m_heap.top().deadline_us);
+        }
+    }
+
+private:
+    struct timer{
+        uint64_t deadline_us;
+        int fd;
+        unsigned seq;
+
+        bool operator>(const timer & o) const { return deadline_us > o.deadline_us; }
+    };
+
+    void arm(uint64_t deadline_us){
+        struct itimerspec its;
+        its.it_interval.tv_sec = 0;
+        its.it_interval.tv_nsec = 0;
+        its.it_value.tv_sec = deadline_us / 1000000;
+        its.it_value.tv_nsec = (deadline_us % 1000000) * 1000;
+        timerfd_settime(m_timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+        m_armed = deadline_us;
+    }
+
+    int m_timerfd;
+    uint64_t m_armed; // timerfd当前设置的到期时间，0表示没有设置
+    std::priority_queue<timer, std::vector<timer>, std::greater<timer> > m_heap;
+};
+
+#endif
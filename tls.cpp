@@ -0,0 +1,275 @@
+#include "tls.h"
+#include "server_stats.h"
+#include "config.h"
+#include <exception>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <openssl/err.h>
+
+tls_context::tls_context(const char *cert, const char *key, bool ktls) : m_ktls(ktls)
+{
+    m_ctx = SSL_CTX_new(TLS_server_method());
+    if (!m_ctx)
+    {
+        throw std::exception();
+    }
+    if (SSL_CTX_use_certificate_chain_file(m_ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(m_ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(m_ctx) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(m_ctx);
+        throw std::exception();
+    }
+    SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+    // 部分写：SSL_write写完一个记录就返回，和非阻塞的writev一样按已发送的字节数推进
+    // 移动的写缓冲：重试时iovec拼出的是同样的内容，但不一定在同一个地址
+    SSL_CTX_set_mode(m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // 不发送close_notify就断开的客户端很常见，当作正常关闭
+    long options = SSL_OP_IGNORE_UNEXPECTED_EOF;
+    if (ktls)
+    {
+        options |= SSL_OP_ENABLE_KTLS;
+    }
+    SSL_CTX_set_options(m_ctx, options);
+    // 一次recv读入socket中的多个记录，而不是每个记录先读头部再读内容
+    SSL_CTX_set_read_ahead(m_ctx, 1);
+    // 会话恢复：TLS 1.2的会话ID查这个缓存，票据的密钥在SSL_CTX_new时生成，fork之后各个worker相同
+    SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(m_ctx, SESSION_CACHE_SIZE);
+    SSL_CTX_set_session_id_context(m_ctx, (const unsigned char *)"webserver", 9);
+    SSL_CTX_set_num_tickets(m_ctx, 1); // 默认每次完整握手发两张票据，浏览器通常只用一张
+}
+
+tls_context::~tls_context()
+{
+    SSL_CTX_free(m_ctx);
+}
+
+SSL *tls_context::create(int fd)
+{
+    SSL *ssl = SSL_new(m_ctx);
+    if (!ssl)
+    {
+        return NULL;
+    }
+    // socket BIO直接读写fd，kTLS只能建立在socket BIO上
+    if (SSL_set_fd(ssl, fd) != 1)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+void tls_session::start(tls_context *context, int fd)
+{
+    m_ssl = context ? context->create(fd) : NULL;
+    m_handshaking = (context != NULL); // SSL对象创建失败时handshake返回TLS_ERROR，不会被当成明文连接
+    m_kernel_tx = false;
+    m_retry_len = 0;
+}
+
+void tls_session::close()
+{
+    if (m_ssl)
+    {
+        if (!m_handshaking)
+        {
+            SSL_shutdown(m_ssl); // 只发送close_notify，不等待对方的回应
+        }
+        SSL_free(m_ssl);
+        m_ssl = NULL;
+    }
+    m_handshaking = false;
+    m_kernel_tx = false;
+}
+
+int tls_session::handshake()
+{
+    if (!m_ssl)
+    {
+        g_stats.tls_failures++;
+        return TLS_ERROR;
+    }
+    while (true)
+    {
+        ERR_clear_error();
+        int ret = SSL_do_handshake(m_ssl);
+        if (ret == 1)
+        {
+            m_handshaking = false;
+#ifndef OPENSSL_NO_KTLS
+            m_kernel_tx = BIO_get_ktls_send(SSL_get_wbio(m_ssl));
+#endif
+            g_stats.tls_handshakes++;
+            if (SSL_session_reused(m_ssl))
+            {
+                g_stats.tls_resumed++;
+            }
+            if (m_kernel_tx)
+            {
+                g_stats.tls_ktls++;
+            }
+            return TLS_DONE;
+        }
+        int err = SSL_get_error(m_ssl, ret);
+        if (err == SSL_ERROR_WANT_READ)
+        {
+            return TLS_WANT_READ;
+        }
+        if (err == SSL_ERROR_WANT_WRITE)
+        {
+            // 证书链没有一次写进发送缓冲区：不在子线程里等待，由主线程等EPOLLOUT后再交回来
+            return TLS_WANT_WRITE;
+        }
+        g_stats.tls_failures++;
+        return TLS_ERROR;
+    }
+}
+
+ssize_t tls_session::recv(void *buf, size_t len)
+{
+    ERR_clear_error();
+    int n = SSL_read(m_ssl, buf, (int)len);
+    if (n > 0)
+    {
+        return n;
+    }
+    switch (SSL_get_error(m_ssl, n))
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    default:
+        errno = ECONNRESET;
+        return -1;
+    }
+}
+
+ssize_t tls_session::write_record(const void *data, size_t len)
+{
+    ERR_clear_error();
+    int n = SSL_write(m_ssl, data, (int)len);
+    if (n > 0)
+    {
+        m_retry_len = 0;
+        return n;
+    }
+    int err = SSL_get_error(m_ssl, n);
+    if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+    {
+        // 这个记录已经加密，下次必须用同样的内容重试
+        m_retry_len = len;
+        errno = EAGAIN;
+        return -1;
+    }
+    errno = EPIPE;
+    return -1;
+}
+
+// 按记录发送iovec：不小于一个记录的部分直接加密，小的部分（响应头部、分块大小行）和后面的内容拼进缓冲区，
+// 不会单独成为一个小记录。怎么切分只取决于iovec的内容，写缓冲满之后重试时得到的记录和上次一样
+ssize_t tls_session::writev(const struct iovec *iov, int count)
+{
+    char buf[RECORD_SIZE];
+    ssize_t total = 0;
+    int i = 0;
+    size_t off = 0;
+    while (i < count)
+    {
+        if (off == iov[i].iov_len)
+        {
+            i++;
+            off = 0;
+            continue;
+        }
+        const char *data = (const char *)iov[i].iov_base + off;
+        size_t len = iov[i].iov_len - off;
+        if (len >= RECORD_SIZE)
+        {
+            len = RECORD_SIZE;
+        }
+        else
+        {
+            len = 0;
+            int j = i;
+            size_t o = off;
+            while (j < count && len < RECORD_SIZE)
+            {
+                size_t n = iov[j].iov_len - o;
+                if (n > RECORD_SIZE - len)
+                {
+                    n = RECORD_SIZE - len;
+                }
+                memcpy(buf + len, (const char *)iov[j].iov_base + o, n);
+                len += n;
+                o += n;
+                if (o == iov[j].iov_len)
+                {
+                    j++;
+                    o = 0;
+                }
+            }
+            data = buf;
+        }
+        ssize_t n = write_record(data, len);
+        if (n < 0)
+        {
+            return total > 0 ? total : -1;
+        }
+        total += n;
+        size_t left = n;
+        while (left > 0)
+        {
+            size_t rest = iov[i].iov_len - off;
+            if (left < rest)
+            {
+                off += left;
+                break;
+            }
+            left -= rest;
+            i++;
+            off = 0;
+        }
+    }
+    return total;
+}
+
+ssize_t tls_session::send(const void *data, size_t len)
+{
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    return writev(&iov, 1);
+}
+
+bool parse_tls_spec(char *spec)
+{
+    char *cert = strchr(spec, ':');
+    char *key = cert ? strchr(cert + 1, ':') : NULL;
+    if (!key)
+    {
+        return false;
+    }
+    *cert++ = '\0';
+    *key++ = '\0';
+    char *flag = strchr(key, ':');
+    if (flag)
+    {
+        *flag++ = '\0';
+        if (strcmp(flag, "noktls") != 0)
+        {
+            return false;
+        }
+        g_config.ktls = false;
+    }
+    g_config.tls_port = atoi(spec);
+    g_config.tls_cert = cert;
+    g_config.tls_key = key;
+    return g_config.tls_port > 0 && *cert && *key;
+}
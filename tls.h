@@ -0,0 +1,78 @@
+#ifndef TLS_H
+#define TLS_H
+/*
+HTTPS监听（-H 端口:证书:私钥[:noktls]），用OpenSSL做握手。
+
+  1. 握手的非对称运算比较慢，主线程不做：TLS连接的第一个可读事件直接交给线程池，子线程推进握手，
+     握手没完成（WANT_READ）时交还连接，等下一个可读事件；需要写时（很少，发送缓冲区满）在子线程里等待可写
+  2. 握手完成后如果OpenSSL把记录层交给了内核（kTLS，SSL_OP_ENABLE_KTLS，需要内核的tls模块和支持的密码套件），
+     发送直接对socket调用writev/sendmsg/splice，内核加密，和明文连接走同样的路径（打包文件、缓存、代理的splice都不变）；
+     否则在用户态加密：响应的iovec拷贝到一块记录大小的缓冲区后SSL_write，代理的响应体读进缓冲区再加密，不用splice
+  3. 接收总是经过SSL_read（OpenSSL在kTLS接收时也能处理控制记录）
+  4. 会话恢复：服务端会话缓存 + TLS 1.3的会话票据。上下文在fork之前创建，所有worker共用票据的密钥，
+     客户端连到任何一个worker都能恢复，恢复的握手不做证书签名
+零拷贝发送（-Z）和上传的splice不用于TLS连接：数据需要经过加密，不能直接引用或者从socket搬走。
+*/
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+
+// 解析-H的参数（端口:证书:私钥[:noktls]，就地切分）写入g_config，格式错误返回false
+bool parse_tls_spec(char * spec);
+
+// 所有TLS连接共用的上下文：证书、私钥、会话缓存和票据密钥
+class tls_context{
+public:
+    static const int SESSION_CACHE_SIZE = 20480; // 服务端会话缓存的条目数（TLS 1.2客户端用会话ID恢复）
+
+    // 证书或者私钥读取失败时抛出异常
+    tls_context(const char * cert, const char * key, bool ktls);
+    ~tls_context();
+
+    SSL * create(int fd); // 新连接的SSL对象，服务端模式
+    bool ktls() const { return m_ktls; }
+
+private:
+    SSL_CTX * m_ctx;
+    bool m_ktls;
+};
+
+// 一个连接上的TLS状态，明文连接上的对象不做任何事情
+class tls_session{
+public:
+    // handshake的结果
+    enum STEP { TLS_DONE = 0, TLS_WANT_READ, TLS_WANT_WRITE, TLS_ERROR };
+    static const size_t RECORD_SIZE = 16384; // 用户态加密时每次SSL_write的最大数据量（一个记录）
+
+    tls_session():m_ssl(NULL), m_handshaking(false), m_kernel_tx(false), m_retry_len(0){}
+
+    // accept之后调用，context为空表示明文连接
+    void start(tls_context * context, int fd);
+    // 连接关闭之前调用：尽力发送close_notify（不等待），释放SSL对象
+    void close();
+
+    bool active() const { return m_handshaking || m_ssl; }
+    bool handshaking() const { return m_handshaking; }
+    // 握手完成并且发送需要经过SSL_write（没有kTLS）
+    bool userspace() const { return m_ssl && !m_handshaking && !m_kernel_tx; }
+    // 上次SSL_write没有写完的记录长度，重试时至少要提供这么多数据（限速截短发送时用）
+    size_t retry_len() const { return m_retry_len; }
+
+    // 推进握手（不阻塞）：需要对方的数据时返回TLS_WANT_READ，写缓冲满时返回TLS_WANT_WRITE
+    int handshake();
+    // 和recv/writev/send一样的返回值和errno（EAGAIN表示需要等待，0表示对方关闭）
+    ssize_t recv(void * buf, size_t len);
+    ssize_t writev(const struct iovec * iov, int count);
+    ssize_t send(const void * data, size_t len);
+
+private:
+    ssize_t write_record(const void * data, size_t len);
+
+    SSL * m_ssl;
+    bool m_handshaking;
+    bool m_kernel_tx;       // 内核负责发送方向的加密
+    size_t m_retry_len;
+};
+
+#endif
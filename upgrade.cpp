@@ -0,0 +1,192 @@
+#include "upgrade.h"
+#include "shm_cache.h"
+#include "http_conn.h"
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static bool make_addr(const char *path, sockaddr_un &addr)
+{
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+bool upgrade_inherit(const char *path, int &lfd, int &tls_lfd, std::vector<std::string> &hot, int &conn)
+{
+    sockaddr_un addr;
+    if (!make_addr(path, addr))
+    {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd); // 没有旧进程（或者只剩下socket文件）
+        return false;
+    }
+    // 旧进程卡住时不要一直等
+    struct timeval tv = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // 第一条消息带着监听socket
+    char buf[4096];
+    struct iovec iov = {buf, sizeof(buf)};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        close(fd);
+        return false;
+    }
+    // 和旧进程共享同一个打开的socket，已经是非阻塞的
+    int fds[2] = {-1, -1};
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), (count < 2 ? count : 2) * sizeof(int));
+    lfd = fds[0];
+    tls_lfd = fds[1];
+    std::string list(buf, n);
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+    {
+        if (n > 0)
+        {
+            list.append(buf, n);
+        }
+    }
+    size_t start = 0;
+    size_t end;
+    while ((end = list.find('\n', start)) != std::string::npos)
+    {
+        if (end > start)
+        {
+            hot.push_back(list.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    conn = fd;
+    return true;
+}
+
+void upgrade_ready(int conn)
+{
+    char c = 'R';
+    ssize_t ret = write(conn, &c, 1);
+    (void)ret;
+    close(conn);
+}
+
+int upgrade_listen(const char *path)
+{
+    sockaddr_un addr;
+    if (!make_addr(path, addr))
+    {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    unlink(path); // 旧进程的控制socket已经用完（或者是上次异常退出留下的）
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int upgrade_handoff(int ctrl_fd, int lfd, int tls_lfd, const std::vector<std::string> &hot)
+{
+    int conn = accept4(ctrl_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0)
+    {
+        return -1;
+    }
+    std::string list;
+    for (size_t i = 0; i < hot.size(); i++)
+    {
+        list += hot[i];
+        list += '\n';
+    }
+    // 至少一个字节的数据才能带上SCM_RIGHTS
+    char first = '\n';
+    struct iovec iov = {&first, 1};
+    int fds[2] = {lfd, tls_lfd};
+    int count = tls_lfd >= 0 ? 2 : 1;
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != 1)
+    {
+        close(conn);
+        return -1;
+    }
+    // 列表只有几十KB，新进程正在读，阻塞发送
+    size_t sent = 0;
+    while (sent < list.size())
+    {
+        ssize_t n = send(conn, list.data() + sent, list.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            close(conn);
+            return -1;
+        }
+        sent += n;
+    }
+    shutdown(conn, SHUT_WR);
+    return conn;
+}
+
+bool upgrade_confirmed(int conn)
+{
+    char c = 0;
+    ssize_t n = read(conn, &c, 1);
+    close(conn);
+    return n == 1 && c == 'R';
+}
+
+std::vector<std::string> hot_files()
+{
+    if (g_shm_cache)
+    {
+        return g_shm_cache->hot_paths(HOT_FILES);
+    }
+    if (http_conn::m_file_cache)
+    {
+        return http_conn::m_file_cache->hot_paths(HOT_FILES);
+    }
+    return std::vector<std::string>();
+}
@@ -0,0 +1,36 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+/*
+热升级（-U 控制socket路径）。
+
+每个进程在控制路径上监听一个Unix socket。新版本用同样的-U启动时先连接这个路径：
+  1. 旧进程接受连接，用SCM_RIGHTS把监听socket（有HTTPS监听时两个）传过去，之后发送热点文件列表（每行一个路径）并关闭写方向
+  2. 新进程用收到的监听socket代替bind/listen，按列表预先读入缓存，开始接受连接后回复一个字节R
+  3. 旧进程收到R后停止接受新连接并排空：关闭空闲的保持连接，正在处理的响应发送完后以Connection: close结束，
+     连接数降到0或者超过DRAIN_SECONDS后退出。新进程在确认前退出（连接关闭而没有R）时旧进程照常服务
+监听socket一直处于listen状态，全连接队列中的连接不会丢失，也不会有连接被重置。
+新进程接管之后在同一个路径上监听自己的控制socket，下一次升级时再交给更新的版本。
+*/
+#include <string>
+#include <vector>
+
+const int HOT_FILES = 256;      // 交给新进程预热的文件数
+const int DRAIN_SECONDS = 30;   // 旧进程最多等待这么久
+
+// 新进程：连接旧进程的控制socket，收到监听socket和热点文件列表后返回true，conn用于之后发送就绪通知
+// 旧进程没有HTTPS监听时tls_lfd为-1；路径上没有旧进程时返回false，调用者自己创建监听socket
+bool upgrade_inherit(const char * path, int & lfd, int & tls_lfd, std::vector<std::string> & hot, int & conn);
+// 新进程：已经可以接受连接，通知旧进程停止接受，并关闭conn
+void upgrade_ready(int conn);
+
+// 在路径上创建控制socket（删除之前的socket文件），失败返回-1
+int upgrade_listen(const char * path);
+// 旧进程：控制socket可读，接受升级请求并发送lfd、tls_lfd（-1表示没有）和热点文件列表，返回等待就绪通知的连接，失败返回-1
+int upgrade_handoff(int ctrl_fd, int lfd, int tls_lfd, const std::vector<std::string> & hot);
+// 旧进程：等待就绪通知的连接可读，新进程已经就绪返回true，新进程失败返回false；都会关闭conn
+bool upgrade_confirmed(int conn);
+
+// 交给新进程的热点文件：有共享内容缓存时取它的最近使用的文件（所有worker共用），否则取本进程的文件缓存
+std::vector<std::string> hot_files();
+
+#endif
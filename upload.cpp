@@ -0,0 +1,162 @@
+#include "upload.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// splice一次最多搬运的字节数，不超过pipe的默认容量
+const size_t SPLICE_CHUNK = 64 * 1024;
+
+file_upload::file_upload(const char *dir, const char *name)
+    : m_path(std::string(dir) + "/" + name), m_fd(-1), m_splice(true)
+{
+    m_pipe[0] = m_pipe[1] = -1;
+    // 临时文件以.开头，不会被当作上传的文件名，也不会和其他上传冲突
+    std::string tmpl = std::string(dir) + "/.upload-XXXXXX";
+    char *buf = &tmpl[0];
+    m_fd = mkostemp(buf, O_CLOEXEC);
+    if (m_fd < 0)
+    {
+        throw std::exception();
+    }
+    m_tmp_path = buf;
+    fchmod(m_fd, 0644);
+    if (pipe2(m_pipe, O_CLOEXEC) < 0)
+    {
+        m_splice = false; // 没有pipe也可以普通读写
+    }
+}
+
+file_upload::~file_upload()
+{
+    if (m_fd >= 0)
+    {
+        abort();
+    }
+    if (m_pipe[0] >= 0)
+    {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+    }
+}
+
+bool file_upload::valid_name(const char *name)
+{
+    size_t len = strlen(name);
+    if (len == 0 || len > 128 || name[0] == '.')
+    {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '_' || c == '-'))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool file_upload::write(const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = ::write(m_fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// socket -> pipe 非阻塞，pipe -> 文件 阻塞直到全部写入，pipe在两次调用之间总是空的
+ssize_t file_upload::splice_from(int sockfd, size_t len)
+{
+    if (!m_splice)
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+    if (len > SPLICE_CHUNK)
+    {
+        len = SPLICE_CHUNK;
+    }
+    ssize_t n = splice(sockfd, NULL, m_pipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0 && errno == EINVAL)
+    {
+        m_splice = false; // 这个socket不支持splice
+        errno = ENOSYS;
+        return -1;
+    }
+    if (n <= 0)
+    {
+        return n;
+    }
+    if (!drain_pipe(n))
+    {
+        errno = EIO;
+        return -1;
+    }
+    return n;
+}
+
+bool file_upload::drain_pipe(size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = m_splice ? splice(m_pipe[0], NULL, m_fd, NULL, len, SPLICE_F_MOVE) : -1;
+        if (n < 0 && (errno == EINVAL || !m_splice))
+        {
+            // 目标文件系统不支持splice，经过用户态把pipe中的数据写完，之后都用普通读写
+            m_splice = false;
+            char buf[4096];
+            n = read(m_pipe[0], buf, len < sizeof(buf) ? len : sizeof(buf));
+            if (n <= 0 || !write(buf, n))
+            {
+                return false;
+            }
+        }
+        else if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        len -= n;
+    }
+    return true;
+}
+
+bool file_upload::finish()
+{
+    int fd = m_fd;
+    m_fd = -1;
+    if (close(fd) < 0 || rename(m_tmp_path.c_str(), m_path.c_str()) < 0)
+    {
+        unlink(m_tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+void file_upload::abort()
+{
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+        unlink(m_tmp_path.c_str());
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+/*
+请求体的流式处理。
+
+http_conn不再把整个请求体放进读缓冲区，而是用读缓冲区作为固定大小的窗口，
+边收边把数据交给body_sink，每个上传占用的内存是固定的，和请求体大小无关。
+缓冲区为空并且处在数据阶段时，支持的接收者可以直接从socket搬运数据（splice），不经过用户态。
+*/
+#include <sys/types.h>
+#include <errno.h>
+#include <exception>
+#include <string>
+
+// 请求体的接收者，由子线程调用
+class body_sink{
+public:
+    virtual ~body_sink(){}
+    // 读缓冲区中的一段请求体
+    virtual bool write(const char * data, size_t len) = 0;
+    // 直接从socket搬运最多len字节，返回搬运的字节数，0表示对方关闭，-1时看errno：
+    // EAGAIN表示socket暂时没有数据，ENOSYS表示不支持，调用者改为recv后调用write
+    virtual ssize_t splice_from(int sockfd, size_t len){
+        (void)sockfd; (void)len;
+        errno = ENOSYS;
+        return -1;
+    }
+    virtual bool finish() = 0; // 请求体接收完毕，返回false表示保存失败
+    virtual void abort() = 0;  // 请求出错或者连接断开，丢弃已经收到的数据
+};
+
+// 上传文件：先写到同目录的临时文件，接收完毕后rename成目标文件，中途失败不会留下不完整的文件
+// socket -> pipe -> 文件 全程splice，pipe每个上传一对
+class file_upload : public body_sink{
+public:
+    file_upload(const char * dir, const char * name); // 创建临时文件失败时抛出异常
+    ~file_upload();
+
+    bool write(const char * data, size_t len);
+    ssize_t splice_from(int sockfd, size_t len);
+    bool finish();
+    void abort();
+
+    // 文件名只能包含字母、数字和 . _ -，不能以.开头，不能包含目录
+    static bool valid_name(const char * name);
+
+private:
+    bool drain_pipe(size_t len); // 把pipe中的len字节写入文件
+
+    std::string m_path;     // 目标文件
+    std::string m_tmp_path; // 临时文件
+    int m_fd;
+    int m_pipe[2];
+    bool m_splice;          // 文件系统不支持splice时改为普通读写
+};
+
+#endif
@@ -0,0 +1,233 @@
+#include "upstream.h"
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+
+upstream_pool::upstream_pool(int epollfd, int max_fd)
+    : m_epollfd(epollfd), m_backend_of(max_fd, NULL), m_owner(max_fd, NULL)
+{
+}
+
+upstream_pool::~upstream_pool()
+{
+    for (size_t fd = 0; fd < m_backend_of.size(); fd++)
+    {
+        if (m_backend_of[fd])
+        {
+            close(fd);
+        }
+    }
+    for (size_t i = 0; i < m_groups.size(); i++)
+    {
+        for (size_t j = 0; j < m_groups[i]->backends.size(); j++)
+        {
+            delete m_groups[i]->backends[j];
+        }
+        delete m_groups[i];
+    }
+}
+
+bool upstream_pool::add_group(const char *spec)
+{
+    const char *eq = strchr(spec, '=');
+    if (!eq || eq == spec || spec[0] != '/')
+    {
+        return false;
+    }
+    upstream_group *group = new upstream_group;
+    group->prefix.assign(spec, eq - spec);
+    group->rr = 0;
+    const char *p = eq + 1;
+    while (*p)
+    {
+        size_t len = strcspn(p, ",");
+        std::string item(p, len);
+        p += len;
+        if (*p == ',')
+        {
+            p++;
+        }
+        size_t colon = item.rfind(':');
+        upstream_backend *backend = new upstream_backend;
+        backend->name = item;
+        memset(&backend->addr, 0, sizeof(backend->addr));
+        backend->addr.sin_family = AF_INET;
+        int port = (colon == std::string::npos) ? 0 : atoi(item.c_str() + colon + 1);
+        std::string host = (colon == std::string::npos) ? item : item.substr(0, colon);
+        if (port <= 0 || port > 65535 || inet_pton(AF_INET, host.c_str(), &backend->addr.sin_addr) != 1)
+        {
+            delete backend;
+            for (size_t j = 0; j < group->backends.size(); j++)
+            {
+                delete group->backends[j];
+            }
+            delete group;
+            return false;
+        }
+        backend->addr.sin_port = htons(port);
+        group->backends.push_back(backend);
+    }
+    if (group->backends.empty())
+    {
+        delete group;
+        return false;
+    }
+    m_groups.push_back(group);
+    return true;
+}
+
+upstream_group *upstream_pool::match(const char *url) const
+{
+    upstream_group *best = NULL;
+    for (size_t i = 0; i < m_groups.size(); i++)
+    {
+        const std::string &prefix = m_groups[i]->prefix;
+        if (strncmp(url, prefix.c_str(), prefix.size()) == 0 && (!best || prefix.size() > best->prefix.size()))
+        {
+            best = m_groups[i];
+        }
+    }
+    return best;
+}
+
+upstream_backend *upstream_pool::choose(upstream_group *group, uint64_t now_us)
+{
+    size_t n = group->backends.size();
+    upstream_backend *best = NULL;
+    bool best_down = true;
+    for (size_t i = 0; i < n; i++)
+    {
+        upstream_backend *b = group->backends[(group->rr + i) % n];
+        bool down = b->down_until_us > now_us;
+        if (!best || (best_down && !down) ||
+            (down == best_down &&
+             b->outstanding.load(std::memory_order_relaxed) < best->outstanding.load(std::memory_order_relaxed)))
+        {
+            best = b;
+            best_down = down;
+        }
+    }
+    group->rr++;
+    return best;
+}
+
+int upstream_pool::acquire(upstream_backend *backend, void *owner, bool &reused, bool &connecting, bool fresh)
+{
+    reused = false;
+    connecting = false;
+    if (!fresh && !backend->idle.empty())
+    {
+        int fd = backend->idle.back();
+        backend->idle.pop_back();
+        m_owner[fd] = owner;
+        reused = true;
+        backend->reuses++;
+        return fd;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fd >= (int)m_backend_of.size())
+    {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&backend->addr, sizeof(backend->addr)) < 0)
+    {
+        if (errno != EINPROGRESS)
+        {
+            close(fd);
+            return -1;
+        }
+        connecting = true;
+    }
+    // 读写都监听，边沿触发，连接放回空闲列表后也不注销
+    epoll_event ev;
+    ev.data.fd = fd;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &ev);
+    m_backend_of[fd] = backend;
+    m_owner[fd] = owner;
+    backend->connects++;
+    return fd;
+}
+
+void upstream_pool::release(upstream_backend *backend, int fd, bool reusable)
+{
+    m_owner[fd] = NULL;
+    if (reusable && backend->idle.size() < MAX_IDLE)
+    {
+        backend->idle.push_back(fd);
+        return;
+    }
+    close_fd(fd);
+}
+
+void upstream_pool::on_idle_event(int fd, uint32_t events)
+{
+    // 空闲连接变得可写是正常的，可读或者挂断说明后端关闭了连接
+    if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+    {
+        return;
+    }
+    upstream_backend *backend = m_backend_of[fd];
+    std::vector<int>::iterator it = std::find(backend->idle.begin(), backend->idle.end(), fd);
+    if (it != backend->idle.end())
+    {
+        backend->idle.erase(it);
+    }
+    close_fd(fd);
+}
+
+void upstream_pool::close_fd(int fd)
+{
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, fd, 0);
+    close(fd);
+    m_backend_of[fd] = NULL;
+    m_owner[fd] = NULL;
+}
+
+void upstream_pool::record(upstream_backend *backend, uint64_t latency_us, bool ok)
+{
+    backend->outstanding--;
+    if (!ok)
+    {
+        backend->errors++;
+        return;
+    }
+    backend->requests++;
+    backend->latency_us += latency_us;
+    unsigned long max = backend->latency_max_us.load();
+    while (latency_us > max && !backend->latency_max_us.compare_exchange_weak(max, latency_us))
+    {
+    }
+}
+
+void upstream_pool::dump(FILE *out) const
+{
+    for (size_t i = 0; i < m_groups.size(); i++)
+    {
+        for (size_t j = 0; j < m_groups[i]->backends.size(); j++)
+        {
+            const upstream_backend *b = m_groups[i]->backends[j];
+            unsigned long requests = b->requests.load();
+            fprintf(out, "upstream %s%s requests %lu errors %lu outstanding %d connects %lu reuses %lu "
+                         "latency_avg_us %lu latency_max_us %lu bytes %lu\n",
+                    m_groups[i]->prefix.c_str(), b->name.c_str(), requests, b->errors.load(), b->outstanding.load(),
+                    b->connects.load(), b->reuses.load(), requests ? b->latency_us.load() / requests : 0,
+                    b->latency_max_us.load(), b->bytes.load());
+        }
+    }
+    fflush(out);
+}
@@ -0,0 +1,87 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+/*
+反向代理的上游（后端）和长连接池。
+
+-P /api/=127.0.0.1:8081,127.0.0.1:8082 把以/api/开头的请求转发给这两个后端，可以配置多组，按最长前缀匹配。
+组内按未完成请求数最少选择后端（相同时轮询），到后端的连接用完后放回空闲列表，之后的请求复用。
+
+上游连接和客户端连接注册在同一个epoll上（边沿触发，同时监听读写），所有的连接操作都在主线程，
+空闲列表和fd表不需要加锁；统计项是原子的，/status/upstreams在子线程读取。
+*/
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+struct upstream_backend{
+    std::string name;               // host:port
+    sockaddr_in addr;
+    std::vector<int> idle;          // 空闲的长连接，只有主线程访问
+    uint64_t down_until_us;         // 连接失败后暂时不再选择，只有主线程访问
+    std::atomic<int> outstanding;   // 正在转发的请求数，用于最少未完成请求的负载均衡
+    std::atomic<unsigned long> requests;    // 完成的请求数
+    std::atomic<unsigned long> errors;      // 失败的请求数（连接失败、响应不完整、客户端中途断开）
+    std::atomic<unsigned long> connects;    // 新建的连接数
+    std::atomic<unsigned long> reuses;      // 复用空闲连接的次数
+    std::atomic<unsigned long> latency_us;  // 累计延迟（从选择后端到响应转发完毕）
+    std::atomic<unsigned long> latency_max_us;
+    std::atomic<unsigned long> bytes;       // 转发给客户端的字节数
+
+    upstream_backend() : down_until_us(0), outstanding(0), requests(0), errors(0), connects(0), reuses(0), latency_us(0),
+        latency_max_us(0), bytes(0){}
+};
+
+struct upstream_group{
+    std::string prefix;                     // url前缀
+    std::vector<upstream_backend *> backends;
+    unsigned rr;                            // 未完成请求数相同时轮询的起点
+};
+
+class upstream_pool{
+public:
+    static const size_t MAX_IDLE = 32;      // 每个后端最多保留的空闲连接数
+    static const uint64_t DOWN_US = 1000000; // 连接失败的后端1秒内不再选择
+
+    upstream_pool(int epollfd, int max_fd);
+    ~upstream_pool();
+
+    // 解析 前缀=host:port[,host:port...]，格式错误时返回false
+    bool add_group(const char * spec);
+    // 最长前缀匹配，没有时返回NULL（启动后只读，子线程也可以调用）
+    upstream_group * match(const char * url) const;
+
+    // 以下只在主线程调用
+    // 选择未完成请求最少的后端，跳过刚刚连接失败的（全部失败时仍然选择）
+    upstream_backend * choose(upstream_group * group, uint64_t now_us);
+    // 连接失败，一段时间内不再选择这个后端
+    void mark_down(upstream_backend * backend, uint64_t now_us) { backend->down_until_us = now_us + DOWN_US; }
+    // 取得到后端的连接（优先复用空闲连接），owner是连接上事件的处理者；失败时返回-1
+    // reused表示是复用的连接，connecting表示非阻塞connect还没有完成
+    int acquire(upstream_backend * backend, void * owner, bool & reused, bool & connecting, bool fresh = false);
+    // 响应结束，可以复用时放回空闲列表，否则关闭
+    void release(upstream_backend * backend, int fd, bool reusable);
+    // fd是否是上游连接，以及当前的处理者（空闲时为NULL）
+    bool is_upstream(int fd) const { return fd >= 0 && fd < (int)m_backend_of.size() && m_backend_of[fd] != NULL; }
+    void * owner(int fd) const { return m_owner[fd]; }
+    // 空闲连接上的事件：后端关闭了连接或者发来了多余的数据，关闭它
+    void on_idle_event(int fd, uint32_t events);
+
+    // 记录一个请求的结果
+    static void record(upstream_backend * backend, uint64_t latency_us, bool ok);
+
+    const std::vector<upstream_group *> & groups() const { return m_groups; }
+    void dump(FILE * out) const;
+
+private:
+    void close_fd(int fd);
+
+    int m_epollfd;
+    std::vector<upstream_group *> m_groups;
+    std::vector<upstream_backend *> m_backend_of;   // fd -> 所属后端，NULL表示不是上游连接
+    std::vector<void *> m_owner;                    // fd -> 正在使用的处理者
+};
+
+#endif
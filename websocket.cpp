@@ -0,0 +1,522 @@
+#include "websocket.h"
+#include "server_stats.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <openssl/evp.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const char WS_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// 掩码先按offset旋转成从p开始的4字节，之后每16/8字节的块和重复的掩码异或，块的起点都是4的倍数
+void ws_unmask(char *p, size_t len, const uint8_t mask[4], size_t offset)
+{
+    uint8_t m[4];
+    for (int i = 0; i < 4; i++)
+    {
+        m[i] = mask[(offset + i) & 3];
+    }
+    uint32_t m32;
+    memcpy(&m32, m, sizeof(m32));
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i m128 = _mm_set1_epi32((int)m32);
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        _mm_storeu_si128((__m128i *)(p + i), _mm_xor_si128(v, m128));
+    }
+#endif
+    uint64_t m64 = ((uint64_t)m32 << 32) | m32;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        v ^= m64;
+        memcpy(p + i, &v, sizeof(v));
+    }
+    for (; i < len; i++)
+    {
+        p[i] ^= m[i & 3];
+    }
+}
+
+// base64(SHA1(key + GUID))
+bool ws_accept_key(const char *key, char *out, size_t cap)
+{
+    size_t key_len = strlen(key);
+    while (key_len > 0 && (key[key_len - 1] == ' ' || key[key_len - 1] == '\t'))
+    {
+        key_len--;
+    }
+    if (key_len != 24 || cap < 29)
+    {
+        return false; // 16字节的随机数编码后是24个字符
+    }
+    char buf[24 + sizeof(WS_GUID)];
+    memcpy(buf, key, key_len);
+    memcpy(buf + key_len, WS_GUID, sizeof(WS_GUID) - 1);
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    if (!EVP_Digest(buf, key_len + sizeof(WS_GUID) - 1, md, &md_len, EVP_sha1(), NULL))
+    {
+        return false;
+    }
+    EVP_EncodeBlock((unsigned char *)out, md, md_len);
+    return true;
+}
+
+static ws_message *allocate(size_t size)
+{
+    void *mem = malloc(sizeof(ws_message) + size);
+    if (!mem)
+    {
+        throw std::bad_alloc();
+    }
+    return new (mem) ws_message;
+}
+
+ws_message *ws_message::encode(int opcode, const char *payload, size_t len)
+{
+    size_t head = len < 126 ? 2 : (len < 65536 ? 4 : 10);
+    ws_message *m = allocate(head + len);
+    uint8_t *h = (uint8_t *)m->m_data;
+    h[0] = 0x80 | opcode;
+    if (len < 126)
+    {
+        h[1] = len;
+    }
+    else if (len < 65536)
+    {
+        h[1] = 126;
+        h[2] = len >> 8;
+        h[3] = len;
+    }
+    else
+    {
+        h[1] = 127;
+        for (int i = 0; i < 8; i++)
+        {
+            h[2 + i] = (uint64_t)len >> (56 - 8 * i);
+        }
+    }
+    memcpy(m->m_data + head, payload, len);
+    m->m_len = head + len;
+    m->m_refs.store(1, std::memory_order_relaxed);
+    return m;
+}
+
+ws_message *ws_message::copy(const char *data, size_t len)
+{
+    ws_message *m = allocate(len);
+    memcpy(m->m_data, data, len);
+    m->m_len = len;
+    m->m_refs.store(1, std::memory_order_relaxed);
+    return m;
+}
+
+void ws_message::unref()
+{
+    if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        this->~ws_message();
+        free(this);
+    }
+}
+
+ws_session::ws_session(void *owner, const char *channel, size_t channel_len, const char *accept_key)
+    : m_slot(0), m_dirty(false), m_overflow(false), m_owner(owner), m_channel(channel, channel_len),
+      m_closing(false), m_head_len(0), m_head_need(2), m_opcode(0), m_fin(false), m_left(0), m_offset(0),
+      m_message_opcode(0), m_control_len(0), m_queued(0), m_sent(0)
+{
+    char buf[160];
+    int n = snprintf(buf, sizeof(buf),
+                     "HTTP/1.1 101 Switching Protocols\r\n"
+                     "Upgrade: websocket\r\n"
+                     "Connection: Upgrade\r\n"
+                     "Sec-WebSocket-Accept: %s\r\n"
+                     "\r\n",
+                     accept_key);
+    ws_message *m = ws_message::copy(buf, n);
+    push(m);
+    m->unref();
+}
+
+ws_session::~ws_session()
+{
+    for (size_t i = 0; i < m_queue.size(); i++)
+    {
+        m_queue[i]->unref();
+    }
+}
+
+void ws_session::consume(ws_hub *hub, const char *data, size_t len)
+{
+    size_t pos = 0;
+    while (pos < len && !m_closing)
+    {
+        if (m_head_len < m_head_need)
+        {
+            size_t n = m_head_need - m_head_len;
+            if (n > len - pos)
+            {
+                n = len - pos;
+            }
+            memcpy(m_head + m_head_len, data + pos, n);
+            m_head_len += n;
+            pos += n;
+            if (m_head_len == 2)
+            {
+                // 第二个字节确定扩展长度，客户端的帧必须带掩码
+                uint8_t len7 = m_head[1] & 0x7f;
+                m_head_need = 2 + (len7 == 126 ? 2 : (len7 == 127 ? 8 : 0)) + 4;
+                if (!(m_head[1] & 0x80))
+                {
+                    fail(1002);
+                    return;
+                }
+            }
+            if (m_head_len < m_head_need)
+            {
+                continue;
+            }
+            if (!start_frame())
+            {
+                return;
+            }
+            if (m_left == 0)
+            {
+                end_frame(hub);
+            }
+            continue;
+        }
+        size_t n = m_left < len - pos ? (size_t)m_left : len - pos;
+        if (m_opcode & 0x8)
+        {
+            memcpy(m_control + m_control_len, data + pos, n);
+            ws_unmask(m_control + m_control_len, n, m_mask, m_offset);
+            m_control_len += n;
+        }
+        else
+        {
+            size_t old = m_message.size();
+            m_message.append(data + pos, n);
+            ws_unmask(&m_message[old], n, m_mask, m_offset);
+        }
+        pos += n;
+        m_left -= n;
+        m_offset += n;
+        if (m_left == 0)
+        {
+            end_frame(hub);
+        }
+    }
+}
+
+// 帧头完整了：检查操作码、分片和长度，协议错误时发送close帧
+bool ws_session::start_frame()
+{
+    m_fin = m_head[0] & 0x80;
+    m_opcode = m_head[0] & 0x0f;
+    if (m_head[0] & 0x70)
+    {
+        fail(1002); // 没有协商扩展，RSV必须为0
+        return false;
+    }
+    uint64_t len = m_head[1] & 0x7f;
+    if (len == 126)
+    {
+        len = ((uint64_t)m_head[2] << 8) | m_head[3];
+    }
+    else if (len == 127)
+    {
+        len = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            len = (len << 8) | m_head[2 + i];
+        }
+    }
+    memcpy(m_mask, m_head + m_head_need - 4, 4);
+    if (m_opcode & 0x8)
+    {
+        if (!m_fin || len > MAX_CONTROL ||
+            (m_opcode != ws_message::CLOSE && m_opcode != ws_message::PING && m_opcode != ws_message::PONG))
+        {
+            fail(1002); // 控制帧不能分片，内容不超过125字节
+            return false;
+        }
+        m_control_len = 0;
+    }
+    else
+    {
+        if (m_opcode == ws_message::CONTINUATION ? m_message_opcode == 0
+                                                  : (m_message_opcode != 0 ||
+                                                     (m_opcode != ws_message::TEXT && m_opcode != ws_message::BINARY)))
+        {
+            fail(1002); // 没有开始的分片、上一条消息还没有结束、未知的操作码
+            return false;
+        }
+        if (len > MAX_MESSAGE - m_message.size())
+        {
+            fail(1009);
+            return false;
+        }
+        if (m_opcode != ws_message::CONTINUATION)
+        {
+            m_message_opcode = m_opcode;
+        }
+    }
+    m_left = len;
+    m_offset = 0;
+    return true;
+}
+
+void ws_session::end_frame(ws_hub *hub)
+{
+    m_head_len = 0;
+    m_head_need = 2;
+    if (m_opcode & 0x8)
+    {
+        on_control();
+    }
+    else if (m_fin)
+    {
+        on_message(hub);
+    }
+}
+
+void ws_session::on_message(ws_hub *hub)
+{
+    g_stats.ws_messages++;
+    hub->publish(m_channel, m_message.data(), m_message.size(), m_message_opcode == ws_message::BINARY);
+    m_message_opcode = 0;
+    if (m_message.capacity() > 4096)
+    {
+        std::string().swap(m_message); // 大消息的缓冲区不留在空闲的连接上
+    }
+    else
+    {
+        m_message.clear();
+    }
+}
+
+void ws_session::on_control()
+{
+    if (m_opcode == ws_message::PING)
+    {
+        ws_message *m = ws_message::encode(ws_message::PONG, m_control, m_control_len);
+        push(m);
+        m->unref();
+    }
+    else if (m_opcode == ws_message::CLOSE)
+    {
+        if (m_control_len == 1)
+        {
+            fail(1002);
+            return;
+        }
+        // 回复同样的状态码，发送完后关闭
+        ws_message *m = ws_message::encode(ws_message::CLOSE, m_control, m_control_len >= 2 ? 2 : 0);
+        push(m);
+        m->unref();
+        m_closing = true;
+    }
+}
+
+void ws_session::fail(uint16_t code)
+{
+    char payload[2] = {(char)(code >> 8), (char)code};
+    ws_message *m = ws_message::encode(ws_message::CLOSE, payload, sizeof(payload));
+    push(m);
+    m->unref();
+    m_closing = true;
+}
+
+bool ws_session::push(ws_message *m)
+{
+    if (m_queued + m->size() > MAX_QUEUED)
+    {
+        m_overflow = true;
+        return false;
+    }
+    m->ref();
+    m_queue.push_back(m);
+    m_queued += m->size();
+    return true;
+}
+
+int ws_session::flush(int fd, tls_session &tls)
+{
+    while (!m_queue.empty())
+    {
+        struct iovec iov[MAX_IOV];
+        int count = 0;
+        for (std::deque<ws_message *>::iterator it = m_queue.begin(); it != m_queue.end() && count < MAX_IOV; ++it)
+        {
+            size_t skip = count == 0 ? m_sent : 0;
+            iov[count].iov_base = (char *)(*it)->data() + skip;
+            iov[count].iov_len = (*it)->size() - skip;
+            count++;
+        }
+        ssize_t n;
+        if (tls.userspace())
+        {
+            n = tls.writev(iov, count);
+        }
+        else
+        {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        }
+        if (n < 0)
+        {
+            return errno == EAGAIN ? WS_BLOCKED : WS_CLOSE;
+        }
+        g_stats.ws_writev++;
+        m_queued -= n;
+        while (n > 0)
+        {
+            ws_message *m = m_queue.front();
+            size_t rest = m->size() - m_sent;
+            if ((size_t)n < rest)
+            {
+                m_sent += n;
+                break;
+            }
+            n -= rest;
+            m_sent = 0;
+            m->unref();
+            m_queue.pop_front();
+        }
+    }
+    return m_closing ? WS_CLOSE : WS_OK;
+}
+
+void ws_session::close(int fd, tls_session &tls)
+{
+    if (m_closing || m_sent != 0)
+    {
+        return; // 发送到一半的帧后面不能插入
+    }
+    m_closing = true;
+    static const char going_away[] = {(char)(0x80 | ws_message::CLOSE), 2, (char)(1001 >> 8), (char)(1001 & 0xff)};
+    if (tls.userspace())
+    {
+        tls.send(going_away, sizeof(going_away));
+        return;
+    }
+    send(fd, going_away, sizeof(going_away), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+ws_hub::ws_hub()
+{
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_eventfd < 0)
+    {
+        throw std::exception();
+    }
+}
+
+ws_hub::~ws_hub()
+{
+    for (size_t i = 0; i < m_queue.size(); i++)
+    {
+        m_queue[i].message->unref();
+    }
+    close(m_eventfd);
+}
+
+void ws_hub::publish(const std::string &channel, const char *data, size_t len, bool binary)
+{
+    pending p;
+    p.channel = channel;
+    p.message = ws_message::encode(binary ? ws_message::BINARY : ws_message::TEXT, data, len);
+    m_lock.lock();
+    bool wake = m_queue.empty();
+    m_queue.push_back(p);
+    m_lock.unlock();
+    g_stats.ws_published++;
+    if (wake)
+    {
+        // 队列原来是空的，唤醒主线程（合并唤醒）
+        uint64_t one = 1;
+        ssize_t ret = write(m_eventfd, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+void ws_hub::subscribe(ws_session *s)
+{
+    std::vector<ws_session *> &subscribers = m_channels[s->channel()];
+    s->m_slot = subscribers.size();
+    subscribers.push_back(s);
+}
+
+// 和最后一个订阅者交换位置后删除，频道空了时删除频道
+void ws_hub::unsubscribe(ws_session *s)
+{
+    std::unordered_map<std::string, std::vector<ws_session *> >::iterator it = m_channels.find(s->channel());
+    if (it == m_channels.end())
+    {
+        return;
+    }
+    std::vector<ws_session *> &subscribers = it->second;
+    if (s->m_slot >= subscribers.size() || subscribers[s->m_slot] != s)
+    {
+        return; // 还没有订阅
+    }
+    ws_session *last = subscribers.back();
+    subscribers[s->m_slot] = last;
+    last->m_slot = s->m_slot;
+    subscribers.pop_back();
+    if (subscribers.empty())
+    {
+        m_channels.erase(it);
+    }
+}
+
+void ws_hub::collect()
+{
+    uint64_t cnt;
+    ssize_t ret = read(m_eventfd, &cnt, sizeof(cnt)); // 先清空计数，之后publish的消息会再次唤醒
+    (void)ret;
+    m_lock.lock();
+    m_batch.swap(m_queue);
+    m_lock.unlock();
+    for (size_t i = 0; i < m_batch.size(); i++)
+    {
+        ws_message *m = m_batch[i].message;
+        std::unordered_map<std::string, std::vector<ws_session *> >::iterator it = m_channels.find(m_batch[i].channel);
+        if (it != m_channels.end())
+        {
+            std::vector<ws_session *> &subscribers = it->second;
+            for (size_t k = 0; k < subscribers.size(); k++)
+            {
+                ws_session *s = subscribers[k];
+                s->push(m); // 溢出的会话由send关闭
+                if (!s->m_dirty)
+                {
+                    s->m_dirty = true;
+                    m_sending.push_back(s);
+                }
+            }
+            g_stats.ws_deliveries += subscribers.size();
+        }
+        m->unref();
+    }
+    m_batch.clear();
+    for (size_t i = 0; i < m_sending.size(); i++)
+    {
+        m_sending[i]->m_dirty = false;
+    }
+}
@@ -0,0 +1,161 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+/*
+WebSocket（RFC 6455）：路径以-s的前缀开始的HTTP/1.1 GET请求带Upgrade: websocket时升级，前缀之后的部分（不含查询串）是频道名，
+连接订阅这个频道，客户端发来的每条消息广播给频道中的所有连接（包括它自己）。
+
+  1. 握手：Sec-WebSocket-Accept = base64(SHA1(key + GUID))，101响应作为发送队列中的第一帧。升级之后连接只由主线程处理
+     （和反向代理一样），子线程处理的握手请求用完成事件COMP_WS交给主线程
+  2. 接收：主线程读到数据后直接解析帧，客户端的帧都带4字节的掩码，去掩码按16字节（SSE2）/8字节一次异或，
+     掩码按帧内的偏移旋转，一帧分几次读到时接着处理。ping回复pong，close回复close后关闭
+  3. 广播：消息只编码一次（服务器发出的帧不带掩码，所有订阅者收到的字节完全相同），放进带引用计数的ws_message，
+     订阅者的发送队列只保存指针。publish可以在任意线程调用，消息放进队列后用eventfd唤醒主线程；
+     主线程一次取出所有消息，先追加到各个订阅者的发送队列，再对每个订阅者用一次writev发送队列中的所有帧
+  4. 发送队列超过MAX_QUEUED（读得太慢的客户端）时关闭连接，不让它占住内存；-W的带宽限制不作用于WebSocket
+文本消息不检查UTF-8，不支持扩展（permessage-deflate）和子协议。
+*/
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <sys/uio.h>
+#include "locker.h"
+#include "tls.h"
+
+// 去掉（或者加上）掩码，offset是p在帧的内容中的偏移
+void ws_unmask(char * p, size_t len, const uint8_t mask[4], size_t offset);
+// Sec-WebSocket-Key对应的Sec-WebSocket-Accept（28个字符加\0），key不是16字节的base64时返回false
+bool ws_accept_key(const char * key, char * out, size_t cap);
+
+// 编码好的一帧，所有订阅者共用，最后一个引用释放时回收
+class ws_message{
+public:
+    enum OPCODE { CONTINUATION = 0x0, TEXT = 0x1, BINARY = 0x2, CLOSE = 0x8, PING = 0x9, PONG = 0xa };
+
+    // 编码一帧（FIN，不带掩码），引用计数为1
+    static ws_message * encode(int opcode, const char * payload, size_t len);
+    // 原样的字节（握手的101响应），引用计数为1
+    static ws_message * copy(const char * data, size_t len);
+
+    void ref() { m_refs.fetch_add(1, std::memory_order_relaxed); }
+    void unref();
+    const char * data() const { return m_data; }
+    size_t size() const { return m_len; }
+
+private:
+    std::atomic<int> m_refs;
+    size_t m_len;
+    char m_data[1];             // 帧头 + 内容，分配时一起分配
+};
+
+class ws_hub;
+
+// 一个升级后的连接：接收帧的状态和发送队列，只在主线程访问
+class ws_session{
+public:
+    // flush的结果
+    enum RESULT { WS_OK = 0, WS_BLOCKED, WS_CLOSE };
+    static const size_t MAX_MESSAGE = 65536;    // 客户端一条消息（所有分片）的最大大小，超过时以1009关闭
+    static const size_t MAX_QUEUED = 1 << 20;   // 发送队列中没有发送的字节数上限
+    static const int MAX_IOV = 64;              // 一次writev的帧数
+
+    // owner是连接（http_conn），accept_key是计算好的Sec-WebSocket-Accept，101响应放进发送队列
+    ws_session(void * owner, const char * channel, size_t channel_len, const char * accept_key);
+    ~ws_session();
+
+    void * owner() const { return m_owner; }
+    const std::string & channel() const { return m_channel; }
+
+    // 消费读到的数据，完整的消息交给hub发布；协议错误或者对方关闭时close帧已经排队，之后的数据忽略
+    void consume(ws_hub * hub, const char * data, size_t len);
+    // 追加一帧到发送队列，队列超过MAX_QUEUED时返回false（连接需要关闭）
+    bool push(ws_message * m);
+    // 发送队列中的帧，tls为HTTPS连接的加密（明文连接上直接sendmsg）
+    int flush(int fd, tls_session & tls);
+    // 连接关闭之前：没有发送过close帧并且没有发送到一半的帧时尽力发送1001（不等待）
+    void close(int fd, tls_session & tls);
+
+    // hub的记录：在频道数组中的下标、本次广播是否已经在待发送列表中、发送队列是否溢出
+    size_t m_slot;
+    bool m_dirty;
+    bool m_overflow;
+
+private:
+    static const size_t MAX_CONTROL = 125;      // 控制帧的最大内容
+
+    bool start_frame();                         // 帧头完整了，检查失败时返回false（close帧已经排队）
+    void end_frame(ws_hub * hub);               // 帧的内容完整了
+    void fail(uint16_t code);                   // 发送close帧，之后关闭连接
+    void on_message(ws_hub * hub);
+    void on_control();
+
+    void * m_owner;
+    std::string m_channel;
+    bool m_closing;             // close帧已经排队，发送完后关闭，不再处理输入
+
+    // 接收帧的状态
+    uint8_t m_head[14];         // 帧头（最长2 + 8 + 4字节）
+    size_t m_head_len;
+    size_t m_head_need;         // 帧头的长度，读到第二个字节后确定
+    int m_opcode;               // 当前帧的操作码
+    bool m_fin;
+    uint8_t m_mask[4];
+    uint64_t m_left;            // 当前帧还没有收到的内容
+    uint64_t m_offset;          // 当前帧已经收到的内容，掩码的偏移
+    int m_message_opcode;       // 正在拼接的消息的类型，0表示没有
+    std::string m_message;      // 拼接中的数据消息（已去掩码）
+    char m_control[MAX_CONTROL];
+    size_t m_control_len;
+
+    // 发送队列
+    std::deque<ws_message *> m_queue;
+    size_t m_queued;            // 队列中没有发送的字节数
+    size_t m_sent;              // 队头的帧已经发送的字节数
+};
+
+// 频道和广播队列。订阅、退订和投递只在主线程，publish可以在任意线程调用
+class ws_hub{
+public:
+    // 创建eventfd失败时抛出异常
+    ws_hub();
+    ~ws_hub();
+
+    // 主线程把eventfd注册到epoll上
+    int fd() const { return m_eventfd; }
+
+    // 消息编码一次后放进广播队列，主线程在下一次事件循环中投递
+    void publish(const std::string & channel, const char * data, size_t len, bool binary = false);
+
+    void subscribe(ws_session * s);
+    void unsubscribe(ws_session * s);
+
+    // eventfd可读时调用：取出所有消息追加到订阅者的发送队列，然后对每个收到了消息的订阅者调用一次send(owner)
+    template<class F>
+    void deliver(F send){
+        collect();
+        // send可能关闭连接（退订并释放会话），每个会话在列表中只出现一次，之后不再访问
+        for(size_t i = 0; i < m_sending.size(); i++){
+            send(m_sending[i]->owner());
+        }
+        m_sending.clear();
+    }
+
+private:
+    struct pending{
+        std::string channel;
+        ws_message * message;
+    };
+    void collect();                         // 取出广播队列，收到消息的订阅者放进m_sending
+
+    int m_eventfd;
+    locker m_lock;
+    std::vector<pending> m_queue;           // 受m_lock保护
+    std::vector<pending> m_batch;           // 主线程取出的一批
+    std::unordered_map<std::string, std::vector<ws_session *> > m_channels;
+    std::vector<ws_session *> m_sending;
+};
+
+#endif
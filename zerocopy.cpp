@@ -0,0 +1,183 @@
+#include "zerocopy.h"
+#include "server_stats.h"
+#include "timer_queue.h"
+#include <deque>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+// 关闭的连接上没有完成的缓存项，按到期时间排列
+static locker orphan_lock;
+static std::deque<std::pair<uint64_t, file_entry_ptr> > orphans;
+
+// 连续被复制的通知数和全局暂停到什么时候
+static std::atomic<int> copied_streak(0);
+static std::atomic<uint64_t> backoff_until(0);
+
+static void sweep_orphans(uint64_t now)
+{
+    orphan_lock.lock();
+    while (!orphans.empty() && orphans.front().first <= now)
+    {
+        orphans.pop_front();
+    }
+    orphan_lock.unlock();
+}
+
+void zerocopy_tracker::reset()
+{
+    m_lock.lock();
+    m_pending.clear();
+    m_next = 0;
+    m_lock.unlock();
+    m_enabled = true;
+    m_used = false;
+}
+
+bool zerocopy_tracker::enabled() const
+{
+    if (!m_enabled.load(std::memory_order_relaxed))
+    {
+        return false;
+    }
+    uint64_t until = backoff_until.load(std::memory_order_relaxed);
+    return until == 0 || timer_queue::now_us() >= until;
+}
+
+ssize_t zerocopy_tracker::send(int fd, const void *data, size_t len, const file_entry_ptr &pin)
+{
+    m_used = true;
+    // 发送和记录编号在同一个锁里，主线程不会先读到通知再看到这次发送
+    m_lock.lock();
+    ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL | MSG_ZEROCOPY);
+    int err = errno;
+    if (n > 0)
+    {
+        pending p;
+        p.seq = m_next++;
+        p.pin = pin;
+        p.bytes = n;
+        p.sent_us = timer_queue::now_us();
+        m_pending.push_back(p);
+    }
+    m_lock.unlock();
+    if (n > 0)
+    {
+        g_stats.zerocopy_sends++;
+    }
+    else if (n < 0 && err == ENOBUFS)
+    {
+        // 每个零拷贝发送占用optmem，用完时这一次复制发送
+        return ::send(fd, data, len, MSG_NOSIGNAL);
+    }
+    errno = err;
+    return n;
+}
+
+// 编号[lo, hi]的发送完成了（一个通知可能合并了连续的多次发送）
+void zerocopy_tracker::complete(uint32_t lo, uint32_t hi, bool copied)
+{
+    uint64_t now = timer_queue::now_us();
+    size_t kept = 0;
+    for (size_t i = 0; i < m_pending.size(); i++)
+    {
+        pending &p = m_pending[i];
+        if (p.seq - lo > hi - lo)
+        {
+            m_pending[kept++] = p; // 不在这个范围（编号会回绕，用无符号差比较）
+            continue;
+        }
+        unsigned long us = now - p.sent_us;
+        g_stats.zerocopy_completions++;
+        g_stats.zerocopy_latency_us += us;
+        unsigned long max = g_stats.zerocopy_latency_max_us.load();
+        while (us > max && !g_stats.zerocopy_latency_max_us.compare_exchange_weak(max, us))
+        {
+        }
+        if (copied)
+        {
+            g_stats.zerocopy_copied++;
+        }
+        else
+        {
+            g_stats.zerocopy_bytes += p.bytes;
+        }
+    }
+    m_pending.resize(kept);
+    if (!copied)
+    {
+        copied_streak = 0;
+        return;
+    }
+    m_enabled = false; // 内核复制了，之后直接普通发送
+    if (++copied_streak >= COPIED_STREAK)
+    {
+        copied_streak = 0;
+        backoff_until = now + BACKOFF_SECONDS * 1000000ULL;
+    }
+}
+
+bool zerocopy_tracker::reap(int fd)
+{
+    if (!m_used.load())
+    {
+        return false;
+    }
+    bool got = false;
+    while (true)
+    {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
+        {
+            break; // EAGAIN：错误队列空了
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+            {
+                continue;
+            }
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0)
+            {
+                continue;
+            }
+            m_lock.lock();
+            complete(err.ee_info, err.ee_data, err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+            m_lock.unlock();
+            got = true;
+        }
+    }
+    return got;
+}
+
+void zerocopy_tracker::orphan(int fd)
+{
+    uint64_t now = timer_queue::now_us();
+    if (m_used.load())
+    {
+        reap(fd);
+        uint64_t deadline = now + ORPHAN_SECONDS * 1000000ULL;
+        m_lock.lock();
+        orphan_lock.lock();
+        for (size_t i = 0; i < m_pending.size(); i++)
+        {
+            if (m_pending[i].pin)
+            {
+                orphans.push_back(std::make_pair(deadline, m_pending[i].pin));
+            }
+        }
+        orphan_lock.unlock();
+        m_pending.clear();
+        m_lock.unlock();
+    }
+    sweep_orphans(now);
+}
@@ -0,0 +1,60 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+/*
+大的内存中响应体用MSG_ZEROCOPY发送（-Z 阈值KB）。
+
+writev把内存缓存中的内容复制到socket的发送缓冲区，几百KB的响应每次都要复制一遍。
+MSG_ZEROCOPY让内核直接引用用户的页，数据真正发送完（被确认）之后在socket的错误队列里放一个完成通知，
+之前这些页的内容不能改变。所以：
+  1. 只对内容不会被改写的缓冲区使用：内存缓存项（发送期间持有shared_ptr，淘汰不会释放）和打包文件（一直映射着）。
+     响应头部在写缓冲区中，下一个响应会改写，仍然复制发送（带MSG_MORE，和响应体合并成分段）
+  2. 每次零拷贝发送按内核的计数编号，缓存项的引用一直保留到对应的完成通知到达
+  3. 完成通知让epoll报告EPOLLERR，主线程读错误队列，不是连接出错
+  4. 内核做不到零拷贝时（回环、不支持分散聚集的网卡等）会复制并在通知中标记，这个连接之后改回普通发送：
+     通知本身有开销，复制了的零拷贝比直接复制更慢。短连接来不及收到通知，所以连续COPIED_STREAK个通知都是复制的时，
+     所有连接暂停零拷贝BACKOFF_SECONDS秒，之后再试
+连接关闭时还没有完成的发送读不到通知了，缓存项的引用再保留ORPHAN_SECONDS，之后再释放。
+*/
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+#include <sys/types.h>
+#include "locker.h"
+#include "file_cache.h"
+
+class zerocopy_tracker{
+public:
+    static const int ORPHAN_SECONDS = 60;   // 关闭的连接上没有完成的发送，缓存项再保留这么久
+    static const int COPIED_STREAK = 32;    // 连续这么多次被内核复制后全局暂停
+    static const int BACKOFF_SECONDS = 10;
+
+    zerocopy_tracker():m_enabled(true), m_used(false), m_next(0){}
+
+    // 新连接：重新计数，允许零拷贝
+    void reset();
+    // 这个连接还在使用零拷贝（没有出现过被内核复制的发送），并且没有全局暂停
+    bool enabled() const;
+    // 用MSG_ZEROCOPY发送，pin在完成前不会被释放（打包文件的内容为空）；optmem不够时退回普通发送
+    ssize_t send(int fd, const void * data, size_t len, const file_entry_ptr & pin);
+    // 读错误队列中的完成通知并释放对应的缓存项，读到了通知返回true（EPOLLERR不是连接出错）
+    bool reap(int fd);
+    // 连接关闭之前调用：读最后的通知，剩下的缓存项延迟释放
+    void orphan(int fd);
+
+private:
+    struct pending{
+        uint32_t seq;
+        file_entry_ptr pin;
+        size_t bytes;
+        uint64_t sent_us;
+    };
+    void complete(uint32_t lo, uint32_t hi, bool copied);   // 调用者持有锁
+
+    locker m_lock;                  // 持有连接的线程发送，主线程读通知
+    std::vector<pending> m_pending; // 按编号排列
+    std::atomic<bool> m_enabled;
+    std::atomic<bool> m_used;       // 发送过零拷贝，EPOLLERR时才需要读错误队列
+    uint32_t m_next;                // 下一次零拷贝发送的编号，和内核的计数一致
+};
+
+#endif